@@ -0,0 +1,171 @@
+package bench
+
+import (
+	"encoding/json"
+	"errors"
+	"math"
+	"sync"
+	"testing"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/util"
+)
+
+const suite = "go"
+
+// analyzeOnce does per file what `audiofs-cli analyze` does: probe via the native workers and round trip the
+// metadata through the compressed JSON export.
+func analyzeOnce(entry CorpusEntry) (*types.FileMetadata, error) {
+	val, err := util.GetMetadataFromFile(entry.Path)
+	if err != nil {
+		return nil, err
+	}
+	data, err := util.MarshallCompressed(val)
+	if err != nil {
+		return nil, err
+	}
+	var roundtrip types.FileMetadata
+	return val, util.UnmarshallCompressed(data, &roundtrip)
+}
+
+// fingerprintedSeconds is the amount of audio the default (bounded) fingerprint decodes.
+func fingerprintedSeconds(entry CorpusEntry) float64 {
+	length := float64(util.FingerprintOptionsFromConfig(false).Length)
+	if length <= 0 {
+		return entry.Seconds
+	}
+	return math.Min(entry.Seconds, length)
+}
+
+// Analyze benchmarks the end-to-end analyze path over the whole corpus. The first pass includes starting the native
+// workers, the following ones run with warm workers, once serially and once with one goroutine per file.
+//
+// The returned metadata feeds the codec benchmarks.
+func Analyze(corpus []CorpusEntry) ([]Result, []*types.FileMetadata, error) {
+	var bytes int64
+	var audio float64
+	for _, entry := range corpus {
+		bytes += entry.Bytes
+		audio += fingerprintedSeconds(entry)
+	}
+
+	var results []Result
+	var metadata []*types.FileMetadata
+	for _, variant := range []string{"cold", "serial"} {
+		metadata = metadata[:0]
+		start := time.Now()
+		for _, entry := range corpus {
+			val, err := analyzeOnce(entry)
+			if err != nil {
+				return nil, nil, err
+			}
+			metadata = append(metadata, val)
+		}
+		results = append(results, NewResult(suite, "analyze", variant, int64(len(corpus)), time.Since(start), bytes, audio))
+	}
+
+	var wg sync.WaitGroup
+	errs := make(chan error, len(corpus))
+	start := time.Now()
+	for _, entry := range corpus {
+		wg.Add(1)
+		go func(entry CorpusEntry) {
+			defer wg.Done()
+			if _, err := analyzeOnce(entry); err != nil {
+				errs <- err
+			}
+		}(entry)
+	}
+	wg.Wait()
+	results = append(results, NewResult(suite, "analyze", "parallel", int64(len(corpus)), time.Since(start), bytes, audio))
+	close(errs)
+	if err := <-errs; err != nil {
+		return nil, nil, err
+	}
+
+	return results, metadata, nil
+}
+
+// CompressedJSON benchmarks MarshallCompressedWithDictionary and UnmarshallCompressedWithAlgo over the given metadata:
+// zstd without and with a dictionary trained on the metadata itself, and uncompressed. Throughput is reported in
+// uncompressed JSON bytes, the compression ratio per record.
+func CompressedJSON(metadata []*types.FileMetadata) ([]Result, error) {
+	if len(metadata) == 0 {
+		return nil, nil
+	}
+	level := config.Config.GetInt("json_export.compression.level")
+
+	var jsonBytes int64
+	samples := make([][]byte, len(metadata))
+	for i, val := range metadata {
+		data, err := json.Marshal(val)
+		if err != nil {
+			return nil, err
+		}
+		samples[i] = data
+		jsonBytes += int64(len(data))
+	}
+	avgJSON := jsonBytes / int64(len(metadata))
+
+	type variant struct {
+		name, algo   string
+		dictionaryID uint32
+	}
+	variants := []variant{{"zstd", "zstd", 0}, {"none", "none", 0}}
+	// The corpus is small, so this overestimates what a dictionary trained on a real library achieves on unseen
+	// records. It still shows the per-record overhead a dictionary removes.
+	if dict, err := util.TrainDictionary(samples, util.DefaultDictionarySize, util.NextDictionaryID(), level); err == nil {
+		id, err := util.RegisterDictionary(dict)
+		if err != nil {
+			return nil, err
+		}
+		variants = append(variants, variant{"zstd_dict", "zstd", id})
+	} else if !errors.Is(err, util.ErrNotEnoughSamples) {
+		return nil, err
+	}
+
+	var results []Result
+	for _, v := range variants {
+		var compressedBytes int64
+		blobs := make([][]byte, len(metadata))
+		for i, val := range metadata {
+			data, err := util.MarshallCompressedWithDictionary(v.algo, level, v.dictionaryID, val)
+			if err != nil {
+				return nil, err
+			}
+			blobs[i] = data
+			compressedBytes += int64(len(data))
+		}
+		ratio := float64(jsonBytes) / float64(compressedBytes)
+
+		marshal := testing.Benchmark(func(b *testing.B) {
+			b.ReportAllocs()
+			b.SetBytes(avgJSON)
+			for i := 0; i < b.N; i++ {
+				if _, err := util.MarshallCompressedWithDictionary(v.algo, level, v.dictionaryID, metadata[i%len(metadata)]); err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+		result := fromBenchmark(suite, "marshall_compressed", v.name, marshal)
+		result.Ratio = ratio
+		results = append(results, result)
+
+		unmarshal := testing.Benchmark(func(b *testing.B) {
+			b.ReportAllocs()
+			b.SetBytes(avgJSON)
+			for i := 0; i < b.N; i++ {
+				var val types.FileMetadata
+				if err := util.UnmarshallCompressedWithAlgo(v.algo, blobs[i%len(blobs)], &val); err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+		result = fromBenchmark(suite, "unmarshall_compressed", v.name, unmarshal)
+		result.Ratio = ratio
+		results = append(results, result)
+	}
+	return results, nil
+}
@@ -0,0 +1,83 @@
+package bench
+
+import (
+	"context"
+	"math/rand"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/lib/cluster"
+)
+
+const (
+	// Frames of a fingerprint of the default fingerprint.length (120 s)
+	clusterFrames = 968
+	// Every clusterDuplicateEvery-th track gets a near-duplicate.
+	clusterDuplicateEvery = 10
+)
+
+// syntheticFingerprints returns `count` fingerprints of random audio, with a near-duplicate for every
+// clusterDuplicateEvery-th of them: a few bits of every hash flipped (a different rip or encoder), shifted by up to two
+// seconds and clipped at either end. Returns the number of duplicates planted.
+//
+// Like in real fingerprints, consecutive hashes differ in a few bits only, which is what makes them compress. Real
+// fingerprints of unrelated recordings share more keys than these, though.
+func syntheticFingerprints(count int) ([]cluster.Track, int) {
+	random := rand.New(rand.NewSource(1))
+	tracks := make([]cluster.Track, 0, count)
+	planted := 0
+	for len(tracks) < count {
+		hashes := make([]uint32, clusterFrames)
+		hashes[0] = random.Uint32()
+		for i := 1; i < len(hashes); i++ {
+			hashes[i] = hashes[i-1]
+			for flips := 2 + random.Intn(8); flips > 0; flips-- {
+				hashes[i] ^= 1 << random.Intn(32)
+			}
+		}
+		tracks = append(tracks, cluster.Track{ID: len(tracks), Fingerprint: []byte(cluster.EncodeFingerprint(hashes))})
+		if len(tracks)%clusterDuplicateEvery != 0 || len(tracks) == count {
+			continue
+		}
+
+		shift := random.Intn(16)
+		duplicate := append([]uint32(nil), hashes[shift:len(hashes)-random.Intn(64)]...)
+		for i := range duplicate {
+			// ~6% of the bits
+			for flips := random.Intn(4); flips > 0; flips-- {
+				duplicate[i] ^= 1 << random.Intn(32)
+			}
+		}
+		tracks = append(tracks, cluster.Track{ID: len(tracks), Fingerprint: []byte(cluster.EncodeFingerprint(duplicate))})
+		planted++
+	}
+	return tracks, planted
+}
+
+// Clusters runs the near-duplicate clustering over `count` synthetic fingerprints. Ops are tracks, Recall is the
+// share of planted duplicates which were found.
+func Clusters(count int) (Result, error) {
+	tracks, planted := syntheticFingerprints(count)
+	var bytes int64
+	for _, t := range tracks {
+		bytes += int64(len(t.Fingerprint))
+	}
+
+	start := time.Now()
+	clusters, _, err := cluster.Find(context.Background(), tracks, cluster.OptionsFromConfig())
+	if err != nil {
+		return Result{}, err
+	}
+	result := NewResult(suite, "cluster", "synthetic", int64(len(tracks)), time.Since(start), bytes, 0)
+
+	found := 0
+	for _, c := range clusters {
+		// Duplicates directly follow their original.
+		if len(c.Tracks) == 2 && c.Tracks[1] == c.Tracks[0]+1 && c.Tracks[1]%clusterDuplicateEvery == 0 {
+			found++
+		}
+	}
+	if planted > 0 {
+		result.Recall = float64(found) / float64(planted)
+	}
+	return result, nil
+}
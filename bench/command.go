@@ -0,0 +1,100 @@
+package bench
+
+import (
+	"github.com/sirupsen/logrus"
+	"github.com/spf13/cobra"
+)
+
+var coldCache bool
+var clusterTracks int
+var objectStore bool
+var packFiles int
+var metadataTracks int
+
+var cmdBench = &cobra.Command{
+	Use:   "bench [corpus directory]",
+	Short: "benchmarks the Go hot paths",
+	Long: `bench runs the Go benchmarks over the synthetic corpus generated by the native 'corpus' benchmark and prints
+one JSON object per result, in the same format as the native benchmarks. With --cold the kernel caches are dropped
+before every directory scan variant, which needs root. The near-duplicate clustering runs over --cluster-tracks
+synthetic fingerprints, 0 skips it. With --s3, the S3 store is benchmarked against an in-memory stand-in. The local store is
+benchmarked with --pack-files small samples, with packs and with one file per object; use 1000000 for a sample library.
+The metadata of --metadata-tracks synthetic tracks is held in memory as parsed and in its compact form, reporting the
+heap and garbage collection cost of each, 0 skips it.`,
+	Args: cobra.MaximumNArgs(1),
+	RunE: func(cmd *cobra.Command, args []string) error {
+		dir := "bench-corpus"
+		if len(args) > 0 {
+			dir = args[0]
+		}
+		corpus, err := LoadCorpus(dir)
+		if err != nil {
+			return err
+		}
+
+		// Per-file info logging would otherwise dominate the measurements.
+		level := logrus.GetLevel()
+		logrus.SetLevel(logrus.WarnLevel)
+		defer logrus.SetLevel(level)
+
+		scan, err := Scan(dir, coldCache)
+		if err != nil {
+			return err
+		}
+		results, metadata, err := Analyze(corpus)
+		if err != nil {
+			return err
+		}
+		codec, err := CompressedJSON(metadata)
+		if err != nil {
+			return err
+		}
+		for _, r := range append(append(scan, results...), codec...) {
+			r.Print()
+		}
+		if clusterTracks > 0 {
+			clusters, err := Clusters(clusterTracks)
+			if err != nil {
+				return err
+			}
+			clusters.Print()
+		}
+		if packFiles > 0 {
+			packs, err := Packs(packFiles, coldCache)
+			if err != nil {
+				return err
+			}
+			for _, r := range packs {
+				r.Print()
+			}
+		}
+		if metadataTracks > 0 {
+			tracks, err := Metadata(metadataTracks)
+			if err != nil {
+				return err
+			}
+			for _, r := range tracks {
+				r.Print()
+			}
+		}
+		if objectStore {
+			objects, err := ObjectStore()
+			if err != nil {
+				return err
+			}
+			for _, r := range objects {
+				r.Print()
+			}
+		}
+		return nil
+	},
+}
+
+func Inject(rootCommand *cobra.Command) {
+	cmdBench.Flags().BoolVar(&coldCache, "cold", false, "drop the kernel caches before every directory scan and store verification")
+	cmdBench.Flags().IntVar(&clusterTracks, "cluster-tracks", 100000, "number of synthetic fingerprints to cluster")
+	cmdBench.Flags().IntVar(&packFiles, "pack-files", 20000, "number of small samples to store")
+	cmdBench.Flags().IntVar(&metadataTracks, "metadata-tracks", 500000, "number of synthetic tracks to hold the metadata of")
+	cmdBench.Flags().BoolVar(&objectStore, "s3", true, "benchmark the S3 store")
+	rootCommand.AddCommand(cmdBench)
+}
@@ -0,0 +1,53 @@
+package bench
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"os"
+	"path/filepath"
+)
+
+// corpusVersion matches CORPUS_VERSION in native/bench/corpus.h.
+const corpusVersion = 1
+
+// CorpusEntry is one line of the manifest written by the native `corpus` generator.
+type CorpusEntry struct {
+	Version    int     `json:"version"`
+	File       string  `json:"file"`
+	Muxer      string  `json:"muxer"`
+	Encoder    string  `json:"encoder"`
+	SampleFmt  string  `json:"sample_fmt"`
+	Depth      int     `json:"depth"`
+	SampleRate int     `json:"sample_rate"`
+	Layout     string  `json:"layout"`
+	Seconds    float64 `json:"seconds"`
+	Bytes      int64   `json:"bytes"`
+
+	// Path is File joined with the corpus directory.
+	Path string `json:"-"`
+}
+
+// LoadCorpus reads the manifest of a corpus generated by `corpus <dir>`.
+func LoadCorpus(dir string) ([]CorpusEntry, error) {
+	manifest, err := os.Open(filepath.Join(dir, "manifest.jsonl"))
+	if err != nil {
+		return nil, fmt.Errorf("no corpus in '%s', run the native `corpus` benchmark first: %w", dir, err)
+	}
+	defer manifest.Close()
+
+	var entries []CorpusEntry
+	scanner := bufio.NewScanner(manifest)
+	for scanner.Scan() {
+		var entry CorpusEntry
+		if err = json.Unmarshal(scanner.Bytes(), &entry); err != nil {
+			return nil, err
+		}
+		if entry.Version != corpusVersion {
+			return nil, fmt.Errorf("corpus in '%s' has version %d, expected %d", dir, entry.Version, corpusVersion)
+		}
+		entry.Path = filepath.Join(dir, entry.File)
+		entries = append(entries, entry)
+	}
+	return entries, scanner.Err()
+}
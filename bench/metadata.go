@@ -0,0 +1,192 @@
+package bench
+
+import (
+	"encoding/json"
+	"fmt"
+	"math/rand"
+	"runtime"
+	"strings"
+	"testing"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+)
+
+const (
+	metadataTracksPerAlbum = 12
+	metadataArtists        = 20000
+	metadataGenres         = 60
+	// metadataGCRuns is the number of full collections timed per variant.
+	metadataGCRuns = 5
+)
+
+var metadataCodecs = []struct {
+	format, formatLong, codec, layout string
+	sampleRate, bits                  int
+	// keyCase spells the tag keys the way the container does: Vorbis comments are upper case, ID3 and MP4 tags are
+	// reported in lower case by libav.
+	keyCase func(string) string
+}{
+	{"flac", "raw FLAC", "flac", "stereo", 44100, 16, strings.ToUpper},
+	{"flac", "raw FLAC", "flac", "stereo", 96000, 24, strings.ToUpper},
+	{"mp3", "MP2/3 (MPEG audio layer 2/3)", "mp3", "stereo", 44100, 0, strings.ToLower},
+	{"mov,mp4,m4a,3gp,3g2,mj2", "QuickTime / MOV", "aac", "stereo", 44100, 0, strings.ToLower},
+	{"ogg", "Ogg", "vorbis", "stereo", 48000, 0, strings.ToUpper},
+	{"aiff", "Audio IFF", "pcm_s24be", "5.1(side)", 48000, 24, strings.ToLower},
+}
+
+// syntheticMetadataJSON returns what the native workers report for the i-th track of a library of albums: the tags of
+// a tagged release, one audio stream, and cover art in every third album. Fingerprints are left out, as listings do not
+// need them and they are unique per track in either representation.
+func syntheticMetadataJSON(random *rand.Rand, i int) []byte {
+	album := i / metadataTracksPerAlbum
+	codec := metadataCodecs[album%len(metadataCodecs)]
+	artist := fmt.Sprintf("Artist %d", album%metadataArtists)
+	tags := map[string]string{
+		codec.keyCase("title"):        fmt.Sprintf("Track %d of album %d (%x)", i%metadataTracksPerAlbum+1, album, random.Uint32()),
+		codec.keyCase("artist"):       artist,
+		codec.keyCase("album_artist"): artist,
+		codec.keyCase("album"):        fmt.Sprintf("Album %d", album),
+		codec.keyCase("genre"):        fmt.Sprintf("Genre %d", album%metadataGenres),
+		codec.keyCase("date"):         fmt.Sprint(1960 + album%60),
+		codec.keyCase("track"):        fmt.Sprintf("%d/%d", i%metadataTracksPerAlbum+1, metadataTracksPerAlbum),
+		codec.keyCase("disc"):         "1/1",
+		codec.keyCase("encoder"):      "Lavf60.3.100",
+		codec.keyCase("comment"):      "",
+	}
+	duration := 120 + random.Intn(360)
+	streams := []map[string]any{{
+		"metadata": map[string]string{},
+		"codec": map[string]any{
+			"ch_layout": codec.layout, "type": "audio", "name": codec.codec, "sample_rate": codec.sampleRate,
+			"bits_per_raw_sample": codec.bits, "nb_channels": 2, "bit_rate": 320000 + random.Intn(1000000),
+		},
+		"index": 0, "nb_frames": duration * codec.sampleRate / 4096, "duration": duration * codec.sampleRate,
+		"time_base_num": 1, "time_base_den": codec.sampleRate, "time_base": fmt.Sprintf("1/%d", codec.sampleRate),
+	}}
+	if album%3 == 0 {
+		streams = append(streams, map[string]any{
+			"metadata": map[string]string{"comment": "Cover (front)"},
+			"codec":    map[string]any{"type": "video", "name": "mjpeg", "width": 1000, "height": 1000},
+			"index":    1, "nb_frames": 1, "duration": 1, "time_base_num": 1, "time_base_den": 90000,
+			"time_base":    "1/90000",
+			"attached_pic": map[string]any{"sha256": fmt.Sprintf("%064x", album), "size": 180000, "offset": 4096},
+		})
+	}
+	data, _ := json.Marshal(map[string]any{
+		"file": map[string]any{
+			"metadata": tags,
+			"format":   map[string]any{"name": codec.format, "long_name": codec.formatLong},
+			"duration": duration * 1000000, "bit_rate": 320000,
+		},
+		"streams": streams,
+	})
+	return data
+}
+
+// heapAfterGC returns the live heap after a full collection.
+func heapAfterGC() uint64 {
+	runtime.GC()
+	var stats runtime.MemStats
+	runtime.ReadMemStats(&stats)
+	return stats.HeapAlloc
+}
+
+// timeGC returns the mean wall time of a full collection and its mean stop-the-world pauses, with whatever is live.
+func timeGC() (time.Duration, time.Duration) {
+	var before, after runtime.MemStats
+	runtime.ReadMemStats(&before)
+	start := time.Now()
+	for i := 0; i < metadataGCRuns; i++ {
+		runtime.GC()
+	}
+	wall := time.Since(start)
+	runtime.ReadMemStats(&after)
+	pauses := time.Duration(after.PauseTotalNs - before.PauseTotalNs)
+	return wall / metadataGCRuns, pauses / time.Duration(after.NumGC-before.NumGC)
+}
+
+// Metadata holds the metadata of `count` synthetic tracks in memory, as FileMetadata ("map") and as
+// types.CompactMetadata ("compact"), and reports the live heap they take and what a full collection costs with them.
+// Both are decoded from JSON one track at a time, like a catalog is loaded. The conversions between the two are
+// benchmarked besides.
+func Metadata(count int) ([]Result, error) {
+	var results []Result
+	sample := make([]*types.FileMetadata, 0, 1000)
+
+	measure := func(variant string, load func(data []byte) error) error {
+		random := rand.New(rand.NewSource(1))
+		base := heapAfterGC()
+		start := time.Now()
+		var bytes int64
+		for i := 0; i < count; i++ {
+			data := syntheticMetadataJSON(random, i)
+			bytes += int64(len(data))
+			if err := load(data); err != nil {
+				return err
+			}
+		}
+		result := NewResult(suite, "metadata_load", variant, int64(count), time.Since(start), bytes, 0)
+		heap := heapAfterGC()
+		if heap > base {
+			result.HeapBytes = int64(heap - base)
+		}
+		gc, pause := timeGC()
+		result.GCS, result.GCPauseS = gc.Seconds(), pause.Seconds()
+		results = append(results, result)
+		return nil
+	}
+
+	tracks := make([]*types.FileMetadata, 0, count)
+	err := measure("map", func(data []byte) error {
+		var val types.FileMetadata
+		if err := json.Unmarshal(data, &val); err != nil {
+			return err
+		}
+		tracks = append(tracks, &val)
+		return nil
+	})
+	if err != nil {
+		return nil, err
+	}
+	for i := 0; i < len(tracks) && len(sample) < cap(sample); i += 1 + len(tracks)/cap(sample) {
+		sample = append(sample, tracks[i])
+	}
+	tracks = nil
+
+	compact := make([]types.CompactMetadata, 0, count)
+	err = measure("compact", func(data []byte) error {
+		var val types.FileMetadata
+		if err := json.Unmarshal(data, &val); err != nil {
+			return err
+		}
+		compact = append(compact, types.Compact(&val))
+		return nil
+	})
+	if err != nil {
+		return nil, err
+	}
+	runtime.KeepAlive(compact)
+	compact = nil
+
+	toCompact := testing.Benchmark(func(b *testing.B) {
+		b.ReportAllocs()
+		for i := 0; i < b.N; i++ {
+			types.Compact(sample[i%len(sample)])
+		}
+	})
+	results = append(results, fromBenchmark(suite, "metadata_convert", "to_compact", toCompact))
+
+	compactSample := make([]types.CompactMetadata, len(sample))
+	for i, val := range sample {
+		compactSample[i] = types.Compact(val)
+	}
+	fromCompact := testing.Benchmark(func(b *testing.B) {
+		b.ReportAllocs()
+		for i := 0; i < b.N; i++ {
+			compactSample[i%len(compactSample)].FileMetadata()
+		}
+	})
+	results = append(results, fromBenchmark(suite, "metadata_convert", "from_compact", fromCompact))
+	return results, nil
+}
@@ -0,0 +1,161 @@
+package bench
+
+import (
+	"fmt"
+	"math/rand"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/internal/s3test"
+	"gitlab.com/t4cc0re/audiofs/lib/store"
+)
+
+const (
+	objectStoreLarge     = 4
+	objectStoreLargeSize = 48 << 20
+	objectStoreSmall     = 2000
+	objectStoreSmallSize = 32 << 10
+	// Slices read by the ranged read benchmark, e.g. a player seeking
+	objectStoreSlices    = 1000
+	objectStoreSliceSize = 64 << 10
+)
+
+type storedFile struct {
+	path, key string
+	size      int64
+}
+
+// writeRandomFiles writes `count` files of random content, and returns them with their store keys.
+func writeRandomFiles(dir string, random *rand.Rand, count int, size int) ([]storedFile, error) {
+	files := make([]storedFile, count)
+	data := make([]byte, size)
+	for i := range files {
+		random.Read(data)
+		path := filepath.Join(dir, fmt.Sprintf("%d-%d", size, i))
+		if err := os.WriteFile(path, data, 0644); err != nil {
+			return nil, err
+		}
+		key, err := store.HashFile(path)
+		if err != nil {
+			return nil, err
+		}
+		files[i] = storedFile{path: path, key: key, size: int64(size)}
+	}
+	return files, nil
+}
+
+// putAll stores the files and syncs the store.
+func putAll(s *store.S3, files []storedFile) (int64, time.Duration, error) {
+	var bytes int64
+	start := time.Now()
+	for _, f := range files {
+		if err := s.Put(f.path, f.key); err != nil {
+			return 0, 0, err
+		}
+		bytes += f.size
+	}
+	err := s.Sync()
+	return bytes, time.Since(start), err
+}
+
+// ObjectStore benchmarks the S3 store against an in-memory stand-in: multipart uploads of large objects, small
+// objects with and without packs, and reads of slices of large objects. Results carry the number of requests, which
+// is what a real server bills and throttles.
+func ObjectStore() ([]Result, error) {
+	dir, err := os.MkdirTemp("", "audiofs-bench-s3-")
+	if err != nil {
+		return nil, err
+	}
+	defer os.RemoveAll(dir)
+	random := rand.New(rand.NewSource(1))
+	large, err := writeRandomFiles(dir, random, objectStoreLarge, objectStoreLargeSize)
+	if err != nil {
+		return nil, err
+	}
+	small, err := writeRandomFiles(dir, random, objectStoreSmall, objectStoreSmallSize)
+	if err != nil {
+		return nil, err
+	}
+
+	server := httptest.NewServer(s3test.New())
+	defer server.Close()
+	open := func(prefix string, packThreshold int64) (*store.S3, error) {
+		options := store.S3OptionsFromConfig()
+		options.Endpoint, options.Bucket, options.Prefix, options.PathStyle = server.URL, "bench", prefix, true
+		options.AccessKey, options.SecretKey = "bench", "bench"
+		options.PackThreshold = packThreshold
+		return store.OpenS3(options)
+	}
+
+	var results []Result
+	measure := func(s *store.S3, bench, variant string, files []storedFile) error {
+		requests := s.Requests()
+		bytes, wall, err := putAll(s, files)
+		if err != nil {
+			return err
+		}
+		result := NewResult(suite, bench, variant, int64(len(files)), wall, bytes, 0)
+		result.Requests = s.Requests() - requests
+		results = append(results, result)
+		return nil
+	}
+
+	packed, err := open("packed/", store.S3OptionsFromConfig().PackThreshold)
+	if err != nil {
+		return nil, err
+	}
+	defer packed.Close()
+	if err = measure(packed, "s3_put", "multipart", large); err != nil {
+		return nil, err
+	}
+	if err = measure(packed, "s3_put", "small_packed", small); err != nil {
+		return nil, err
+	}
+	unpacked, err := open("unpacked/", 0)
+	if err != nil {
+		return nil, err
+	}
+	defer unpacked.Close()
+	if err = measure(unpacked, "s3_put", "small", small); err != nil {
+		return nil, err
+	}
+
+	// Ranged reads of slices, as when serving part of a track
+	requests := packed.Requests()
+	slice := make([]byte, objectStoreSliceSize)
+	start := time.Now()
+	for i := 0; i < objectStoreSlices; i++ {
+		f := large[random.Intn(len(large))]
+		object, err := packed.Open(f.key)
+		if err != nil {
+			return nil, err
+		}
+		if _, err = object.ReadAt(slice, random.Int63n(f.size-int64(len(slice)))); err != nil {
+			return nil, err
+		}
+		_ = object.Close()
+	}
+	result := NewResult(suite, "s3_read", "slice", objectStoreSlices, time.Since(start),
+		objectStoreSlices*objectStoreSliceSize, 0)
+	result.Requests = packed.Requests() - requests
+	results = append(results, result)
+
+	// Sequential small reads of a whole object hit the cached block most of the time.
+	requests = packed.Requests()
+	start = time.Now()
+	object, err := packed.Open(large[0].key)
+	if err != nil {
+		return nil, err
+	}
+	for off := int64(0); off < object.Size(); off += int64(len(slice)) {
+		if _, err = object.ReadAt(slice, off); err != nil {
+			return nil, err
+		}
+	}
+	_ = object.Close()
+	result = NewResult(suite, "s3_read", "sequential", 1, time.Since(start), object.Size(), 0)
+	result.Requests = packed.Requests() - requests
+	return append(results, result), nil
+}
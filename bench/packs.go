@@ -0,0 +1,113 @@
+package bench
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/store"
+)
+
+// Sizes of the samples of a sample library (one-shots, loops)
+const (
+	packSampleMin = 4 << 10
+	packSampleMax = 100 << 10
+)
+
+// Packs benchmarks a store of `count` small samples, with packs and with one file per object: putting them (as the
+// import's store stage does, the samples are hashed beforehand) and verifying all of them by reading and hashing their
+// content. With `cold` the kernel caches are dropped before verifying.
+func Packs(count int, cold bool) ([]Result, error) {
+	variants := []struct {
+		name      string
+		threshold int64
+	}{
+		{"packed", config.Config.GetInt64("store.pack_threshold")},
+		{"files", 0},
+	}
+	var results []Result
+	for _, variant := range variants {
+		r, err := benchPacks(variant.name, variant.threshold, count, cold)
+		if err != nil {
+			return nil, err
+		}
+		results = append(results, r...)
+	}
+	return results, nil
+}
+
+func benchPacks(variant string, threshold int64, count int, cold bool) ([]Result, error) {
+	dir, err := os.MkdirTemp("", "audiofs-bench-packs-")
+	if err != nil {
+		return nil, err
+	}
+	defer os.RemoveAll(dir)
+	objects, err := store.OpenDir(filepath.Join(dir, "store"), threshold, config.Config.GetInt64("store.pack_size"))
+	if err != nil {
+		return nil, err
+	}
+	defer objects.Close()
+
+	// Samples are written to the same path one after another, so the corpus does not take twice the space.
+	random := rand.New(rand.NewSource(1))
+	sample := filepath.Join(dir, "sample")
+	data := make([]byte, packSampleMax)
+	var bytes int64
+	var putTime time.Duration
+	for i := 0; i < count; i++ {
+		size := packSampleMin + random.Intn(packSampleMax-packSampleMin)
+		random.Read(data[:size])
+		if err = os.WriteFile(sample, data[:size], 0644); err != nil {
+			return nil, err
+		}
+		sum := sha256.Sum256(data[:size])
+
+		start := time.Now()
+		if err = objects.Put(sample, hex.EncodeToString(sum[:])); err != nil {
+			return nil, err
+		}
+		putTime += time.Since(start)
+		bytes += int64(size)
+	}
+	start := time.Now()
+	if err = objects.Sync(); err != nil {
+		return nil, err
+	}
+	putTime += time.Since(start)
+	results := []Result{NewResult(suite, "store_put", variant, int64(count), putTime, bytes, 0)}
+
+	if cold {
+		if err = dropCaches(); err != nil {
+			return nil, err
+		}
+		variant += "_cold"
+	}
+	var verified, verifiedBytes int64
+	buffer := make([]byte, 256<<10)
+	start = time.Now()
+	err = objects.Walk(func(key string, object store.Object) error {
+		hash := sha256.New()
+		if _, err := io.CopyBuffer(hash, io.NewSectionReader(object, 0, object.Size()), buffer); err != nil {
+			return err
+		}
+		if hex.EncodeToString(hash.Sum(nil)) != key {
+			return fmt.Errorf("%w: object %s", store.ErrHashMismatch, key)
+		}
+		verified++
+		verifiedBytes += object.Size()
+		return nil
+	})
+	if err != nil {
+		return nil, err
+	}
+	if verified != int64(count) {
+		return nil, fmt.Errorf("verified %d of %d objects", verified, count)
+	}
+	return append(results, NewResult(suite, "store_verify", variant, verified, time.Since(start), verifiedBytes, 0)), nil
+}
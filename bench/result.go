@@ -0,0 +1,73 @@
+package bench
+
+import (
+	"encoding/json"
+	"os"
+	"testing"
+	"time"
+)
+
+// Result is a single benchmark result. It has the same shape as the lines printed by the native benchmarks
+// (native/bench/bench.h), so both can be collected into one file and compared between releases.
+type Result struct {
+	Suite   string  `json:"suite"`
+	Bench   string  `json:"bench"`
+	Variant string  `json:"variant"`
+	Ops     int64   `json:"ops"`
+	NsPerOp float64 `json:"ns_per_op"`
+	WallS   float64 `json:"wall_s"`
+	Bytes   int64   `json:"bytes"`
+	GBPerS  float64 `json:"gb_per_s"`
+	AudioS  float64 `json:"audio_s"`
+	// Realtime is audio seconds processed per wall second.
+	Realtime        float64 `json:"realtime"`
+	AllocsPerOp     int64   `json:"allocs_per_op"`
+	AllocBytesPerOp int64   `json:"alloc_bytes_per_op"`
+	// Ratio is the compression ratio, for codec benchmarks.
+	Ratio float64 `json:"ratio,omitempty"`
+	// Recall is the share of the expected results which were found, for search benchmarks.
+	Recall float64 `json:"recall,omitempty"`
+	// Requests is the number of requests sent, for object storage benchmarks.
+	Requests int64 `json:"requests,omitempty"`
+	// FirstS is the time to the first result, for streaming benchmarks.
+	FirstS float64 `json:"first_s,omitempty"`
+	// HeapBytes is the live heap held by the benchmarked data, GCS the wall time of a full collection with it and
+	// GCPauseS the stop-the-world part of that, for in-memory benchmarks.
+	HeapBytes int64   `json:"heap_bytes,omitempty"`
+	GCS       float64 `json:"gc_s,omitempty"`
+	GCPauseS  float64 `json:"gc_pause_s,omitempty"`
+}
+
+// NewResult derives the rates from the raw measurements.
+func NewResult(suite, bench, variant string, ops int64, wall time.Duration, bytes int64, audioSeconds float64) Result {
+	r := Result{
+		Suite:   suite,
+		Bench:   bench,
+		Variant: variant,
+		Ops:     ops,
+		WallS:   wall.Seconds(),
+		Bytes:   bytes,
+		AudioS:  audioSeconds,
+	}
+	if ops > 0 {
+		r.NsPerOp = float64(wall.Nanoseconds()) / float64(ops)
+	}
+	if r.WallS > 0 {
+		r.GBPerS = float64(bytes) / r.WallS / 1e9
+		r.Realtime = audioSeconds / r.WallS
+	}
+	return r
+}
+
+// fromBenchmark converts a testing.Benchmark result. Bytes are taken from b.SetBytes.
+func fromBenchmark(suite, bench, variant string, br testing.BenchmarkResult) Result {
+	r := NewResult(suite, bench, variant, int64(br.N), br.T, br.Bytes*int64(br.N), 0)
+	r.AllocsPerOp = br.AllocsPerOp()
+	r.AllocBytesPerOp = br.AllocedBytesPerOp()
+	return r
+}
+
+func (r Result) Print() {
+	line, _ := json.Marshal(r)
+	os.Stdout.Write(append(line, '\n'))
+}
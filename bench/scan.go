@@ -0,0 +1,78 @@
+package bench
+
+import (
+	"errors"
+	"os"
+	"path/filepath"
+	"strings"
+	"syscall"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/walk"
+)
+
+var ErrCannotDropCaches = errors.New("dropping the page cache needs root (write access to /proc/sys/vm/drop_caches)")
+
+// dropCaches evicts the page, dentry and inode caches, so the next walk hits the disk.
+func dropCaches() error {
+	syscall.Sync()
+	if err := os.WriteFile("/proc/sys/vm/drop_caches", []byte("3\n"), 0); err != nil {
+		return errors.Join(ErrCannotDropCaches, err)
+	}
+	return nil
+}
+
+// Scan benchmarks listing the media files below dir: filepath.WalkDir as the `analyze` command used to, and the
+// parallel walker with the configured `scan.workers`. Both select files by the same extensions. FirstS is the time to
+// the first file, which is when probing can start. With `cold` the kernel caches are dropped before every variant.
+func Scan(dir string, cold bool) ([]Result, error) {
+	extensions := walk.DefaultExtensions()
+	variants := []struct {
+		name string
+		walk func(emit func(string) bool) error
+	}{
+		{"serial", func(emit func(string) bool) error {
+			return filepath.WalkDir(dir, func(path string, entry os.DirEntry, err error) error {
+				if err != nil {
+					return err
+				}
+				if entry.Type().IsRegular() && extensions[strings.TrimPrefix(strings.ToLower(filepath.Ext(path)), ".")] {
+					emit(path)
+				}
+				return nil
+			})
+		}},
+		{"parallel", func(emit func(string) bool) error {
+			return walk.Walk([]string{dir}, walk.Options{Workers: config.Config.GetInt("scan.workers"), Extensions: extensions}, emit)
+		}},
+	}
+
+	var results []Result
+	for _, variant := range variants {
+		name := variant.name
+		if cold {
+			if err := dropCaches(); err != nil {
+				return nil, err
+			}
+			name += "_cold"
+		}
+		var files int64
+		var first time.Duration
+		start := time.Now()
+		err := variant.walk(func(string) bool {
+			if files == 0 {
+				first = time.Since(start)
+			}
+			files++
+			return true
+		})
+		if err != nil {
+			return nil, err
+		}
+		r := NewResult(suite, "scan", name, files, time.Since(start), 0, 0)
+		r.FirstS = first.Seconds()
+		results = append(results, r)
+	}
+	return results, nil
+}
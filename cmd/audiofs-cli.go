@@ -1,18 +1,23 @@
 package main
 
 import (
+	"encoding/json"
 	"fmt"
 	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/bench"
 	"gitlab.com/t4cc0re/audiofs/config"
 	_ "gitlab.com/t4cc0re/audiofs/config"
 	"gitlab.com/t4cc0re/audiofs/lib"
-	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/lib/catalog"
+	"gitlab.com/t4cc0re/audiofs/lib/exporter"
+	"gitlab.com/t4cc0re/audiofs/lib/importer"
+	"gitlab.com/t4cc0re/audiofs/metrics"
     //	"gitlab.com/t4cc0re/audiofs/native"
 	"gitlab.com/t4cc0re/audiofs/serve"
 	"gitlab.com/t4cc0re/audiofs/util"
 	"os"
-	"path/filepath"
 	"strings"
+	"sync"
 
 	"github.com/spf13/cobra"
 )
@@ -20,6 +25,8 @@ import (
 func main() {
 	var import_KeepOriginal = true
 	var importExists_CarefulDedupe = true
+	// exists is a quick check by default: it only fingerprints the bounded window (see fingerprint.length).
+	var exists_CarefulDedupe = false
 
 	var cmdImport = &cobra.Command{
 		Use:   "import [file to import]",
@@ -27,7 +34,10 @@ func main() {
 		Long:  `import will import a file into AudioFS and deduplicate its contents where appropriate.`,
 		Args:  cobra.MinimumNArgs(1),
 		Run: func(cmd *cobra.Command, args []string) {
-			lib.ImportFile(args[0], import_KeepOriginal, importExists_CarefulDedupe)
+			metrics.ServeConfigured()
+			if err := lib.ImportFile(args[0], import_KeepOriginal, importExists_CarefulDedupe); err != nil {
+				logrus.Errorf("import: %v", err)
+			}
 		},
 	}
 
@@ -37,7 +47,10 @@ func main() {
 		Long:  `import-catalog will import all references previously stored via 'catalog', as if they were passed to 'import'. This can be used for a multi-stage deduplication.`,
 		Args:  cobra.MinimumNArgs(0),
 		Run: func(cmd *cobra.Command, args []string) {
-			lib.ImportCatalog(import_KeepOriginal, importExists_CarefulDedupe)
+			metrics.ServeConfigured()
+			if err := lib.ImportCatalog(import_KeepOriginal, importExists_CarefulDedupe); err != nil {
+				logrus.Errorf("import-catalog: %v", err)
+			}
 		},
 	}
 
@@ -47,63 +60,195 @@ func main() {
 		Long:  `catalog will import all metadata into AudioFS, but does not import the actual audio stream. It does only keep a reference to the file provided.`,
 		Args:  cobra.MinimumNArgs(1),
 		Run: func(cmd *cobra.Command, args []string) {
-			lib.AddToCatalog(args[0])
+			if err := lib.AddToCatalog(args[0]); err != nil {
+				logrus.Errorf("could not catalog '%s': %v", args[0], err)
+			}
+		},
+	}
+
+	var cmdSnapshot = &cobra.Command{
+		Use:   "snapshot",
+		Short: "write the columnar catalog snapshot",
+		Long:  `snapshot writes a columnar, memory mappable copy of the catalog, which 'query' scans. Re-run it after cataloging to include new files.`,
+		Args:  cobra.NoArgs,
+		RunE: func(cmd *cobra.Command, args []string) error {
+			files, err := lib.Snapshot()
+			if err != nil {
+				return err
+			}
+			logrus.Infof("snapshot of %d files written", files)
+			return nil
+		},
+	}
+
+	var query catalog.StreamQuery
+	var query_Count, query_Summary bool
+	var cmdQuery = &cobra.Command{
+		Use:   "query",
+		Short: "list cataloged files by stream properties",
+		Long:  `query scans the catalog snapshot (see 'snapshot') and prints the files having at least one matching stream, e.g. 'query --codec flac --min-bits 24 --min-rate 96001' or 'query --no-chromaprint'.`,
+		Args:  cobra.NoArgs,
+		RunE: func(cmd *cobra.Command, args []string) error {
+			snapshot, err := lib.Query()
+			if err != nil {
+				return err
+			}
+			defer snapshot.Close()
+
+			streams := snapshot.SelectStreams(query)
+			files := snapshot.StreamsToFiles(streams)
+			switch {
+			case query_Summary:
+				for codec, count := range snapshot.CountBy(streams, snapshot.Uint32(catalog.ColStreamCodec)) {
+					fmt.Printf("%s\t%d\n", codec, count)
+				}
+			case query_Count:
+				fmt.Printf("%d streams in %d files\n", streams.Count(), files.Count())
+			default:
+				files.ForEach(func(file int) {
+					fmt.Println(snapshot.Path(file))
+				})
+			}
+			return nil
+		},
+	}
+
+	var cmdClusters = &cobra.Command{
+		Use:   "clusters",
+		Short: "find near-duplicate recordings",
+		Long:  `clusters compares the fingerprints in the catalog snapshot (see 'snapshot') and prints one JSON line per set of near-duplicates (remasters, different rips, clipped versions), with the similarity and offset in seconds of every verified pair.`,
+		Args:  cobra.NoArgs,
+		RunE: func(cmd *cobra.Command, args []string) error {
+			clusters, err := lib.Clusters()
+			if err != nil {
+				return err
+			}
+			encoder := json.NewEncoder(os.Stdout)
+			for _, c := range clusters {
+				if err = encoder.Encode(c); err != nil {
+					return err
+				}
+			}
+			return nil
 		},
 	}
 
 	var cmdExists = &cobra.Command{
 		Use:   "exists [file to check]",
 		Short: "checks existence in the AudioFS catalog",
-		Long:  `checks whether the precise file, or an equivalent audio stream is already in the AudioFS catalog`,
+		Long:  `checks whether the precise file, or an equivalent audio stream is already in the AudioFS catalog. Prints the store key of the object holding it, and fails if there is none.`,
 		Args:  cobra.MinimumNArgs(1),
-		Run: func(cmd *cobra.Command, args []string) {
-			lib.Exists(args[0], importExists_CarefulDedupe)
+		RunE: func(cmd *cobra.Command, args []string) error {
+			object, found, err := lib.FindStored(args[0], exists_CarefulDedupe)
+			if err != nil {
+				return err
+			}
+			if !found {
+				return fmt.Errorf("'%s' is not stored", args[0])
+			}
+			fmt.Println(object)
+			return nil
 		},
 	}
 
+	var export_Format = exporter.Original
+	var export_Verify bool
+	var export_Jobs int
 	var cmdExport = &cobra.Command{
-		Use:   "export [track_id] [destination file]",
-		Short: "exports a track as AIFF",
-		Long:  `exports a track as AIFF (even if the source was lossy)`,
-		Args:  cobra.MinimumNArgs(1),
-		Run: func(cmd *cobra.Command, args []string) {
-			fmt.Println("exists: " + strings.Join(args, " "))
+		Use:   "export [cataloged file or directory]... [destination directory]",
+		Short: "exports stored files",
+		Long:  `export reconstructs the stored files which were cataloged as the given files, or below the given directories, in the destination directory: a file as <destination>/<name>, a directory as <destination>/<directory name>/<relative path>. '--format original' writes the file as it was imported, '--format aiff' transcodes its first audio stream to AIFF (even if the source was lossy), tagged with the archived metadata. Files are exported in parallel ('--jobs', 'export.workers') and replace existing outputs once complete. Prints the path of every exported file, and its SHA-256 with '--verify'.`,
+		Args:  cobra.MinimumNArgs(2),
+		RunE: func(cmd *cobra.Command, args []string) error {
+			options := exporter.OptionsFromConfig()
+			options.Format, options.Verify = export_Format, export_Verify
+			if export_Jobs > 0 {
+				options.Workers = export_Jobs
+			}
+			if options.Verify && options.Format != exporter.Original {
+				return fmt.Errorf("--verify needs --format %s", exporter.Original)
+			}
+			return lib.Export(args[:len(args)-1], args[len(args)-1], options, func(result exporter.Result) {
+				switch {
+				case result.Err != nil:
+					logrus.Errorf("could not export '%s': %v", result.Entry.Path, result.Err)
+				case result.Hash != "":
+					fmt.Printf("%s  %s\n", result.Hash, result.Output)
+				default:
+					fmt.Println(result.Output)
+				}
+			})
 		},
 	}
 
 	var cmdAnalyze = &cobra.Command{
-		Use:   "analyze [file]",
-		Short: "analyze a song",
-		Long:  `analyzes a song and prints metadata about the file`,
+		Use:   "analyze [file or directory]...",
+		Short: "analyze songs",
+		Long:  `analyzes songs and prints their fingerprint. Directories are searched for files with the extensions in 'scan.extensions'. Files which did not change since they were last analyzed are not probed again.`,
 		Args:  cobra.MinimumNArgs(1),
 		Run: func(cmd *cobra.Command, args []string) {
-			err := filepath.Walk(args[0],
-				func(file string, info os.FileInfo, err error) error {
-					if err != nil {
-						return err
-					}
-					//fmt.Println(path, info.Size())
-
-					if !strings.HasSuffix(file, ".flac") {
-						return nil
+			// The walker emits files serially, probing them is spread over the native workers.
+			files := make(chan string, config.Config.GetInt("import.queue_size"))
+			var wg sync.WaitGroup
+			for i := 0; i < util.DefaultNativePool().Size(); i++ {
+				wg.Add(1)
+				go func() {
+					defer wg.Done()
+					for file := range files {
+						val, d, err := lib.Analyze(file)
+						if err != nil {
+							logrus.Warnf("could not analyze '%s': %v", file, err)
+							continue
+						}
+						logrus.Debugf("%+v\n", val)
+						logrus.Debugf("%d\n", len(d))
+						if len(val.Streams) > 0 {
+							fmt.Fprintf(os.Stdout, "%s\t%s\n", val.Streams[0].Chromaprint, file)
+						}
 					}
-					//file := args[0]
-					val, err := util.GetMetadataFromFile(file)
-					logrus.Printf("%+v\n", val)
-					logrus.Printf("%+v\n", err)
-					d, err := util.MarshallCompressed(val)
-					logrus.Printf("%d\n", len(d))
-					var a types.FileMetadata
-					logrus.Printf("%+v\n", util.UnmarshallCompressed(d, &a))
-					if len(a.Streams) > 0 {
-						fmt.Fprintf(os.Stdout, "%s\t%s\n", a.Streams[0].Chromaprint, file)
-					}
-					return nil
-				})
+				}()
+			}
+			err := importer.Paths(args, false)(func(file string) bool {
+				files <- file
+				return true
+			})
+			close(files)
+			wg.Wait()
 			if err != nil {
 				logrus.Println(err)
 			}
+		},
+	}
+
+	var trainDictionary_Samples = 4096
+	var trainDictionary_Size = util.DefaultDictionarySize
 
+	var cmdTrainDictionary = &cobra.Command{
+		Use:   "train-dictionary [file or directory]...",
+		Short: "train a zstd dictionary for stored metadata",
+		Long:  `train-dictionary trains a zstd dictionary on the metadata of a random sample of the catalog's records. If files or directories are given instead, a random sample of them is probed. The dictionary is stored with the next version number in 'json_export.compression.dictionaries' and used for all metadata written afterwards. Older dictionaries are still needed to read metadata written with them.`,
+		Args:  cobra.MinimumNArgs(0),
+		RunE: func(cmd *cobra.Command, args []string) error {
+			var samples [][]byte
+			var err error
+			if len(args) == 0 {
+				samples, err = lib.SampleCatalogMetadata(trainDictionary_Samples)
+			} else {
+				samples, err = util.SampleMetadataJSON(args, trainDictionary_Samples)
+			}
+			if err != nil {
+				return err
+			}
+			dict, err := util.TrainDictionary(samples, trainDictionary_Size, util.NextDictionaryID(), config.Config.GetInt("json_export.compression.level"))
+			if err != nil {
+				return err
+			}
+			path, err := util.SaveDictionary(dict)
+			if err != nil {
+				return err
+			}
+			logrus.Infof("trained %d byte dictionary on %d samples: %s", len(dict), len(samples), path)
+			return nil
 		},
 	}
 
@@ -131,13 +276,67 @@ a count and a string.`,
 
 	config.Config.SetDefault("json_export.compression.algo", "zstd")
 	config.Config.SetDefault("json_export.compression.level", 10)
+	config.Config.SetDefault("json_export.compression.dictionaries", "dictionaries")
+	config.Config.SetDefault("json_export.compression.dictionary", 0) // 0: newest, -1: none
+	config.Config.SetDefault("catalog.dir", "catalog")
+	config.Config.SetDefault("store.backend", "fs") // fs: store.dir, s3: store.s3.*
+	config.Config.SetDefault("store.dir", "store")
+	config.Config.SetDefault("store.pack_threshold", 256<<10) // smaller objects are appended to packs, 0 disables packs
+	config.Config.SetDefault("store.pack_size", 1<<30)
+	config.Config.SetDefault("store.force_lock", false) // break the lock of a writer which did not close the store
+	config.Config.SetDefault("store.s3.endpoint", "")
+	config.Config.SetDefault("store.s3.bucket", "")
+	config.Config.SetDefault("store.s3.prefix", "")
+	config.Config.SetDefault("store.s3.region", "us-east-1")
+	config.Config.SetDefault("store.s3.path_style", true)
+	config.Config.SetDefault("store.s3.access_key", "") // '': AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY
+	config.Config.SetDefault("store.s3.secret_key", "")
+	config.Config.SetDefault("store.s3.part_size", 16<<20)
+	config.Config.SetDefault("store.s3.uploads", 4) // parts in flight per object
+	config.Config.SetDefault("store.s3.block_size", 1<<20)
+	config.Config.SetDefault("store.s3.pack_threshold", 1<<20) // smaller objects are coalesced, 0 disables packs
+	config.Config.SetDefault("store.s3.pack_size", 64<<20)
+	config.Config.SetDefault("store.s3.retries", 3)
+	config.Config.SetDefault("export.workers", 4) // files exported in parallel
+	config.Config.SetDefault("scan.workers", 8)
+	config.Config.SetDefault("scan.extensions", []string{}) // empty: everything the native demuxers support, "*": all files
+	config.Config.SetDefault("scan.readahead", 2<<20)       // bytes prefetched per file ahead of probing, 0 disables
+	config.Config.SetDefault("import.queue_size", 64)
+	config.Config.SetDefault("import.workers.probe", 4)
+	config.Config.SetDefault("import.workers.fingerprint", 0) // 0: one per native worker
+	config.Config.SetDefault("import.workers.store", 2)
 	config.Config.SetDefault("import.file.keep_original", true)
 	config.Config.SetDefault("import.catalog.keep_original", true)
 	config.Config.SetDefault("import.file.careful_dedupe", true)
 	config.Config.SetDefault("import.catalog.careful_dedupe", true)
+	config.Config.SetDefault("import.art.min_size", 16<<10) // embedded pictures stored once across files
 	config.Config.SetDefault("check.careful_dedupe", true)
 	config.Config.SetDefault("conversion.dither", "high_shibata")
 	config.Config.SetDefault("conversion.resampler", "swr")
+	config.Config.SetDefault("conversion.dsd_rate", 88200) // lowest PCM rate DSD is converted to, 0 leaves it to libav
+	config.Config.SetDefault("conversion.dsd_threads", 0)  // per conversion, 0: one per channel and CPU
+	config.Config.SetDefault("fingerprint.length", 120)
+	config.Config.SetDefault("fingerprint.second_window", "")
+	config.Config.SetDefault("native.workers", 0)                 // 0: one per scheduler thread
+	config.Config.SetDefault("scheduler.threads", 0)              // budget shared by all jobs and their codecs, 0: one per CPU
+	config.Config.SetDefault("scheduler.interactive_reserve", -1) // threads batch work may not use, -1: a quarter of the budget
+	config.Config.SetDefault("scheduler.job_threads.interactive", 2)
+	config.Config.SetDefault("scheduler.job_threads.background", 1)
+	config.Config.SetDefault("scheduler.job_threads.batch", 1)
+	config.Config.SetDefault("cluster.tables", 4)
+	config.Config.SetDefault("cluster.key_bits", 32)   // per key, drawn from two consecutive frames
+	config.Config.SetDefault("cluster.sample_bits", 5) // index 1 in 32 keys
+	config.Config.SetDefault("cluster.max_bucket", 32)
+	config.Config.SetDefault("cluster.min_shared", 2)
+	config.Config.SetDefault("cluster.offset_radius", 2)
+	config.Config.SetDefault("cluster.min_overlap", 80) // frames, ~10 s
+	config.Config.SetDefault("cluster.min_similarity", 0.75)
+	config.Config.SetDefault("cluster.workers", 0) // 0: the scheduler's budget
+	config.Config.SetDefault("native.timeout", "5m")
+	config.Config.SetDefault("native.memory_budget", 1<<30)      // in-memory buffers of all workers, 0: no limit
+	config.Config.SetDefault("native.memory_wait", "5s")         // new in-memory outputs wait this long for room, then spill
+	config.Config.SetDefault("native.spill_dir", "")             // '': $TMPDIR
+	config.Config.SetDefault("metrics.listen", "127.0.0.1:9464") // '' disables the endpoint in `serve`
 	config.Config.SetDefault("loglevel", "info")
 	levelStr := config.Config.GetString("loglevel")
 	level, err := logrus.ParseLevel(levelStr)
@@ -152,13 +351,28 @@ a count and a string.`,
 	cmdImport.Flags().BoolVarP(&importExists_CarefulDedupe, "careful", "c", true, "only dedupe a file if PCM audio is bit-for-bit identical")
 	cmdImportCatalog.Flags().BoolVarP(&import_KeepOriginal, "keep", "k", true, "keep the original file")
 	cmdImportCatalog.Flags().BoolVarP(&importExists_CarefulDedupe, "careful", "c", true, "only dedupe a file if PCM audio is bit-for-bit identical")
-	cmdExists.Flags().BoolVarP(&importExists_CarefulDedupe, "careful", "c", true, "also check if PCM audio is bit-for-bit identical")
+	cmdExists.Flags().BoolVarP(&exists_CarefulDedupe, "careful", "c", false, "fingerprint the whole stream instead of the bounded window, and check if PCM audio is bit-for-bit identical")
+	cmdQuery.Flags().StringVar(&query.Type, "type", "audio", "stream type")
+	cmdQuery.Flags().StringVar(&query.Codec, "codec", "", "codec name, e.g. flac")
+	cmdQuery.Flags().Int32Var(&query.MinBits, "min-bits", 0, "minimum bits per raw sample")
+	cmdQuery.Flags().Int32Var(&query.MinSampleRate, "min-rate", 0, "minimum sample rate")
+	cmdQuery.Flags().Int32Var(&query.MaxSampleRate, "max-rate", 0, "maximum sample rate")
+	cmdQuery.Flags().BoolVar(&query.NoChromaprint, "no-chromaprint", false, "only streams without a fingerprint")
+	cmdQuery.Flags().BoolVar(&query_Count, "count", false, "only print the number of matches")
+	cmdQuery.Flags().BoolVar(&query_Summary, "summary", false, "print the number of matching streams per codec")
+	cmdExport.Flags().StringVarP(&export_Format, "format", "f", export_Format, "original or aiff")
+	cmdExport.Flags().BoolVar(&export_Verify, "verify", false, "hash originals while writing them and check them against the store")
+	cmdExport.Flags().IntVarP(&export_Jobs, "jobs", "j", 0, "files exported in parallel (default: 'export.workers')")
+	cmdTrainDictionary.Flags().IntVarP(&trainDictionary_Samples, "samples", "n", trainDictionary_Samples, "number of files to sample")
+	cmdTrainDictionary.Flags().IntVarP(&trainDictionary_Size, "size", "s", trainDictionary_Size, "maximum dictionary size in bytes")
 
 	config.Config.Store()
 
 	var rootCmd = &cobra.Command{Use: "audiofs-cli"}
-	rootCmd.AddCommand(cmdAnalyze, cmdImport, cmdImportCatalog, cmdCatalog, cmdExists, cmdEcho, cmdExport)
+	rootCmd.AddCommand(cmdAnalyze, cmdImport, cmdImportCatalog, cmdCatalog, cmdExists, cmdEcho, cmdExport, cmdTrainDictionary, cmdSnapshot, cmdQuery, cmdClusters)
 	cmdEcho.AddCommand(cmdTimes)
 	serve.Inject(rootCmd)
+	bench.Inject(rootCmd)
 	rootCmd.Execute()
+	util.DefaultNativePool().Close()
 }
@@ -0,0 +1,303 @@
+package catalog
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"hash/crc32"
+	"io"
+	"os"
+	"path/filepath"
+	"sync"
+	"time"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/filelock"
+)
+
+// The catalog is an append-only log of records. A later record for the same path supersedes earlier ones. Every
+// record is checksummed, so a torn write (crash, full disk) only loses the record being written.
+//
+//	header: logMagic | uint32 version
+//	record: uint32 payload length | uint32 CRC-32C of payload | payload
+//	payload: uvarint len(path) | path | varint size | varint mod time (unix ns) | uvarint len(object) | object
+//	         | metadata blob
+//
+// The metadata blob is the file's types.FileMetadata as written by util.MarshallCompressed.
+const (
+	logMagic   = "AFSCATLG"
+	logVersion = 1
+	logFile    = "catalog.log"
+	// Records are small, anything bigger than this is corruption.
+	maxRecordSize = 64 << 20
+)
+
+var (
+	ErrNotACatalog        = errors.New("not an AudioFS catalog")
+	ErrUnsupportedVersion = errors.New("unsupported catalog version")
+
+	crcTable = crc32.MakeTable(crc32.Castagnoli)
+)
+
+// Entry is one cataloged file.
+type Entry struct {
+	// Path is absolute and clean.
+	Path string
+	Size int64
+	// ModTime is the file's modification time in unix nanoseconds.
+	ModTime int64
+	// Object is the store key of the imported audio, empty if the file was only cataloged.
+	Object string
+	// Metadata is the compressed types.FileMetadata (see util.MarshallCompressed).
+	Metadata []byte
+}
+
+type Catalog struct {
+	dir   string
+	mutex sync.Mutex
+	log   *os.File
+}
+
+var (
+	defaultCatalog     *Catalog
+	defaultCatalogErr  error
+	defaultCatalogOnce sync.Once
+)
+
+// Default opens the catalog in `catalog.dir` once per process.
+func Default() (*Catalog, error) {
+	defaultCatalogOnce.Do(func() {
+		defaultCatalog, defaultCatalogErr = Open(config.Config.GetString("catalog.dir"))
+	})
+	return defaultCatalog, defaultCatalogErr
+}
+
+// Open opens (or creates) the catalog in dir. A torn record at the end of the log is cut off.
+//
+// Several processes may append to the same catalog (e.g. `import` and `import-catalog`): the log is opened for
+// appending, and every append and the recovery hold a lock on it, so recovering never cuts off another process'
+// record while it is being written.
+func Open(dir string) (*Catalog, error) {
+	if err := os.MkdirAll(dir, 0755); err != nil {
+		return nil, err
+	}
+	log, err := os.OpenFile(filepath.Join(dir, logFile), os.O_RDWR|os.O_CREATE|os.O_APPEND, 0644)
+	if err != nil {
+		return nil, err
+	}
+	c := &Catalog{dir: dir, log: log}
+	if err = c.recover(); err != nil {
+		_ = log.Close()
+		return nil, err
+	}
+	return c, nil
+}
+
+// Dir is the directory the catalog and its derived files (e.g. snapshots) live in.
+func (c *Catalog) Dir() string {
+	return c.dir
+}
+
+// ModTime is the time of the last append, e.g. to tell whether a snapshot is stale.
+func (c *Catalog) ModTime() (time.Time, error) {
+	info, err := os.Stat(c.log.Name())
+	if err != nil {
+		return time.Time{}, err
+	}
+	return info.ModTime(), nil
+}
+
+// recover writes the header into a new log, or cuts off a torn record at its end.
+func (c *Catalog) recover() (err error) {
+	if err = filelock.Lock(c.log); err != nil {
+		return err
+	}
+	defer func() {
+		if unlockErr := filelock.Unlock(c.log); err == nil {
+			err = unlockErr
+		}
+	}()
+
+	info, err := c.log.Stat()
+	if err != nil {
+		return err
+	}
+	if info.Size() == 0 {
+		header := make([]byte, len(logMagic)+4)
+		copy(header, logMagic)
+		binary.LittleEndian.PutUint32(header[len(logMagic):], logVersion)
+		_, err = c.log.Write(header)
+		return err
+	}
+
+	end, err := c.scan(func(Entry) error { return nil })
+	if err != nil {
+		return err
+	}
+	if end < info.Size() {
+		logrus.Warnf("catalog: dropping %d bytes of incomplete records at the end of the log", info.Size()-end)
+		return c.log.Truncate(end)
+	}
+	return nil
+}
+
+// Append adds a record. Safe for concurrent use. Relative paths are made absolute against the working directory, so
+// the record still names the same file when read from elsewhere.
+func (c *Catalog) Append(entry Entry) error {
+	path, err := filepath.Abs(entry.Path)
+	if err != nil {
+		return err
+	}
+	entry.Path = path
+
+	payload := make([]byte, 0, 4*binary.MaxVarintLen64+len(entry.Path)+len(entry.Object)+len(entry.Metadata))
+	payload = binary.AppendUvarint(payload, uint64(len(entry.Path)))
+	payload = append(payload, entry.Path...)
+	payload = binary.AppendVarint(payload, entry.Size)
+	payload = binary.AppendVarint(payload, entry.ModTime)
+	payload = binary.AppendUvarint(payload, uint64(len(entry.Object)))
+	payload = append(payload, entry.Object...)
+	payload = append(payload, entry.Metadata...)
+
+	record := make([]byte, 8, 8+len(payload))
+	binary.LittleEndian.PutUint32(record, uint32(len(payload)))
+	binary.LittleEndian.PutUint32(record[4:], crc32.Checksum(payload, crcTable))
+	record = append(record, payload...)
+
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	if err := filelock.Lock(c.log); err != nil {
+		return err
+	}
+	// One write per record, so a crash tears at most this one.
+	_, err = c.log.Write(record)
+	if unlockErr := filelock.Unlock(c.log); err == nil {
+		err = unlockErr
+	}
+	return err
+}
+
+// Scan calls fn for every record in the order they were written, including superseded ones. Stops at the first error
+// returned by fn. Appends block until the scan is done, so fn must not append.
+func (c *Catalog) Scan(fn func(Entry) error) error {
+	_, err := c.scan(fn)
+	return err
+}
+
+// Entries returns the current record of every cataloged path, in the order the paths were first cataloged.
+func (c *Catalog) Entries() ([]Entry, error) {
+	var entries []Entry
+	index := map[string]int{}
+	err := c.Scan(func(entry Entry) error {
+		if i, ok := index[entry.Path]; ok {
+			entries[i] = entry
+			return nil
+		}
+		index[entry.Path] = len(entries)
+		entries = append(entries, entry)
+		return nil
+	})
+	return entries, err
+}
+
+// scan reads the log from the beginning. It returns the offset after the last complete record.
+func (c *Catalog) scan(fn func(Entry) error) (int64, error) {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+
+	// Reads go through their own descriptor, so the append position is not disturbed.
+	file, err := os.Open(c.log.Name())
+	if err != nil {
+		return 0, err
+	}
+	defer file.Close()
+	reader := bufio.NewReaderSize(file, 1<<20)
+
+	header := make([]byte, len(logMagic)+4)
+	if _, err = io.ReadFull(reader, header); err != nil || string(header[:len(logMagic)]) != logMagic {
+		return 0, ErrNotACatalog
+	}
+	if version := binary.LittleEndian.Uint32(header[len(logMagic):]); version != logVersion {
+		return 0, fmt.Errorf("%w: %d", ErrUnsupportedVersion, version)
+	}
+
+	offset := int64(len(header))
+	recordHeader := make([]byte, 8)
+	var payload []byte
+	for {
+		if _, err = io.ReadFull(reader, recordHeader); err != nil {
+			// EOF, or a torn record header
+			return offset, nil
+		}
+		length := binary.LittleEndian.Uint32(recordHeader)
+		if length > maxRecordSize {
+			return offset, nil
+		}
+		if cap(payload) < int(length) {
+			payload = make([]byte, length)
+		}
+		payload = payload[:length]
+		if _, err = io.ReadFull(reader, payload); err != nil {
+			return offset, nil
+		}
+		if crc32.Checksum(payload, crcTable) != binary.LittleEndian.Uint32(recordHeader[4:]) {
+			logrus.Warnf("catalog: checksum mismatch at offset %d, ignoring the rest of the log", offset)
+			return offset, nil
+		}
+		entry, ok := decodeEntry(payload)
+		if !ok {
+			return offset, nil
+		}
+		if err = fn(entry); err != nil {
+			return offset, err
+		}
+		offset += int64(len(recordHeader)) + int64(length)
+	}
+}
+
+// decodeEntry parses a payload. The entry does not reference `payload`, which is reused.
+func decodeEntry(payload []byte) (Entry, bool) {
+	var entry Entry
+	pathLength, n := binary.Uvarint(payload)
+	if n <= 0 || uint64(len(payload)-n) < pathLength {
+		return entry, false
+	}
+	payload = payload[n:]
+	entry.Path = string(payload[:pathLength])
+	payload = payload[pathLength:]
+	if entry.Size, n = binary.Varint(payload); n <= 0 {
+		return entry, false
+	}
+	payload = payload[n:]
+	if entry.ModTime, n = binary.Varint(payload); n <= 0 {
+		return entry, false
+	}
+	payload = payload[n:]
+	objectLength, n := binary.Uvarint(payload)
+	if n <= 0 || uint64(len(payload)-n) < objectLength {
+		return entry, false
+	}
+	payload = payload[n:]
+	entry.Object = string(payload[:objectLength])
+	entry.Metadata = append([]byte(nil), payload[objectLength:]...)
+	return entry, true
+}
+
+// Sync flushes appended records to stable storage.
+func (c *Catalog) Sync() error {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	return c.log.Sync()
+}
+
+func (c *Catalog) Close() error {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	if err := c.log.Sync(); err != nil {
+		_ = c.log.Close()
+		return err
+	}
+	return c.log.Close()
+}
@@ -0,0 +1,36 @@
+package catalog
+
+import (
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+func TestAppendMakesPathsAbsolute(t *testing.T) {
+	dir := t.TempDir()
+	c, err := Open(filepath.Join(dir, "catalog"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close()
+
+	wd, err := os.Getwd()
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i, path := range []string{"a.flac", "./a.flac", "b/../a.flac", filepath.Join(wd, "a.flac")} {
+		if err = c.Append(Entry{Path: path, Size: int64(i)}); err != nil {
+			t.Fatal(err)
+		}
+	}
+	entries, err := c.Entries()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(entries) != 1 {
+		t.Fatalf("%d entries, want 1: %v", len(entries), entries)
+	}
+	if want := filepath.Join(wd, "a.flac"); entries[0].Path != want || entries[0].Size != 3 {
+		t.Fatalf("entry %s (size %d), want %s (size 3)", entries[0].Path, entries[0].Size, want)
+	}
+}
@@ -0,0 +1,193 @@
+package catalog
+
+import (
+	"math"
+	"math/bits"
+)
+
+// Bitmap selects rows of one snapshot table, one bit per row. Filters narrow a selection in place and work on 64 rows
+// at a time: every word is built from a branch free comparison per row, and words without selected rows are skipped,
+// so chaining the most selective filter first only reads the following columns where something is left.
+type Bitmap []uint64
+
+// AllRows selects every row of a table with n rows.
+func AllRows(n int) Bitmap {
+	b := make(Bitmap, (n+63)/64)
+	for i := range b {
+		b[i] = ^uint64(0)
+	}
+	if n%64 != 0 {
+		b[len(b)-1] = (uint64(1) << (n % 64)) - 1
+	}
+	return b
+}
+
+func b2u(b bool) uint64 {
+	if b {
+		return 1
+	}
+	return 0
+}
+
+// chunk returns the rows of word w. Columns missing in the snapshot are empty, which deselects everything.
+func chunk[T any](col []T, w int) []T {
+	start := w * 64
+	if start >= len(col) {
+		return nil
+	}
+	end := start + 64
+	if end > len(col) {
+		end = len(col)
+	}
+	return col[start:end]
+}
+
+// WhereUint32 keeps rows whose value equals v, e.g. a dictionary code.
+func (b Bitmap) WhereUint32(col []uint32, v uint32) Bitmap {
+	for w := range b {
+		if b[w] == 0 {
+			continue
+		}
+		var mask uint64
+		for i, x := range chunk(col, w) {
+			mask |= b2u(x == v) << i
+		}
+		b[w] &= mask
+	}
+	return b
+}
+
+// WhereInt32Between keeps rows with min <= value <= max.
+func (b Bitmap) WhereInt32Between(col []int32, min, max int32) Bitmap {
+	for w := range b {
+		if b[w] == 0 {
+			continue
+		}
+		var mask uint64
+		for i, x := range chunk(col, w) {
+			mask |= b2u(x >= min && x <= max) << i
+		}
+		b[w] &= mask
+	}
+	return b
+}
+
+// WhereInt64Between keeps rows with min <= value <= max.
+func (b Bitmap) WhereInt64Between(col []int64, min, max int64) Bitmap {
+	for w := range b {
+		if b[w] == 0 {
+			continue
+		}
+		var mask uint64
+		for i, x := range chunk(col, w) {
+			mask |= b2u(x >= min && x <= max) << i
+		}
+		b[w] &= mask
+	}
+	return b
+}
+
+// WhereEmpty keeps rows whose variable length value is empty (or not empty, if `empty` is false). Only the offsets
+// are read.
+func (b Bitmap) WhereEmpty(col VarColumn, empty bool) Bitmap {
+	for w := range b {
+		if b[w] == 0 {
+			continue
+		}
+		var mask uint64
+		offsets := col.Offsets
+		start := w * 64
+		for i := 0; i < 64 && start+i+1 < len(offsets); i++ {
+			mask |= b2u((offsets[start+i+1] == offsets[start+i]) == empty) << i
+		}
+		b[w] &= mask
+	}
+	return b
+}
+
+func (b Bitmap) Count() int {
+	count := 0
+	for _, word := range b {
+		count += bits.OnesCount64(word)
+	}
+	return count
+}
+
+// ForEach calls fn for every selected row, in order.
+func (b Bitmap) ForEach(fn func(row int)) {
+	for w, word := range b {
+		for word != 0 {
+			fn(w*64 + bits.TrailingZeros64(word))
+			word &= word - 1
+		}
+	}
+}
+
+// StreamsToFiles selects the files having at least one selected stream.
+func (s *Snapshot) StreamsToFiles(streams Bitmap) Bitmap {
+	files := make(Bitmap, (s.Files+63)/64)
+	streamFile := s.Uint32(ColStreamFile)
+	streams.ForEach(func(row int) {
+		file := streamFile[row]
+		files[file/64] |= 1 << (file % 64)
+	})
+	return files
+}
+
+// CountBy counts the selected rows per value of a dictionary encoded column.
+func (s *Snapshot) CountBy(rows Bitmap, col []uint32) map[string]int {
+	counts := make([]int, s.dictionary.Len())
+	rows.ForEach(func(row int) {
+		counts[col[row]]++
+	})
+	result := map[string]int{}
+	for code, count := range counts {
+		if count > 0 {
+			result[s.String(uint32(code))] = count
+		}
+	}
+	return result
+}
+
+// StreamQuery filters streams. Zero values do not filter.
+type StreamQuery struct {
+	Type          string
+	Codec         string
+	MinBits       int32
+	MinSampleRate int32
+	MaxSampleRate int32
+	NoChromaprint bool
+}
+
+// SelectStreams runs a query over the stream table. Dictionary encoded filters come first, they are the cheapest and
+// usually the most selective.
+func (s *Snapshot) SelectStreams(q StreamQuery) Bitmap {
+	rows := AllRows(s.Streams)
+	for _, filter := range []struct {
+		value string
+		col   ColumnID
+	}{{q.Type, ColStreamType}, {q.Codec, ColStreamCodec}} {
+		if filter.value == "" {
+			continue
+		}
+		code, ok := s.Code(filter.value)
+		if !ok {
+			return make(Bitmap, len(rows))
+		}
+		rows.WhereUint32(s.Uint32(filter.col), code)
+	}
+	if q.MinBits > 0 {
+		rows.WhereInt32Between(s.Int32(ColStreamBitsPerRawSample), q.MinBits, math.MaxInt32)
+	}
+	if q.MinSampleRate > 0 || q.MaxSampleRate > 0 {
+		max := q.MaxSampleRate
+		if max <= 0 {
+			max = math.MaxInt32
+		}
+		rows.WhereInt32Between(s.Int32(ColStreamSampleRate), q.MinSampleRate, max)
+	}
+	if q.NoChromaprint {
+		rows.WhereEmpty(s.Var(ColStreamChromaprintOffsets, ColStreamChromaprintData), true)
+	}
+	return rows
+}
@@ -0,0 +1,361 @@
+package catalog
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"os"
+	"path/filepath"
+	"unsafe"
+)
+
+// A snapshot is a read-only, columnar copy of the catalog for scans. It is memory mapped and its columns are used in
+// place, so a query only pages in the columns it reads.
+//
+//	header (64 bytes): snapshotMagic | uint32 version | uint32 column count | uint64 files | uint64 streams
+//	                   | uint64 tags | uint64 dictionary strings | padding
+//	directory: column count × (uint32 ColumnID | uint32 ColumnType | uint64 offset | uint64 length)
+//	columns: little endian, each aligned to snapshotAlignment
+//
+// There are three tables: files, streams (sorted by file) and tags (sorted by file, then stream). Numeric fields are
+// fixed width columns. Repetitive strings (format and codec names, channel layouts, tag keys) are stored as uint32
+// codes into the string dictionary. Variable length data (paths, fingerprints, tag values, the compressed metadata)
+// is stored as a data column plus a uint64 offset column with one entry more than the table has rows, so row i is
+// data[offsets[i]:offsets[i+1]].
+//
+// Readers ignore columns they do not know, so columns can be added without bumping the version.
+const (
+	snapshotMagic      = "AFSSNAP\x00"
+	snapshotVersion    = 1
+	snapshotHeaderSize = 64
+	snapshotDirEntry   = 24
+	snapshotAlignment  = 64
+	SnapshotFile       = "catalog.snapshot"
+)
+
+type ColumnID uint32
+
+const (
+	// files
+	ColFilePathOffsets ColumnID = iota + 1
+	ColFilePathData
+	ColFileSize
+	ColFileModTime
+	ColFileFormat
+	ColFileDuration
+	ColFileBitRate
+	// ColFileStreams holds the first stream row of every file, plus the total number of streams.
+	ColFileStreams
+	ColFileMetadataOffsets
+	ColFileMetadataData
+
+	// streams
+	ColStreamFile
+	ColStreamIndex
+	ColStreamType
+	ColStreamCodec
+	ColStreamLayout
+	ColStreamChannels
+	ColStreamSampleRate
+	ColStreamBitsPerRawSample
+	ColStreamBitsPerCodedSample
+	ColStreamBitRate
+	ColStreamDuration
+	ColStreamTimeBaseNum
+	ColStreamTimeBaseDen
+	ColStreamChromaprintOffsets
+	ColStreamChromaprintData
+	ColStreamChromaprintLength
+
+	// tags
+	ColTagFile
+	// ColTagStream is the stream row the tag belongs to, -1 for container tags.
+	ColTagStream
+	ColTagKey
+	ColTagValueOffsets
+	ColTagValueData
+
+	// string dictionary
+	ColDictionaryOffsets
+	ColDictionaryData
+
+	// ColFileObjectOffsets/ColFileObjectData hold the store key of imported files, empty if only cataloged.
+	ColFileObjectOffsets
+	ColFileObjectData
+
+	// streams, continued
+	ColStreamChromaprintSecondOffsets
+	ColStreamChromaprintSecondData
+	ColStreamChromaprintSecondOffset
+)
+
+type ColumnType uint32
+
+const (
+	ColumnUint32 ColumnType = iota + 1
+	ColumnInt32
+	ColumnInt64
+	ColumnUint64
+	ColumnBytes
+)
+
+func (t ColumnType) size() int {
+	switch t {
+	case ColumnUint32, ColumnInt32:
+		return 4
+	case ColumnInt64, ColumnUint64:
+		return 8
+	default:
+		return 1
+	}
+}
+
+var (
+	ErrNotASnapshot              = errors.New("not an AudioFS catalog snapshot")
+	ErrCorruptSnapshot           = errors.New("corrupt catalog snapshot")
+	ErrUnsupportedSnapshotHost   = errors.New("catalog snapshots are only supported on little endian hosts")
+	ErrUnsupportedSnapshotFormat = errors.New("unsupported catalog snapshot version")
+)
+
+type column struct {
+	typ  ColumnType
+	data []byte
+}
+
+// Snapshot is an opened snapshot. Slices returned by it are only valid until Close.
+type Snapshot struct {
+	data    []byte
+	unmap   func() error
+	columns map[ColumnID]column
+
+	Files   int
+	Streams int
+	Tags    int
+
+	dictionary VarColumn
+	codes      map[string]uint32
+}
+
+// SnapshotPath is where `snapshot` writes the snapshot of a catalog.
+func SnapshotPath(c *Catalog) string {
+	return filepath.Join(c.Dir(), SnapshotFile)
+}
+
+func littleEndianHost() bool {
+	x := uint16(1)
+	return *(*byte)(unsafe.Pointer(&x)) == 1
+}
+
+// OpenSnapshot maps a snapshot and validates its column directory.
+func OpenSnapshot(path string) (*Snapshot, error) {
+	if !littleEndianHost() {
+		return nil, ErrUnsupportedSnapshotHost
+	}
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	info, err := file.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if info.Size() < snapshotHeaderSize {
+		return nil, ErrNotASnapshot
+	}
+	data, unmap, err := mapFile(file, int(info.Size()))
+	if err != nil {
+		return nil, err
+	}
+	s := &Snapshot{data: data, unmap: unmap, columns: map[ColumnID]column{}}
+	if err = s.parse(); err != nil {
+		_ = unmap()
+		return nil, fmt.Errorf("%s: %w", path, err)
+	}
+	return s, nil
+}
+
+func (s *Snapshot) parse() error {
+	if string(s.data[:len(snapshotMagic)]) != snapshotMagic {
+		return ErrNotASnapshot
+	}
+	header := s.data[len(snapshotMagic):]
+	if version := binary.LittleEndian.Uint32(header); version != snapshotVersion {
+		return fmt.Errorf("%w: %d", ErrUnsupportedSnapshotFormat, version)
+	}
+	count := uint64(binary.LittleEndian.Uint32(header[4:]))
+	files := binary.LittleEndian.Uint64(header[8:])
+	streams := binary.LittleEndian.Uint64(header[16:])
+	tags := binary.LittleEndian.Uint64(header[24:])
+	strings := binary.LittleEndian.Uint64(header[32:])
+	size := uint64(len(s.data))
+	if files > size || streams > size || tags > size || strings > size || count*snapshotDirEntry > size {
+		return ErrCorruptSnapshot
+	}
+	s.Files, s.Streams, s.Tags = int(files), int(streams), int(tags)
+
+	directory := s.data[snapshotHeaderSize:]
+	if uint64(len(directory)) < count*snapshotDirEntry {
+		return ErrCorruptSnapshot
+	}
+	for i := uint64(0); i < count; i++ {
+		entry := directory[i*snapshotDirEntry:]
+		id := ColumnID(binary.LittleEndian.Uint32(entry))
+		typ := ColumnType(binary.LittleEndian.Uint32(entry[4:]))
+		offset := binary.LittleEndian.Uint64(entry[8:])
+		length := binary.LittleEndian.Uint64(entry[16:])
+		if offset%snapshotAlignment != 0 || offset > size || length > size-offset || length%uint64(typ.size()) != 0 {
+			return ErrCorruptSnapshot
+		}
+		s.columns[id] = column{typ: typ, data: s.data[offset : offset+length]}
+	}
+
+	// Fixed width columns must have one value per row, offset columns one more and end at the size of their data.
+	// Contents are not validated, that would page in every column on open. Indexing is bounds checked, so a corrupt
+	// snapshot panics instead of reading out of the mapping.
+	for id, rows := range snapshotColumnRows(s.Files, s.Streams, s.Tags, int(strings)) {
+		col, ok := s.columns[id]
+		if !ok {
+			continue
+		}
+		if len(col.data)/col.typ.size() != rows {
+			return ErrCorruptSnapshot
+		}
+	}
+	for offsets, data := range snapshotVarColumns {
+		if col := s.Uint64(offsets); len(col) > 0 && col[len(col)-1] != uint64(len(s.Bytes(data))) {
+			return ErrCorruptSnapshot
+		}
+	}
+
+	s.dictionary = s.Var(ColDictionaryOffsets, ColDictionaryData)
+	s.codes = make(map[string]uint32, s.dictionary.Len())
+	for i := 0; i < s.dictionary.Len(); i++ {
+		s.codes[string(s.dictionary.Get(i))] = uint32(i)
+	}
+	return nil
+}
+
+// snapshotColumnRows is the number of values every fixed width column has.
+func snapshotColumnRows(files, streams, tags, strings int) map[ColumnID]int {
+	rows := map[ColumnID]int{
+		ColFilePathOffsets:          files + 1,
+		ColFileMetadataOffsets:      files + 1,
+		ColFileObjectOffsets:        files + 1,
+		ColFileStreams:              files + 1,
+		ColStreamChromaprintOffsets: streams + 1,
+		ColTagValueOffsets:          tags + 1,
+		ColDictionaryOffsets:        strings + 1,
+
+		ColStreamChromaprintSecondOffsets: streams + 1,
+		ColStreamChromaprintSecondOffset:  streams,
+	}
+	for _, id := range []ColumnID{ColFileSize, ColFileModTime, ColFileFormat, ColFileDuration, ColFileBitRate} {
+		rows[id] = files
+	}
+	for id := ColStreamFile; id <= ColStreamChromaprintLength; id++ {
+		if id != ColStreamChromaprintOffsets && id != ColStreamChromaprintData {
+			rows[id] = streams
+		}
+	}
+	for _, id := range []ColumnID{ColTagFile, ColTagStream, ColTagKey} {
+		rows[id] = tags
+	}
+	return rows
+}
+
+// snapshotVarColumns maps offset columns to their data.
+var snapshotVarColumns = map[ColumnID]ColumnID{
+	ColFilePathOffsets:          ColFilePathData,
+	ColFileMetadataOffsets:      ColFileMetadataData,
+	ColFileObjectOffsets:        ColFileObjectData,
+	ColStreamChromaprintOffsets: ColStreamChromaprintData,
+	ColTagValueOffsets:          ColTagValueData,
+	ColDictionaryOffsets:        ColDictionaryData,
+
+	ColStreamChromaprintSecondOffsets: ColStreamChromaprintSecondData,
+}
+
+func (s *Snapshot) Close() error {
+	s.columns = nil
+	return s.unmap()
+}
+
+func view[T any](data []byte) []T {
+	if len(data) == 0 {
+		return nil
+	}
+	var zero T
+	return unsafe.Slice((*T)(unsafe.Pointer(&data[0])), len(data)/int(unsafe.Sizeof(zero)))
+}
+
+func (s *Snapshot) typed(id ColumnID, typ ColumnType) []byte {
+	col, ok := s.columns[id]
+	if !ok || col.typ != typ {
+		return nil
+	}
+	return col.data
+}
+
+// Has reports whether the snapshot has all of the columns, as older snapshots lack those added since.
+func (s *Snapshot) Has(ids ...ColumnID) bool {
+	for _, id := range ids {
+		if _, ok := s.columns[id]; !ok {
+			return false
+		}
+	}
+	return true
+}
+
+// Uint32 returns a column in place. nil if the snapshot does not have it.
+func (s *Snapshot) Uint32(id ColumnID) []uint32 { return view[uint32](s.typed(id, ColumnUint32)) }
+
+// Int32 returns a column in place. nil if the snapshot does not have it.
+func (s *Snapshot) Int32(id ColumnID) []int32 { return view[int32](s.typed(id, ColumnInt32)) }
+
+// Int64 returns a column in place. nil if the snapshot does not have it.
+func (s *Snapshot) Int64(id ColumnID) []int64 { return view[int64](s.typed(id, ColumnInt64)) }
+
+// Uint64 returns a column in place. nil if the snapshot does not have it.
+func (s *Snapshot) Uint64(id ColumnID) []uint64 { return view[uint64](s.typed(id, ColumnUint64)) }
+
+// Bytes returns a data column in place. nil if the snapshot does not have it.
+func (s *Snapshot) Bytes(id ColumnID) []byte { return s.typed(id, ColumnBytes) }
+
+// VarColumn is a variable length column: row i is Data[Offsets[i]:Offsets[i+1]].
+type VarColumn struct {
+	Offsets []uint64
+	Data    []byte
+}
+
+func (s *Snapshot) Var(offsetsID, dataID ColumnID) VarColumn {
+	return VarColumn{Offsets: s.Uint64(offsetsID), Data: s.Bytes(dataID)}
+}
+
+func (v VarColumn) Len() int {
+	if len(v.Offsets) == 0 {
+		return 0
+	}
+	return len(v.Offsets) - 1
+}
+
+// Get returns row i in place.
+func (v VarColumn) Get(i int) []byte {
+	return v.Data[v.Offsets[i]:v.Offsets[i+1]]
+}
+
+// String returns the dictionary string for a code.
+func (s *Snapshot) String(code uint32) string {
+	return string(s.dictionary.Get(int(code)))
+}
+
+// Code returns the dictionary code of a string. false if no row has that value, so a scan for it can be skipped.
+func (s *Snapshot) Code(value string) (uint32, bool) {
+	code, ok := s.codes[value]
+	return code, ok
+}
+
+// Path returns the path of a file row.
+func (s *Snapshot) Path(file int) string {
+	return string(s.Var(ColFilePathOffsets, ColFilePathData).Get(file))
+}
@@ -0,0 +1,293 @@
+package catalog
+
+import (
+	"bufio"
+	"encoding/binary"
+	"os"
+	"sort"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/util"
+)
+
+// varBuilder builds an offset and a data column.
+type varBuilder struct {
+	offsets []uint64
+	data    []byte
+}
+
+func newVarBuilder() varBuilder {
+	return varBuilder{offsets: []uint64{0}}
+}
+
+func (v *varBuilder) add(value []byte) {
+	v.data = append(v.data, value...)
+	v.offsets = append(v.offsets, uint64(len(v.data)))
+}
+
+// dictionaryBuilder assigns codes to strings in the order they are first seen.
+type dictionaryBuilder struct {
+	codes   map[string]uint32
+	strings varBuilder
+}
+
+func (d *dictionaryBuilder) code(value string) uint32 {
+	if code, ok := d.codes[value]; ok {
+		return code
+	}
+	code := uint32(len(d.codes))
+	d.codes[value] = code
+	d.strings.add([]byte(value))
+	return code
+}
+
+type snapshotBuilder struct {
+	dictionary dictionaryBuilder
+
+	filePath     varBuilder
+	fileSize     []int64
+	fileModTime  []int64
+	fileFormat   []uint32
+	fileDuration []int64
+	fileBitRate  []int64
+	fileStreams  []uint32
+	fileMetadata varBuilder
+	fileObject   varBuilder
+
+	streamFile                    []uint32
+	streamIndex                   []int32
+	streamType                    []uint32
+	streamCodec                   []uint32
+	streamLayout                  []uint32
+	streamChannels                []int32
+	streamSampleRate              []int32
+	streamBitsPerRawSample        []int32
+	streamBitsPerCodedSample      []int32
+	streamBitRate                 []int64
+	streamDuration                []int64
+	streamTimeBaseNum             []int64
+	streamTimeBaseDen             []int64
+	streamChromaprint             varBuilder
+	streamChromaprintLength       []int32
+	streamChromaprintSecond       varBuilder
+	streamChromaprintSecondOffset []int32
+
+	tagFile   []uint32
+	tagStream []int32
+	tagKey    []uint32
+	tagValue  varBuilder
+}
+
+func newSnapshotBuilder() *snapshotBuilder {
+	return &snapshotBuilder{
+		dictionary:              dictionaryBuilder{codes: map[string]uint32{}, strings: newVarBuilder()},
+		filePath:                newVarBuilder(),
+		fileStreams:             []uint32{0},
+		fileMetadata:            newVarBuilder(),
+		fileObject:              newVarBuilder(),
+		streamChromaprint:       newVarBuilder(),
+		streamChromaprintSecond: newVarBuilder(),
+		tagValue:                newVarBuilder(),
+	}
+}
+
+// addTags adds tags sorted by key, so snapshots of the same catalog are identical.
+func (b *snapshotBuilder) addTags(file uint32, stream int32, tags map[string]string) {
+	keys := make([]string, 0, len(tags))
+	for key := range tags {
+		keys = append(keys, key)
+	}
+	sort.Strings(keys)
+	for _, key := range keys {
+		b.tagFile = append(b.tagFile, file)
+		b.tagStream = append(b.tagStream, stream)
+		b.tagKey = append(b.tagKey, b.dictionary.code(key))
+		b.tagValue.add([]byte(tags[key]))
+	}
+}
+
+func (b *snapshotBuilder) add(entry *Entry, metadata *types.FileMetadata) {
+	file := uint32(len(b.fileSize))
+	b.filePath.add([]byte(entry.Path))
+	b.fileSize = append(b.fileSize, entry.Size)
+	b.fileModTime = append(b.fileModTime, entry.ModTime)
+	b.fileFormat = append(b.fileFormat, b.dictionary.code(metadata.File.Format.Name))
+	b.fileDuration = append(b.fileDuration, int64(metadata.File.Duration))
+	b.fileBitRate = append(b.fileBitRate, int64(metadata.File.BitRate))
+	b.fileMetadata.add(entry.Metadata)
+	b.fileObject.add([]byte(entry.Object))
+	b.addTags(file, -1, metadata.File.Metadata)
+
+	for _, stream := range metadata.Streams {
+		row := int32(len(b.streamFile))
+		b.streamFile = append(b.streamFile, file)
+		b.streamIndex = append(b.streamIndex, int32(stream.Index))
+		b.streamType = append(b.streamType, b.dictionary.code(stream.Codec.Type))
+		b.streamCodec = append(b.streamCodec, b.dictionary.code(stream.Codec.Name))
+		b.streamLayout = append(b.streamLayout, b.dictionary.code(stream.Codec.ChLayout))
+		b.streamChannels = append(b.streamChannels, int32(stream.Codec.NbChannels))
+		b.streamSampleRate = append(b.streamSampleRate, int32(stream.Codec.SampleRate))
+		b.streamBitsPerRawSample = append(b.streamBitsPerRawSample, int32(stream.Codec.BitsPerRawSample))
+		b.streamBitsPerCodedSample = append(b.streamBitsPerCodedSample, int32(stream.Codec.BitsPerCodedSample))
+		b.streamBitRate = append(b.streamBitRate, int64(stream.Codec.BitRate))
+		b.streamDuration = append(b.streamDuration, int64(stream.Duration))
+		b.streamTimeBaseNum = append(b.streamTimeBaseNum, stream.TimeBaseNum)
+		b.streamTimeBaseDen = append(b.streamTimeBaseDen, stream.TimeBaseDen)
+		b.streamChromaprint.add([]byte(stream.Chromaprint))
+		b.streamChromaprintLength = append(b.streamChromaprintLength, int32(stream.ChromaprintLength))
+		b.streamChromaprintSecond.add([]byte(stream.ChromaprintSecond))
+		b.streamChromaprintSecondOffset = append(b.streamChromaprintSecondOffset, int32(stream.ChromaprintSecondOffset))
+		b.addTags(file, row, stream.Metadata)
+	}
+	b.fileStreams = append(b.fileStreams, uint32(len(b.streamFile)))
+}
+
+type snapshotColumn struct {
+	id   ColumnID
+	typ  ColumnType
+	data any
+	size int
+}
+
+func fixed[T uint32 | int32 | int64 | uint64](id ColumnID, typ ColumnType, data []T) snapshotColumn {
+	return snapshotColumn{id: id, typ: typ, data: data, size: len(data) * typ.size()}
+}
+
+func bytesColumn(id ColumnID, data []byte) snapshotColumn {
+	return snapshotColumn{id: id, typ: ColumnBytes, data: data, size: len(data)}
+}
+
+func (b *snapshotBuilder) columns() []snapshotColumn {
+	return []snapshotColumn{
+		fixed(ColFilePathOffsets, ColumnUint64, b.filePath.offsets),
+		bytesColumn(ColFilePathData, b.filePath.data),
+		fixed(ColFileSize, ColumnInt64, b.fileSize),
+		fixed(ColFileModTime, ColumnInt64, b.fileModTime),
+		fixed(ColFileFormat, ColumnUint32, b.fileFormat),
+		fixed(ColFileDuration, ColumnInt64, b.fileDuration),
+		fixed(ColFileBitRate, ColumnInt64, b.fileBitRate),
+		fixed(ColFileStreams, ColumnUint32, b.fileStreams),
+		fixed(ColFileMetadataOffsets, ColumnUint64, b.fileMetadata.offsets),
+		bytesColumn(ColFileMetadataData, b.fileMetadata.data),
+
+		fixed(ColStreamFile, ColumnUint32, b.streamFile),
+		fixed(ColStreamIndex, ColumnInt32, b.streamIndex),
+		fixed(ColStreamType, ColumnUint32, b.streamType),
+		fixed(ColStreamCodec, ColumnUint32, b.streamCodec),
+		fixed(ColStreamLayout, ColumnUint32, b.streamLayout),
+		fixed(ColStreamChannels, ColumnInt32, b.streamChannels),
+		fixed(ColStreamSampleRate, ColumnInt32, b.streamSampleRate),
+		fixed(ColStreamBitsPerRawSample, ColumnInt32, b.streamBitsPerRawSample),
+		fixed(ColStreamBitsPerCodedSample, ColumnInt32, b.streamBitsPerCodedSample),
+		fixed(ColStreamBitRate, ColumnInt64, b.streamBitRate),
+		fixed(ColStreamDuration, ColumnInt64, b.streamDuration),
+		fixed(ColStreamTimeBaseNum, ColumnInt64, b.streamTimeBaseNum),
+		fixed(ColStreamTimeBaseDen, ColumnInt64, b.streamTimeBaseDen),
+		fixed(ColStreamChromaprintOffsets, ColumnUint64, b.streamChromaprint.offsets),
+		bytesColumn(ColStreamChromaprintData, b.streamChromaprint.data),
+		fixed(ColStreamChromaprintLength, ColumnInt32, b.streamChromaprintLength),
+
+		fixed(ColTagFile, ColumnUint32, b.tagFile),
+		fixed(ColTagStream, ColumnInt32, b.tagStream),
+		fixed(ColTagKey, ColumnUint32, b.tagKey),
+		fixed(ColTagValueOffsets, ColumnUint64, b.tagValue.offsets),
+		bytesColumn(ColTagValueData, b.tagValue.data),
+
+		fixed(ColDictionaryOffsets, ColumnUint64, b.dictionary.strings.offsets),
+		bytesColumn(ColDictionaryData, b.dictionary.strings.data),
+
+		fixed(ColFileObjectOffsets, ColumnUint64, b.fileObject.offsets),
+		bytesColumn(ColFileObjectData, b.fileObject.data),
+
+		fixed(ColStreamChromaprintSecondOffsets, ColumnUint64, b.streamChromaprintSecond.offsets),
+		bytesColumn(ColStreamChromaprintSecondData, b.streamChromaprintSecond.data),
+		fixed(ColStreamChromaprintSecondOffset, ColumnInt32, b.streamChromaprintSecondOffset),
+	}
+}
+
+func align(offset int) int {
+	return (offset + snapshotAlignment - 1) / snapshotAlignment * snapshotAlignment
+}
+
+func (b *snapshotBuilder) write(path string) error {
+	columns := b.columns()
+
+	header := make([]byte, snapshotHeaderSize+len(columns)*snapshotDirEntry)
+	copy(header, snapshotMagic)
+	binary.LittleEndian.PutUint32(header[8:], snapshotVersion)
+	binary.LittleEndian.PutUint32(header[12:], uint32(len(columns)))
+	binary.LittleEndian.PutUint64(header[16:], uint64(len(b.fileSize)))
+	binary.LittleEndian.PutUint64(header[24:], uint64(len(b.streamFile)))
+	binary.LittleEndian.PutUint64(header[32:], uint64(len(b.tagFile)))
+	binary.LittleEndian.PutUint64(header[40:], uint64(len(b.dictionary.codes)))
+
+	offset := align(len(header))
+	for i, col := range columns {
+		entry := header[snapshotHeaderSize+i*snapshotDirEntry:]
+		binary.LittleEndian.PutUint32(entry, uint32(col.id))
+		binary.LittleEndian.PutUint32(entry[4:], uint32(col.typ))
+		binary.LittleEndian.PutUint64(entry[8:], uint64(offset))
+		binary.LittleEndian.PutUint64(entry[16:], uint64(col.size))
+		offset = align(offset + col.size)
+	}
+
+	// Written next to the target and renamed, so readers never map a partial snapshot.
+	tmp := path + ".tmp"
+	file, err := os.Create(tmp)
+	if err != nil {
+		return err
+	}
+	defer os.Remove(tmp)
+	writer := bufio.NewWriterSize(file, 1<<20)
+	written := 0
+	pad := func(to int) {
+		for ; written < to; written++ {
+			_ = writer.WriteByte(0)
+		}
+	}
+	if _, err = writer.Write(header); err != nil {
+		_ = file.Close()
+		return err
+	}
+	written = len(header)
+	for _, col := range columns {
+		pad(align(written))
+		if err = binary.Write(writer, binary.LittleEndian, col.data); err != nil {
+			_ = file.Close()
+			return err
+		}
+		written += col.size
+	}
+	if err = writer.Flush(); err != nil {
+		_ = file.Close()
+		return err
+	}
+	if err = file.Sync(); err != nil {
+		_ = file.Close()
+		return err
+	}
+	if err = file.Close(); err != nil {
+		return err
+	}
+	return os.Rename(tmp, path)
+}
+
+// WriteSnapshot writes a snapshot of the current catalog entries to path. Entries whose metadata cannot be decoded
+// are skipped with a warning. Returns the number of files in the snapshot.
+func WriteSnapshot(c *Catalog, path string) (int, error) {
+	entries, err := c.Entries()
+	if err != nil {
+		return 0, err
+	}
+	b := newSnapshotBuilder()
+	for i := range entries {
+		var metadata types.FileMetadata
+		if err = util.UnmarshallCompressed(entries[i].Metadata, &metadata); err != nil {
+			logrus.Warnf("snapshot: skipping '%s': %v", entries[i].Path, err)
+			continue
+		}
+		b.add(&entries[i], &metadata)
+	}
+	return len(b.fileSize), b.write(path)
+}
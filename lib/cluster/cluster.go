@@ -0,0 +1,496 @@
+// Package cluster finds near-duplicate recordings (remasters, different rips, clipped versions) among all stored
+// fingerprints, without comparing every pair.
+//
+// Candidates come from locality sensitive hashing: every table projects the hashes of each two consecutive frames
+// onto a fixed subset of their bits, and tracks sharing several projected keys become candidates. Only keys whose
+// value falls into a fixed 1 in 2^SampleBits range are indexed. As that depends on the key alone, two tracks sample
+// the same frames wherever they are, so shifted and clipped versions still meet. Candidates are verified by the bit
+// error rate of their hashes, aligned at the offset their shared keys agree on, and verified pairs are joined into
+// clusters.
+//
+// Each step runs on all workers. Memory is bounded by one table's sampled keys plus the decoded hashes of the tracks
+// which have candidates, not by the number of tracks times their length.
+package cluster
+
+import (
+	"context"
+	"sort"
+	"sync"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/catalog"
+	"gitlab.com/t4cc0re/audiofs/lib/scheduler"
+)
+
+// Options tune candidate generation and verification.
+type Options struct {
+	// Tables is the number of LSH tables, each with its own projection of KeyBits bits of two consecutive frames. More
+	// tables and fewer key bits find pairs with more differing bits, at the cost of more candidates.
+	Tables  int
+	KeyBits int
+	// SampleBits indexes 1 in 2^SampleBits keys. Random pairs share a key with a probability of about
+	// 2^-(KeyBits-SampleBits) per pair of sampled frames, so the difference has to grow with the number of tracks.
+	SampleBits int
+	// MaxBucket skips keys shared by more tracks, e.g. silence, which say nothing about a pair.
+	MaxBucket int
+	// MinShared is the number of keys a pair has to share to be verified.
+	MinShared int
+	// OffsetRadius is the number of frames around the shared keys' offset which are tried when verifying.
+	OffsetRadius int
+	// MinOverlap is the number of frames a pair has to overlap at its best offset, unless one track is shorter.
+	MinOverlap int
+	// MinSimilarity is the share of equal bits (1 - bit error rate) of a near-duplicate. Unrelated audio is at about
+	// 0.5.
+	MinSimilarity float64
+	// Workers is the number of threads to use, 0 for the scheduler's budget.
+	Workers int
+}
+
+// OptionsFromConfig returns the options set in `cluster.*`.
+func OptionsFromConfig() Options {
+	return Options{
+		Tables:        config.Config.GetInt("cluster.tables"),
+		KeyBits:       config.Config.GetInt("cluster.key_bits"),
+		SampleBits:    config.Config.GetInt("cluster.sample_bits"),
+		MaxBucket:     config.Config.GetInt("cluster.max_bucket"),
+		MinShared:     config.Config.GetInt("cluster.min_shared"),
+		OffsetRadius:  config.Config.GetInt("cluster.offset_radius"),
+		MinOverlap:    config.Config.GetInt("cluster.min_overlap"),
+		MinSimilarity: config.Config.GetFloat64("cluster.min_similarity"),
+		Workers:       config.Config.GetInt("cluster.workers"),
+	}
+}
+
+// Track is a fingerprint to cluster, as stored in FileMetadata.
+type Track struct {
+	// ID identifies the track to the caller, e.g. its snapshot row.
+	ID          int
+	Fingerprint []byte
+}
+
+// Match is a verified pair of tracks.
+type Match struct {
+	// A and B are Track.IDs.
+	A, B       int
+	Similarity float64
+	// Offset aligns the two: frame i of A matches frame i-Offset of B (frames are FrameSeconds apart).
+	Offset int
+}
+
+// Cluster is a set of near-duplicates, connected by their matches.
+type Cluster struct {
+	// Tracks are Track.IDs, ascending.
+	Tracks  []int
+	Matches []Match
+}
+
+// Stats describe a run.
+type Stats struct {
+	Tracks  int
+	Invalid int
+	// Candidates is the number of pairs which shared at least MinShared keys.
+	Candidates int
+	Matches    int
+}
+
+type posting struct {
+	key   uint32
+	track uint32
+	pos   uint32
+}
+
+// pairKey is one shared key of a pair of tracks (by index, a < b), and the offset it implies.
+type pairKey struct {
+	a, b   uint32
+	offset int32
+}
+
+type engine struct {
+	tracks  []Track
+	options Options
+	workers int
+}
+
+// Find clusters the tracks. Runs as scheduler.Batch work.
+func Find(ctx context.Context, tracks []Track, options Options) ([]Cluster, Stats, error) {
+	workers := options.Workers
+	if workers <= 0 {
+		workers = scheduler.Default().Budget()
+	}
+	grant, err := scheduler.Default().Acquire(ctx, scheduler.Batch, workers)
+	if err != nil {
+		return nil, Stats{}, err
+	}
+	defer grant.Release()
+
+	e := &engine{tracks: tracks, options: options, workers: grant.Threads}
+	stats := Stats{Tracks: len(tracks)}
+
+	var keys []pairKey
+	for table := 0; table < options.Tables; table++ {
+		if err = ctx.Err(); err != nil {
+			return nil, stats, err
+		}
+		var invalid int
+		keys, invalid = e.sharedKeys(table, keys)
+		stats.Invalid = invalid
+	}
+	candidates := e.candidates(keys)
+	keys = nil
+	stats.Candidates = len(candidates)
+	if err = ctx.Err(); err != nil {
+		return nil, stats, err
+	}
+
+	matches := e.verify(candidates)
+	stats.Matches = len(matches)
+	return e.join(matches), stats, nil
+}
+
+// parallel runs fn over [0, n) split into one range per worker.
+func (e *engine) parallel(n int, fn func(worker, from, to int)) {
+	var wg sync.WaitGroup
+	for w := 0; w < e.workers; w++ {
+		from, to := n*w/e.workers, n*(w+1)/e.workers
+		if from == to {
+			continue
+		}
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			fn(w, from, to)
+		}(w)
+	}
+	wg.Wait()
+}
+
+// projection picks the bits of a table's keys, half from a frame and half from the next one, the same ones on every
+// run. Spreading the bits over two frames keeps the tables independent with up to 64 bits per key.
+func (e *engine) projection(table int) (masks [2]uint32, seed uint64) {
+	state := uint64(0x9E3779B97F4A7C15) * uint64(table+1)
+	next := func() uint64 {
+		state ^= state << 13
+		state ^= state >> 7
+		state ^= state << 17
+		return state
+	}
+	for frame := range masks {
+		want := e.options.KeyBits / 2
+		if frame == 1 {
+			want = e.options.KeyBits - want
+		}
+		for set := 0; set < want && set < 32; {
+			if bit := uint32(1) << (next() % 32); masks[frame]&bit == 0 {
+				masks[frame] |= bit
+				set++
+			}
+		}
+	}
+	return masks, next()
+}
+
+// sampled returns the keys of one table, grouped by key, then track and frame.
+func (e *engine) sampled(table int) ([]posting, int) {
+	const shardBits = 8
+	masks, seed := e.projection(table)
+	sampleShift := 32 - uint(e.options.SampleBits)
+	shardOf := func(key uint32) uint32 { return (key * 0x85EBCA6B) >> (32 - shardBits) }
+
+	parts := make([][]posting, e.workers)
+	invalid := make([]int, e.workers)
+	e.parallel(len(e.tracks), func(worker, from, to int) {
+		var d decoder
+		for t := from; t < to; t++ {
+			hashes, err := d.decode(e.tracks[t].Fingerprint)
+			if err != nil {
+				invalid[worker]++
+				continue
+			}
+			for pos := 0; pos+1 < len(hashes); pos++ {
+				// The top bits of the product depend on every projected bit, so sampling by them does not favor
+				// some bits. Sampling spends key bits though: only KeyBits - SampleBits tell sampled keys apart.
+				projected := uint64(hashes[pos]&masks[0])<<32 | uint64(hashes[pos+1]&masks[1])
+				key := uint32((projected ^ seed) * 0x9E3779B97F4A7C15 >> 32)
+				if e.options.SampleBits > 0 && key>>sampleShift != 0 {
+					continue
+				}
+				parts[worker] = append(parts[worker], posting{key: key, track: uint32(t), pos: uint32(pos)})
+			}
+		}
+	})
+
+	// Partition by shard, so every shard is sorted on its own.
+	var starts [1<<shardBits + 1]int
+	for _, part := range parts {
+		for _, p := range part {
+			starts[shardOf(p.key)+1]++
+		}
+	}
+	for s := 1; s < len(starts); s++ {
+		starts[s] += starts[s-1]
+	}
+	postings := make([]posting, starts[len(starts)-1])
+	next := starts
+	for w := range parts {
+		for _, p := range parts[w] {
+			s := shardOf(p.key)
+			postings[next[s]] = p
+			next[s]++
+		}
+		parts[w] = nil
+	}
+	e.parallel(1<<shardBits, func(_, from, to int) {
+		for s := from; s < to; s++ {
+			shard := postings[starts[s]:starts[s+1]]
+			sort.Slice(shard, func(i, j int) bool {
+				if shard[i].key != shard[j].key {
+					return shard[i].key < shard[j].key
+				}
+				if shard[i].track != shard[j].track {
+					return shard[i].track < shard[j].track
+				}
+				return shard[i].pos < shard[j].pos
+			})
+		}
+	})
+
+	var total int
+	for _, n := range invalid {
+		total += n
+	}
+	return postings, total
+}
+
+// sharedKeys appends one pairKey per pair of tracks sharing a key of the table. A track's first frame with a key
+// stands for it.
+func (e *engine) sharedKeys(table int, keys []pairKey) ([]pairKey, int) {
+	postings, invalid := e.sampled(table)
+	parts := make([][]pairKey, e.workers)
+	e.parallel(len(postings), func(worker, from, to int) {
+		// Start and end at bucket boundaries, the previous worker takes the bucket spanning them.
+		for from > 0 && from < len(postings) && postings[from].key == postings[from-1].key {
+			from++
+		}
+		for to < len(postings) && postings[to].key == postings[to-1].key {
+			to++
+		}
+		var members []posting
+		for i := from; i < to; {
+			j := i
+			members = members[:0]
+			for ; j < to && postings[j].key == postings[i].key; j++ {
+				if j == i || postings[j].track != postings[j-1].track {
+					members = append(members, postings[j])
+				}
+			}
+			i = j
+			if len(members) < 2 || len(members) > e.options.MaxBucket {
+				continue
+			}
+			for x := range members {
+				for y := x + 1; y < len(members); y++ {
+					parts[worker] = append(parts[worker], pairKey{
+						a:      members[x].track,
+						b:      members[y].track,
+						offset: int32(members[x].pos) - int32(members[y].pos),
+					})
+				}
+			}
+		}
+	})
+	for _, part := range parts {
+		keys = append(keys, part...)
+	}
+	return keys, invalid
+}
+
+// candidates groups the shared keys by pair, and keeps the pairs sharing at least MinShared, at the offset most of
+// their keys agree on.
+func (e *engine) candidates(keys []pairKey) []pairKey {
+	// Partition by the first track, so every shard is sorted and grouped on its own.
+	shards := e.workers * 4
+	shardOf := func(k pairKey) int { return int(uint64(k.a) * uint64(shards) / uint64(len(e.tracks))) }
+	starts := make([]int, shards+1)
+	for _, k := range keys {
+		starts[shardOf(k)+1]++
+	}
+	for s := 1; s < len(starts); s++ {
+		starts[s] += starts[s-1]
+	}
+	partitioned := make([]pairKey, len(keys))
+	next := append([]int(nil), starts...)
+	for _, k := range keys {
+		s := shardOf(k)
+		partitioned[next[s]] = k
+		next[s]++
+	}
+
+	parts := make([][]pairKey, shards)
+	e.parallel(shards, func(_, from, to int) {
+		for s := from; s < to; s++ {
+			shard := partitioned[starts[s]:starts[s+1]]
+			sort.Slice(shard, func(i, j int) bool {
+				if shard[i].a != shard[j].a {
+					return shard[i].a < shard[j].a
+				}
+				if shard[i].b != shard[j].b {
+					return shard[i].b < shard[j].b
+				}
+				return shard[i].offset < shard[j].offset
+			})
+			for i := 0; i < len(shard); {
+				j, best, votes := i, shard[i].offset, 0
+				for run := i; j < len(shard) && shard[j].a == shard[i].a && shard[j].b == shard[i].b; j++ {
+					if shard[j].offset != shard[run].offset {
+						run = j
+					}
+					if j-run+1 > votes {
+						best, votes = shard[j].offset, j-run+1
+					}
+				}
+				if j-i >= e.options.MinShared {
+					parts[s] = append(parts[s], pairKey{a: shard[i].a, b: shard[i].b, offset: best})
+				}
+				i = j
+			}
+		}
+	})
+	var candidates []pairKey
+	for _, part := range parts {
+		candidates = append(candidates, part...)
+	}
+	return candidates
+}
+
+// verify compares the hashes of every candidate pair around its offset, and keeps the near-duplicates.
+func (e *engine) verify(candidates []pairKey) []Match {
+	// Decode every track with candidates once.
+	decoded := make([][]uint32, len(e.tracks))
+	var involved []int
+	for _, c := range candidates {
+		for _, t := range []uint32{c.a, c.b} {
+			if decoded[t] == nil {
+				decoded[t] = []uint32{}
+				involved = append(involved, int(t))
+			}
+		}
+	}
+	e.parallel(len(involved), func(_, from, to int) {
+		var d decoder
+		for _, t := range involved[from:to] {
+			if hashes, err := d.decode(e.tracks[t].Fingerprint); err == nil {
+				decoded[t] = append([]uint32(nil), hashes...)
+			}
+		}
+	})
+
+	parts := make([][]Match, e.workers)
+	e.parallel(len(candidates), func(worker, from, to int) {
+		for _, c := range candidates[from:to] {
+			a, b := decoded[c.a], decoded[c.b]
+			minOverlap := e.options.MinOverlap
+			if len(a) < minOverlap || len(b) < minOverlap {
+				minOverlap = len(a)
+				if len(b) < minOverlap {
+					minOverlap = len(b)
+				}
+			}
+			best, bestOffset := -1.0, 0
+			for offset := int(c.offset) - e.options.OffsetRadius; offset <= int(c.offset)+e.options.OffsetRadius; offset++ {
+				if score, overlap := similarity(a, b, offset); overlap > 0 && overlap >= minOverlap && score > best {
+					best, bestOffset = score, offset
+				}
+			}
+			if best >= e.options.MinSimilarity {
+				parts[worker] = append(parts[worker], Match{
+					A:          e.tracks[c.a].ID,
+					B:          e.tracks[c.b].ID,
+					Similarity: best,
+					Offset:     bestOffset,
+				})
+			}
+		}
+	})
+	var matches []Match
+	for _, part := range parts {
+		matches = append(matches, part...)
+	}
+	return matches
+}
+
+// join builds the connected components of the matches, largest first.
+func (e *engine) join(matches []Match) []Cluster {
+	parent := map[int]int{}
+	var find func(int) int
+	find = func(id int) int {
+		p, ok := parent[id]
+		if !ok || p == id {
+			return id
+		}
+		root := find(p)
+		parent[id] = root
+		return root
+	}
+	for _, m := range matches {
+		if a, b := find(m.A), find(m.B); a != b {
+			parent[a] = b
+		}
+	}
+
+	byRoot := map[int]*Cluster{}
+	var clusters []*Cluster
+	member := map[int]bool{}
+	for _, m := range matches {
+		root := find(m.A)
+		c, ok := byRoot[root]
+		if !ok {
+			c = &Cluster{}
+			byRoot[root] = c
+			clusters = append(clusters, c)
+		}
+		c.Matches = append(c.Matches, m)
+		for _, id := range []int{m.A, m.B} {
+			if !member[id] {
+				member[id] = true
+				c.Tracks = append(c.Tracks, id)
+			}
+		}
+	}
+
+	result := make([]Cluster, len(clusters))
+	for i, c := range clusters {
+		sort.Ints(c.Tracks)
+		result[i] = *c
+	}
+	sort.SliceStable(result, func(i, j int) bool {
+		if len(result[i].Tracks) != len(result[j].Tracks) {
+			return len(result[i].Tracks) > len(result[j].Tracks)
+		}
+		return result[i].Tracks[0] < result[j].Tracks[0]
+	})
+	return result
+}
+
+// FromSnapshot returns the first fingerprinted audio stream of every file, with the file's row as ID. The
+// fingerprints are used in place, so the snapshot has to stay open while they are clustered.
+func FromSnapshot(snapshot *catalog.Snapshot) []Track {
+	audio, ok := snapshot.Code("audio")
+	if !ok {
+		return nil
+	}
+	fingerprints := snapshot.Var(catalog.ColStreamChromaprintOffsets, catalog.ColStreamChromaprintData)
+	streamFile := snapshot.Uint32(catalog.ColStreamFile)
+
+	var tracks []Track
+	seen := map[uint32]bool{}
+	catalog.AllRows(snapshot.Streams).
+		WhereUint32(snapshot.Uint32(catalog.ColStreamType), audio).
+		WhereEmpty(fingerprints, false).
+		ForEach(func(row int) {
+			if file := streamFile[row]; !seen[file] {
+				seen[file] = true
+				tracks = append(tracks, Track{ID: int(file), Fingerprint: fingerprints.Get(row)})
+			}
+		})
+	return tracks
+}
@@ -0,0 +1,199 @@
+package cluster
+
+import (
+	"encoding/base64"
+	"errors"
+	"math/bits"
+)
+
+var ErrInvalidFingerprint = errors.New("invalid chromaprint fingerprint")
+
+// FrameSeconds is the time between two hashes of a fingerprint (chromaprint's default algorithm hops 4096/3 samples
+// at 11025 Hz).
+const FrameSeconds = 4096.0 / 3 / 11025
+
+// chromaprint's default algorithm (CHROMAPRINT_ALGORITHM_TEST2), which the chromaprint muxer uses.
+const defaultAlgorithm = 1
+
+// bitReader reads little endian bit fields, as chromaprint packs its 5 bit array.
+type bitReader struct {
+	data []byte
+	pos  int
+	acc  uint64
+	n    uint
+}
+
+func (r *bitReader) read(width uint) (uint32, bool) {
+	for r.n < width {
+		if r.pos >= len(r.data) {
+			return 0, false
+		}
+		r.acc |= uint64(r.data[r.pos]) << r.n
+		r.pos++
+		r.n += 8
+	}
+	value := uint32(r.acc & (1<<width - 1))
+	r.acc >>= width
+	r.n -= width
+	return value, true
+}
+
+type bitWriter struct {
+	data []byte
+	acc  uint64
+	n    uint
+}
+
+func (w *bitWriter) write(value uint32, width uint) {
+	w.acc |= uint64(value) << w.n
+	for w.n += width; w.n >= 8; w.n -= 8 {
+		w.data = append(w.data, byte(w.acc))
+		w.acc >>= 8
+	}
+}
+
+func (w *bitWriter) bytes() []byte {
+	if w.n > 0 {
+		return append(w.data, byte(w.acc))
+	}
+	return w.data
+}
+
+// packedGroup returns the g-th 3 bytes of packed, which hold 8 values of 3 bits.
+func packedGroup(packed []byte, g int) uint32 {
+	if i := g * 3; i+3 <= len(packed) {
+		return uint32(packed[i]) | uint32(packed[i+1])<<8 | uint32(packed[i+2])<<16
+	}
+	var group uint32
+	for i := g * 3; i < len(packed); i++ {
+		group |= uint32(packed[i]) << (8 * (i - g*3))
+	}
+	return group
+}
+
+// decoder decodes fingerprints, reusing its buffers between calls.
+type decoder struct {
+	raw    []byte
+	hashes []uint32
+}
+
+// decode decodes a fingerprint as the chromaprint muxer writes it (its default "base64" format: compressed and URL
+// safe base64 encoded) into one 32 bit hash per frame. The result is only valid until the next call.
+//
+// The compressed format is a header (algorithm, 24 bit big endian hash count) followed by, for every hash XORed with
+// the previous one, the distances between its set bits as 3 bit values terminated by 0. Distances of 7 and more are
+// completed by 5 bit values stored after all 3 bit ones.
+func (d *decoder) decode(encoded []byte) ([]uint32, error) {
+	size := base64.RawURLEncoding.DecodedLen(len(encoded))
+	if cap(d.raw) < size {
+		d.raw = make([]byte, size)
+	}
+	size, err := base64.RawURLEncoding.Decode(d.raw[:size], encoded)
+	if err != nil || size < 4 {
+		return nil, ErrInvalidFingerprint
+	}
+	data := d.raw[:size]
+	count := int(data[1])<<16 | int(data[2])<<8 | int(data[3])
+	// Every hash takes at least its 3 bit terminator.
+	if count*3 > (len(data)-4)*8 {
+		return nil, ErrInvalidFingerprint
+	}
+	if count == 0 {
+		return d.hashes[:0], nil
+	}
+
+	// The 5 bit values start after the 3 bit one terminating the last hash. Find it by counting zeros 8 values (3
+	// bytes) at a time.
+	packed := data[4:]
+	groups := (len(packed) + 2) / 3
+	zeros, end := 0, -1
+	for g := 0; g < groups; g++ {
+		group := packedGroup(packed, g)
+		n := bits.OnesCount32(^(group | group>>1 | group>>2) & 0x249249)
+		if zeros+n < count {
+			zeros += n
+			continue
+		}
+		for k := 0; ; k++ {
+			if group>>(3*k)&7 == 0 {
+				if zeros++; zeros == count {
+					end = g*8 + k + 1
+					break
+				}
+			}
+		}
+		break
+	}
+	// The last group is padded with zeros, which count as terminators, so the last one may lie past the data.
+	if end < 0 || (end*3+7)/8 > len(packed) {
+		return nil, ErrInvalidFingerprint
+	}
+	exceptional := bitReader{data: packed[(end*3+7)/8:]}
+
+	if cap(d.hashes) < count {
+		d.hashes = make([]uint32, count)
+	}
+	hashes := d.hashes[:count]
+	var x, previous, bit uint32
+	hash := 0
+	for g := 0; hash < count; g++ {
+		group := packedGroup(packed, g)
+		for k := 0; k < 8 && hash < count; k++ {
+			step := group >> (3 * k) & 7
+			if step == 0 {
+				previous ^= x
+				hashes[hash] = previous
+				hash++
+				x, bit = 0, 0
+				continue
+			}
+			if step == 7 {
+				extra, ok := exceptional.read(5)
+				if !ok {
+					return nil, ErrInvalidFingerprint
+				}
+				step += extra
+			}
+			if bit += step; bit > 32 {
+				return nil, ErrInvalidFingerprint
+			}
+			x |= 1 << (bit - 1)
+		}
+	}
+	return hashes, nil
+}
+
+// DecodeFingerprint decodes a fingerprint as stored in FileMetadata (the chromaprint muxer's default format) into one
+// 32 bit hash per frame of FrameSeconds.
+func DecodeFingerprint(encoded string) ([]uint32, error) {
+	var d decoder
+	hashes, err := d.decode([]byte(encoded))
+	return hashes, err
+}
+
+// EncodeFingerprint is the inverse of DecodeFingerprint, e.g. for synthetic fingerprints.
+func EncodeFingerprint(hashes []uint32) string {
+	var normal, exceptional bitWriter
+	var previous uint32
+	for _, hash := range hashes {
+		x := hash ^ previous
+		previous = hash
+		last := uint32(0)
+		for bit := uint32(1); x != 0; bit, x = bit+1, x>>1 {
+			if x&1 == 0 {
+				continue
+			}
+			if distance := bit - last; distance >= 7 {
+				normal.write(7, 3)
+				exceptional.write(distance-7, 5)
+			} else {
+				normal.write(distance, 3)
+			}
+			last = bit
+		}
+		normal.write(0, 3)
+	}
+	count := len(hashes)
+	data := append([]byte{defaultAlgorithm, byte(count >> 16), byte(count >> 8), byte(count)}, normal.bytes()...)
+	return base64.RawURLEncoding.EncodeToString(append(data, exceptional.bytes()...))
+}
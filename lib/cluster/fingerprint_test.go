@@ -0,0 +1,64 @@
+package cluster
+
+import (
+	"encoding/base64"
+	"errors"
+	"math/rand"
+	"reflect"
+	"testing"
+)
+
+func TestFingerprintRoundTrip(t *testing.T) {
+	random := rand.New(rand.NewSource(1))
+	for _, count := range []int{0, 1, 2, 7, 8, 9, 100, 1000} {
+		hashes := make([]uint32, count)
+		for i := range hashes {
+			switch i % 4 {
+			case 0:
+				hashes[i] = random.Uint32()
+			case 1:
+				// Only far apart bits, which need the 5 bit values
+				hashes[i] = 1<<31 | 1
+			case 2:
+				hashes[i] = 0
+			default:
+				hashes[i] = hashes[i-1] ^ 1<<uint(random.Intn(32))
+			}
+		}
+		decoded, err := DecodeFingerprint(EncodeFingerprint(hashes))
+		if err != nil {
+			t.Fatalf("%d hashes: %v", count, err)
+		}
+		if len(decoded) != count || (count > 0 && !reflect.DeepEqual(decoded, hashes)) {
+			t.Fatalf("%d hashes: decoded %d different ones", count, len(decoded))
+		}
+	}
+}
+
+func TestFingerprintMalformed(t *testing.T) {
+	valid := EncodeFingerprint([]uint32{0xdeadbeef, 1<<31 | 1, 0x12345678})
+	for name, encoded := range map[string]string{
+		"not base64": "!!!!",
+		"short":      base64.RawURLEncoding.EncodeToString([]byte{1, 0, 0}),
+		// The padding of the last 3 bit group counts as terminators past the data.
+		"terminators in padding": base64.RawURLEncoding.EncodeToString([]byte{1, 0, 0, 2, 0xFF}),
+		"count too large":        base64.RawURLEncoding.EncodeToString([]byte{1, 0xFF, 0xFF, 0xFF, 0}),
+		"truncated":              valid[:len(valid)-3],
+	} {
+		if _, err := DecodeFingerprint(encoded); !errors.Is(err, ErrInvalidFingerprint) {
+			t.Errorf("%s: got %v, want ErrInvalidFingerprint", name, err)
+		}
+	}
+}
+
+// Corrupt catalog fingerprints are decoded by parallel workers, so they must fail instead of panicking.
+func TestFingerprintCorruptDoesNotPanic(t *testing.T) {
+	random := rand.New(rand.NewSource(1))
+	raw := make([]byte, 64)
+	for i := 0; i < 100000; i++ {
+		n := 4 + random.Intn(len(raw)-4)
+		random.Read(raw[:n])
+		raw[1], raw[2] = 0, 0
+		_, _ = DecodeFingerprint(base64.RawURLEncoding.EncodeToString(raw[:n]))
+	}
+}
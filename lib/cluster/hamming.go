@@ -0,0 +1,46 @@
+package cluster
+
+import "math/bits"
+
+// hammingDistance counts the differing bits of a and b, up to the length of a. The hashes of two frames are XORed into
+// one 64 bit word, so there is one POPCNT per two frames (math/bits compiles to it on amd64 and arm64), and four
+// independent sums keep several of them in flight.
+func hammingDistance(a, b []uint32) int {
+	b = b[:len(a)]
+	var s0, s1, s2, s3 int
+	i := 0
+	for ; i+8 <= len(a); i += 8 {
+		s0 += bits.OnesCount64(uint64(a[i]^b[i]) | uint64(a[i+1]^b[i+1])<<32)
+		s1 += bits.OnesCount64(uint64(a[i+2]^b[i+2]) | uint64(a[i+3]^b[i+3])<<32)
+		s2 += bits.OnesCount64(uint64(a[i+4]^b[i+4]) | uint64(a[i+5]^b[i+5])<<32)
+		s3 += bits.OnesCount64(uint64(a[i+6]^b[i+6]) | uint64(a[i+7]^b[i+7])<<32)
+	}
+	for ; i < len(a); i++ {
+		s0 += bits.OnesCount32(a[i] ^ b[i])
+	}
+	return s0 + s1 + s2 + s3
+}
+
+// similarity compares frame i of a with frame i-offset of b, over the frames both have. It returns the share of equal
+// bits and the number of frames compared.
+func similarity(a, b []uint32, offset int) (float64, int) {
+	if offset > 0 {
+		if offset >= len(a) {
+			return 0, 0
+		}
+		a = a[offset:]
+	} else if offset < 0 {
+		if -offset >= len(b) {
+			return 0, 0
+		}
+		b = b[-offset:]
+	}
+	n := len(a)
+	if len(b) < n {
+		n = len(b)
+	}
+	if n == 0 {
+		return 0, 0
+	}
+	return 1 - float64(hammingDistance(a[:n], b[:n]))/float64(32*n), n
+}
@@ -0,0 +1,286 @@
+// Package exporter reconstructs cataloged files from the store: either the stored object as it was imported, or
+// transcoded to AIFF and tagged from the archived metadata. Files are exported concurrently and streamed straight into
+// the destination, so nothing is held in memory in full, whatever the file's size.
+package exporter
+
+import (
+	"context"
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"hash"
+	"io"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/catalog"
+	"gitlab.com/t4cc0re/audiofs/lib/store"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/util"
+)
+
+const (
+	// Original exports the stored object, bit for bit.
+	Original = "original"
+	// AIFF exports the first audio stream as AIFF, tagged with the archived metadata.
+	AIFF = "aiff"
+
+	// copyBuffer is the size of the reads and writes of objects which are copied through userspace.
+	copyBuffer = 1 << 20
+)
+
+var (
+	ErrNotStored     = errors.New("cataloged, but not stored")
+	ErrCorrupt       = errors.New("stored object does not match its key")
+	ErrUnknownFormat = errors.New("unknown export format")
+)
+
+type Options struct {
+	// Format is Original or AIFF.
+	Format string
+	// Verify hashes originals while they are written, and fails files whose hash differs from their store key.
+	Verify bool
+	// Workers is the number of files exported concurrently.
+	Workers int
+}
+
+// OptionsFromConfig returns the options set in `export.*`, exporting originals.
+func OptionsFromConfig() Options {
+	return Options{Format: Original, Workers: config.Config.GetInt("export.workers")}
+}
+
+// Job is a cataloged file and where to export it to.
+type Job struct {
+	Entry  catalog.Entry
+	Output string
+}
+
+// Result is a finished Job. Hash is the output's SHA-256, if it was verified.
+type Result struct {
+	Job
+	Bytes int64
+	Hash  string
+	Err   error
+}
+
+// Plan picks the entries which are, or are below, one of `roots` (as they were cataloged), and places them in
+// `destination`: a file root as destination/<name>, a directory root as destination/<directory name>/<relative path>.
+// AIFF outputs get the extension .aiff.
+func Plan(entries []catalog.Entry, roots []string, destination, format string) ([]Job, error) {
+	if format != Original && format != AIFF {
+		return nil, fmt.Errorf("%w '%s'", ErrUnknownFormat, format)
+	}
+	cleaned := make([]string, len(roots))
+	for i, root := range roots {
+		abs, err := filepath.Abs(root)
+		if err != nil {
+			return nil, err
+		}
+		cleaned[i] = abs
+	}
+
+	var jobs []Job
+	outputs := map[string]string{}
+	for _, entry := range entries {
+		// Cataloged paths are absolute and clean already.
+		path := entry.Path
+		for _, root := range cleaned {
+			var output string
+			if path == root {
+				output = filepath.Join(destination, filepath.Base(path))
+			} else if rel, ok := strings.CutPrefix(path, root+string(filepath.Separator)); ok {
+				output = filepath.Join(destination, filepath.Base(root), rel)
+			} else {
+				continue
+			}
+			if format == AIFF {
+				output = strings.TrimSuffix(output, filepath.Ext(output)) + ".aiff"
+			}
+			if other, ok := outputs[output]; ok {
+				return nil, fmt.Errorf("'%s' and '%s' would both be exported to '%s'", other, entry.Path, output)
+			}
+			outputs[output] = entry.Path
+			jobs = append(jobs, Job{Entry: entry, Output: output})
+			break
+		}
+	}
+	return jobs, nil
+}
+
+// Run exports the jobs with options.Workers workers, and calls done with every result, one at a time. Once ctx is done,
+// no further jobs are started, and its error is returned.
+func Run(ctx context.Context, objects store.Store, jobs []Job, options Options, done func(Result)) error {
+	workers := options.Workers
+	if workers < 1 {
+		workers = 1
+	}
+	next := make(chan Job)
+	var mu sync.Mutex
+	var wg sync.WaitGroup
+	for i := 0; i < workers; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			var buffer []byte
+			for job := range next {
+				result := export(objects, job, options, &buffer)
+				mu.Lock()
+				done(result)
+				mu.Unlock()
+			}
+		}()
+	}
+
+	var err error
+feed:
+	for _, job := range jobs {
+		select {
+		case next <- job:
+		case <-ctx.Done():
+			err = ctx.Err()
+			break feed
+		}
+	}
+	close(next)
+	wg.Wait()
+	return err
+}
+
+// export writes a job's output to a temporary file next to it, which replaces the output once it is complete and
+// synced. The output gets the modification time the file had when it was cataloged.
+func export(objects store.Store, job Job, options Options, buffer *[]byte) (result Result) {
+	result.Job = job
+	if job.Entry.Object == "" {
+		result.Err = ErrNotStored
+		return
+	}
+	dir := filepath.Dir(job.Output)
+	if result.Err = os.MkdirAll(dir, 0755); result.Err != nil {
+		return
+	}
+	tmp, err := os.CreateTemp(dir, "."+filepath.Base(job.Output)+".*.tmp")
+	if err != nil {
+		result.Err = err
+		return
+	}
+	defer func() {
+		if result.Err != nil {
+			_ = os.Remove(tmp.Name())
+		}
+	}()
+
+	switch options.Format {
+	case Original:
+		if *buffer == nil {
+			*buffer = make([]byte, copyBuffer)
+		}
+		result.Bytes, result.Hash, err = copyObject(objects, job.Entry.Object, tmp, options.Verify, *buffer)
+		if err == nil {
+			err = tmp.Sync()
+		}
+		if closeErr := tmp.Close(); err == nil {
+			err = closeErr
+		}
+	case AIFF:
+		_ = tmp.Close()
+		err = transcode(objects, job.Entry, tmp.Name())
+		if err == nil {
+			var info os.FileInfo
+			if info, err = os.Stat(tmp.Name()); err == nil {
+				result.Bytes = info.Size()
+			}
+		}
+	default:
+		err = fmt.Errorf("%w '%s'", ErrUnknownFormat, options.Format)
+	}
+	if err != nil {
+		result.Err = err
+		return
+	}
+
+	modTime := time.Unix(0, job.Entry.ModTime)
+	if result.Err = os.Chtimes(tmp.Name(), modTime, modTime); result.Err != nil {
+		return
+	}
+	result.Err = os.Rename(tmp.Name(), job.Output)
+	return
+}
+
+// localPath is the file of a loose object of a local store, which can be read directly.
+func localPath(objects store.Store, key string) (string, bool) {
+	if local, ok := objects.(interface{ LocalPath(string) (string, bool) }); ok {
+		return local.LocalPath(key)
+	}
+	return "", false
+}
+
+// copyObject copies an object to out, hashing it on the way if `verify` is set. Unhashed local objects are copied by
+// the kernel (copy_file_range), everything else through buffer.
+func copyObject(objects store.Store, key string, out *os.File, verify bool, buffer []byte) (int64, string, error) {
+	var src io.Reader
+	if path, ok := localPath(objects, key); ok {
+		file, err := os.Open(path)
+		if err != nil {
+			return 0, "", err
+		}
+		defer file.Close()
+		src = file
+	} else {
+		object, err := objects.Open(key)
+		if err != nil {
+			return 0, "", err
+		}
+		defer object.Close()
+		src = io.NewSectionReader(object, 0, object.Size())
+	}
+
+	var dst io.Writer = out
+	var sum hash.Hash
+	if verify {
+		sum = sha256.New()
+		dst = io.MultiWriter(out, sum)
+	} else if _, ok := src.(*os.File); !ok {
+		// Hide out's ReadFrom, which would copy through a small buffer of its own.
+		dst = struct{ io.Writer }{out}
+	}
+	n, err := io.CopyBuffer(dst, src, buffer)
+	if err != nil || sum == nil {
+		return n, "", err
+	}
+	got := hex.EncodeToString(sum.Sum(nil))
+	if got != key {
+		return n, got, fmt.Errorf("%w: exported '%s', expected '%s'", ErrCorrupt, got, key)
+	}
+	return n, got, nil
+}
+
+// transcode has the native worker transcode an object into an AIFF file. Objects which are not a file of their own are
+// staged into a temporary file next to the output first.
+func transcode(objects store.Store, entry catalog.Entry, output string) error {
+	var metadata types.FileMetadata
+	if err := util.UnmarshallCompressed(entry.Metadata, &metadata); err != nil {
+		return err
+	}
+	source, ok := localPath(objects, entry.Object)
+	if !ok {
+		staged, err := os.CreateTemp(filepath.Dir(output), "."+filepath.Base(output)+".*.src")
+		if err != nil {
+			return err
+		}
+		defer os.Remove(staged.Name())
+		_, _, err = copyObject(objects, entry.Object, staged, false, make([]byte, copyBuffer))
+		if closeErr := staged.Close(); err == nil {
+			err = closeErr
+		}
+		if err != nil {
+			return err
+		}
+		source = staged.Name()
+	}
+	return util.ExportFile(source, &metadata, output, AIFF)
+}
@@ -0,0 +1,3 @@
+// Package filelock serializes processes sharing an append-only file (the catalog log, the stat cache) with advisory
+// locks.
+package filelock
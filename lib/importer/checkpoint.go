@@ -0,0 +1,92 @@
+package importer
+
+import (
+	"bufio"
+	"encoding/json"
+	"errors"
+	"os"
+)
+
+// checkpoint records the files an import committed, one JSON object per line, so a killed import can be resumed
+// without redoing them. Lines are only written after the catalog records they describe are synced, and a torn last
+// line is ignored on load. It is removed once an import finished without failures.
+type checkpoint struct {
+	path string
+	file *os.File
+	done map[string]checkpointEntry
+}
+
+type checkpointEntry struct {
+	Path    string `json:"path"`
+	Size    int64  `json:"size"`
+	ModTime int64  `json:"mtime"`
+}
+
+func openCheckpoint(path string) (*checkpoint, error) {
+	c := &checkpoint{path: path, done: map[string]checkpointEntry{}}
+	if file, err := os.Open(path); err == nil {
+		scanner := bufio.NewScanner(file)
+		scanner.Buffer(make([]byte, 0, 64*1024), 1024*1024)
+		for scanner.Scan() {
+			var entry checkpointEntry
+			if json.Unmarshal(scanner.Bytes(), &entry) == nil {
+				c.done[entry.Path] = entry
+			}
+		}
+		_ = file.Close()
+	} else if !errors.Is(err, os.ErrNotExist) {
+		return nil, err
+	}
+
+	file, err := os.OpenFile(path, os.O_WRONLY|os.O_CREATE|os.O_APPEND, 0644)
+	if err != nil {
+		return nil, err
+	}
+	c.file = file
+	// Terminate a torn last line, so the next entry is not glued to it.
+	if info, err := file.Stat(); err == nil && info.Size() > 0 {
+		last := make([]byte, 1)
+		if reader, err := os.Open(path); err == nil {
+			if _, err = reader.ReadAt(last, info.Size()-1); err == nil && last[0] != '\n' {
+				_, _ = file.Write([]byte{'\n'})
+			}
+			_ = reader.Close()
+		}
+	}
+	return c, nil
+}
+
+// isDone reports whether a previous run committed the file, and it did not change since.
+func (c *checkpoint) isDone(path string, size, modTime int64) bool {
+	entry, ok := c.done[path]
+	return ok && entry.Size == size && entry.ModTime == modTime
+}
+
+// commit durably records a batch of committed files.
+func (c *checkpoint) commit(entries []checkpointEntry) error {
+	if len(entries) == 0 {
+		return nil
+	}
+	var buf []byte
+	for _, entry := range entries {
+		line, err := json.Marshal(entry)
+		if err != nil {
+			return err
+		}
+		buf = append(append(buf, line...), '\n')
+	}
+	if _, err := c.file.Write(buf); err != nil {
+		return err
+	}
+	return c.file.Sync()
+}
+
+func (c *checkpoint) close() error {
+	return c.file.Close()
+}
+
+// remove deletes the checkpoint after a complete import.
+func (c *checkpoint) remove() error {
+	_ = c.file.Close()
+	return os.Remove(c.path)
+}
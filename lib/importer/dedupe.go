@@ -0,0 +1,168 @@
+package importer
+
+import (
+	"os"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/lib/catalog"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+)
+
+// dedupeKey identifies equivalent audio: the same fingerprint with the same codec, bit depth and channel layout (see
+// the README's premises). Lossy and lossless versions of a recording are kept side by side.
+//
+// The fingerprint only covers the first `fingerprint.length` seconds by default, which versions of a recording often
+// share (radio edit and extended mix, album and bonus track version). So the key also has the fingerprinted length,
+// the stream's duration in milliseconds and the optional second window.
+type dedupeKey struct {
+	codec        string
+	bits         int
+	layout       string
+	fingerprint  string
+	length       int
+	durationMs   int64
+	second       string
+	secondOffset int
+}
+
+// durationMs converts a stream duration in time base units to milliseconds, so containers with different time bases
+// agree. -1 if it is unknown.
+func durationMs(duration, num, den int64) int64 {
+	if duration <= 0 || num <= 0 || den <= 0 {
+		return -1
+	}
+	return duration * 1000 * num / den
+}
+
+// keyOf is the key of a file's first fingerprinted audio stream. false if there is none.
+func keyOf(metadata *types.FileMetadata) (dedupeKey, bool) {
+	for _, stream := range metadata.Streams {
+		if stream.Codec.Type == "audio" && stream.Chromaprint != "" {
+			return dedupeKey{
+				codec:        stream.Codec.Name,
+				bits:         stream.Codec.BitsPerRawSample,
+				layout:       stream.Codec.ChLayout,
+				fingerprint:  stream.Chromaprint,
+				length:       stream.ChromaprintLength,
+				durationMs:   durationMs(int64(stream.Duration), stream.TimeBaseNum, stream.TimeBaseDen),
+				second:       stream.ChromaprintSecond,
+				secondOffset: stream.ChromaprintSecondOffset,
+			}, true
+		}
+	}
+	return dedupeKey{}, false
+}
+
+// dedupeIndex maps keys to the store object holding that audio. Only the dedupe stage (a single worker) uses it.
+type dedupeIndex struct {
+	objects map[dedupeKey]string
+}
+
+// dedupeColumns are the snapshot columns the index is built from, besides the file objects.
+var dedupeColumns = []catalog.ColumnID{
+	catalog.ColStreamFile, catalog.ColStreamType, catalog.ColStreamCodec, catalog.ColStreamBitsPerRawSample,
+	catalog.ColStreamLayout, catalog.ColStreamDuration, catalog.ColStreamTimeBaseNum, catalog.ColStreamTimeBaseDen,
+	catalog.ColStreamChromaprintOffsets, catalog.ColStreamChromaprintData, catalog.ColStreamChromaprintLength,
+	catalog.ColStreamChromaprintSecondOffsets, catalog.ColStreamChromaprintSecondData,
+	catalog.ColStreamChromaprintSecondOffset,
+}
+
+// openDedupeSnapshot opens the catalog snapshot, rewriting it first if the catalog changed since or it predates a
+// column the index needs.
+func openDedupeSnapshot(c *catalog.Catalog) (*catalog.Snapshot, error) {
+	path := catalog.SnapshotPath(c)
+	modified, err := c.ModTime()
+	if err != nil {
+		return nil, err
+	}
+	if info, err := os.Stat(path); err == nil && !info.ModTime().Before(modified) {
+		snapshot, err := catalog.OpenSnapshot(path)
+		if err == nil && snapshot.Has(dedupeColumns...) {
+			return snapshot, nil
+		}
+		if err == nil {
+			_ = snapshot.Close()
+		}
+	}
+	if _, err = catalog.WriteSnapshot(c, path); err != nil {
+		return nil, err
+	}
+	return catalog.OpenSnapshot(path)
+}
+
+// loadDedupeIndex builds the index from the catalog snapshot, which has the needed columns without decoding every
+// record.
+func loadDedupeIndex(c *catalog.Catalog) (*dedupeIndex, error) {
+	index := &dedupeIndex{objects: map[dedupeKey]string{}}
+	snapshot, err := openDedupeSnapshot(c)
+	if err != nil {
+		return nil, err
+	}
+	defer snapshot.Close()
+
+	audio, ok := snapshot.Code("audio")
+	objects := snapshot.Var(catalog.ColFileObjectOffsets, catalog.ColFileObjectData)
+	// Nothing was imported yet (or the snapshot predates store objects)
+	if !ok || objects.Len() != snapshot.Files {
+		return index, nil
+	}
+	fingerprints := snapshot.Var(catalog.ColStreamChromaprintOffsets, catalog.ColStreamChromaprintData)
+	streamFile := snapshot.Uint32(catalog.ColStreamFile)
+	codec := snapshot.Uint32(catalog.ColStreamCodec)
+	bits := snapshot.Int32(catalog.ColStreamBitsPerRawSample)
+	layout := snapshot.Uint32(catalog.ColStreamLayout)
+	duration := snapshot.Int64(catalog.ColStreamDuration)
+	timeBaseNum := snapshot.Int64(catalog.ColStreamTimeBaseNum)
+	timeBaseDen := snapshot.Int64(catalog.ColStreamTimeBaseDen)
+	length := snapshot.Int32(catalog.ColStreamChromaprintLength)
+	seconds := snapshot.Var(catalog.ColStreamChromaprintSecondOffsets, catalog.ColStreamChromaprintSecondData)
+	secondOffset := snapshot.Int32(catalog.ColStreamChromaprintSecondOffset)
+
+	streams := catalog.AllRows(snapshot.Streams).
+		WhereUint32(snapshot.Uint32(catalog.ColStreamType), audio).
+		WhereEmpty(fingerprints, false)
+	seen := map[uint32]bool{}
+	streams.ForEach(func(row int) {
+		file := streamFile[row]
+		// Only the first fingerprinted audio stream, as in keyOf
+		if seen[file] {
+			return
+		}
+		seen[file] = true
+		object := objects.Get(int(file))
+		if len(object) == 0 {
+			return
+		}
+		index.objects[dedupeKey{
+			codec:        snapshot.String(codec[row]),
+			bits:         int(bits[row]),
+			layout:       snapshot.String(layout[row]),
+			fingerprint:  string(fingerprints.Get(row)),
+			length:       int(length[row]),
+			durationMs:   durationMs(duration[row], timeBaseNum[row], timeBaseDen[row]),
+			second:       string(seconds.Get(row)),
+			secondOffset: int(secondOffset[row]),
+		}] = string(object)
+	})
+	logrus.Debugf("import: dedupe index has %d recordings", len(index.objects))
+	return index, nil
+}
+
+// Lookup returns the store object an import would dedupe a file against: one holding equivalent audio, or with
+// careful, the file itself (`hash` is its SHA-256, see store.HashFile). metadata has to be fingerprinted with the
+// options of `careful` (see util.FingerprintOptionsFromConfig).
+func Lookup(c *catalog.Catalog, metadata *types.FileMetadata, hash string, careful bool) (string, bool, error) {
+	key, ok := keyOf(metadata)
+	if !ok {
+		return "", false, nil
+	}
+	index, err := loadDedupeIndex(c)
+	if err != nil {
+		return "", false, err
+	}
+	object, found := index.objects[key]
+	if !found || (careful && object != hash) {
+		return "", false, nil
+	}
+	return object, true, nil
+}
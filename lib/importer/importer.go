@@ -0,0 +1,405 @@
+// Package importer imports files into AudioFS as a pipeline of stages with bounded queues in between:
+//
+//	scan → probe → fingerprint → dedupe → store → commit
+//
+// Every stage has its own worker count, sized for its bottleneck: probing (stat and hashing) is I/O bound,
+// fingerprinting is CPU bound and runs on the native workers, dedupe owns the in-memory index and commit owns the
+// catalog, so both are single workers. A full queue blocks the stage feeding it, so memory stays bounded however large
+// the collection is. Committed files are checkpointed, so a killed import resumes where it stopped.
+package importer
+
+import (
+	"context"
+	"errors"
+	"os"
+	"path/filepath"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/catalog"
+	"gitlab.com/t4cc0re/audiofs/lib/statcache"
+	"gitlab.com/t4cc0re/audiofs/lib/store"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/lib/walk"
+	"gitlab.com/t4cc0re/audiofs/metrics"
+	"gitlab.com/t4cc0re/audiofs/util"
+)
+
+const (
+	checkpointFile = "import.checkpoint"
+	// The commit stage syncs the catalog and checkpoints at least every commitBatch files or commitInterval.
+	commitBatch    = 256
+	commitInterval = time.Second
+	statusInterval = 10 * time.Second
+)
+
+var (
+	ErrIncomplete         = errors.New("import incomplete, run it again to resume")
+	ErrDuplicateNotStored = errors.New("duplicate of a file which is not stored yet")
+)
+
+type Options struct {
+	// KeepOriginal keeps imported files. Otherwise they are deleted once committed.
+	KeepOriginal bool
+	// Careful fingerprints full streams and only dedupes files with identical content.
+	Careful bool
+}
+
+// item is a file travelling through the pipeline.
+type item struct {
+	path     string
+	info     os.FileInfo
+	size     int64
+	modTime  int64
+	hash     string
+	metadata *types.FileMetadata
+	blob     []byte
+	// object is the store key the catalog entry points to: the file's own hash, or the object of its duplicate.
+	object string
+	// stored is set if the object is the file's own content, which the store stage has to put. It closes `done`
+	// afterwards.
+	stored bool
+	done   chan struct{}
+	// waitFor is the `done` of the file this one duplicates, if that is still in the pipeline.
+	waitFor <-chan struct{}
+	err     error
+}
+
+// Source emits the paths to import until it is done or emit returns false.
+type Source func(emit func(path string) bool) error
+
+// Paths walks files and directories (see walk.OptionsFromConfig). Paths are emitted absolute, so the catalog and the
+// checkpoint do not depend on the working directory. Files which have to be read, as they are not in the
+// stat cache for the fingerprint options of `careful`, are prefetched while they wait in the probe queue.
+func Paths(paths []string, careful bool) Source {
+	return func(emit func(string) bool) error {
+		walkOptions := walk.OptionsFromConfig()
+		if stats, err := statcache.Default(); err == nil {
+			fingerprint := util.FingerprintOptionsFromConfig(careful)
+			walkOptions.NeedsRead = func(_ string, info os.FileInfo) bool {
+				return !stats.Cached(info, fingerprint)
+			}
+		}
+		return walk.Walk(paths, walkOptions, emit)
+	}
+}
+
+// Cataloged emits the files which were cataloged but not imported.
+func Cataloged(c *catalog.Catalog) Source {
+	return func(emit func(string) bool) error {
+		entries, err := c.Entries()
+		if err != nil {
+			return err
+		}
+		for _, entry := range entries {
+			if entry.Object == "" && !emit(entry.Path) {
+				return nil
+			}
+		}
+		return nil
+	}
+}
+
+type importer struct {
+	options    Options
+	catalog    *catalog.Catalog
+	store      store.Store
+	stats      *statcache.Cache
+	index      *dedupeIndex
+	checkpoint *checkpoint
+	artMinSize int64
+	// inflight maps objects being stored to their `done`, until the store stage is done with them.
+	inflightMu sync.Mutex
+	inflight   map[string]chan struct{}
+
+	// owned by the commit stage
+	pending    []checkpointEntry
+	originals  []string
+	lastCommit time.Time
+	commitErr  error
+}
+
+func (imp *importer) probe(it *item) outcome {
+	info, err := os.Stat(it.path)
+	if err != nil {
+		it.err = err
+		return fail
+	}
+	if !info.Mode().IsRegular() {
+		return skip
+	}
+	it.info, it.size, it.modTime = info, info.Size(), info.ModTime().UnixNano()
+	if imp.checkpoint.isDone(it.path, it.size, it.modTime) {
+		return skip
+	}
+	cached, err := imp.stats.Lookup(it.path, info, imp.fingerprintOptions())
+	if err != nil {
+		it.err = err
+		return fail
+	}
+	if it.hash = cached.Hash; it.hash == "" {
+		// Reading the whole file also warms the page cache for the fingerprint stage.
+		if it.hash, err = store.HashFile(it.path); err != nil {
+			it.err = err
+			return fail
+		}
+	}
+	if cached.Metadata != nil {
+		var metadata types.FileMetadata
+		if util.UnmarshallCompressed(cached.Metadata, &metadata) == nil {
+			it.metadata, it.blob = &metadata, cached.Metadata
+		}
+	}
+	return forward
+}
+
+func (imp *importer) fingerprintOptions() util.FingerprintOptions {
+	return util.FingerprintOptionsFromConfig(imp.options.Careful)
+}
+
+func (imp *importer) fingerprint(it *item) outcome {
+	// Unchanged since an earlier probe (see statcache)
+	if it.metadata != nil {
+		return forward
+	}
+	var err error
+	if it.metadata, err = util.GetMetadataFromFileWithOptions(it.path, imp.fingerprintOptions()); err != nil {
+		it.err = err
+		return fail
+	}
+	if it.blob, err = util.MarshallCompressed(it.metadata); err != nil {
+		it.err = err
+		return fail
+	}
+	if err = imp.stats.Put(it.info, imp.fingerprintOptions(), it.hash, it.blob); err != nil {
+		logrus.Warnf("import: could not cache the probe of '%s': %v", it.path, err)
+	}
+	return forward
+}
+
+func (imp *importer) dedupe(it *item) outcome {
+	key, ok := keyOf(it.metadata)
+	if ok {
+		existing, found := imp.index.objects[key]
+		// Careful mode cannot compare decoded audio yet, so it only dedupes identical files.
+		if found && (!imp.options.Careful || existing == it.hash) {
+			imp.inflightMu.Lock()
+			it.object, it.waitFor = existing, imp.inflight[existing]
+			imp.inflightMu.Unlock()
+			return forward
+		}
+	}
+	it.object, it.stored, it.done = it.hash, true, make(chan struct{})
+	imp.inflightMu.Lock()
+	imp.inflight[it.hash] = it.done
+	imp.inflightMu.Unlock()
+	if ok {
+		imp.index.objects[key] = it.hash
+	}
+	return forward
+}
+
+func (imp *importer) storeObject(it *item) outcome {
+	if !it.stored {
+		// The dedupe stage emitted the original first, so it is already being stored by another worker.
+		if it.waitFor != nil {
+			<-it.waitFor
+		}
+		if !imp.store.Has(it.object) {
+			it.err = ErrDuplicateNotStored
+			return fail
+		}
+		return forward
+	}
+	defer imp.stored(it)
+	var err error
+	if cuts := imp.artCuts(it); len(cuts) > 0 {
+		err = imp.store.PutSpliced(it.path, it.object, cuts)
+	} else {
+		err = imp.store.Put(it.path, it.object)
+	}
+	if err != nil {
+		it.err = err
+		return fail
+	}
+	return forward
+}
+
+// stored releases the duplicates waiting for an object, once it was put or failed. Duplicates found later check the
+// store directly, so the entry is dropped and inflight only holds the objects in the pipeline.
+func (imp *importer) stored(it *item) {
+	imp.inflightMu.Lock()
+	delete(imp.inflight, it.object)
+	imp.inflightMu.Unlock()
+	close(it.done)
+}
+
+// artCuts are the embedded pictures of `import.art.min_size` or more which are stored as-is in the file, so the store
+// keeps cover art shared by the tracks of an album once. Probes cached before pictures were located have none.
+func (imp *importer) artCuts(it *item) []store.Cut {
+	if it.metadata == nil {
+		return nil
+	}
+	var cuts []store.Cut
+	for _, stream := range it.metadata.Streams {
+		if pic := stream.AttachedPic; pic != nil && pic.Offset >= 0 && pic.Size > 0 && pic.Size >= imp.artMinSize {
+			cuts = append(cuts, store.Cut{Offset: pic.Offset, Size: pic.Size, Key: pic.SHA256})
+		}
+	}
+	return cuts
+}
+
+func (imp *importer) commit(it *item) outcome {
+	err := imp.catalog.Append(catalog.Entry{
+		Path:     it.path,
+		Size:     it.size,
+		ModTime:  it.modTime,
+		Object:   it.object,
+		Metadata: it.blob,
+	})
+	if err != nil {
+		it.err = err
+		return fail
+	}
+	imp.pending = append(imp.pending, checkpointEntry{Path: it.path, Size: it.size, ModTime: it.modTime})
+	if !imp.options.KeepOriginal {
+		imp.originals = append(imp.originals, it.path)
+	}
+	if len(imp.pending) >= commitBatch || time.Since(imp.lastCommit) >= commitInterval {
+		if err = imp.flush(); err != nil {
+			it.err = err
+			return fail
+		}
+	}
+	return forward
+}
+
+// flush makes the committed files durable: objects first, then the catalog, then the checkpoint, then originals are
+// deleted. A crash in between only redoes files, it never loses them.
+func (imp *importer) flush() error {
+	imp.lastCommit = time.Now()
+	if len(imp.pending) == 0 {
+		return nil
+	}
+	if err := imp.store.Sync(); err != nil {
+		imp.commitErr = err
+		return err
+	}
+	if err := imp.catalog.Sync(); err != nil {
+		imp.commitErr = err
+		return err
+	}
+	if err := imp.checkpoint.commit(imp.pending); err != nil {
+		imp.commitErr = err
+		return err
+	}
+	imp.pending = imp.pending[:0]
+	for _, path := range imp.originals {
+		if err := os.Remove(path); err != nil {
+			logrus.Warnf("import: could not remove '%s': %v", path, err)
+		}
+	}
+	imp.originals = imp.originals[:0]
+	return nil
+}
+
+func workers(key string, fallback int) int {
+	if n := config.Config.GetInt(key); n > 0 {
+		return n
+	}
+	return fallback
+}
+
+// Run imports everything the source emits. Cancelling ctx stops scanning, files already in the pipeline are finished.
+// Returns ErrIncomplete if anything failed or the import was cancelled, in which case the checkpoint is kept.
+func Run(ctx context.Context, source Source, options Options) error {
+	cat, err := catalog.Default()
+	if err != nil {
+		return err
+	}
+	objects, err := store.Default()
+	if err != nil {
+		return err
+	}
+	// Gives up the write lock, so other processes can import
+	defer func() {
+		if err := objects.Close(); err != nil {
+			logrus.Warnf("import: could not close the store: %v", err)
+		}
+	}()
+	stats, err := statcache.Default()
+	if err != nil {
+		return err
+	}
+	index, err := loadDedupeIndex(cat)
+	if err != nil {
+		return err
+	}
+	cp, err := openCheckpoint(filepath.Join(cat.Dir(), checkpointFile))
+	if err != nil {
+		return err
+	}
+	if len(cp.done) > 0 {
+		logrus.Infof("import: resuming, %d files were committed before", len(cp.done))
+	}
+
+	imp := &importer{options: options, catalog: cat, store: objects, stats: stats, index: index, checkpoint: cp,
+		artMinSize: config.Config.GetInt64("import.art.min_size"), inflight: map[string]chan struct{}{},
+		lastCommit: time.Now()}
+	queue := config.Config.GetInt("import.queue_size")
+	p := newPipeline(
+		newStage("probe", workers("import.workers.probe", 4), queue, imp.probe),
+		newStage("fingerprint", workers("import.workers.fingerprint", util.DefaultNativePool().Size()), queue, imp.fingerprint),
+		newStage("dedupe", 1, queue, imp.dedupe),
+		newStage("store", workers("import.workers.store", 2), queue, imp.storeObject),
+		newStage("commit", 1, queue, imp.commit),
+	)
+	defer metrics.Default.Register(p.collect)()
+	p.start()
+
+	var scanned atomic.Uint64
+	ticker := time.NewTicker(statusInterval)
+	defer ticker.Stop()
+	go func() {
+		for {
+			select {
+			case <-ticker.C:
+				logrus.Infof("import: scan %d found | %s", scanned.Load(), p.status())
+			case <-p.done:
+				return
+			}
+		}
+	}()
+
+	first := p.stages[0].in
+	scanErr := source(func(path string) bool {
+		select {
+		case first <- &item{path: path}:
+			scanned.Add(1)
+			return true
+		case <-ctx.Done():
+			return false
+		}
+	})
+	close(first)
+	<-p.done
+	if err = imp.flush(); err != nil {
+		_ = cp.close()
+		return err
+	}
+
+	var failed uint64
+	for _, s := range p.stages {
+		failed += s.results[fail].Load()
+	}
+	committed := p.stages[len(p.stages)-1].results[forward].Load()
+	logrus.Infof("import: %d files scanned, %d committed, %d failed", scanned.Load(), committed, failed)
+	if scanErr != nil || failed > 0 || ctx.Err() != nil || imp.commitErr != nil {
+		_ = cp.close()
+		return errors.Join(ErrIncomplete, scanErr, ctx.Err(), imp.commitErr)
+	}
+	return cp.remove()
+}
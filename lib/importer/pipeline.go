@@ -0,0 +1,132 @@
+package importer
+
+import (
+	"fmt"
+	"io"
+	"strings"
+	"sync"
+	"sync/atomic"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/metrics"
+)
+
+// outcome is what a stage decided about an item.
+type outcome int
+
+const (
+	// forward passes the item to the next stage.
+	forward outcome = iota
+	// skip drops the item as done, e.g. it was imported by an earlier run.
+	skip
+	// fail drops the item. It is retried by the next import.
+	fail
+)
+
+var outcomeNames = []string{"ok", "skipped", "failed"}
+
+// stage runs `workers` goroutines applying fn to the items of its input queue. Queues are bounded, so a saturated
+// stage blocks the ones before it instead of buffering the whole collection.
+type stage struct {
+	name    string
+	workers int
+	fn      func(*item) outcome
+	in      chan *item
+	busy    atomic.Int64
+	results [3]atomic.Uint64
+}
+
+func newStage(name string, workers int, queue int, fn func(*item) outcome) *stage {
+	if workers < 1 {
+		workers = 1
+	}
+	return &stage{name: name, workers: workers, fn: fn, in: make(chan *item, queue)}
+}
+
+// run processes items until the input queue is closed, then closes `next`, or calls `finished` for the last stage.
+func (s *stage) run(next *stage, finished func()) {
+	var wg sync.WaitGroup
+	for i := 0; i < s.workers; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for it := range s.in {
+				s.busy.Add(1)
+				result := s.fn(it)
+				s.busy.Add(-1)
+				s.results[result].Add(1)
+				if result == fail {
+					logrus.Warnf("import: %s '%s': %v", s.name, it.path, it.err)
+				}
+				if result == forward && next != nil {
+					next.in <- it
+				}
+			}
+		}()
+	}
+	go func() {
+		wg.Wait()
+		if next != nil {
+			close(next.in)
+		} else {
+			finished()
+		}
+	}()
+}
+
+// pipeline is a chain of stages. The first stage's queue is fed by the caller.
+type pipeline struct {
+	stages []*stage
+	done   chan struct{}
+}
+
+func newPipeline(stages ...*stage) *pipeline {
+	return &pipeline{stages: stages, done: make(chan struct{})}
+}
+
+func (p *pipeline) start() {
+	for i, s := range p.stages {
+		var next *stage
+		if i+1 < len(p.stages) {
+			next = p.stages[i+1]
+		}
+		s.run(next, func() { close(p.done) })
+	}
+}
+
+// status is one line of queue depths and busy workers per stage, e.g. for periodic logging.
+func (p *pipeline) status() string {
+	parts := make([]string, 0, len(p.stages))
+	for _, s := range p.stages {
+		parts = append(parts, fmt.Sprintf("%s %d/%d queued, %d/%d busy, %d done",
+			s.name, len(s.in), cap(s.in), s.busy.Load(), s.workers, s.results[forward].Load()))
+	}
+	return strings.Join(parts, " | ")
+}
+
+// collect exposes the live state of every stage. The queue depth relative to its capacity shows the bottleneck: the
+// stage before the last full queue is saturated.
+func (p *pipeline) collect(w io.Writer) {
+	metrics.Header(w, "audiofs_import_queue_depth", "gauge", "Items waiting in front of an import stage.")
+	for _, s := range p.stages {
+		fmt.Fprintf(w, "audiofs_import_queue_depth{stage=%q} %d\n", s.name, len(s.in))
+	}
+	metrics.Header(w, "audiofs_import_queue_capacity", "gauge", "Capacity of the queue in front of an import stage.")
+	for _, s := range p.stages {
+		fmt.Fprintf(w, "audiofs_import_queue_capacity{stage=%q} %d\n", s.name, cap(s.in))
+	}
+	metrics.Header(w, "audiofs_import_busy_workers", "gauge", "Workers of an import stage processing an item.")
+	for _, s := range p.stages {
+		fmt.Fprintf(w, "audiofs_import_busy_workers{stage=%q} %d\n", s.name, s.busy.Load())
+	}
+	metrics.Header(w, "audiofs_import_workers", "gauge", "Workers of an import stage.")
+	for _, s := range p.stages {
+		fmt.Fprintf(w, "audiofs_import_workers{stage=%q} %d\n", s.name, s.workers)
+	}
+	metrics.Header(w, "audiofs_import_items_total", "counter", "Items processed by an import stage.")
+	for _, s := range p.stages {
+		for result, name := range outcomeNames {
+			fmt.Fprintf(w, "audiofs_import_items_total{stage=%q,result=%q} %d\n", s.name, name, s.results[result].Load())
+		}
+	}
+}
@@ -1,8 +1,25 @@
 package lib
 
 import (
+	"context"
+	"encoding/json"
 	"fmt"
+	"github.com/sirupsen/logrus"
 	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/catalog"
+	"gitlab.com/t4cc0re/audiofs/lib/cluster"
+	"gitlab.com/t4cc0re/audiofs/lib/exporter"
+	"gitlab.com/t4cc0re/audiofs/lib/importer"
+	"gitlab.com/t4cc0re/audiofs/lib/scheduler"
+	"gitlab.com/t4cc0re/audiofs/lib/statcache"
+	"gitlab.com/t4cc0re/audiofs/lib/store"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/util"
+	"math/rand"
+	"os"
+	"os/signal"
+	"path/filepath"
+	"syscall"
 //	_ "gitlab.com/t4cc0re/audiofs/native"
 )
 
@@ -49,25 +66,248 @@ func useNativeFFmpeg() bool {
 	return config.Config.GetBool("experimental.native_code.ffmpeg")
 }
 
+// Analyze returns a file's metadata and its compressed form. Files which did not change since they were last analyzed
+// are not probed again (see statcache).
+func Analyze(path string) (*types.FileMetadata, []byte, error) {
+	cache, err := statcache.Default()
+	if err != nil {
+		return nil, nil, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	metadata, blob, err := cache.Probe(path, util.FingerprintOptionsFromConfig(false))
+	if err != nil {
+		return nil, nil, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	return metadata, blob, nil
+}
+
 func AddToCatalog(path string) error {
-	fmt.Println("AddToCatalog: '" + path + "'")
-	return ERR_NOTIMPLEMENTED
+	c, err := catalog.Default()
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	// The catalog is read from other working directories (import-catalog, export).
+	if path, err = filepath.Abs(path); err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	info, err := os.Stat(path)
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	_, blob, err := Analyze(path)
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	err = c.Append(catalog.Entry{Path: path, Size: info.Size(), ModTime: info.ModTime().UnixNano(), Metadata: blob})
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	return nil
 }
 
+// Snapshot writes the columnar snapshot of the catalog used by Query. Returns the number of files in it.
+func Snapshot() (int, error) {
+	c, err := catalog.Default()
+	if err != nil {
+		return 0, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	files, err := catalog.WriteSnapshot(c, catalog.SnapshotPath(c))
+	if err != nil {
+		return 0, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	return files, nil
+}
+
+// Query opens the catalog snapshot written by Snapshot. The caller has to close it.
+func Query() (*catalog.Snapshot, error) {
+	c, err := catalog.Default()
+	if err != nil {
+		return nil, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	snapshot, err := catalog.OpenSnapshot(catalog.SnapshotPath(c))
+	if err != nil {
+		return nil, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	return snapshot, nil
+}
+
+// SampleCatalogMetadata returns the metadata JSON of a random sample of up to n catalog records, e.g. to train a
+// compression dictionary on what is actually stored. Records which cannot be decoded are skipped.
+func SampleCatalogMetadata(n int) ([][]byte, error) {
+	c, err := catalog.Default()
+	if err != nil {
+		return nil, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	// Reservoir sampling over the log, so the blobs of a huge catalog are not all held in memory.
+	var blobs [][]byte
+	seen := 0
+	err = c.Scan(func(entry catalog.Entry) error {
+		seen++
+		if len(blobs) < n {
+			blobs = append(blobs, entry.Metadata)
+		} else if i := rand.Intn(seen); i < n {
+			blobs[i] = entry.Metadata
+		}
+		return nil
+	})
+	if err != nil {
+		return nil, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	samples := blobs[:0]
+	for _, blob := range blobs {
+		var sample json.RawMessage
+		if err = util.UnmarshallCompressed(blob, &sample); err != nil {
+			logrus.Debugf("skipping a catalog record: %v", err)
+			continue
+		}
+		samples = append(samples, sample)
+	}
+	return samples, nil
+}
+
+// ClusterMatch is a verified pair of near-duplicates.
+type ClusterMatch struct {
+	A          string  `json:"a"`
+	B          string  `json:"b"`
+	Similarity float64 `json:"similarity"`
+	// Offset aligns the two: A at t seconds plays B at t-Offset.
+	Offset float64 `json:"offset"`
+}
+
+// Cluster is a set of near-duplicate files.
+type Cluster struct {
+	Paths   []string       `json:"paths"`
+	Matches []ClusterMatch `json:"matches"`
+}
+
+// Clusters finds the near-duplicate recordings among the fingerprints in the catalog snapshot, largest sets first, or
+// until the process is interrupted.
+func Clusters() ([]Cluster, error) {
+	ctx, stop := signal.NotifyContext(context.Background(), os.Interrupt, syscall.SIGTERM)
+	defer stop()
+	snapshot, err := Query()
+	if err != nil {
+		return nil, err
+	}
+	defer snapshot.Close()
+
+	found, stats, err := cluster.Find(ctx, cluster.FromSnapshot(snapshot), cluster.OptionsFromConfig())
+	if err != nil {
+		return nil, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	logrus.Infof("clustered %d fingerprints (%d invalid): %d candidate pairs, %d near-duplicates",
+		stats.Tracks, stats.Invalid, stats.Candidates, stats.Matches)
+
+	clusters := make([]Cluster, len(found))
+	for i, c := range found {
+		for _, file := range c.Tracks {
+			clusters[i].Paths = append(clusters[i].Paths, snapshot.Path(file))
+		}
+		for _, m := range c.Matches {
+			clusters[i].Matches = append(clusters[i].Matches, ClusterMatch{
+				A:          snapshot.Path(m.A),
+				B:          snapshot.Path(m.B),
+				Similarity: m.Similarity,
+				Offset:     float64(m.Offset) * cluster.FrameSeconds,
+			})
+		}
+	}
+	return clusters, nil
+}
+
+// Export reconstructs the stored files which are, or are below, one of `roots` in `destination` (see exporter.Plan),
+// and calls done with every result, until all are exported or the process is interrupted. Files which fail are
+// reported to done, and counted in the error returned.
+func Export(roots []string, destination string, options exporter.Options, done func(exporter.Result)) error {
+	ctx, stop := signal.NotifyContext(context.Background(), os.Interrupt, syscall.SIGTERM)
+	defer stop()
+	c, err := catalog.Default()
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	entries, err := c.Entries()
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	jobs, err := exporter.Plan(entries, roots, destination, options.Format)
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	if len(jobs) == 0 {
+		return NewError("no cataloged files below the given paths", ERR_UNKNOWN.Code())
+	}
+	objects, err := store.Default()
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	defer objects.Close()
+
+	failed := 0
+	err = exporter.Run(ctx, objects, jobs, options, func(result exporter.Result) {
+		if result.Err != nil {
+			failed++
+		}
+		done(result)
+	})
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	if failed > 0 {
+		return WrapError(fmt.Errorf("%d of %d files could not be exported", failed, len(jobs)), ERR_UNKNOWN.Code())
+	}
+	return nil
+}
+
+// runImport runs an import until it is done or the process is interrupted. An interrupted import resumes on the next
+// run.
+func runImport(source importer.Source, keepOriginal bool, carefulDedupe bool) error {
+	ctx, stop := signal.NotifyContext(context.Background(), os.Interrupt, syscall.SIGTERM)
+	defer stop()
+	err := importer.Run(ctx, source, importer.Options{KeepOriginal: keepOriginal, Careful: carefulDedupe})
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	return nil
+}
+
+// ImportFile imports a file, or all files below a directory.
 func ImportFile(path string, keepOriginal bool, carefulDedupe bool) error {
-	fmt.Println("ImportFiles: '" + path + "'")
-	fmt.Printf("keepOriginal: %t\n", keepOriginal)
-	fmt.Printf("carefulDedupe: %t\n", carefulDedupe)
-	return ERR_NOTIMPLEMENTED
+	return runImport(importer.Paths([]string{path}, carefulDedupe), keepOriginal, carefulDedupe)
 }
 
+// ImportCatalog imports all files which were only cataloged so far.
 func ImportCatalog(keepOriginal bool, carefulDedupe bool) error {
-	fmt.Println("ImportCatalog")
-	fmt.Printf("keepOriginal: %t\n", keepOriginal)
-	fmt.Printf("carefulDedupe: %t\n", carefulDedupe)
-	return ERR_NOTIMPLEMENTED
+	c, err := catalog.Default()
+	if err != nil {
+		return WrapError(err, ERR_UNKNOWN.Code())
+	}
+	return runImport(importer.Cataloged(c), keepOriginal, carefulDedupe)
 }
 
+// Exists checks whether an import of the file would be deduped, see FindStored.
 func Exists(path string, carefulDedupe bool) (bool, error) {
-	return false, ERR_NOTIMPLEMENTED
+	_, found, err := FindStored(path, carefulDedupe)
+	return found, err
+}
+
+// FindStored checks whether equivalent audio, or with carefulDedupe the file itself, is stored already, i.e. whether
+// an import of the file would be deduped. Returns the store key of the object holding it.
+func FindStored(path string, carefulDedupe bool) (string, bool, error) {
+	c, err := catalog.Default()
+	if err != nil {
+		return "", false, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	// Quick checks only fingerprint a bounded window, so this is roughly constant-time per file.
+	metadata, err := util.GetMetadataFromFileAs(scheduler.Interactive, path, util.FingerprintOptionsFromConfig(carefulDedupe))
+	if err != nil {
+		return "", false, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	hash, err := store.HashFile(path)
+	if err != nil {
+		return "", false, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	object, found, err := importer.Lookup(c, metadata, hash, carefulDedupe)
+	if err != nil {
+		return "", false, WrapError(err, ERR_UNKNOWN.Code())
+	}
+	return object, found, nil
 }
@@ -0,0 +1,233 @@
+// Package scheduler admits CPU bound work (probing, fingerprinting, transcoding) against one process-wide thread
+// budget, so concurrent imports, verification and serving do not oversubscribe the cores. Every job names a priority
+// class and the threads it would like to use, including the codec threads libav starts for it; it runs once the
+// budget has room for at least one of them.
+//
+// Classes are strictly ordered: while a job of a higher class waits, no job of a lower class is admitted. On top of
+// that, a part of the budget is reserved for Interactive jobs, so a read never waits for a batch job to finish.
+package scheduler
+
+import (
+	"context"
+	"fmt"
+	"io"
+	"runtime"
+	"sync"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/metrics"
+)
+
+// Class is a job's priority. Lower values are admitted first.
+type Class int
+
+const (
+	// Interactive is someone waiting for the result, e.g. a read of a served file.
+	Interactive Class = iota
+	// Background is work nobody waits for, but which should not queue behind an import, e.g. verification.
+	Background
+	// Batch is bulk work, e.g. imports.
+	Batch
+
+	classes = 3
+)
+
+var classNames = [classes]string{"interactive", "background", "batch"}
+
+func (c Class) String() string {
+	return classNames[c]
+}
+
+type waiter struct {
+	class   Class
+	threads int
+	granted int // set once admitted
+	ready   chan struct{}
+}
+
+// Scheduler hands out threads of a fixed budget. Safe for concurrent use.
+type Scheduler struct {
+	mu sync.Mutex
+	// budget is the number of threads all running jobs may use together, reserve the part only Interactive jobs may
+	// use.
+	budget  int
+	reserve int
+	used    int
+	queues  [classes][]*waiter
+
+	running  [classes]int // threads in use
+	admitted [classes]uint64
+	waited   [classes]time.Duration
+}
+
+// New returns a scheduler for `budget` threads, `reserve` of which only Interactive jobs may use.
+func New(budget, reserve int) *Scheduler {
+	if budget < 1 {
+		budget = 1
+	}
+	if reserve < 0 {
+		reserve = 0
+	}
+	if reserve >= budget {
+		reserve = budget - 1
+	}
+	return &Scheduler{budget: budget, reserve: reserve}
+}
+
+var (
+	defaultScheduler     *Scheduler
+	defaultSchedulerOnce sync.Once
+)
+
+// Default returns the process-wide scheduler, sized by `scheduler.threads` and `scheduler.interactive_reserve`.
+func Default() *Scheduler {
+	defaultSchedulerOnce.Do(func() {
+		defaultScheduler = New(sizeFromConfig())
+		metrics.Default.Register(defaultScheduler.collect)
+	})
+	return defaultScheduler
+}
+
+// sizeFromConfig returns the configured budget and reserve. A budget of 0 is one thread per CPU. A reserve of 0 reserves
+// nothing, only a negative one means the default of a quarter of the budget.
+func sizeFromConfig() (budget, reserve int) {
+	budget = config.Config.GetInt("scheduler.threads")
+	if budget <= 0 {
+		budget = runtime.NumCPU()
+	}
+	reserve = config.Config.GetInt("scheduler.interactive_reserve")
+	if reserve < 0 {
+		reserve = (budget + 3) / 4
+	}
+	return budget, reserve
+}
+
+// Threads is the number of threads a job of `class` asks for, from `scheduler.job_threads.<class>`.
+func Threads(class Class) int {
+	if threads := config.Config.GetInt("scheduler.job_threads." + class.String()); threads > 1 {
+		return threads
+	}
+	return 1
+}
+
+// Budget is the number of threads all jobs may use together.
+func (s *Scheduler) Budget() int {
+	return s.budget
+}
+
+// Grant is the permission to run a job with Threads threads. It has to be released once the job is done.
+type Grant struct {
+	s       *Scheduler
+	class   Class
+	Threads int
+}
+
+// Acquire waits until a job of `class` may run, and grants it up to `threads` threads (at least one).
+func (s *Scheduler) Acquire(ctx context.Context, class Class, threads int) (*Grant, error) {
+	if threads < 1 {
+		threads = 1
+	}
+	w := &waiter{class: class, threads: threads, ready: make(chan struct{})}
+	start := time.Now()
+
+	s.mu.Lock()
+	s.queues[class] = append(s.queues[class], w)
+	s.dispatch()
+	s.mu.Unlock()
+
+	select {
+	case <-w.ready:
+	case <-ctx.Done():
+		s.mu.Lock()
+		if w.granted == 0 {
+			s.remove(w)
+			// A lower class may have been held back by this one.
+			s.dispatch()
+			s.mu.Unlock()
+			return nil, ctx.Err()
+		}
+		s.mu.Unlock()
+		// Admitted meanwhile, give it back.
+		(&Grant{s: s, class: class, Threads: w.granted}).Release()
+		return nil, ctx.Err()
+	}
+
+	s.mu.Lock()
+	s.waited[class] += time.Since(start)
+	s.mu.Unlock()
+	return &Grant{s: s, class: class, Threads: w.granted}, nil
+}
+
+// Release returns the grant's threads to the budget.
+func (g *Grant) Release() {
+	s := g.s
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.used -= g.Threads
+	s.running[g.class] -= g.Threads
+	s.dispatch()
+}
+
+// dispatch admits waiting jobs in class order, as long as the budget allows. Must be called with s.mu held.
+func (s *Scheduler) dispatch() {
+	for class := Class(0); class < classes; class++ {
+		limit := s.budget
+		if class != Interactive {
+			limit -= s.reserve
+		}
+		for len(s.queues[class]) > 0 && s.used < limit {
+			w := s.queues[class][0]
+			s.queues[class] = s.queues[class][1:]
+			w.granted = w.threads
+			if w.granted > limit-s.used {
+				w.granted = limit - s.used
+			}
+			s.used += w.granted
+			s.running[class] += w.granted
+			s.admitted[class]++
+			close(w.ready)
+		}
+		if len(s.queues[class]) > 0 {
+			// Strict priority: lower classes wait for this one.
+			return
+		}
+	}
+}
+
+// remove drops a waiter which was not admitted. Must be called with s.mu held.
+func (s *Scheduler) remove(w *waiter) {
+	queue := s.queues[w.class]
+	for i := range queue {
+		if queue[i] == w {
+			s.queues[w.class] = append(queue[:i], queue[i+1:]...)
+			return
+		}
+	}
+}
+
+func (s *Scheduler) collect(w io.Writer) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	metrics.Header(w, "audiofs_scheduler_threads", "gauge", "Threads all jobs may use together.")
+	fmt.Fprintf(w, "audiofs_scheduler_threads %d\n", s.budget)
+	metrics.Header(w, "audiofs_scheduler_reserved_threads", "gauge", "Threads only interactive jobs may use.")
+	fmt.Fprintf(w, "audiofs_scheduler_reserved_threads %d\n", s.reserve)
+	metrics.Header(w, "audiofs_scheduler_running_threads", "gauge", "Threads in use by the running jobs of a class.")
+	for class := Class(0); class < classes; class++ {
+		fmt.Fprintf(w, "audiofs_scheduler_running_threads{class=%q} %d\n", class, s.running[class])
+	}
+	metrics.Header(w, "audiofs_scheduler_waiting_jobs", "gauge", "Jobs of a class waiting to be admitted.")
+	for class := Class(0); class < classes; class++ {
+		fmt.Fprintf(w, "audiofs_scheduler_waiting_jobs{class=%q} %d\n", class, len(s.queues[class]))
+	}
+	metrics.Header(w, "audiofs_scheduler_admitted_total", "counter", "Jobs of a class admitted so far.")
+	for class := Class(0); class < classes; class++ {
+		fmt.Fprintf(w, "audiofs_scheduler_admitted_total{class=%q} %d\n", class, s.admitted[class])
+	}
+	metrics.Header(w, "audiofs_scheduler_wait_seconds_total", "counter", "Time jobs of a class waited to be admitted.")
+	for class := Class(0); class < classes; class++ {
+		fmt.Fprintf(w, "audiofs_scheduler_wait_seconds_total{class=%q} %g\n", class, s.waited[class].Seconds())
+	}
+}
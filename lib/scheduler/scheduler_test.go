@@ -0,0 +1,111 @@
+package scheduler
+
+import (
+	"context"
+	"testing"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+)
+
+// acquireAsync starts an Acquire and waits until it is queued.
+func acquireAsync(t *testing.T, s *Scheduler, class Class, threads int) <-chan *Grant {
+	t.Helper()
+	s.mu.Lock()
+	queued := len(s.queues[class])
+	s.mu.Unlock()
+
+	granted := make(chan *Grant, 1)
+	go func() {
+		g, err := s.Acquire(context.Background(), class, threads)
+		if err != nil {
+			t.Error(err)
+		}
+		granted <- g
+	}()
+	for {
+		s.mu.Lock()
+		n := len(s.queues[class])
+		s.mu.Unlock()
+		if n > queued {
+			return granted
+		}
+		time.Sleep(time.Millisecond)
+	}
+}
+
+func TestClassOrder(t *testing.T) {
+	s := New(1, 0)
+	running, err := s.Acquire(context.Background(), Batch, 1)
+	if err != nil {
+		t.Fatal(err)
+	}
+	batch := acquireAsync(t, s, Batch, 1)
+	background := acquireAsync(t, s, Background, 1)
+	interactive := acquireAsync(t, s, Interactive, 1)
+
+	running.Release()
+	next := <-interactive
+	select {
+	case <-background:
+		t.Fatal("background job admitted before the interactive one finished")
+	case <-batch:
+		t.Fatal("batch job admitted before the interactive one finished")
+	default:
+	}
+	next.Release()
+	next = <-background
+	select {
+	case <-batch:
+		t.Fatal("batch job admitted before the background one finished")
+	default:
+	}
+	next.Release()
+	(<-batch).Release()
+}
+
+func TestReserve(t *testing.T) {
+	s := New(4, 1)
+	batch, err := s.Acquire(context.Background(), Batch, 8)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if batch.Threads != 3 {
+		t.Fatalf("batch job granted %d threads, want 3", batch.Threads)
+	}
+	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Millisecond)
+	defer cancel()
+	if _, err = s.Acquire(ctx, Background, 1); err != context.DeadlineExceeded {
+		t.Fatalf("background job in the reserve: %v", err)
+	}
+	interactive, err := s.Acquire(context.Background(), Interactive, 2)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if interactive.Threads != 1 {
+		t.Fatalf("interactive job granted %d threads, want 1", interactive.Threads)
+	}
+	interactive.Release()
+	batch.Release()
+
+	s = New(4, 0)
+	if batch, err = s.Acquire(context.Background(), Batch, 8); err != nil {
+		t.Fatal(err)
+	}
+	if batch.Threads != 4 {
+		t.Fatalf("batch job granted %d threads without a reserve, want 4", batch.Threads)
+	}
+	batch.Release()
+}
+
+func TestSizeFromConfig(t *testing.T) {
+	defer config.Config.Set("scheduler.threads", nil)
+	defer config.Config.Set("scheduler.interactive_reserve", nil)
+	config.Config.Set("scheduler.threads", 8)
+	for _, c := range []struct{ configured, want int }{{-1, 2}, {0, 0}, {3, 3}} {
+		config.Config.Set("scheduler.interactive_reserve", c.configured)
+		if budget, reserve := sizeFromConfig(); budget != 8 || reserve != c.want {
+			t.Errorf("reserve %d: got budget %d, reserve %d, want 8, %d", c.configured, budget, reserve, c.want)
+		}
+	}
+}
@@ -0,0 +1,17 @@
+//go:build linux
+
+package statcache
+
+import (
+	"os"
+	"syscall"
+)
+
+// statKey returns a file's device and inode, and its ctime in unix nanoseconds.
+func statKey(info os.FileInfo) (key, int64, bool) {
+	stat, ok := info.Sys().(*syscall.Stat_t)
+	if !ok {
+		return key{}, 0, false
+	}
+	return key{dev: uint64(stat.Dev), inode: stat.Ino}, stat.Ctim.Nano(), true
+}
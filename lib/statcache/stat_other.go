@@ -0,0 +1,10 @@
+//go:build !linux && !darwin && !freebsd && !netbsd
+
+package statcache
+
+import "os"
+
+// statKey has no inode to key by on this platform, so nothing is cached.
+func statKey(os.FileInfo) (key, int64, bool) {
+	return key{}, 0, false
+}
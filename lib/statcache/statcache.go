@@ -0,0 +1,577 @@
+// Package statcache remembers the content hash and probe result of every file AudioFS looked at, keyed by device and
+// inode. A file whose size, mtime and ctime did not change since is not read again, so rescanning an unchanged
+// collection only costs a stat per file. Renamed and moved files are recognized by their content hash, without
+// decoding them again.
+package statcache
+
+import (
+	"bufio"
+	"crypto/sha256"
+	"encoding/binary"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"hash/crc32"
+	"io"
+	"os"
+	"path/filepath"
+	"sync"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/filelock"
+	"gitlab.com/t4cc0re/audiofs/lib/store"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/util"
+)
+
+// The cache is an append-only log like the catalog. A later record for the same device and inode supersedes earlier
+// ones, and the log is compacted on open once most of it is superseded. Appends and compaction hold the log's advisory
+// lock, and a process which finds the log replaced by another one's compaction loads the new log before appending.
+//
+//	header: cacheMagic | uint32 version
+//	record: uint32 payload length | uint32 CRC-32C of payload | payload
+//	payload: uvarint dev | uvarint inode | varint size | varint mtime | varint ctime (unix ns) | sha256 (32 bytes)
+//	         | uvarint len(options) | options | metadata blob
+//
+// Only the stat fields and the hash are kept in memory, metadata blobs are read from the log when needed.
+const (
+	cacheMagic   = "AFSSTATC"
+	cacheVersion = 1
+	cacheFile    = "stat.cache"
+	// Records are small, anything bigger than this is corruption.
+	maxRecordSize = 64 << 20
+	// The log is compacted on open if it has this many more records than files.
+	compactSlack = 4096
+)
+
+var (
+	ErrNotACache          = errors.New("not an AudioFS stat cache")
+	ErrUnsupportedVersion = errors.New("unsupported stat cache version")
+
+	crcTable = crc32.MakeTable(crc32.Castagnoli)
+)
+
+// key identifies a file independent of its path.
+type key struct {
+	dev   uint64
+	inode uint64
+}
+
+// stamp is what changes if a file's content might have changed. Renames and chmod only change the ctime.
+type stamp struct {
+	size    int64
+	modTime int64
+}
+
+type entry struct {
+	stamp
+	changeTime int64
+	hash       [sha256.Size]byte
+	// options are the fingerprint options the metadata was probed with (see optionsKey).
+	options string
+	// metadata is the blob's position in the log.
+	offset int64
+	length int
+}
+
+// Result is what the cache knows about a file's content.
+type Result struct {
+	// Hash is the store key of the content, "" if it is not known (yet).
+	Hash string
+	// Metadata is the compressed types.FileMetadata (see util.MarshallCompressed), nil if the file has to be probed.
+	Metadata []byte
+}
+
+type Cache struct {
+	mutex   sync.Mutex
+	log     *os.File
+	entries map[key]*entry
+	// byStamp finds candidates for files which moved to another inode, e.g. across file systems. Built on first use.
+	byStamp map[stamp][]*entry
+	// interned option strings, there are only a few distinct ones
+	options map[string]string
+	records int
+	// generation counts (re)loads of the log, entries of an older generation point into a replaced log.
+	generation int
+}
+
+var (
+	defaultCache     *Cache
+	defaultCacheErr  error
+	defaultCacheOnce sync.Once
+)
+
+// Default opens the cache in `catalog.dir` once per process.
+func Default() (*Cache, error) {
+	defaultCacheOnce.Do(func() {
+		dir := config.Config.GetString("catalog.dir")
+		if err := os.MkdirAll(dir, 0755); err != nil {
+			defaultCacheErr = err
+			return
+		}
+		defaultCache, defaultCacheErr = Open(filepath.Join(dir, cacheFile))
+	})
+	return defaultCache, defaultCacheErr
+}
+
+// Open loads the cache at path, or creates it. A torn record at the end is cut off.
+func Open(path string) (*Cache, error) {
+	log, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE|os.O_APPEND, 0644)
+	if err != nil {
+		return nil, err
+	}
+	c := &Cache{log: log, options: map[string]string{}}
+	if err = c.lock(); err != nil {
+		_ = c.log.Close()
+		return nil, err
+	}
+	// Still holding the lock, so no other process appends between reading the log and replacing it.
+	if c.records > 2*len(c.entries)+compactSlack {
+		if err = c.compact(); err != nil {
+			logrus.Warnf("statcache: could not compact '%s': %v", path, err)
+		}
+	}
+	if err = filelock.Unlock(c.log); err != nil {
+		_ = c.log.Close()
+		return nil, err
+	}
+	return c, nil
+}
+
+// lock takes the log's advisory lock and loads the log if it was not loaded yet. If another process compacted the log
+// while this one was not holding the lock, the replaced log is closed and the new one loaded instead: records appended
+// to the old one would be lost. The caller holds the mutex.
+func (c *Cache) lock() error {
+	for {
+		if err := filelock.Lock(c.log); err != nil {
+			return err
+		}
+		replaced, err := c.replaced()
+		if err != nil {
+			_ = filelock.Unlock(c.log)
+			return err
+		}
+		if !replaced {
+			break
+		}
+		log, err := os.OpenFile(c.log.Name(), os.O_RDWR|os.O_CREATE|os.O_APPEND, 0644)
+		if err != nil {
+			_ = filelock.Unlock(c.log)
+			return err
+		}
+		// Closing releases the lock of the replaced log.
+		_ = c.log.Close()
+		c.log, c.entries = log, nil
+	}
+	if c.entries == nil {
+		c.entries, c.byStamp, c.records = map[key]*entry{}, nil, 0
+		c.generation++
+		if err := c.load(); err != nil {
+			_ = filelock.Unlock(c.log)
+			return err
+		}
+	}
+	return nil
+}
+
+// replaced reports whether the log file was renamed over (see compact) or removed since it was opened.
+func (c *Cache) replaced() (bool, error) {
+	current, err := os.Stat(c.log.Name())
+	if errors.Is(err, os.ErrNotExist) {
+		return true, nil
+	} else if err != nil {
+		return false, err
+	}
+	info, err := c.log.Stat()
+	if err != nil {
+		return false, err
+	}
+	return !os.SameFile(current, info), nil
+}
+
+// load reads the log into memory, or writes the header into a new one.
+func (c *Cache) load() error {
+	info, err := c.log.Stat()
+	if err != nil {
+		return err
+	}
+	if info.Size() == 0 {
+		header := make([]byte, len(cacheMagic)+4)
+		copy(header, cacheMagic)
+		binary.LittleEndian.PutUint32(header[len(cacheMagic):], cacheVersion)
+		_, err = c.log.Write(header)
+		return err
+	}
+
+	reader := bufio.NewReaderSize(io.NewSectionReader(c.log, 0, info.Size()), 1<<20)
+	header := make([]byte, len(cacheMagic)+4)
+	if _, err = io.ReadFull(reader, header); err != nil || string(header[:len(cacheMagic)]) != cacheMagic {
+		return ErrNotACache
+	}
+	if version := binary.LittleEndian.Uint32(header[len(cacheMagic):]); version != cacheVersion {
+		return fmt.Errorf("%w: %d", ErrUnsupportedVersion, version)
+	}
+
+	offset := int64(len(header))
+	recordHeader := make([]byte, 8)
+	var payload []byte
+	for {
+		if _, err = io.ReadFull(reader, recordHeader); err != nil {
+			break
+		}
+		length := binary.LittleEndian.Uint32(recordHeader)
+		if length > maxRecordSize {
+			break
+		}
+		if cap(payload) < int(length) {
+			payload = make([]byte, length)
+		}
+		payload = payload[:length]
+		if _, err = io.ReadFull(reader, payload); err != nil {
+			break
+		}
+		if crc32.Checksum(payload, crcTable) != binary.LittleEndian.Uint32(recordHeader[4:]) {
+			logrus.Warnf("statcache: checksum mismatch at offset %d, ignoring the rest of the cache", offset)
+			break
+		}
+		k, e, ok := c.decode(payload, offset+int64(len(recordHeader)))
+		if !ok {
+			break
+		}
+		c.entries[k] = e
+		c.records++
+		offset += int64(len(recordHeader)) + int64(length)
+	}
+	if offset < info.Size() {
+		logrus.Warnf("statcache: dropping %d bytes of incomplete records at the end of the cache", info.Size()-offset)
+		return c.log.Truncate(offset)
+	}
+	return nil
+}
+
+// decode parses the payload of the record at `offset`.
+func (c *Cache) decode(payload []byte, offset int64) (key, *entry, bool) {
+	var k key
+	e := &entry{}
+	start := len(payload)
+	var n int
+	if k.dev, n = binary.Uvarint(payload); n <= 0 {
+		return k, nil, false
+	}
+	payload = payload[n:]
+	if k.inode, n = binary.Uvarint(payload); n <= 0 {
+		return k, nil, false
+	}
+	payload = payload[n:]
+	for _, field := range []*int64{&e.size, &e.modTime, &e.changeTime} {
+		if *field, n = binary.Varint(payload); n <= 0 {
+			return k, nil, false
+		}
+		payload = payload[n:]
+	}
+	if len(payload) < sha256.Size {
+		return k, nil, false
+	}
+	copy(e.hash[:], payload)
+	payload = payload[sha256.Size:]
+	optionsLength, n := binary.Uvarint(payload)
+	if n <= 0 || uint64(len(payload)-n) < optionsLength {
+		return k, nil, false
+	}
+	payload = payload[n:]
+	e.options = c.intern(string(payload[:optionsLength]))
+	payload = payload[optionsLength:]
+	e.offset, e.length = offset+int64(start-len(payload)), len(payload)
+	return k, e, true
+}
+
+func (c *Cache) intern(options string) string {
+	if interned, ok := c.options[options]; ok {
+		return interned
+	}
+	c.options[options] = options
+	return options
+}
+
+// append writes a record and points e at its metadata blob. The caller holds the mutex.
+func (c *Cache) append(k key, e *entry, metadata []byte) error {
+	payload := make([]byte, 0, 5*binary.MaxVarintLen64+sha256.Size+len(e.options)+len(metadata))
+	payload = binary.AppendUvarint(payload, k.dev)
+	payload = binary.AppendUvarint(payload, k.inode)
+	payload = binary.AppendVarint(payload, e.size)
+	payload = binary.AppendVarint(payload, e.modTime)
+	payload = binary.AppendVarint(payload, e.changeTime)
+	payload = append(payload, e.hash[:]...)
+	payload = binary.AppendUvarint(payload, uint64(len(e.options)))
+	payload = append(payload, e.options...)
+	payload = append(payload, metadata...)
+
+	record := make([]byte, 8, 8+len(payload))
+	binary.LittleEndian.PutUint32(record, uint32(len(payload)))
+	binary.LittleEndian.PutUint32(record[4:], crc32.Checksum(payload, crcTable))
+	record = append(record, payload...)
+
+	if _, err := c.log.Write(record); err != nil {
+		return err
+	}
+	// The log is opened for appending, so this is where our record ended even if another process appended meanwhile.
+	end, err := c.log.Seek(0, io.SeekCurrent)
+	if err != nil {
+		return err
+	}
+	e.offset, e.length = end-int64(len(metadata)), len(metadata)
+	c.records++
+	return nil
+}
+
+// compact rewrites the log with only the current records. The caller holds the log's lock.
+func (c *Cache) compact() error {
+	tmp, err := os.CreateTemp(filepath.Dir(c.log.Name()), cacheFile+".*.tmp")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(tmp.Name())
+	compacted := &Cache{log: tmp, entries: map[key]*entry{}, options: c.options}
+	if err = compacted.load(); err != nil {
+		_ = tmp.Close()
+		return err
+	}
+	for k, e := range c.entries {
+		metadata, err := c.metadata(e)
+		if err != nil {
+			_ = tmp.Close()
+			return err
+		}
+		copied := *e
+		if err = compacted.append(k, &copied, metadata); err != nil {
+			_ = tmp.Close()
+			return err
+		}
+		compacted.entries[k] = &copied
+	}
+	_ = tmp.Close()
+	if err = os.Rename(tmp.Name(), c.log.Name()); err != nil {
+		return err
+	}
+	// Reopen for appending, the blob offsets stay valid.
+	log, err := os.OpenFile(c.log.Name(), os.O_RDWR|os.O_APPEND, 0644)
+	if err != nil {
+		return err
+	}
+	logrus.Debugf("statcache: compacted %d records to %d", c.records, compacted.records)
+	_ = c.log.Close()
+	c.log, c.entries, c.records = log, compacted.entries, compacted.records
+	return nil
+}
+
+func (c *Cache) metadata(e *entry) ([]byte, error) {
+	if e.length == 0 {
+		return nil, nil
+	}
+	metadata := make([]byte, e.length)
+	_, err := c.log.ReadAt(metadata, e.offset)
+	return metadata, err
+}
+
+// result is what e knows about content probed with `options`. The caller holds the mutex.
+func (c *Cache) result(e *entry, options string) (Result, error) {
+	result := Result{Hash: hex.EncodeToString(e.hash[:])}
+	if e.options != options {
+		return result, nil
+	}
+	var err error
+	result.Metadata, err = c.metadata(e)
+	return result, err
+}
+
+// candidates are the entries for other inodes with the same size and mtime. The caller holds the mutex.
+func (c *Cache) candidates(k key, s stamp) []*entry {
+	if c.byStamp == nil {
+		c.byStamp = make(map[stamp][]*entry, len(c.entries))
+		for _, e := range c.entries {
+			c.byStamp[e.stamp] = append(c.byStamp[e.stamp], e)
+		}
+	}
+	var candidates []*entry
+	for _, e := range c.byStamp[s] {
+		if c.entries[k] != e {
+			candidates = append(candidates, e)
+		}
+	}
+	return candidates
+}
+
+// Lookup returns what is known about the content of the file at path, which info was stat'ed from. The file is only
+// read if it may have been renamed or moved: then its hash is compared to the cached one. A hash computed on the way is
+// returned even if nothing was cached, so the caller does not have to read the file again.
+func (c *Cache) Lookup(path string, info os.FileInfo, options util.FingerprintOptions) (Result, error) {
+	k, changeTime, ok := statKey(info)
+	if !ok {
+		return Result{}, nil
+	}
+	s := stamp{size: info.Size(), modTime: info.ModTime().UnixNano()}
+	optionsKey := optionsKey(options)
+
+	c.mutex.Lock()
+	e, found := c.entries[k]
+	if found && e.stamp == s && e.changeTime == changeTime {
+		defer c.mutex.Unlock()
+		return c.result(e, optionsKey)
+	}
+	var candidates []*entry
+	if found && e.stamp == s {
+		// Same inode and content stamp, only the ctime changed: renamed, chmod'ed or touched with the old mtime.
+		candidates = []*entry{e}
+	} else {
+		candidates = c.candidates(k, s)
+	}
+	generation := c.generation
+	c.mutex.Unlock()
+	if len(candidates) == 0 {
+		return Result{}, nil
+	}
+
+	hash, err := store.HashFile(path)
+	if err != nil {
+		return Result{}, err
+	}
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	if c.generation != generation {
+		// The log was reloaded meanwhile, the candidates' blobs are gone.
+		return Result{Hash: hash}, nil
+	}
+	for _, candidate := range candidates {
+		if hex.EncodeToString(candidate.hash[:]) != hash {
+			continue
+		}
+		// Remember the file under its new stat, so the next lookup does not hash it again.
+		metadata, err := c.metadata(candidate)
+		if err != nil {
+			return Result{}, err
+		}
+		moved := &entry{stamp: s, changeTime: changeTime, hash: candidate.hash, options: candidate.options}
+		if err = c.put(k, moved, metadata); err != nil {
+			return Result{}, err
+		}
+		return c.result(moved, optionsKey)
+	}
+	return Result{Hash: hash}, nil
+}
+
+// Cached reports whether the probe result of the file info was stat'ed from is cached with these options, so the file
+// does not need to be read. Unlike Lookup it never reads the file.
+func (c *Cache) Cached(info os.FileInfo, options util.FingerprintOptions) bool {
+	k, changeTime, ok := statKey(info)
+	if !ok {
+		return false
+	}
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	e, found := c.entries[k]
+	return found && e.size == info.Size() && e.modTime == info.ModTime().UnixNano() && e.changeTime == changeTime &&
+		e.options == optionsKey(options)
+}
+
+// Put remembers the content hash and metadata of the file info was stat'ed from before it was read.
+func (c *Cache) Put(info os.FileInfo, options util.FingerprintOptions, hash string, metadata []byte) error {
+	k, changeTime, ok := statKey(info)
+	if !ok {
+		return nil
+	}
+	e := &entry{
+		stamp:      stamp{size: info.Size(), modTime: info.ModTime().UnixNano()},
+		changeTime: changeTime,
+	}
+	if n, err := hex.Decode(e.hash[:], []byte(hash)); err != nil || n != sha256.Size {
+		return fmt.Errorf("statcache: invalid hash '%s'", hash)
+	}
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	e.options = c.intern(optionsKey(options))
+	return c.put(k, e, metadata)
+}
+
+// put appends e and replaces the entry of k. The caller holds the mutex.
+func (c *Cache) put(k key, e *entry, metadata []byte) error {
+	if err := c.lock(); err != nil {
+		return err
+	}
+	err := c.append(k, e, metadata)
+	if unlockErr := filelock.Unlock(c.log); err == nil {
+		err = unlockErr
+	}
+	if err != nil {
+		return err
+	}
+	if old, ok := c.entries[k]; ok && c.byStamp != nil {
+		list := c.byStamp[old.stamp]
+		for i, candidate := range list {
+			if candidate == old {
+				c.byStamp[old.stamp] = append(list[:i:i], list[i+1:]...)
+				break
+			}
+		}
+	}
+	c.entries[k] = e
+	if c.byStamp != nil {
+		c.byStamp[e.stamp] = append(c.byStamp[e.stamp], e)
+	}
+	return nil
+}
+
+// Probe returns a file's metadata, probing it through the native workers only if its content is not cached with
+// these options yet. The compressed metadata is returned as well.
+func (c *Cache) Probe(path string, options util.FingerprintOptions) (*types.FileMetadata, []byte, error) {
+	info, err := os.Stat(path)
+	if err != nil {
+		return nil, nil, err
+	}
+	result, err := c.Lookup(path, info, options)
+	if err != nil {
+		return nil, nil, err
+	}
+	if result.Metadata != nil {
+		var metadata types.FileMetadata
+		if err = util.UnmarshallCompressed(result.Metadata, &metadata); err == nil {
+			return &metadata, result.Metadata, nil
+		}
+		logrus.Warnf("statcache: ignoring unreadable metadata of '%s': %v", path, err)
+	}
+	if result.Hash == "" {
+		if result.Hash, err = store.HashFile(path); err != nil {
+			return nil, nil, err
+		}
+	}
+	metadata, err := util.GetMetadataFromFileWithOptions(path, options)
+	if err != nil {
+		return nil, nil, err
+	}
+	blob, err := util.MarshallCompressed(metadata)
+	if err != nil {
+		return nil, nil, err
+	}
+	if err = c.Put(info, options, result.Hash, blob); err != nil {
+		logrus.Warnf("statcache: could not remember '%s': %v", path, err)
+	}
+	return metadata, blob, nil
+}
+
+// Len is the number of cached files.
+func (c *Cache) Len() int {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	return len(c.entries)
+}
+
+func (c *Cache) Close() error {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	return c.log.Close()
+}
+
+// optionsKey identifies fingerprint options, metadata probed with other options is not reused.
+func optionsKey(options util.FingerprintOptions) string {
+	return fmt.Sprintf("%d/%s", options.Length, options.SecondWindow)
+}
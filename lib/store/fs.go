@@ -0,0 +1,363 @@
+package store
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+)
+
+// Dir is a local directory of objects: <dir>/<first two hex digits>/<key>, or in packs (see packs) if they are smaller
+// than `store.pack_threshold`. Writers hold <dir>/lock.
+type Dir struct {
+	dir   string
+	force bool
+	packs *packs
+
+	mu     sync.Mutex
+	locked bool
+}
+
+// Open opens a Dir with the packs configured in `store.*`.
+func Open(dir string) (*Dir, error) {
+	return OpenDir(dir, config.Config.GetInt64("store.pack_threshold"), config.Config.GetInt64("store.pack_size"))
+}
+
+// OpenDir opens a Dir which packs objects smaller than packThreshold into packs of up to packSize.
+func OpenDir(dir string, packThreshold, packSize int64) (*Dir, error) {
+	if err := os.MkdirAll(dir, 0755); err != nil {
+		return nil, err
+	}
+	return &Dir{dir: dir, force: config.Config.GetBool("store.force_lock"), packs: newPacks(dir, packThreshold, packSize)}, nil
+}
+
+// Path is where an object is stored.
+func (s *Dir) Path(key string) string {
+	if len(key) < 2 {
+		return filepath.Join(s.dir, key)
+	}
+	return filepath.Join(s.dir, key[:2], key)
+}
+
+// LocalPath is the file holding an object, for readers which need one of their own (e.g. the native tools). Packed
+// and spliced objects have none.
+func (s *Dir) LocalPath(key string) (string, bool) {
+	if _, ok, _ := s.packs.lookup(key); ok {
+		return "", false
+	}
+	path := s.Path(key)
+	_, err := os.Stat(path)
+	return path, err == nil
+}
+
+func (s *Dir) Has(key string) bool {
+	if _, ok, _ := s.packs.lookup(key); ok {
+		return true
+	}
+	if _, err := os.Stat(s.Path(key)); err == nil {
+		return true
+	}
+	_, err := os.Stat(s.recipePath(key))
+	return err == nil
+}
+
+// lock takes the write lock, unless this process holds it already.
+func (s *Dir) lock() error {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if s.locked {
+		return nil
+	}
+	path := filepath.Join(s.dir, lockName)
+	for {
+		file, err := os.OpenFile(path, os.O_WRONLY|os.O_CREATE|os.O_EXCL, 0644)
+		if err == nil {
+			_, err = file.WriteString(ownerID)
+			if err == nil {
+				err = file.Sync()
+			}
+			if closeErr := file.Close(); err == nil {
+				err = closeErr
+			}
+			if err != nil {
+				_ = os.Remove(path)
+				return err
+			}
+			s.locked = true
+			return nil
+		}
+		if !errors.Is(err, os.ErrExist) {
+			return err
+		}
+		holder, _ := os.ReadFile(path)
+		if !s.force {
+			return lockedError(holder)
+		}
+		logrus.Warnf("store: breaking the lock held by '%s'", holder)
+		s.force = false
+		if err = os.Remove(path); err != nil && !errors.Is(err, os.ErrNotExist) {
+			return err
+		}
+	}
+}
+
+// Put copies a file into the store. Objects below the pack threshold are appended to a pack and are durable after
+// Sync. Others are durable once Put returns: their content, their directory entry and a newly created prefix directory
+// are synced.
+func (s *Dir) Put(path string, key string) error {
+	if s.Has(key) {
+		return nil
+	}
+	if err := s.lock(); err != nil {
+		return err
+	}
+	source, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer source.Close()
+	info, err := source.Stat()
+	if err != nil {
+		return err
+	}
+	return s.put(source, info.Size(), key, path)
+}
+
+// put stores `size` bytes of source under key, as a loose object or into a pack. Called with the lock held.
+func (s *Dir) put(source io.ReaderAt, size int64, key, name string) error {
+	if s.packs.accepts(key, size) {
+		data, err := readVerified(source, size, key, name)
+		if err != nil {
+			return err
+		}
+		return s.packs.put(key, data)
+	}
+	target := s.Path(key)
+	_, err := os.Stat(filepath.Dir(target))
+	newPrefix := errors.Is(err, os.ErrNotExist)
+	if err = os.MkdirAll(filepath.Dir(target), 0755); err != nil {
+		return err
+	}
+	tmp, err := os.CreateTemp(filepath.Dir(target), key+".*.tmp")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(tmp.Name())
+
+	hash := sha256.New()
+	if _, err = io.Copy(io.MultiWriter(tmp, hash), io.NewSectionReader(source, 0, size)); err != nil {
+		_ = tmp.Close()
+		return err
+	}
+	if actual := hex.EncodeToString(hash.Sum(nil)); actual != key {
+		_ = tmp.Close()
+		return fmt.Errorf("%w: '%s'", ErrHashMismatch, name)
+	}
+	if err = tmp.Sync(); err != nil {
+		_ = tmp.Close()
+		return err
+	}
+	if err = tmp.Close(); err != nil {
+		return err
+	}
+	if err = os.Rename(tmp.Name(), target); err != nil {
+		return err
+	}
+	if err = syncDir(filepath.Dir(target)); err != nil {
+		return err
+	}
+	if newPrefix {
+		return syncDir(s.dir)
+	}
+	return nil
+}
+
+// syncDir makes the entries of a directory (e.g. a file renamed into it) durable.
+func syncDir(path string) error {
+	dir, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	err = dir.Sync()
+	if closeErr := dir.Close(); err == nil {
+		err = closeErr
+	}
+	return err
+}
+
+// recipePath is where the recipe of a spliced object is stored.
+func (s *Dir) recipePath(key string) string {
+	return s.Path(key) + recipeSuffix
+}
+
+func (s *Dir) PutSpliced(path string, key string, cuts []Cut) error {
+	if s.Has(key) {
+		return nil
+	}
+	if err := s.lock(); err != nil {
+		return err
+	}
+	recipe, err := splice(path, key, cuts, s.Has, s.put)
+	if err != nil {
+		return err
+	}
+	// The recipe must not refer to packed parts which a crash could lose.
+	if err = s.packs.sync(); err != nil {
+		return err
+	}
+	target := s.recipePath(key)
+	_, err = os.Stat(filepath.Dir(target))
+	newPrefix := errors.Is(err, os.ErrNotExist)
+	if err = os.MkdirAll(filepath.Dir(target), 0755); err != nil {
+		return err
+	}
+	tmp, err := os.CreateTemp(filepath.Dir(target), key+".*.tmp")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(tmp.Name())
+	if _, err = tmp.Write(recipe); err == nil {
+		err = tmp.Sync()
+	}
+	if closeErr := tmp.Close(); err == nil {
+		err = closeErr
+	}
+	if err != nil {
+		return err
+	}
+	if err = os.Rename(tmp.Name(), target); err != nil {
+		return err
+	}
+	if err = syncDir(filepath.Dir(target)); err != nil {
+		return err
+	}
+	if newPrefix {
+		return syncDir(s.dir)
+	}
+	return nil
+}
+
+type dirObject struct {
+	*os.File
+	size int64
+}
+
+func (o dirObject) Size() int64 {
+	return o.size
+}
+
+func (s *Dir) Open(key string) (Object, error) {
+	if r, ok, err := s.packs.lookup(key); err != nil {
+		return nil, err
+	} else if ok {
+		return s.packs.open(r)
+	}
+	file, err := os.Open(s.Path(key))
+	if errors.Is(err, os.ErrNotExist) {
+		recipe, recipeErr := os.ReadFile(s.recipePath(key))
+		if recipeErr == nil {
+			return openSpliced(recipe, s.Open)
+		}
+	}
+	if err != nil {
+		return nil, err
+	}
+	info, err := file.Stat()
+	if err != nil {
+		_ = file.Close()
+		return nil, err
+	}
+	return dirObject{File: file, size: info.Size()}, nil
+}
+
+// Sync syncs the packs. Objects of their own are durable before Put returns.
+func (s *Dir) Sync() error {
+	return s.packs.sync()
+}
+
+func (s *Dir) Close() error {
+	if err := s.packs.close(); err != nil {
+		return err
+	}
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if !s.locked {
+		return nil
+	}
+	s.locked = false
+	path := filepath.Join(s.dir, lockName)
+	// Only remove the lock if it was not broken by another writer meanwhile.
+	if holder, err := os.ReadFile(path); err != nil || !bytes.Equal(holder, []byte(ownerID)) {
+		if errors.Is(err, os.ErrNotExist) {
+			return nil
+		}
+		return err
+	}
+	return os.Remove(path)
+}
+
+// Walk calls fn for every object: the packed ones in the order they are stored, then the others by key. Packs are
+// read sequentially that way, e.g. to verify or back up the store. Spliced objects are walked as a whole, after (and
+// besides) their parts and body.
+func (s *Dir) Walk(fn func(key string, object Object) error) error {
+	records, err := s.packs.all()
+	if err != nil {
+		return err
+	}
+	for _, r := range records {
+		object, err := s.packs.open(r)
+		if err != nil {
+			return err
+		}
+		if err = fn(hex.EncodeToString(r.hash[:]), object); err != nil {
+			return err
+		}
+	}
+
+	prefixes, err := os.ReadDir(s.dir)
+	if err != nil {
+		return err
+	}
+	for _, prefix := range prefixes {
+		if !prefix.IsDir() || len(prefix.Name()) != 2 {
+			continue
+		}
+		entries, err := os.ReadDir(filepath.Join(s.dir, prefix.Name()))
+		if err != nil {
+			return err
+		}
+		names := make(map[string]bool, len(entries))
+		for _, entry := range entries {
+			names[entry.Name()] = true
+		}
+		for _, entry := range entries {
+			if !entry.Type().IsRegular() || strings.HasSuffix(entry.Name(), ".tmp") {
+				continue
+			}
+			// Spliced objects are opened by their key, so their recipe is followed. A plain copy would win anyway.
+			key := strings.TrimSuffix(entry.Name(), recipeSuffix)
+			if key != entry.Name() && names[key] {
+				continue
+			}
+			object, err := s.Open(key)
+			if err != nil {
+				return err
+			}
+			err = fn(key, object)
+			_ = object.Close()
+			if err != nil {
+				return err
+			}
+		}
+	}
+	return nil
+}
@@ -0,0 +1,24 @@
+package store
+
+import (
+	"crypto/rand"
+	"encoding/hex"
+	"fmt"
+	"os"
+)
+
+// lockName is the lock's name in a store, holding its writer's ownerID.
+const lockName = "lock"
+
+// ownerID identifies this process as a writer. The random part tells apart processes which reused a PID, e.g. after
+// a reboot.
+var ownerID = func() string {
+	host, _ := os.Hostname()
+	random := make([]byte, 8)
+	_, _ = rand.Read(random)
+	return fmt.Sprintf("%s:%d:%s", host, os.Getpid(), hex.EncodeToString(random))
+}()
+
+func lockedError(holder []byte) error {
+	return fmt.Errorf("%w: held by '%s' (set store.force_lock if it was not closed cleanly)", ErrLocked, holder)
+}
@@ -0,0 +1,446 @@
+package store
+
+import (
+	"encoding/binary"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// Small objects of a Dir are appended to pack files instead of getting a file each, which saves an inode, a directory
+// entry and a few syscalls per object, and turns a full scan into sequential reads:
+//
+//	<dir>/packs/<n>.pack  objects, concatenated. Only the last pack is appended to, the others are immutable.
+//	<dir>/packs/index     one fixed size record per object, appended on Sync after the packs were synced
+//
+// A crash loses at most the records of objects put since the last Sync; their bytes stay unreferenced in the pack.
+const (
+	packsDir  = "packs"
+	indexName = "index"
+	// recordSize is the size of an index record: SHA-256, pack number, length, offset, all little endian.
+	recordSize = 32 + 4 + 4 + 8
+)
+
+type packRecord struct {
+	hash   [32]byte
+	pack   uint32
+	length uint32
+	offset uint64
+}
+
+func (r *packRecord) marshal(b []byte) {
+	copy(b, r.hash[:])
+	binary.LittleEndian.PutUint32(b[32:], r.pack)
+	binary.LittleEndian.PutUint32(b[36:], r.length)
+	binary.LittleEndian.PutUint64(b[40:], r.offset)
+}
+
+func (r *packRecord) unmarshal(b []byte) {
+	copy(r.hash[:], b)
+	r.pack = binary.LittleEndian.Uint32(b[32:])
+	r.length = binary.LittleEndian.Uint32(b[36:])
+	r.offset = binary.LittleEndian.Uint64(b[40:])
+}
+
+func hashOf(key string) ([32]byte, bool) {
+	var hash [32]byte
+	if len(key) != 2*len(hash) {
+		return hash, false
+	}
+	_, err := hex.Decode(hash[:], []byte(key))
+	return hash, err == nil
+}
+
+// packs is the pack state of a Dir. The index is a sorted slice of the records loaded on first use, 48 bytes per
+// object, plus a map of the ones added since, by this process or (see refresh) by others.
+type packs struct {
+	dir       string
+	threshold int64
+	size      int64
+
+	mu     sync.RWMutex
+	loaded bool
+	sorted []packRecord
+	recent map[[32]byte]packRecord
+	// indexSize is how much of the index file was loaded, in whole records.
+	indexSize int64
+
+	// owned by the writer (mu held for writing)
+	current  *os.File
+	number   uint32
+	end      int64
+	index    *os.File
+	unsynced []packRecord
+
+	readersMu sync.Mutex
+	readers   map[uint32]*os.File
+}
+
+func newPacks(dir string, threshold, size int64) *packs {
+	return &packs{dir: filepath.Join(dir, packsDir), threshold: threshold, size: size,
+		recent: map[[32]byte]packRecord{}, readers: map[uint32]*os.File{}}
+}
+
+func (p *packs) packPath(number uint32) string {
+	return filepath.Join(p.dir, fmt.Sprintf("%08d.pack", number))
+}
+
+// load reads the index. Called with mu held for writing.
+func (p *packs) load() error {
+	if p.loaded {
+		return nil
+	}
+	data, err := os.ReadFile(filepath.Join(p.dir, indexName))
+	if err != nil && !errors.Is(err, os.ErrNotExist) {
+		return err
+	}
+	// A torn last record was not synced, so its object is not referenced anywhere yet.
+	records := make([]packRecord, len(data)/recordSize)
+	for i := range records {
+		records[i].unmarshal(data[i*recordSize:])
+	}
+	sort.Slice(records, func(i, j int) bool {
+		return string(records[i].hash[:]) < string(records[j].hash[:])
+	})
+	p.sorted, p.loaded = records, true
+	p.indexSize = int64(len(records) * recordSize)
+	return nil
+}
+
+// indexGrown reports whether records were appended to the index since it was loaded. Called with mu held.
+func (p *packs) indexGrown() (bool, error) {
+	info, err := os.Stat(filepath.Join(p.dir, indexName))
+	if errors.Is(err, os.ErrNotExist) {
+		return false, nil
+	}
+	if err != nil {
+		return false, err
+	}
+	return info.Size()-info.Size()%recordSize > p.indexSize, nil
+}
+
+// refresh loads the records appended to the index since it was loaded, e.g. by another process's sync. The index is
+// only ever appended to, so only its new tail is read. Called with mu held for writing.
+func (p *packs) refresh() error {
+	if !p.loaded {
+		return p.load()
+	}
+	info, err := os.Stat(filepath.Join(p.dir, indexName))
+	if errors.Is(err, os.ErrNotExist) {
+		return nil
+	}
+	if err != nil {
+		return err
+	}
+	size := info.Size() - info.Size()%recordSize
+	if size <= p.indexSize {
+		return nil
+	}
+	file, err := os.Open(filepath.Join(p.dir, indexName))
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+	data := make([]byte, size-p.indexSize)
+	if _, err = file.ReadAt(data, p.indexSize); err != nil {
+		return err
+	}
+	for i := 0; i+recordSize <= len(data); i += recordSize {
+		var r packRecord
+		r.unmarshal(data[i:])
+		// This process's own records are known already.
+		if _, ok := p.lookupLocked(r.hash); !ok {
+			p.recent[r.hash] = r
+		}
+	}
+	p.indexSize = size
+	return nil
+}
+
+func (p *packs) lookupLocked(hash [32]byte) (packRecord, bool) {
+	if r, ok := p.recent[hash]; ok {
+		return r, true
+	}
+	i := sort.Search(len(p.sorted), func(i int) bool { return string(p.sorted[i].hash[:]) >= string(hash[:]) })
+	if i < len(p.sorted) && p.sorted[i].hash == hash {
+		return p.sorted[i], true
+	}
+	return packRecord{}, false
+}
+
+func (p *packs) lookup(key string) (packRecord, bool, error) {
+	// Packs written with an earlier threshold are still read, so this does not depend on it.
+	hash, ok := hashOf(key)
+	if !ok {
+		return packRecord{}, false, nil
+	}
+	p.mu.RLock()
+	if p.loaded {
+		if r, ok := p.lookupLocked(hash); ok {
+			p.mu.RUnlock()
+			return r, true, nil
+		}
+		// Not known (yet). Another process may have packed it since, but misses are common (every Put of a new object
+		// asks first), so only reload if the index grew.
+		grown, err := p.indexGrown()
+		p.mu.RUnlock()
+		if err != nil || !grown {
+			return packRecord{}, false, err
+		}
+	} else {
+		p.mu.RUnlock()
+	}
+
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if err := p.refresh(); err != nil {
+		return packRecord{}, false, err
+	}
+	r, ok := p.lookupLocked(hash)
+	return r, ok, nil
+}
+
+// accepts reports whether an object goes into a pack.
+func (p *packs) accepts(key string, size int64) bool {
+	_, ok := hashOf(key)
+	return ok && size < p.threshold
+}
+
+// openCurrent opens the pack to append to: the last one, unless it is full. Called with mu held for writing.
+func (p *packs) openCurrent(incoming int64) error {
+	if p.current != nil && (p.end == 0 || p.end+incoming <= p.size) {
+		return nil
+	}
+	if p.current != nil {
+		// Full. Records are only written for synced bytes, so sync it before moving on.
+		if err := p.current.Sync(); err != nil {
+			return err
+		}
+		if err := p.current.Close(); err != nil {
+			return err
+		}
+		p.current = nil
+		p.number++
+	} else {
+		if err := os.MkdirAll(p.dir, 0755); err != nil {
+			return err
+		}
+		entries, err := os.ReadDir(p.dir)
+		if err != nil {
+			return err
+		}
+		for _, entry := range entries {
+			if name, ok := strings.CutSuffix(entry.Name(), ".pack"); ok {
+				if n, err := strconv.ParseUint(name, 10, 32); err == nil && uint32(n) > p.number {
+					p.number = uint32(n)
+				}
+			}
+		}
+	}
+	for {
+		file, err := os.OpenFile(p.packPath(p.number), os.O_RDWR|os.O_CREATE, 0644)
+		if err != nil {
+			return err
+		}
+		info, err := file.Stat()
+		if err != nil {
+			_ = file.Close()
+			return err
+		}
+		if info.Size() > 0 && info.Size()+incoming > p.size {
+			_ = file.Close()
+			p.number++
+			continue
+		}
+		p.current, p.end = file, info.Size()
+		break
+	}
+	if p.index == nil {
+		index, err := os.OpenFile(filepath.Join(p.dir, indexName), os.O_WRONLY|os.O_CREATE|os.O_APPEND, 0644)
+		if err != nil {
+			return err
+		}
+		// Drop a torn last record, so the ones appended next stay aligned.
+		info, err := index.Stat()
+		if err == nil && info.Size()%recordSize != 0 {
+			err = index.Truncate(info.Size() - info.Size()%recordSize)
+		}
+		if err != nil {
+			_ = index.Close()
+			return err
+		}
+		p.index = index
+	}
+	return nil
+}
+
+// put appends an object to the current pack. It is visible to this process right away, and to others after sync.
+func (p *packs) put(key string, data []byte) error {
+	hash, _ := hashOf(key)
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if err := p.load(); err != nil {
+		return err
+	}
+	if _, ok := p.lookupLocked(hash); ok {
+		return nil
+	}
+	if err := p.openCurrent(int64(len(data))); err != nil {
+		return err
+	}
+	if _, err := p.current.WriteAt(data, p.end); err != nil {
+		return err
+	}
+	r := packRecord{hash: hash, pack: p.number, length: uint32(len(data)), offset: uint64(p.end)}
+	p.end += int64(len(data))
+	p.recent[hash] = r
+	p.unsynced = append(p.unsynced, r)
+	return nil
+}
+
+// sync makes the objects put so far durable: their pack first, then their records.
+func (p *packs) sync() error {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if len(p.unsynced) == 0 {
+		return nil
+	}
+	if err := p.current.Sync(); err != nil {
+		return err
+	}
+	records := make([]byte, len(p.unsynced)*recordSize)
+	for i := range p.unsynced {
+		p.unsynced[i].marshal(records[i*recordSize:])
+	}
+	// If everything before them was loaded, the own records do not make the index look grown to lookup.
+	info, err := p.index.Stat()
+	if err != nil {
+		return err
+	}
+	if _, err = p.index.Write(records); err != nil {
+		return err
+	}
+	if info.Size() == p.indexSize {
+		p.indexSize += int64(len(records))
+	}
+	if err := p.index.Sync(); err != nil {
+		return err
+	}
+	p.unsynced = p.unsynced[:0]
+
+	// Merge the map into the slice once it grows, which keeps memory at 48 bytes per object during long imports.
+	if len(p.recent) >= 1<<16 && len(p.recent) >= len(p.sorted)/4 {
+		for _, r := range p.recent {
+			p.sorted = append(p.sorted, r)
+		}
+		sort.Slice(p.sorted, func(i, j int) bool {
+			return string(p.sorted[i].hash[:]) < string(p.sorted[j].hash[:])
+		})
+		p.recent = map[[32]byte]packRecord{}
+	}
+	return nil
+}
+
+// close syncs and closes the files written to, and the shared read descriptors. Objects opened from packs cannot be
+// read afterwards.
+func (p *packs) close() error {
+	err := p.sync()
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	for _, file := range []**os.File{&p.current, &p.index} {
+		if *file != nil {
+			if closeErr := (*file).Close(); err == nil {
+				err = closeErr
+			}
+			*file = nil
+		}
+	}
+	p.readersMu.Lock()
+	defer p.readersMu.Unlock()
+	for number, file := range p.readers {
+		if closeErr := file.Close(); err == nil {
+			err = closeErr
+		}
+		delete(p.readers, number)
+	}
+	return err
+}
+
+// reader returns a read only descriptor of a pack. They are opened once and shared, reads use pread.
+func (p *packs) reader(number uint32) (*os.File, error) {
+	p.readersMu.Lock()
+	defer p.readersMu.Unlock()
+	if file, ok := p.readers[number]; ok {
+		return file, nil
+	}
+	file, err := os.Open(p.packPath(number))
+	if err != nil {
+		return nil, err
+	}
+	p.readers[number] = file
+	return file, nil
+}
+
+func (p *packs) open(r packRecord) (Object, error) {
+	file, err := p.reader(r.pack)
+	if err != nil {
+		return nil, err
+	}
+	return packObject{file: file, offset: int64(r.offset), size: int64(r.length)}, nil
+}
+
+// all returns every record, in pack order.
+func (p *packs) all() ([]packRecord, error) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if err := p.refresh(); err != nil {
+		return nil, err
+	}
+	records := append([]packRecord(nil), p.sorted...)
+	for _, r := range p.recent {
+		records = append(records, r)
+	}
+	sort.Slice(records, func(i, j int) bool {
+		if records[i].pack != records[j].pack {
+			return records[i].pack < records[j].pack
+		}
+		return records[i].offset < records[j].offset
+	})
+	return records, nil
+}
+
+// packObject is an object in a pack. Closing it keeps the shared descriptor open.
+type packObject struct {
+	file   *os.File
+	offset int64
+	size   int64
+}
+
+func (o packObject) Size() int64 {
+	return o.size
+}
+
+func (o packObject) ReadAt(b []byte, off int64) (int, error) {
+	if off >= o.size {
+		return 0, io.EOF
+	}
+	if remaining := o.size - off; int64(len(b)) > remaining {
+		n, err := o.file.ReadAt(b[:remaining], o.offset+off)
+		if err == nil {
+			err = io.EOF
+		}
+		return n, err
+	}
+	return o.file.ReadAt(b, o.offset+off)
+}
+
+func (o packObject) Close() error {
+	return nil
+}
@@ -0,0 +1,510 @@
+package store
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"io"
+	"net/http"
+	"net/url"
+	"os"
+	"sort"
+	"sync"
+	"time"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+)
+
+// S3Options configure an S3 store.
+type S3Options struct {
+	// Endpoint is the server's base URL, e.g. https://s3.eu-central-1.amazonaws.com or http://127.0.0.1:9000.
+	Endpoint string
+	Bucket   string
+	// Prefix is prepended to every key, so several stores can share a bucket.
+	Prefix string
+	Region string
+	// PathStyle addresses the bucket in the path instead of the host name, which most self-hosted servers need.
+	PathStyle bool
+	// Credentials, empty for anonymous requests.
+	AccessKey string
+	SecretKey string
+	// PartSize is the size of a multipart upload's parts, at least 5 MiB. Smaller objects are uploaded at once.
+	PartSize int64
+	// Uploads is the number of parts of one object uploaded concurrently. Each of them holds a PartSize buffer.
+	Uploads int
+	// BlockSize aligns ranged reads, so a slice of an object costs one request per block at most.
+	BlockSize int64
+	// Objects smaller than PackThreshold are coalesced into packs of about PackSize, 0 disables packing.
+	PackThreshold int64
+	PackSize      int64
+	// Retries is the number of times a failed or throttled request is sent again.
+	Retries int
+	// ForceLock breaks another writer's lock, after it was not closed cleanly.
+	ForceLock bool
+}
+
+// S3OptionsFromConfig returns the options set in `store.s3.*`. Credentials default to the AWS_ACCESS_KEY_ID and
+// AWS_SECRET_ACCESS_KEY environment variables.
+func S3OptionsFromConfig() S3Options {
+	options := S3Options{
+		Endpoint:      config.Config.GetString("store.s3.endpoint"),
+		Bucket:        config.Config.GetString("store.s3.bucket"),
+		Prefix:        config.Config.GetString("store.s3.prefix"),
+		Region:        config.Config.GetString("store.s3.region"),
+		PathStyle:     config.Config.GetBool("store.s3.path_style"),
+		AccessKey:     config.Config.GetString("store.s3.access_key"),
+		SecretKey:     config.Config.GetString("store.s3.secret_key"),
+		PartSize:      config.Config.GetInt64("store.s3.part_size"),
+		Uploads:       config.Config.GetInt("store.s3.uploads"),
+		BlockSize:     config.Config.GetInt64("store.s3.block_size"),
+		PackThreshold: config.Config.GetInt64("store.s3.pack_threshold"),
+		PackSize:      config.Config.GetInt64("store.s3.pack_size"),
+		Retries:       config.Config.GetInt("store.s3.retries"),
+		ForceLock:     config.Config.GetBool("store.force_lock"),
+	}
+	if options.AccessKey == "" {
+		options.AccessKey, options.SecretKey = os.Getenv("AWS_ACCESS_KEY_ID"), os.Getenv("AWS_SECRET_ACCESS_KEY")
+	}
+	return options
+}
+
+// S3 is a store in an S3 compatible bucket:
+//
+//	<prefix>objects/<key>     objects of PackThreshold and more
+//	<prefix>packs/<name>      small objects, concatenated
+//	<prefix>packs/<name>.idx  "<key> <offset> <length>" per line, written after its pack
+//	<key>.recipe              the recipe of a spliced object (see Cut), packed, or next to objects if packs are off
+//	<prefix>lock              the writer's ID, created only if it does not exist yet
+//
+// Small objects are buffered until their pack is full or Sync is called.
+type S3 struct {
+	client  *s3Client
+	options S3Options
+	// known maps keys of objects outside of packs which exist to their size, which spares HEAD requests.
+	known sync.Map
+
+	lockMu sync.Mutex
+	locked bool
+
+	packMu sync.Mutex
+	// pending is the pack being filled, with the entries of its objects (without a pack name yet).
+	pending        []byte
+	pendingEntries map[string]packEntry
+	// index locates the objects of all uploaded packs. It is loaded on first use.
+	index       map[string]packEntry
+	indexLoaded bool
+}
+
+type packEntry struct {
+	pack           string
+	offset, length int64
+}
+
+func OpenS3(options S3Options) (*S3, error) {
+	if options.Endpoint == "" || options.Bucket == "" {
+		return nil, errors.New("store.s3.endpoint and store.s3.bucket have to be set")
+	}
+	endpoint, err := url.Parse(options.Endpoint)
+	if err != nil {
+		return nil, err
+	}
+	if options.Region == "" {
+		options.Region = "us-east-1"
+	}
+	if options.PartSize < 5<<20 {
+		options.PartSize = 5 << 20
+	}
+	if options.Uploads <= 0 {
+		options.Uploads = 1
+	}
+	if options.BlockSize <= 0 {
+		options.BlockSize = 1 << 20
+	}
+	client := &s3Client{
+		http: &http.Client{Transport: &http.Transport{
+			Proxy:               http.ProxyFromEnvironment,
+			MaxIdleConnsPerHost: 64,
+			IdleConnTimeout:     90 * time.Second,
+		}},
+		endpoint:  endpoint,
+		bucket:    options.Bucket,
+		pathStyle: options.PathStyle,
+		region:    options.Region,
+		accessKey: options.AccessKey,
+		secretKey: options.SecretKey,
+		retries:   options.Retries,
+	}
+	return &S3{client: client, options: options, pendingEntries: map[string]packEntry{}}, nil
+}
+
+// Requests returns the number of requests sent so far.
+func (s *S3) Requests() int64 {
+	return s.client.requests.Load()
+}
+
+func (s *S3) objectKey(key string) string {
+	return s.options.Prefix + "objects/" + key
+}
+
+func (s *S3) packKey(name string) string {
+	return s.options.Prefix + "packs/" + name
+}
+
+func (s *S3) Has(key string) bool {
+	if _, ok := s.known.Load(key); ok {
+		return true
+	}
+	if _, ok, _ := s.packed(key); ok {
+		return true
+	}
+	if _, ok, _ := s.packed(key + recipeSuffix); ok {
+		return true
+	}
+	size, err := s.client.head(s.objectKey(key))
+	if err != nil {
+		if s.options.PackThreshold <= 0 {
+			_, ok, _ := s.recipe(key)
+			return ok
+		}
+		return false
+	}
+	s.known.Store(key, size)
+	return true
+}
+
+// lock creates the lock object, unless this process holds it already. Servers which do not support conditional
+// writes (If-None-Match) silently replace another writer's lock.
+func (s *S3) lock() error {
+	s.lockMu.Lock()
+	defer s.lockMu.Unlock()
+	if s.locked {
+		return nil
+	}
+	key := s.options.Prefix + lockName
+	err := s.client.put(key, []byte(ownerID), http.Header{"If-None-Match": {"*"}})
+	var s3err *s3Error
+	if errors.As(err, &s3err) && (s3err.Status == http.StatusPreconditionFailed || s3err.Status == http.StatusConflict) {
+		holder, getErr := s.client.get(key, nil)
+		switch {
+		case getErr != nil:
+			return getErr
+		case string(holder) == ownerID:
+			err = nil
+		case s.options.ForceLock:
+			logrus.Warnf("store: breaking the lock held by '%s'", holder)
+			err = s.client.put(key, []byte(ownerID), nil)
+		default:
+			return lockedError(holder)
+		}
+	}
+	if err != nil {
+		return err
+	}
+	s.locked = true
+	return nil
+}
+
+func (s *S3) Put(path string, key string) error {
+	source, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer source.Close()
+	info, err := source.Stat()
+	if err != nil {
+		return err
+	}
+	size := info.Size()
+	// Small objects are only ever packed, so looking them up in the index suffices.
+	if size < s.options.PackThreshold {
+		if _, ok, err := s.packed(key); err != nil || ok {
+			return err
+		}
+	} else if s.Has(key) {
+		return nil
+	}
+	if err = s.lock(); err != nil {
+		return err
+	}
+	return s.put(source, size, key, path)
+}
+
+// put uploads `size` bytes of source under key, or adds them to the pending pack. Called with the lock held.
+func (s *S3) put(source io.ReaderAt, size int64, key, name string) error {
+	switch {
+	case size < s.options.PackThreshold:
+		data, err := readVerified(source, size, key, name)
+		if err != nil {
+			return err
+		}
+		return s.addToPack(key, data)
+	case size <= s.options.PartSize:
+		data, err := readVerified(source, size, key, name)
+		if err != nil {
+			return err
+		}
+		if err = s.client.put(s.objectKey(key), data, nil); err != nil {
+			return err
+		}
+	default:
+		if err := s.putMultipart(io.NewSectionReader(source, 0, size), key, name); err != nil {
+			return err
+		}
+	}
+	s.known.Store(key, size)
+	return nil
+}
+
+// PutSpliced uploads the parts and body first. The recipe goes into the pending pack, which is uploaded after the
+// parts it may hold, or is an object of its own next to the object it describes if packs are disabled.
+func (s *S3) PutSpliced(path string, key string, cuts []Cut) error {
+	if s.Has(key) {
+		return nil
+	}
+	if err := s.lock(); err != nil {
+		return err
+	}
+	recipe, err := splice(path, key, cuts, s.Has, s.put)
+	if err != nil {
+		return err
+	}
+	if s.options.PackThreshold > 0 {
+		return s.addToPack(key+recipeSuffix, recipe)
+	}
+	return s.client.put(s.objectKey(key)+recipeSuffix, recipe, nil)
+}
+
+// recipe fetches the recipe of a spliced object, if key is one.
+func (s *S3) recipe(key string) ([]byte, bool, error) {
+	if s.options.PackThreshold > 0 {
+		entry, ok, err := s.packed(key + recipeSuffix)
+		if err != nil || !ok {
+			return nil, false, err
+		}
+		var object Object
+		if entry.pack == "" {
+			object, err = s.pendingObject(key + recipeSuffix)
+		} else {
+			object = &s3Object{s: s, key: s.packKey(entry.pack), base: entry.offset, size: entry.length}
+		}
+		if err != nil {
+			return nil, false, err
+		}
+		defer object.Close()
+		recipe := make([]byte, object.Size())
+		if _, err = object.ReadAt(recipe, 0); err != nil && err != io.EOF {
+			return nil, false, err
+		}
+		return recipe, true, nil
+	}
+	recipe, err := s.client.get(s.objectKey(key)+recipeSuffix, nil)
+	if errors.Is(err, os.ErrNotExist) {
+		return nil, false, nil
+	}
+	return recipe, err == nil, err
+}
+
+// putMultipart uploads a file in parts, at most Uploads of them at a time. The next part is read and hashed while the
+// previous ones are in flight; the upload is only completed if the whole file matches key.
+func (s *S3) putMultipart(source io.Reader, key, name string) error {
+	upload, err := s.client.createMultipart(s.objectKey(key))
+	if err != nil {
+		return err
+	}
+
+	// Free buffers; taking one blocks while Uploads parts are in flight.
+	buffers := make(chan []byte, s.options.Uploads)
+	for i := 0; i < s.options.Uploads; i++ {
+		buffers <- nil
+	}
+	var (
+		wg       sync.WaitGroup
+		mu       sync.Mutex
+		parts    []completedPart
+		firstErr error
+	)
+	fail := func(err error) {
+		mu.Lock()
+		if firstErr == nil {
+			firstErr = err
+		}
+		mu.Unlock()
+	}
+	failed := func() bool {
+		mu.Lock()
+		defer mu.Unlock()
+		return firstErr != nil
+	}
+
+	hash := sha256.New()
+	for number := 1; !failed(); number++ {
+		buffer := <-buffers
+		if buffer == nil {
+			buffer = make([]byte, s.options.PartSize)
+		}
+		n, err := io.ReadFull(source, buffer)
+		if n == 0 {
+			buffers <- buffer
+			if err != io.EOF {
+				fail(err)
+			}
+			break
+		}
+		if err != nil && err != io.ErrUnexpectedEOF {
+			buffers <- buffer
+			fail(err)
+			break
+		}
+		hash.Write(buffer[:n])
+		wg.Add(1)
+		go func(number int, buffer []byte, n int) {
+			defer wg.Done()
+			defer func() { buffers <- buffer }()
+			if failed() {
+				return
+			}
+			part, err := upload.upload(number, buffer[:n])
+			if err != nil {
+				fail(err)
+				return
+			}
+			mu.Lock()
+			parts = append(parts, part)
+			mu.Unlock()
+		}(number, buffer, n)
+		if n < len(buffer) {
+			break
+		}
+	}
+	wg.Wait()
+
+	if firstErr == nil && hex.EncodeToString(hash.Sum(nil)) != key {
+		firstErr = fmt.Errorf("%w: '%s'", ErrHashMismatch, name)
+	}
+	if firstErr == nil {
+		sort.Slice(parts, func(i, j int) bool { return parts[i].PartNumber < parts[j].PartNumber })
+		firstErr = upload.complete(parts)
+	}
+	if firstErr != nil {
+		if err := upload.abort(); err != nil {
+			logrus.Warnf("store: could not abort the upload of '%s': %v", key, err)
+		}
+	}
+	return firstErr
+}
+
+func (s *S3) Open(key string) (Object, error) {
+	entry, ok, err := s.packed(key)
+	if err != nil {
+		return nil, err
+	}
+	if ok {
+		if entry.pack == "" {
+			return s.pendingObject(key)
+		}
+		return &s3Object{s: s, key: s.packKey(entry.pack), base: entry.offset, size: entry.length}, nil
+	}
+	size, ok := s.known.Load(key)
+	if !ok {
+		if size, err = s.client.head(s.objectKey(key)); err != nil {
+			if recipe, ok, recipeErr := s.recipe(key); recipeErr == nil && ok {
+				return openSpliced(recipe, s.Open)
+			}
+			return nil, err
+		}
+		s.known.Store(key, size)
+	}
+	return &s3Object{s: s, key: s.objectKey(key), size: size.(int64)}, nil
+}
+
+func (s *S3) Sync() error {
+	s.packMu.Lock()
+	defer s.packMu.Unlock()
+	return s.flushPack()
+}
+
+func (s *S3) Close() error {
+	err := s.Sync()
+	s.lockMu.Lock()
+	defer s.lockMu.Unlock()
+	if !s.locked {
+		return err
+	}
+	s.locked = false
+	key := s.options.Prefix + lockName
+	// Only remove the lock if it was not broken by another writer meanwhile.
+	holder, getErr := s.client.get(key, nil)
+	if getErr != nil || string(holder) != ownerID {
+		if err == nil && !errors.Is(getErr, os.ErrNotExist) {
+			err = getErr
+		}
+		return err
+	}
+	if deleteErr := s.client.delete(key); err == nil {
+		err = deleteErr
+	}
+	return err
+}
+
+// s3Object reads an object (or an object's range of a pack) with ranged GETs aligned to BlockSize. The blocks of the
+// last read are kept, so sequential small reads cost one request per block.
+type s3Object struct {
+	s          *S3
+	key        string
+	base, size int64
+
+	mu sync.Mutex
+	// cached holds the object's bytes from cachedAt.
+	cached   []byte
+	cachedAt int64
+}
+
+func (o *s3Object) Size() int64 {
+	return o.size
+}
+
+func (o *s3Object) ReadAt(p []byte, off int64) (int, error) {
+	if off < 0 {
+		return 0, errors.New("negative offset")
+	}
+	if off >= o.size {
+		return 0, io.EOF
+	}
+	end := off + int64(len(p))
+	if end > o.size {
+		end = o.size
+	}
+
+	o.mu.Lock()
+	defer o.mu.Unlock()
+	if off < o.cachedAt || end > o.cachedAt+int64(len(o.cached)) {
+		block := o.s.options.BlockSize
+		from := off / block * block
+		to := (end + block - 1) / block * block
+		if to > o.size {
+			to = o.size
+		}
+		data, err := o.s.client.getRange(o.key, o.base+from, to-from)
+		if err != nil {
+			return 0, err
+		}
+		if int64(len(data)) != to-from {
+			return 0, io.ErrUnexpectedEOF
+		}
+		o.cached, o.cachedAt = data, from
+	}
+	n := copy(p, o.cached[off-o.cachedAt:end-o.cachedAt])
+	if n < len(p) {
+		return n, io.EOF
+	}
+	return n, nil
+}
+
+func (o *s3Object) Close() error {
+	o.mu.Lock()
+	o.cached = nil
+	o.mu.Unlock()
+	return nil
+}
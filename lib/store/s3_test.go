@@ -0,0 +1,192 @@
+package store
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"io"
+	"math/rand"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"testing"
+
+	"gitlab.com/t4cc0re/audiofs/internal/s3test"
+)
+
+func openTestS3(t *testing.T, stub *s3test.Server, packThreshold int64) *S3 {
+	t.Helper()
+	server := httptest.NewServer(stub)
+	t.Cleanup(server.Close)
+	s, err := OpenS3(S3Options{Endpoint: server.URL, Bucket: "test", Prefix: "audio/", PathStyle: true,
+		Uploads: 3, BlockSize: 4096, PackThreshold: packThreshold, PackSize: 1 << 20})
+	if err != nil {
+		t.Fatal(err)
+	}
+	return s
+}
+
+// writeTestFile writes content to a file in dir, and returns its path and key.
+func writeTestFile(t *testing.T, dir, name string, content []byte) (string, string) {
+	t.Helper()
+	path := filepath.Join(dir, name)
+	if err := os.WriteFile(path, content, 0644); err != nil {
+		t.Fatal(err)
+	}
+	sum := sha256.Sum256(content)
+	return path, hex.EncodeToString(sum[:])
+}
+
+func randomBytes(random *rand.Rand, size int) []byte {
+	data := make([]byte, size)
+	random.Read(data)
+	return data
+}
+
+// checkObject reads an object whole and in small ranges at random offsets, which cross BlockSize boundaries, and
+// compares it with want.
+func checkObject(t *testing.T, s Store, key string, want []byte) {
+	t.Helper()
+	object, err := s.Open(key)
+	if err != nil {
+		t.Fatalf("open %s: %v", key, err)
+	}
+	defer object.Close()
+	if object.Size() != int64(len(want)) {
+		t.Fatalf("%s: size %d, want %d", key, object.Size(), len(want))
+	}
+	got := make([]byte, len(want))
+	if _, err = object.ReadAt(got, 0); err != nil && err != io.EOF {
+		t.Fatalf("read %s: %v", key, err)
+	}
+	if !bytes.Equal(got, want) {
+		t.Fatalf("%s: content differs", key)
+	}
+	random := rand.New(rand.NewSource(int64(len(want))))
+	for i := 0; i < 20 && len(want) > 0; i++ {
+		off := random.Intn(len(want))
+		chunk := make([]byte, 1+random.Intn(10000))
+		n, err := object.ReadAt(chunk, int64(off))
+		if err != nil && err != io.EOF {
+			t.Fatalf("read %s at %d: %v", key, off, err)
+		}
+		if !bytes.Equal(chunk[:n], want[off:off+n]) || (n < len(chunk) && off+n != len(want)) {
+			t.Fatalf("%s: %d bytes at %d differ", key, len(chunk), off)
+		}
+	}
+}
+
+func TestS3PutOpen(t *testing.T) {
+	random := rand.New(rand.NewSource(1))
+	dir := t.TempDir()
+	stub := s3test.New()
+	s := openTestS3(t, stub, 64<<10)
+
+	// Packed, a single PUT, and multipart with a short last part
+	contents := map[string][]byte{}
+	for i, size := range []int{0, 1, 1000, 64<<10 - 1, 64 << 10, 300 << 10, 11<<20 + 12345} {
+		path, key := writeTestFile(t, dir, strconv.Itoa(i), randomBytes(random, size))
+		if err := s.Put(path, key); err != nil {
+			t.Fatalf("put %d bytes: %v", size, err)
+		}
+		contents[key], _ = os.ReadFile(path)
+	}
+	for key, content := range contents {
+		if !s.Has(key) {
+			t.Fatalf("%s (%d bytes) missing", key, len(content))
+		}
+		checkObject(t, s, key, content)
+	}
+	if err := s.Close(); err != nil {
+		t.Fatal(err)
+	}
+	if len(stub.Keys("audio/lock")) != 0 {
+		t.Fatal("lock left behind")
+	}
+	if len(stub.Keys("audio/packs/")) != 2 {
+		t.Fatalf("packs: %v, want one pack and its index", stub.Keys("audio/packs/"))
+	}
+
+	// Another process finds the packed objects through the index.
+	other := openTestS3(t, stub, 64<<10)
+	for key, content := range contents {
+		if !other.Has(key) {
+			t.Fatalf("%s (%d bytes) missing after reopening", key, len(content))
+		}
+		checkObject(t, other, key, content)
+	}
+	if other.Has(strings.Repeat("0", 64)) {
+		t.Fatal("found an object never put")
+	}
+}
+
+func TestS3Spliced(t *testing.T) {
+	for _, packThreshold := range []int64{0, 64 << 10} {
+		t.Run(fmt.Sprintf("threshold %d", packThreshold), func(t *testing.T) {
+			random := rand.New(rand.NewSource(2))
+			dir := t.TempDir()
+			stub := s3test.New()
+			s := openTestS3(t, stub, packThreshold)
+
+			// Two files sharing a range, like the cover art of an album's tracks
+			shared := randomBytes(random, 100<<10)
+			sum := sha256.Sum256(shared)
+			sharedKey := hex.EncodeToString(sum[:])
+			contents := map[string][]byte{}
+			for i, head := range []int{4096, 10000} {
+				content := append(randomBytes(random, head), shared...)
+				content = append(content, randomBytes(random, 200<<10)...)
+				path, key := writeTestFile(t, dir, strconv.Itoa(i), content)
+				if err := s.PutSpliced(path, key, []Cut{{Offset: int64(head), Size: int64(len(shared)), Key: sharedKey}}); err != nil {
+					t.Fatal(err)
+				}
+				contents[key] = content
+				checkObject(t, s, key, content)
+			}
+			if err := s.Close(); err != nil {
+				t.Fatal(err)
+			}
+			// Two bodies and the part, the recipes are packed or next to them.
+			want := 3
+			if packThreshold == 0 {
+				want += 2
+			}
+			if objects := stub.Keys("audio/objects/"); len(objects) != want {
+				t.Fatalf("objects: %v, want %d", objects, want)
+			}
+
+			other := openTestS3(t, stub, packThreshold)
+			for key, content := range contents {
+				if !other.Has(key) {
+					t.Fatalf("%s missing after reopening", key)
+				}
+				checkObject(t, other, key, content)
+			}
+		})
+	}
+}
+
+func TestS3MultipartHashMismatch(t *testing.T) {
+	dir := t.TempDir()
+	stub := s3test.New()
+	s := openTestS3(t, stub, 0)
+	path, _ := writeTestFile(t, dir, "changed", randomBytes(rand.New(rand.NewSource(3)), 12<<20))
+	key := strings.Repeat("ab", 32)
+
+	if err := s.Put(path, key); !errors.Is(err, ErrHashMismatch) {
+		t.Fatalf("put: %v, want %v", err, ErrHashMismatch)
+	}
+	if stub.Aborted() != 1 || stub.Uploads() != 0 {
+		t.Fatalf("%d uploads aborted, %d left", stub.Aborted(), stub.Uploads())
+	}
+	if s.Has(key) || len(stub.Keys("audio/objects/")) != 0 {
+		t.Fatal("object stored despite the mismatch")
+	}
+	if err := s.Close(); err != nil {
+		t.Fatal(err)
+	}
+}
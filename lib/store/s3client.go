@@ -0,0 +1,336 @@
+package store
+
+import (
+	"bytes"
+	"crypto/hmac"
+	"crypto/sha256"
+	"encoding/hex"
+	"encoding/xml"
+	"errors"
+	"fmt"
+	"io"
+	"net/http"
+	"net/url"
+	"os"
+	"sort"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+// s3Client is the subset of the S3 API the store needs, signed with AWS Signature Version 4. Bodies are not signed
+// (UNSIGNED-PAYLOAD), their integrity is checked by the store's content hashes.
+type s3Client struct {
+	http      *http.Client
+	endpoint  *url.URL
+	bucket    string
+	pathStyle bool
+	region    string
+	accessKey string
+	secretKey string
+	retries   int
+	// requests counts the requests sent, retries included.
+	requests atomic.Int64
+}
+
+// s3Error is a response other than 2xx.
+type s3Error struct {
+	Status  int
+	Code    string `xml:"Code"`
+	Message string `xml:"Message"`
+}
+
+func (e *s3Error) Error() string {
+	return fmt.Sprintf("s3: %d %s: %s", e.Status, e.Code, e.Message)
+}
+
+func (e *s3Error) Is(target error) bool {
+	return target == os.ErrNotExist && e.Status == http.StatusNotFound
+}
+
+// retryable reports whether a request may succeed when sent again.
+func (e *s3Error) retryable() bool {
+	return e.Status >= 500 || e.Status == http.StatusTooManyRequests || e.Code == "SlowDown"
+}
+
+// url returns the URL of a key, or of the bucket if key is "".
+func (c *s3Client) url(key string, query url.Values) *url.URL {
+	u := *c.endpoint
+	path := "/" + key
+	if c.pathStyle {
+		path = "/" + c.bucket + path
+	} else {
+		u.Host = c.bucket + "." + u.Host
+	}
+	u.Path = path
+	u.RawPath = escapePath(path)
+	u.RawQuery = canonicalQuery(query)
+	return &u
+}
+
+// escape percent encodes everything but RFC 3986's unreserved characters, as SigV4 requires.
+func escape(s string, keepSlash bool) string {
+	var b strings.Builder
+	for i := 0; i < len(s); i++ {
+		c := s[i]
+		if 'A' <= c && c <= 'Z' || 'a' <= c && c <= 'z' || '0' <= c && c <= '9' || c == '-' || c == '_' ||
+			c == '.' || c == '~' || c == '/' && keepSlash {
+			b.WriteByte(c)
+		} else {
+			fmt.Fprintf(&b, "%%%02X", c)
+		}
+	}
+	return b.String()
+}
+
+func escapePath(path string) string {
+	return escape(path, true)
+}
+
+func canonicalQuery(query url.Values) string {
+	keys := make([]string, 0, len(query))
+	for key := range query {
+		keys = append(keys, key)
+	}
+	sort.Strings(keys)
+	var parts []string
+	for _, key := range keys {
+		for _, value := range query[key] {
+			parts = append(parts, escape(key, false)+"="+escape(value, false))
+		}
+	}
+	return strings.Join(parts, "&")
+}
+
+func hmacSHA256(key []byte, data string) []byte {
+	mac := hmac.New(sha256.New, key)
+	mac.Write([]byte(data))
+	return mac.Sum(nil)
+}
+
+// sign adds the SigV4 headers. Requests without credentials are sent anonymously.
+func (c *s3Client) sign(req *http.Request, now time.Time) {
+	const payload = "UNSIGNED-PAYLOAD"
+	stamp := now.UTC().Format("20060102T150405Z")
+	req.Header.Set("x-amz-date", stamp)
+	req.Header.Set("x-amz-content-sha256", payload)
+	if c.accessKey == "" {
+		return
+	}
+
+	signed := []string{"host", "x-amz-content-sha256", "x-amz-date"}
+	for name := range req.Header {
+		if name = strings.ToLower(name); name == "if-none-match" || name == "range" {
+			signed = append(signed, name)
+		}
+	}
+	sort.Strings(signed)
+	var headers strings.Builder
+	for _, name := range signed {
+		value := req.Header.Get(name)
+		if name == "host" {
+			value = req.URL.Host
+		}
+		headers.WriteString(name + ":" + strings.TrimSpace(value) + "\n")
+	}
+	canonical := strings.Join([]string{req.Method, req.URL.EscapedPath(), req.URL.RawQuery, headers.String(),
+		strings.Join(signed, ";"), payload}, "\n")
+	digest := sha256.Sum256([]byte(canonical))
+
+	scope := stamp[:8] + "/" + c.region + "/s3/aws4_request"
+	toSign := "AWS4-HMAC-SHA256\n" + stamp + "\n" + scope + "\n" + hex.EncodeToString(digest[:])
+	key := hmacSHA256([]byte("AWS4"+c.secretKey), stamp[:8])
+	key = hmacSHA256(key, c.region)
+	key = hmacSHA256(key, "s3")
+	key = hmacSHA256(key, "aws4_request")
+	req.Header.Set("Authorization", fmt.Sprintf("AWS4-HMAC-SHA256 Credential=%s/%s, SignedHeaders=%s, Signature=%s",
+		c.accessKey, scope, strings.Join(signed, ";"), hex.EncodeToString(hmacSHA256(key, toSign))))
+}
+
+// do sends a request, retrying throttled and failed ones with exponential backoff. The body is held in memory, so it
+// can be sent again. A response other than 2xx is returned as *s3Error, with its body closed.
+func (c *s3Client) do(method, key string, query url.Values, header http.Header, body []byte) (*http.Response, error) {
+	backoff := 100 * time.Millisecond
+	for attempt := 0; ; attempt++ {
+		req, err := http.NewRequest(method, c.url(key, query).String(), bytes.NewReader(body))
+		if err != nil {
+			return nil, err
+		}
+		req.ContentLength = int64(len(body))
+		for name, values := range header {
+			req.Header[name] = values
+		}
+		c.sign(req, time.Now())
+		c.requests.Add(1)
+
+		resp, err := c.http.Do(req)
+		if err == nil && resp.StatusCode/100 == 2 {
+			return resp, nil
+		}
+		if err == nil {
+			s3err := &s3Error{Status: resp.StatusCode}
+			data, _ := io.ReadAll(io.LimitReader(resp.Body, 64*1024))
+			_ = resp.Body.Close()
+			_ = xml.Unmarshal(data, s3err)
+			if s3err.Code == "" {
+				s3err.Code = http.StatusText(resp.StatusCode)
+			}
+			err = s3err
+		}
+		var s3err *s3Error
+		if attempt >= c.retries || errors.As(err, &s3err) && !s3err.retryable() {
+			return nil, fmt.Errorf("%s '%s': %w", method, key, err)
+		}
+		time.Sleep(backoff)
+		backoff *= 2
+	}
+}
+
+// call is do for requests whose response body is not needed.
+func (c *s3Client) call(method, key string, query url.Values, header http.Header, body []byte) (http.Header, error) {
+	resp, err := c.do(method, key, query, header, body)
+	if err != nil {
+		return nil, err
+	}
+	_, _ = io.Copy(io.Discard, resp.Body)
+	_ = resp.Body.Close()
+	return resp.Header, nil
+}
+
+func (c *s3Client) get(key string, header http.Header) ([]byte, error) {
+	resp, err := c.do(http.MethodGet, key, nil, header, nil)
+	if err != nil {
+		return nil, err
+	}
+	defer resp.Body.Close()
+	return io.ReadAll(resp.Body)
+}
+
+// getRange returns length bytes from offset. Ranges past the end are shortened.
+func (c *s3Client) getRange(key string, offset, length int64) ([]byte, error) {
+	return c.get(key, http.Header{"Range": {fmt.Sprintf("bytes=%d-%d", offset, offset+length-1)}})
+}
+
+// head returns the size of an object.
+func (c *s3Client) head(key string) (int64, error) {
+	resp, err := c.do(http.MethodHead, key, nil, nil, nil)
+	if err != nil {
+		return 0, err
+	}
+	_ = resp.Body.Close()
+	return resp.ContentLength, nil
+}
+
+func (c *s3Client) put(key string, body []byte, header http.Header) error {
+	_, err := c.call(http.MethodPut, key, nil, header, body)
+	return err
+}
+
+func (c *s3Client) delete(key string) error {
+	_, err := c.call(http.MethodDelete, key, nil, nil, nil)
+	return err
+}
+
+// list returns the keys and sizes of all objects below prefix.
+func (c *s3Client) list(prefix string) (map[string]int64, error) {
+	objects := map[string]int64{}
+	query := url.Values{"list-type": {"2"}, "prefix": {prefix}}
+	for {
+		resp, err := c.do(http.MethodGet, "", query, nil, nil)
+		if err != nil {
+			return nil, err
+		}
+		var result struct {
+			Contents []struct {
+				Key  string `xml:"Key"`
+				Size int64  `xml:"Size"`
+			} `xml:"Contents"`
+			IsTruncated           bool   `xml:"IsTruncated"`
+			NextContinuationToken string `xml:"NextContinuationToken"`
+		}
+		err = xml.NewDecoder(resp.Body).Decode(&result)
+		_ = resp.Body.Close()
+		if err != nil {
+			return nil, err
+		}
+		for _, object := range result.Contents {
+			objects[object.Key] = object.Size
+		}
+		if !result.IsTruncated {
+			return objects, nil
+		}
+		query.Set("continuation-token", result.NextContinuationToken)
+	}
+}
+
+// multipart is an upload of an object in parts. Parts may be uploaded in any order and concurrently.
+type multipart struct {
+	c        *s3Client
+	key      string
+	uploadID string
+}
+
+type completedPart struct {
+	PartNumber int    `xml:"PartNumber"`
+	ETag       string `xml:"ETag"`
+}
+
+func (c *s3Client) createMultipart(key string) (*multipart, error) {
+	resp, err := c.do(http.MethodPost, key, url.Values{"uploads": {""}}, nil, nil)
+	if err != nil {
+		return nil, err
+	}
+	defer resp.Body.Close()
+	var result struct {
+		UploadID string `xml:"UploadId"`
+	}
+	if err = xml.NewDecoder(resp.Body).Decode(&result); err != nil {
+		return nil, err
+	}
+	return &multipart{c: c, key: key, uploadID: result.UploadID}, nil
+}
+
+// upload uploads part number (from 1), and returns its ETag.
+func (m *multipart) upload(number int, body []byte) (completedPart, error) {
+	header, err := m.c.call(http.MethodPut, m.key, url.Values{
+		"partNumber": {fmt.Sprint(number)},
+		"uploadId":   {m.uploadID},
+	}, nil, body)
+	if err != nil {
+		return completedPart{}, err
+	}
+	return completedPart{PartNumber: number, ETag: header.Get("ETag")}, nil
+}
+
+// complete assembles the parts, which have to be in order, into the object.
+func (m *multipart) complete(parts []completedPart) error {
+	body, err := xml.Marshal(struct {
+		XMLName xml.Name        `xml:"CompleteMultipartUpload"`
+		Parts   []completedPart `xml:"Part"`
+	}{Parts: parts})
+	if err != nil {
+		return err
+	}
+	resp, err := m.c.do(http.MethodPost, m.key, url.Values{"uploadId": {m.uploadID}}, nil, body)
+	if err != nil {
+		return err
+	}
+	defer resp.Body.Close()
+	// S3 reports some failures with a 200 and an error document.
+	data, err := io.ReadAll(resp.Body)
+	if err != nil {
+		return err
+	}
+	if bytes.Contains(data, []byte("<Error>")) {
+		s3err := &s3Error{Status: resp.StatusCode}
+		_ = xml.Unmarshal(data, s3err)
+		return fmt.Errorf("completing '%s': %w", m.key, s3err)
+	}
+	return nil
+}
+
+// abort discards the uploaded parts.
+func (m *multipart) abort() error {
+	_, err := m.c.call(http.MethodDelete, m.key, url.Values{"uploadId": {m.uploadID}}, nil, nil)
+	return err
+}
@@ -0,0 +1,165 @@
+package store
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/rand"
+	"encoding/hex"
+	"fmt"
+	"strings"
+	"sync"
+	"time"
+)
+
+// indexLoaders is the number of pack indexes fetched concurrently when the index is loaded.
+const indexLoaders = 8
+
+// packed locates a small object, in an uploaded pack or the pending one (with an empty pack name).
+func (s *S3) packed(key string) (packEntry, bool, error) {
+	if s.options.PackThreshold <= 0 {
+		return packEntry{}, false, nil
+	}
+	s.packMu.Lock()
+	defer s.packMu.Unlock()
+	if entry, ok := s.pendingEntries[key]; ok {
+		return entry, true, nil
+	}
+	if err := s.loadIndex(); err != nil {
+		return packEntry{}, false, err
+	}
+	entry, ok := s.index[key]
+	return entry, ok, nil
+}
+
+// loadIndex reads the indexes of all packs, once. Called with packMu held.
+func (s *S3) loadIndex() error {
+	if s.indexLoaded {
+		return nil
+	}
+	objects, err := s.client.list(s.packKey(""))
+	if err != nil {
+		return err
+	}
+	var indexes []string
+	for key := range objects {
+		if strings.HasSuffix(key, ".idx") {
+			indexes = append(indexes, key)
+		}
+	}
+
+	index := map[string]packEntry{}
+	var mu sync.Mutex
+	var wg sync.WaitGroup
+	var firstErr error
+	next := make(chan string)
+	for i := 0; i < indexLoaders; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for key := range next {
+				data, err := s.client.get(key, nil)
+				mu.Lock()
+				if err == nil {
+					err = parseIndex(data, strings.TrimSuffix(key[len(s.packKey("")):], ".idx"), index)
+				}
+				if err != nil && firstErr == nil {
+					firstErr = err
+				}
+				mu.Unlock()
+			}
+		}()
+	}
+	for _, key := range indexes {
+		next <- key
+	}
+	close(next)
+	wg.Wait()
+	if firstErr != nil {
+		return firstErr
+	}
+	s.index, s.indexLoaded = index, true
+	return nil
+}
+
+func parseIndex(data []byte, pack string, index map[string]packEntry) error {
+	scanner := bufio.NewScanner(bytes.NewReader(data))
+	for scanner.Scan() {
+		var key string
+		entry := packEntry{pack: pack}
+		if _, err := fmt.Sscan(scanner.Text(), &key, &entry.offset, &entry.length); err != nil {
+			return fmt.Errorf("index of pack '%s': %w", pack, err)
+		}
+		index[key] = entry
+	}
+	return scanner.Err()
+}
+
+// addToPack appends a small object to the pending pack, and uploads the pack once it is full.
+func (s *S3) addToPack(key string, data []byte) error {
+	s.packMu.Lock()
+	defer s.packMu.Unlock()
+	if _, ok := s.pendingEntries[key]; ok {
+		return nil
+	}
+	s.pendingEntries[key] = packEntry{offset: int64(len(s.pending)), length: int64(len(data))}
+	s.pending = append(s.pending, data...)
+	if int64(len(s.pending)) < s.options.PackSize {
+		return nil
+	}
+	return s.flushPack()
+}
+
+// flushPack uploads the pending pack, then its index, which makes its objects visible to other processes. Called
+// with packMu held.
+func (s *S3) flushPack() error {
+	if len(s.pendingEntries) == 0 {
+		return nil
+	}
+	if err := s.loadIndex(); err != nil {
+		return err
+	}
+	random := make([]byte, 4)
+	_, _ = rand.Read(random)
+	name := fmt.Sprintf("%d-%s", time.Now().UnixNano(), hex.EncodeToString(random))
+
+	var index bytes.Buffer
+	for key, entry := range s.pendingEntries {
+		fmt.Fprintf(&index, "%s %d %d\n", key, entry.offset, entry.length)
+	}
+	if err := s.client.put(s.packKey(name), s.pending, nil); err != nil {
+		return err
+	}
+	if err := s.client.put(s.packKey(name)+".idx", index.Bytes(), nil); err != nil {
+		return err
+	}
+	for key, entry := range s.pendingEntries {
+		entry.pack = name
+		s.index[key] = entry
+	}
+	s.pending, s.pendingEntries = nil, map[string]packEntry{}
+	return nil
+}
+
+// pendingObject reads an object of the pending pack, from a copy, as the pack may be uploaded meanwhile.
+func (s *S3) pendingObject(key string) (Object, error) {
+	s.packMu.Lock()
+	entry, ok := s.pendingEntries[key]
+	var data []byte
+	if ok {
+		data = append(data, s.pending[entry.offset:entry.offset+entry.length]...)
+	}
+	s.packMu.Unlock()
+	if !ok {
+		// Uploaded since it was looked up
+		return s.Open(key)
+	}
+	return bytesObject{bytes.NewReader(data)}, nil
+}
+
+type bytesObject struct {
+	*bytes.Reader
+}
+
+func (o bytesObject) Close() error {
+	return nil
+}
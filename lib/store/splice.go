@@ -0,0 +1,255 @@
+package store
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"hash"
+	"io"
+	"os"
+	"sort"
+)
+
+// A file can be stored spliced: ranges of it which other files share, like the cover art embedded in every track of
+// an album, are stored as objects of their own (its parts), the rest of the file as one more object (its body), and a
+// recipe stored with the file's key joins them again:
+//
+//	body <key> <size>
+//	part <offset> <size> <key>    one line per part, by offset, which is where the part starts in the file
+//
+// Has and Open do not tell spliced objects apart from others, readers get the original file either way.
+const recipeSuffix = ".recipe"
+
+var ErrBadCut = errors.New("cut outside of the file or overlapping another")
+
+// Cut is a range of a file to store as a part. Key is the HashFile of the range's content.
+type Cut struct {
+	Offset, Size int64
+	Key          string
+}
+
+// putFunc stores `size` bytes of source under key. name is what errors refer to.
+type putFunc func(source io.ReaderAt, size int64, key, name string) error
+
+// splice stores the parts and the body of a file, and returns its recipe. The whole file is hashed in the same pass as
+// its parts and its body, so a file modified since it was hashed (or probed) is not stored under a wrong key.
+func splice(path, key string, cuts []Cut, has func(string) bool, put putFunc) ([]byte, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	info, err := file.Stat()
+	if err != nil {
+		return nil, err
+	}
+	size := info.Size()
+	cuts = append([]Cut(nil), cuts...)
+	sort.Slice(cuts, func(i, j int) bool { return cuts[i].Offset < cuts[j].Offset })
+	var end int64
+	for _, cut := range cuts {
+		if cut.Offset < end || cut.Size <= 0 || cut.Offset+cut.Size > size {
+			return nil, fmt.Errorf("%w: %d+%d of '%s'", ErrBadCut, cut.Offset, cut.Size, path)
+		}
+		end = cut.Offset + cut.Size
+	}
+	body := bodyOf(file, size, cuts)
+
+	whole, bodyHash := sha256.New(), sha256.New()
+	parts := make([]hash.Hash, len(cuts))
+	for i := range parts {
+		parts[i] = sha256.New()
+	}
+	buffer := make([]byte, 1<<20)
+	reader := io.NewSectionReader(file, 0, size)
+	for pos, next := int64(0), 0; ; {
+		n, err := io.ReadFull(reader, buffer)
+		chunk := buffer[:n]
+		whole.Write(chunk)
+		for len(chunk) > 0 {
+			// Up to the next boundary: into the current cut, or the body until the next one
+			var target hash.Hash
+			var until int64
+			switch {
+			case next < len(cuts) && pos >= cuts[next].Offset:
+				target, until = parts[next], cuts[next].Offset+cuts[next].Size
+			case next < len(cuts):
+				target, until = bodyHash, cuts[next].Offset
+			default:
+				target, until = bodyHash, size
+			}
+			take := int64(len(chunk))
+			if until-pos < take {
+				take = until - pos
+			}
+			target.Write(chunk[:take])
+			chunk, pos = chunk[take:], pos+take
+			if next < len(cuts) && pos == cuts[next].Offset+cuts[next].Size {
+				next++
+			}
+		}
+		if err == io.EOF || err == io.ErrUnexpectedEOF {
+			break
+		} else if err != nil {
+			return nil, err
+		}
+	}
+	if hex.EncodeToString(whole.Sum(nil)) != key {
+		return nil, fmt.Errorf("%w: '%s'", ErrHashMismatch, path)
+	}
+
+	var recipe bytes.Buffer
+	bodyKey := hex.EncodeToString(bodyHash.Sum(nil))
+	fmt.Fprintf(&recipe, "body %s %d\n", bodyKey, body.size)
+	for i, cut := range cuts {
+		if hex.EncodeToString(parts[i].Sum(nil)) != cut.Key {
+			return nil, fmt.Errorf("%w: %d+%d of '%s'", ErrHashMismatch, cut.Offset, cut.Size, path)
+		}
+		if !has(cut.Key) {
+			if err = put(io.NewSectionReader(file, cut.Offset, cut.Size), cut.Size, cut.Key, path); err != nil {
+				return nil, err
+			}
+		}
+		fmt.Fprintf(&recipe, "part %d %d %s\n", cut.Offset, cut.Size, cut.Key)
+	}
+	if !has(bodyKey) {
+		if err = put(body, body.size, bodyKey, path); err != nil {
+			return nil, err
+		}
+	}
+	return recipe.Bytes(), nil
+}
+
+// bodyOf is a view of a file without its cuts.
+func bodyOf(file io.ReaderAt, size int64, cuts []Cut) *joined {
+	body := &joined{}
+	var pos int64
+	for _, cut := range append(cuts, Cut{Offset: size}) {
+		if cut.Offset > pos {
+			body.segments = append(body.segments, segment{start: body.size, size: cut.Offset - pos, source: file, offset: pos})
+			body.size += cut.Offset - pos
+		}
+		pos = cut.Offset + cut.Size
+	}
+	return body
+}
+
+// openSpliced opens the body and parts of a recipe, and joins them.
+func openSpliced(recipe []byte, open func(key string) (Object, error)) (Object, error) {
+	o := &splicedObject{}
+	var body Object
+	var pos, bodyPos int64
+	scanner := bufio.NewScanner(bytes.NewReader(recipe))
+	for scanner.Scan() {
+		var kind, key string
+		var offset, size int64
+		var err error
+		if bytes.HasPrefix(scanner.Bytes(), []byte("body ")) {
+			_, err = fmt.Sscan(scanner.Text(), &kind, &key, &size)
+		} else {
+			_, err = fmt.Sscan(scanner.Text(), &kind, &offset, &size, &key)
+		}
+		if err == nil && (kind == "body") == (body != nil) {
+			err = errors.New("body missing or repeated")
+		}
+		if err == nil && kind == "part" && offset < pos {
+			err = errors.New("parts out of order")
+		}
+		if err != nil {
+			_ = o.Close()
+			return nil, fmt.Errorf("recipe: %w", err)
+		}
+
+		object, err := open(key)
+		if err != nil {
+			_ = o.Close()
+			return nil, err
+		}
+		o.objects = append(o.objects, object)
+		if kind == "body" {
+			body = object
+			continue
+		}
+		if offset > pos {
+			o.segments = append(o.segments, segment{start: pos, size: offset - pos, source: body, offset: bodyPos})
+			bodyPos += offset - pos
+		}
+		o.segments = append(o.segments, segment{start: offset, size: size, source: object})
+		pos = offset + size
+	}
+	if err := scanner.Err(); err != nil || body == nil {
+		_ = o.Close()
+		return nil, fmt.Errorf("recipe: %v", err)
+	}
+	if rest := body.Size() - bodyPos; rest > 0 {
+		o.segments = append(o.segments, segment{start: pos, size: rest, source: body, offset: bodyPos})
+		pos += rest
+	}
+	o.size = pos
+	return o, nil
+}
+
+// segment maps [start, start+size) of a joined view to source, at offset.
+type segment struct {
+	start, size int64
+	source      io.ReaderAt
+	offset      int64
+}
+
+// joined is a view of segments, back to back.
+type joined struct {
+	segments []segment
+	size     int64
+}
+
+func (j *joined) ReadAt(p []byte, off int64) (int, error) {
+	if off < 0 {
+		return 0, errors.New("negative offset")
+	}
+	i := sort.Search(len(j.segments), func(i int) bool { return j.segments[i].start+j.segments[i].size > off })
+	n := 0
+	for ; n < len(p) && i < len(j.segments); i++ {
+		s := j.segments[i]
+		within := off + int64(n) - s.start
+		want := s.size - within
+		if int64(len(p)-n) < want {
+			want = int64(len(p) - n)
+		}
+		m, err := s.source.ReadAt(p[n:n+int(want)], s.offset+within)
+		n += m
+		if int64(m) < want {
+			if err == nil || err == io.EOF {
+				err = io.ErrUnexpectedEOF
+			}
+			return n, err
+		}
+	}
+	if n < len(p) {
+		return n, io.EOF
+	}
+	return n, nil
+}
+
+// splicedObject is an object joined from its body and parts.
+type splicedObject struct {
+	joined
+	objects []Object
+}
+
+func (o *splicedObject) Size() int64 {
+	return o.size
+}
+
+func (o *splicedObject) Close() error {
+	var err error
+	for _, object := range o.objects {
+		if closeErr := object.Close(); err == nil {
+			err = closeErr
+		}
+	}
+	o.objects = nil
+	return err
+}
@@ -0,0 +1,100 @@
+// Package store keeps imported audio, content addressed by the SHA-256 of the original file. Putting the same content
+// twice is a no-op, which makes imports idempotent.
+//
+// Objects live in a local directory (Dir) or an S3 compatible bucket (S3), chosen by `store.backend`. Any number of
+// processes may read a store, only one may write to it: writers hold a lock until Close.
+package store
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"sync"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+)
+
+var (
+	ErrHashMismatch = errors.New("file changed while it was stored")
+	ErrLocked       = errors.New("store is locked by another writer")
+)
+
+// Store is a set of objects, keyed by the HashFile of their content.
+type Store interface {
+	// Has reports whether an object exists.
+	Has(key string) bool
+	// Put copies a file into the store under key, which has to be its HashFile. The content is hashed again while
+	// copying, so a file modified since it was hashed is not stored under a wrong key.
+	Put(path string, key string) error
+	// PutSpliced stores a file like Put, but the ranges of it in cuts as objects of their own, which other files share
+	// (see Cut). Opening key still reads the whole file.
+	PutSpliced(path string, key string, cuts []Cut) error
+	// Open opens an object for reading.
+	Open(key string) (Object, error)
+	// Sync makes all objects Put so far durable. Until then, a crash may lose them.
+	Sync() error
+	// Close syncs and gives up the write lock. The store stays usable, the next Put takes the lock again.
+	Close() error
+}
+
+// Object is a stored object.
+type Object interface {
+	io.ReaderAt
+	io.Closer
+	Size() int64
+}
+
+var (
+	defaultStore     Store
+	defaultStoreErr  error
+	defaultStoreOnce sync.Once
+)
+
+// Default opens the store configured in `store.*` once per process.
+func Default() (Store, error) {
+	defaultStoreOnce.Do(func() {
+		switch backend := config.Config.GetString("store.backend"); backend {
+		case "", "fs":
+			defaultStore, defaultStoreErr = Open(config.Config.GetString("store.dir"))
+		case "s3":
+			defaultStore, defaultStoreErr = OpenS3(S3OptionsFromConfig())
+		default:
+			defaultStoreErr = fmt.Errorf("unknown store.backend '%s'", backend)
+		}
+	})
+	return defaultStore, defaultStoreErr
+}
+
+// HashFile returns the store key of a file's content.
+func HashFile(path string) (string, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return "", err
+	}
+	defer file.Close()
+	hash := sha256.New()
+	if _, err = io.Copy(hash, file); err != nil {
+		return "", err
+	}
+	return hex.EncodeToString(hash.Sum(nil)), nil
+}
+
+// readVerified reads `size` bytes of source, and checks they still have the content hashed into key. name is what the
+// error refers to.
+func readVerified(source io.ReaderAt, size int64, key, name string) ([]byte, error) {
+	data := make([]byte, size)
+	if n, err := source.ReadAt(data, 0); int64(n) < size {
+		if err == io.EOF {
+			// Truncated since it was hashed.
+			err = fmt.Errorf("%w: '%s'", ErrHashMismatch, name)
+		}
+		return nil, err
+	}
+	if sum := sha256.Sum256(data); hex.EncodeToString(sum[:]) != key {
+		return nil, fmt.Errorf("%w: '%s'", ErrHashMismatch, name)
+	}
+	return data, nil
+}
@@ -19,35 +19,52 @@ type FileMetadata struct {
 		Duration  int `json:"duration"`
 		BitRate   int `json:"bit_rate,omitempty"`
 	} `json:"file"`
-	Streams []struct {
-		Metadata map[string]string `json:"metadata"`
-		Codec    struct {
-			ChLayout           string `json:"ch_layout"`
-			Type               string `json:"type"`
-			Name               string `json:"name"`
-			CodecTag           int    `json:"codec_tag,omitempty"`
-			BitRate            int    `json:"bit_rate,omitempty"`
-			BitsPerCodedSample int    `json:"bits_per_coded_sample,omitempty"`
-			BitsPerRawSample   int    `json:"bits_per_raw_sample,omitempty"`
-			Profile            int    `json:"profile,omitempty"`
-			Level              int    `json:"level,omitempty"`
-			Width              int    `json:"width,omitempty"`
-			Height             int    `json:"height,omitempty"`
-			BitsPerSample      int    `json:"bits_per_sample,omitempty"`
-			SampleRate         int    `json:"sample_rate,omitempty"`
-			FrameSize          int    `json:"frame_size,omitempty"`
-			BlockAlign         int    `json:"block_align,omitempty"`
-			NbChannels         int    `json:"nb_channels"`
-			ProfileName        string `json:"profile_name,omitempty"`
-		} `json:"codec"`
-		Index       int      `json:"index"`
-		NbFrames    int      `json:"nb_frames"`
-		Duration    int      `json:"duration"`
-		TimeBaseNum int64    `json:"time_base_num"`
-		TimeBaseDen int64    `json:"time_base_den"`
-		TimeBase    *big.Rat `json:"time_base"`
-		Chromaprint string   `json:"chromaprint,omitempty"`
-	} `json:"streams"`
+	Streams []Stream `json:"streams"`
+}
+
+type Stream struct {
+	Metadata map[string]string `json:"metadata"`
+	Codec    struct {
+		ChLayout           string `json:"ch_layout"`
+		Type               string `json:"type"`
+		Name               string `json:"name"`
+		CodecTag           int    `json:"codec_tag,omitempty"`
+		BitRate            int    `json:"bit_rate,omitempty"`
+		BitsPerCodedSample int    `json:"bits_per_coded_sample,omitempty"`
+		BitsPerRawSample   int    `json:"bits_per_raw_sample,omitempty"`
+		Profile            int    `json:"profile,omitempty"`
+		Level              int    `json:"level,omitempty"`
+		Width              int    `json:"width,omitempty"`
+		Height             int    `json:"height,omitempty"`
+		BitsPerSample      int    `json:"bits_per_sample,omitempty"`
+		SampleRate         int    `json:"sample_rate,omitempty"`
+		FrameSize          int    `json:"frame_size,omitempty"`
+		BlockAlign         int    `json:"block_align,omitempty"`
+		NbChannels         int    `json:"nb_channels"`
+		ProfileName        string `json:"profile_name,omitempty"`
+	} `json:"codec"`
+	Index       int      `json:"index"`
+	NbFrames    int      `json:"nb_frames"`
+	Duration    int      `json:"duration"`
+	TimeBaseNum int64    `json:"time_base_num"`
+	TimeBaseDen int64    `json:"time_base_den"`
+	TimeBase    *big.Rat `json:"time_base"`
+	Chromaprint string   `json:"chromaprint,omitempty"`
+	// ChromaprintLength is the fingerprinted window in seconds. 0 if the full stream was fingerprinted.
+	ChromaprintLength int `json:"chromaprint_length,omitempty"`
+	// ChromaprintSecond is the fingerprint of the optional second window (e.g. the middle of a long mix).
+	ChromaprintSecond       string `json:"chromaprint_second,omitempty"`
+	ChromaprintSecondOffset int    `json:"chromaprint_second_offset,omitempty"`
+	// AttachedPic is set for streams which are a picture embedded in the file, e.g. cover art.
+	AttachedPic *AttachedPic `json:"attached_pic,omitempty"`
+}
+
+// AttachedPic identifies an embedded picture by content, so it is stored once, however many files embed it.
+type AttachedPic struct {
+	SHA256 string `json:"sha256"`
+	Size   int64  `json:"size"`
+	// Offset is where the picture is in the file, -1 if it is not stored there as-is (e.g. base64 in Ogg comments).
+	Offset int64 `json:"offset"`
 }
 
 func (f *FileMetadata) filltimeBase() {
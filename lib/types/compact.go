@@ -0,0 +1,356 @@
+package types
+
+import (
+	"math/big"
+	"sort"
+	"sync"
+)
+
+// Str is a string interned in Strings. The zero Str is "".
+type Str uint32
+
+func (s Str) String() string {
+	return Strings.Get(s)
+}
+
+// StringTable interns strings: every distinct string is stored once and named by a Str. Safe for concurrent use.
+type StringTable struct {
+	mu      sync.RWMutex
+	ids     map[string]Str
+	strings []string
+}
+
+func NewStringTable() *StringTable {
+	return &StringTable{ids: map[string]Str{"": 0}, strings: []string{""}}
+}
+
+// Strings is the table CompactMetadata interns tag keys, codec and format names and common tag values in.
+var Strings = NewStringTable()
+
+// Intern returns the Str of s, adding it if it is new.
+func (t *StringTable) Intern(s string) Str {
+	t.mu.RLock()
+	id, ok := t.ids[s]
+	t.mu.RUnlock()
+	if ok {
+		return id
+	}
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	if id, ok = t.ids[s]; ok {
+		return id
+	}
+	id = Str(len(t.strings))
+	t.ids[s] = id
+	t.strings = append(t.strings, s)
+	return id
+}
+
+// Lookup returns the Str of s, if s was interned.
+func (t *StringTable) Lookup(s string) (Str, bool) {
+	t.mu.RLock()
+	defer t.mu.RUnlock()
+	id, ok := t.ids[s]
+	return id, ok
+}
+
+func (t *StringTable) Get(id Str) string {
+	t.mu.RLock()
+	defer t.mu.RUnlock()
+	return t.strings[id]
+}
+
+// Len is the number of strings interned.
+func (t *StringTable) Len() int {
+	t.mu.RLock()
+	defer t.mu.RUnlock()
+	return len(t.strings)
+}
+
+// sharedTagValues are the tags whose values repeat across files (the album's tracks, the artist's albums), so they are
+// interned. Others, like titles, are mostly unique and kept as they are. Keys are matched case-insensitively, as
+// Vorbis comments and ID3 frames spell them differently.
+var sharedTagValues = map[string]bool{
+	"album": true, "album_artist": true, "albumartist": true, "artist": true, "composer": true, "performer": true,
+	"genre": true, "date": true, "year": true, "originaldate": true, "track": true, "tracktotal": true,
+	"totaltracks": true, "disc": true, "disctotal": true, "totaldiscs": true, "compilation": true, "label": true,
+	"publisher": true, "copyright": true, "encoder": true, "encoded_by": true, "language": true, "media": true,
+	"vendor": true, "major_brand": true, "minor_version": true, "compatible_brands": true, "handler_name": true,
+	"mimetype": true, "comment": true,
+}
+
+func sharesValues(key string) bool {
+	var lower [32]byte
+	if len(key) > len(lower) {
+		return false
+	}
+	for i := 0; i < len(key); i++ {
+		c := key[i]
+		if 'A' <= c && c <= 'Z' {
+			c += 'a' - 'A'
+		}
+		lower[i] = c
+	}
+	return sharedTagValues[string(lower[:len(key)])]
+}
+
+// Rational is a time base, like libav's AVRational.
+type Rational struct {
+	Num, Den int32
+}
+
+// Rat returns r as a big.Rat, or nil if its denominator is 0.
+func (r Rational) Rat() *big.Rat {
+	if r.Den == 0 {
+		return nil
+	}
+	return big.NewRat(int64(r.Num), int64(r.Den))
+}
+
+func (r Rational) Float64() float64 {
+	if r.Den == 0 {
+		return 0
+	}
+	return float64(r.Num) / float64(r.Den)
+}
+
+// timeBaseSource records which of FileMetadata's time base fields were set, so FileMetadata restores them as they were.
+type timeBaseSource uint8
+
+const (
+	// timeBaseBoth: TimeBase matches TimeBaseNum/TimeBaseDen, as filled in by UnmarshalJSON.
+	timeBaseBoth timeBaseSource = iota
+	// timeBaseFields: TimeBase was nil.
+	timeBaseFields
+	// timeBaseDiffers: TimeBase did not match TimeBaseNum/TimeBaseDen (e.g. the denominator was 0), which are kept in
+	// CompactStream.timeBaseFields.
+	timeBaseDiffers
+)
+
+// Tag is a single tag of a file or stream.
+type Tag struct {
+	Value string
+	Key   Str
+}
+
+// Tags is a small set of tags, sorted by key. Files have a dozen or two, which a scan finds faster than a map, at a
+// fraction of its memory.
+type Tags []Tag
+
+// Get returns the value of the tag `key`.
+func (t Tags) Get(key string) (string, bool) {
+	id, ok := Strings.Lookup(key)
+	if !ok {
+		return "", false
+	}
+	for _, tag := range t {
+		if tag.Key == id {
+			return tag.Value, true
+		}
+	}
+	return "", false
+}
+
+// CompactStream is a stream of a CompactMetadata. Integers have the width libav gives them.
+type CompactStream struct {
+	Chromaprint       string
+	ChromaprintSecond string
+	AttachedPic       *AttachedPic
+	NbFrames          int64
+	Duration          int64
+	BitRate           int64
+	// TimeBase is TimeBaseNum/TimeBaseDen of the stream, or its TimeBase if those did not match it.
+	TimeBase       Rational
+	timeBaseFields Rational
+	// tagsEnd is where the stream's tags end in CompactMetadata.tags. They start where the previous stream's end.
+	tagsEnd  uint32
+	Index    int32
+	timeBase timeBaseSource
+	// nilTags is set if the stream's tag map was nil rather than empty.
+	nilTags bool
+
+	ChLayout, Type, Name, ProfileName Str
+	CodecTag                          uint32
+
+	BitsPerCodedSample, BitsPerRawSample, BitsPerSample int32
+	Profile, Level, Width, Height                       int32
+	SampleRate, FrameSize, BlockAlign, NbChannels       int32
+	ChromaprintLength, ChromaprintSecondOffset          int32
+}
+
+// CompactMetadata holds what FileMetadata holds in a fraction of the memory and pointers, for keeping large catalogs in
+// memory (e.g. to list them). Names, tag keys and common tag values are interned in Strings, the tags of the file and
+// all its streams share one slice, and the time base is a plain Rational.
+type CompactMetadata struct {
+	Streams []CompactStream
+	// tags are the file's tags, followed by those of every stream, each sorted by key.
+	tags     []Tag
+	fileTags uint32
+
+	StartTime, Duration, BitRate     int64
+	Format, FormatLongName, MimeType Str
+	Flags                            int32
+	// nilFileTags is set if the file's tag map was nil rather than empty.
+	nilFileTags bool
+}
+
+// appendTags appends the tags of a map, sorted by key.
+func appendTags(tags []Tag, metadata map[string]string) []Tag {
+	start := len(tags)
+	for key, value := range metadata {
+		tag := Tag{Key: Strings.Intern(key), Value: value}
+		if sharesValues(key) {
+			tag.Value = Strings.Get(Strings.Intern(value))
+		}
+		tags = append(tags, tag)
+	}
+	added := tags[start:]
+	sort.Slice(added, func(i, j int) bool { return added[i].Key < added[j].Key })
+	return tags
+}
+
+// tagMap returns the tags as a map, or nil if the map they came from was nil.
+func tagMap(tags []Tag, isNil bool) map[string]string {
+	if isNil {
+		return nil
+	}
+	metadata := make(map[string]string, len(tags))
+	for _, tag := range tags {
+		metadata[tag.Key.String()] = tag.Value
+	}
+	return metadata
+}
+
+// Compact converts f. Strings which are not interned (titles, fingerprints) are shared with f rather than copied, the
+// others are replaced by their interned copy, so f's copies can be collected once f is dropped.
+func Compact(f *FileMetadata) CompactMetadata {
+	count := len(f.File.Metadata)
+	for i := range f.Streams {
+		count += len(f.Streams[i].Metadata)
+	}
+	c := CompactMetadata{
+		tags:           appendTags(make([]Tag, 0, count), f.File.Metadata),
+		StartTime:      int64(f.File.StartTime),
+		Duration:       int64(f.File.Duration),
+		BitRate:        int64(f.File.BitRate),
+		Format:         Strings.Intern(f.File.Format.Name),
+		FormatLongName: Strings.Intern(f.File.Format.LongName),
+		MimeType:       Strings.Intern(f.File.Format.MimeType),
+		Flags:          int32(f.File.Format.Flags),
+		nilFileTags:    f.File.Metadata == nil,
+	}
+	if f.Streams != nil {
+		c.Streams = make([]CompactStream, len(f.Streams))
+	}
+	c.fileTags = uint32(len(c.tags))
+	for i := range f.Streams {
+		s, cs := &f.Streams[i], &c.Streams[i]
+		c.tags = appendTags(c.tags, s.Metadata)
+		*cs = CompactStream{
+			Chromaprint:             s.Chromaprint,
+			ChromaprintSecond:       s.ChromaprintSecond,
+			AttachedPic:             s.AttachedPic,
+			NbFrames:                int64(s.NbFrames),
+			Duration:                int64(s.Duration),
+			BitRate:                 int64(s.Codec.BitRate),
+			TimeBase:                Rational{Num: int32(s.TimeBaseNum), Den: int32(s.TimeBaseDen)},
+			tagsEnd:                 uint32(len(c.tags)),
+			Index:                   int32(s.Index),
+			nilTags:                 s.Metadata == nil,
+			ChLayout:                Strings.Intern(s.Codec.ChLayout),
+			Type:                    Strings.Intern(s.Codec.Type),
+			Name:                    Strings.Intern(s.Codec.Name),
+			ProfileName:             Strings.Intern(s.Codec.ProfileName),
+			CodecTag:                uint32(s.Codec.CodecTag),
+			BitsPerCodedSample:      int32(s.Codec.BitsPerCodedSample),
+			BitsPerRawSample:        int32(s.Codec.BitsPerRawSample),
+			BitsPerSample:           int32(s.Codec.BitsPerSample),
+			Profile:                 int32(s.Codec.Profile),
+			Level:                   int32(s.Codec.Level),
+			Width:                   int32(s.Codec.Width),
+			Height:                  int32(s.Codec.Height),
+			SampleRate:              int32(s.Codec.SampleRate),
+			FrameSize:               int32(s.Codec.FrameSize),
+			BlockAlign:              int32(s.Codec.BlockAlign),
+			NbChannels:              int32(s.Codec.NbChannels),
+			ChromaprintLength:       int32(s.ChromaprintLength),
+			ChromaprintSecondOffset: int32(s.ChromaprintSecondOffset),
+		}
+		switch {
+		case s.TimeBase == nil:
+			cs.timeBase = timeBaseFields
+		case cs.TimeBase.Den == 0 || s.TimeBase.Cmp(cs.TimeBase.Rat()) != 0:
+			cs.timeBase, cs.timeBaseFields = timeBaseDiffers, cs.TimeBase
+			cs.TimeBase = Rational{Num: int32(s.TimeBase.Num().Int64()), Den: int32(s.TimeBase.Denom().Int64())}
+		}
+	}
+	return c
+}
+
+// FileTags are the tags of the file.
+func (c *CompactMetadata) FileTags() Tags {
+	return c.tags[:c.fileTags:c.fileTags]
+}
+
+// StreamTags are the tags of the i-th stream.
+func (c *CompactMetadata) StreamTags(i int) Tags {
+	start := c.fileTags
+	if i > 0 {
+		start = c.Streams[i-1].tagsEnd
+	}
+	end := c.Streams[i].tagsEnd
+	return c.tags[start:end:end]
+}
+
+// FileMetadata converts c back. It equals what c was made of, as long as its integers fit the widths of c's.
+func (c *CompactMetadata) FileMetadata() *FileMetadata {
+	f := &FileMetadata{}
+	f.File.Metadata = tagMap(c.FileTags(), c.nilFileTags)
+	f.File.Format.Name = c.Format.String()
+	f.File.Format.LongName = c.FormatLongName.String()
+	f.File.Format.MimeType = c.MimeType.String()
+	f.File.Format.Flags = int(c.Flags)
+	f.File.StartTime, f.File.Duration, f.File.BitRate = int(c.StartTime), int(c.Duration), int(c.BitRate)
+
+	if c.Streams != nil {
+		f.Streams = make([]Stream, len(c.Streams))
+	}
+	for i := range c.Streams {
+		cs, s := &c.Streams[i], &f.Streams[i]
+		s.Metadata = tagMap(c.StreamTags(i), cs.nilTags)
+		s.Codec.ChLayout = cs.ChLayout.String()
+		s.Codec.Type = cs.Type.String()
+		s.Codec.Name = cs.Name.String()
+		s.Codec.ProfileName = cs.ProfileName.String()
+		s.Codec.CodecTag = int(cs.CodecTag)
+		s.Codec.BitRate = int(cs.BitRate)
+		s.Codec.BitsPerCodedSample = int(cs.BitsPerCodedSample)
+		s.Codec.BitsPerRawSample = int(cs.BitsPerRawSample)
+		s.Codec.BitsPerSample = int(cs.BitsPerSample)
+		s.Codec.Profile = int(cs.Profile)
+		s.Codec.Level = int(cs.Level)
+		s.Codec.Width = int(cs.Width)
+		s.Codec.Height = int(cs.Height)
+		s.Codec.SampleRate = int(cs.SampleRate)
+		s.Codec.FrameSize = int(cs.FrameSize)
+		s.Codec.BlockAlign = int(cs.BlockAlign)
+		s.Codec.NbChannels = int(cs.NbChannels)
+		s.Index = int(cs.Index)
+		s.NbFrames = int(cs.NbFrames)
+		s.Duration = int(cs.Duration)
+		fields := cs.TimeBase
+		if cs.timeBase == timeBaseDiffers {
+			fields = cs.timeBaseFields
+		}
+		s.TimeBaseNum, s.TimeBaseDen = int64(fields.Num), int64(fields.Den)
+		if cs.timeBase != timeBaseFields {
+			s.TimeBase = cs.TimeBase.Rat()
+		}
+		s.Chromaprint = cs.Chromaprint
+		s.ChromaprintLength = int(cs.ChromaprintLength)
+		s.ChromaprintSecond = cs.ChromaprintSecond
+		s.ChromaprintSecondOffset = int(cs.ChromaprintSecondOffset)
+		s.AttachedPic = cs.AttachedPic
+	}
+	return f
+}
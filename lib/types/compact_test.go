@@ -0,0 +1,56 @@
+package types
+
+import (
+	"encoding/json"
+	"math/big"
+	"reflect"
+	"testing"
+)
+
+func roundTrip(t *testing.T, name string, f *FileMetadata) {
+	t.Helper()
+	c := Compact(f)
+	if back := c.FileMetadata(); !reflect.DeepEqual(back, f) {
+		t.Errorf("%s: round trip changed the metadata\n got %+v\nwant %+v", name, back, f)
+	}
+}
+
+func TestCompactRoundTripJSON(t *testing.T) {
+	var f FileMetadata
+	err := json.Unmarshal([]byte(`{
+		"file": {"metadata": {"ALBUM": "Album", "title": "Title", "DATE": "2001"},
+			"format": {"name": "flac", "long_name": "raw FLAC", "flags": 256},
+			"start_time": 0, "duration": 240000000, "bit_rate": 1411200},
+		"streams": [
+			{"metadata": {}, "codec": {"ch_layout": "stereo", "type": "audio", "name": "flac", "bits_per_raw_sample": 16,
+				"sample_rate": 44100, "frame_size": 4096, "nb_channels": 2},
+				"index": 0, "nb_frames": 0, "duration": 10584000, "time_base_num": 1, "time_base_den": 44100,
+				"chromaprint": "AQAAA", "chromaprint_length": 120},
+			{"metadata": {"comment": "Cover (front)"}, "codec": {"type": "video", "name": "mjpeg", "width": 500,
+				"height": 500, "nb_channels": 0},
+				"index": 1, "nb_frames": 1, "duration": 1, "time_base": "1/90000",
+				"attached_pic": {"sha256": "ab", "size": 60000, "offset": 8192}}
+		]}`), &f)
+	if err != nil {
+		t.Fatal(err)
+	}
+	roundTrip(t, "probed", &f)
+}
+
+func TestCompactRoundTripEdgeCases(t *testing.T) {
+	roundTrip(t, "empty", &FileMetadata{})
+	roundTrip(t, "no streams", &FileMetadata{Streams: []Stream{}})
+
+	f := &FileMetadata{Streams: make([]Stream, 5)}
+	f.File.Metadata = map[string]string{}
+	f.Streams[0].Metadata = map[string]string{"Artist": "Someone"}
+	// Only the fields
+	f.Streams[1].TimeBaseNum, f.Streams[1].TimeBaseDen = 1, 48000
+	// Both, unreduced
+	f.Streams[2].TimeBaseNum, f.Streams[2].TimeBaseDen, f.Streams[2].TimeBase = 2, 88200, big.NewRat(1, 44100)
+	// Only the pointer
+	f.Streams[3].TimeBase = big.NewRat(1, 1000)
+	// Fields which do not match the pointer
+	f.Streams[4].TimeBaseNum, f.Streams[4].TimeBaseDen, f.Streams[4].TimeBase = 1, 1000, big.NewRat(1, 90000)
+	roundTrip(t, "time bases and tags", f)
+}
@@ -0,0 +1,18 @@
+//go:build !linux
+
+package walk
+
+import "os"
+
+// readDir returns the entries of a directory. Inodes are not available, so files are emitted in name order.
+func readDir(dir string) ([]entry, error) {
+	dirEntries, err := os.ReadDir(dir)
+	if err != nil {
+		return nil, err
+	}
+	entries := make([]entry, len(dirEntries))
+	for i, e := range dirEntries {
+		entries[i] = entry{name: e.Name(), mode: e.Type()}
+	}
+	return entries, nil
+}
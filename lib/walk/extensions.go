@@ -0,0 +1,88 @@
+package walk
+
+import (
+	"strings"
+
+	"gitlab.com/t4cc0re/audiofs/config"
+)
+
+// demuxerExtensions are the file extensions of the demuxers built into the native code. Keep it in sync with
+// native/demuxers.list. The extensions are taken from the demuxers' `extensions` in libavformat, plus the common ones
+// of demuxers which only probe (e.g. ogg). Demuxers which need options to open a file (raw G.726, codec2raw) or which
+// are not audio (apng) select nothing.
+var demuxerExtensions = map[string][]string{
+	"aa":        {"aa"},
+	"aac":       {"aac"},
+	"ac3":       {"ac3"},
+	"aea":       {"aea"},
+	"aiff":      {"aif", "aiff", "afc", "aifc"},
+	"ape":       {"ape", "apl", "mac"},
+	"apng":      nil,
+	"aptx":      {"aptx"},
+	"aptx_hd":   {"aptxhd"},
+	"ast":       {"ast"},
+	"boa":       nil,
+	"caf":       {"caf"},
+	"codec2raw": nil,
+	"daud":      {"302", "daud"},
+	"dsf":       {"dsf"},
+	"dts":       {"dts"},
+	"dtshd":     {"dtshd"},
+	"eac3":      {"eac3", "ec3"},
+	"epaf":      {"paf", "fap"},
+	"flac":      {"flac"},
+	"g722":      {"g722", "722"},
+	"g726":      nil,
+	"g726le":    nil,
+	"g729":      {"g729"},
+	"gsm":       {"gsm"},
+	"lmlm4":     nil,
+	"loas":      {"loas", "latm"},
+	"mlp":       {"mlp"},
+	"mov":       {"mov", "mp4", "m4a", "m4b", "3gp", "3g2"},
+	"mp3":       {"mp2", "mp3", "m2a", "mpa"},
+	"msf":       {"msf"},
+	"nut":       {"nut"},
+	"ogg":       {"ogg", "oga", "opus", "spx"},
+	"oma":       {"oma", "omg", "aa3"},
+	"sbc":       {"sbc", "msbc"},
+	"sln":       {"sln"},
+	"sox":       {"sox"},
+	"tak":       {"tak"},
+	"truehd":    {"thd"},
+	"tta":       {"tta"},
+	"w64":       {"w64"},
+	"wav":       {"wav"},
+	"wsaud":     {"aud"},
+	"wv":        {"wv"},
+	"wve":       {"wve"},
+	"xwma":      {"xwma"},
+}
+
+// DefaultExtensions is the set of extensions the native code can demux.
+func DefaultExtensions() map[string]bool {
+	extensions := map[string]bool{}
+	for _, list := range demuxerExtensions {
+		for _, extension := range list {
+			extensions[extension] = true
+		}
+	}
+	return extensions
+}
+
+// ExtensionsFromConfig returns `scan.extensions`, or DefaultExtensions if it is empty. "*" selects all files (nil).
+func ExtensionsFromConfig() map[string]bool {
+	configured := config.Config.GetStringSlice("scan.extensions")
+	if len(configured) == 0 {
+		return DefaultExtensions()
+	}
+	extensions := map[string]bool{}
+	for _, extension := range configured {
+		extension = strings.ToLower(strings.TrimPrefix(strings.TrimSpace(extension), "."))
+		if extension == "*" {
+			return nil
+		}
+		extensions[extension] = true
+	}
+	return extensions
+}
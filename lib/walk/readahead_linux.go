@@ -0,0 +1,19 @@
+//go:build linux
+
+package walk
+
+import (
+	"os"
+
+	"golang.org/x/sys/unix"
+)
+
+// readahead asks the kernel to read the first n bytes of a file into the page cache in the background.
+func readahead(path string, n int64) error {
+	file, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+	return unix.Fadvise(int(file.Fd()), 0, n, unix.FADV_WILLNEED)
+}
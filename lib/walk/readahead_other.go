@@ -0,0 +1,8 @@
+//go:build !linux
+
+package walk
+
+// readahead is a no-op where posix_fadvise is not available.
+func readahead(string, int64) error {
+	return nil
+}
@@ -0,0 +1,217 @@
+// Package walk lists the media files below directories. Directories are read concurrently, and the files of every
+// directory are emitted in inode order, which on most file systems is close to their order on disk. That keeps a
+// spinning disk from seeking back and forth when the files are read in the order they are emitted.
+package walk
+
+import (
+	"errors"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
+	"sync"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+)
+
+var ErrUnreadable = errors.New("some directories could not be read")
+
+type Options struct {
+	// Workers is the number of directories read concurrently.
+	Workers int
+	// Extensions selects files by their lower case extension, without the dot. nil selects all files.
+	Extensions map[string]bool
+	// Readahead is the amount of bytes at the start of every emitted file the kernel is asked to prefetch, so they are
+	// in the page cache by the time the file is read. 0 disables it.
+	Readahead int64
+	// NeedsRead selects the files to prefetch, e.g. to leave out files whose probe result is cached. nil: all files.
+	NeedsRead func(path string, info os.FileInfo) bool
+}
+
+// OptionsFromConfig returns the options configured in `scan.*`.
+func OptionsFromConfig() Options {
+	return Options{
+		Workers:    config.Config.GetInt("scan.workers"),
+		Extensions: ExtensionsFromConfig(),
+		Readahead:  config.Config.GetInt64("scan.readahead"),
+	}
+}
+
+// entry is a directory entry as returned by readDir.
+type entry struct {
+	name  string
+	inode uint64
+	// mode is the file type, or os.ModeIrregular if the directory entry did not say.
+	mode os.FileMode
+}
+
+// walker shares a stack of directories between its workers. Depth first keeps the stack short.
+type walker struct {
+	options Options
+	emit    func(path string) bool
+
+	mutex sync.Mutex
+	cond  *sync.Cond
+	dirs  []string
+	// pending is the number of directories on the stack or being read.
+	pending  int
+	stopped  bool
+	failures int
+
+	// emitMutex serializes emit, so batches are not interleaved.
+	emitMutex sync.Mutex
+}
+
+// Walk calls emit for every selected file below roots, until emit returns false. emit is never called concurrently.
+// Paths are emitted absolute and clean, so they do not depend on the working directory. Roots which are files are
+// emitted regardless of their extension. Unreadable directories are logged and skipped, and ErrUnreadable is returned at
+// the end.
+func Walk(roots []string, options Options, emit func(path string) bool) error {
+	if options.Workers < 1 {
+		options.Workers = 1
+	}
+	w := &walker{options: options, emit: emit}
+	w.cond = sync.NewCond(&w.mutex)
+
+	for _, root := range roots {
+		root, err := filepath.Abs(root)
+		if err != nil {
+			return err
+		}
+		info, err := os.Stat(root)
+		if err != nil {
+			return err
+		}
+		if info.IsDir() {
+			w.dirs = append(w.dirs, root)
+			w.pending++
+		} else if !w.emitBatch([]string{root}) {
+			return nil
+		}
+	}
+
+	var wg sync.WaitGroup
+	for i := 0; i < options.Workers; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			w.work()
+		}()
+	}
+	wg.Wait()
+	if w.failures > 0 {
+		return ErrUnreadable
+	}
+	return nil
+}
+
+func (w *walker) work() {
+	for {
+		w.mutex.Lock()
+		for len(w.dirs) == 0 && w.pending > 0 && !w.stopped {
+			w.cond.Wait()
+		}
+		if w.stopped || len(w.dirs) == 0 {
+			w.mutex.Unlock()
+			return
+		}
+		dir := w.dirs[len(w.dirs)-1]
+		w.dirs = w.dirs[:len(w.dirs)-1]
+		w.mutex.Unlock()
+
+		subdirs, files, err := w.list(dir)
+		stopped := false
+		if err != nil {
+			logrus.Warnf("walk: could not read '%s': %v", dir, err)
+		} else {
+			stopped = !w.emitBatch(files)
+		}
+
+		w.mutex.Lock()
+		if err != nil {
+			w.failures++
+		}
+		if stopped {
+			w.stopped = true
+		}
+		w.dirs = append(w.dirs, subdirs...)
+		w.pending += len(subdirs) - 1
+		w.cond.Broadcast()
+		w.mutex.Unlock()
+	}
+}
+
+// list reads a directory and returns its subdirectories and its selected files in inode order.
+func (w *walker) list(dir string) ([]string, []string, error) {
+	entries, err := readDir(dir)
+	if err != nil {
+		return nil, nil, err
+	}
+	var subdirs []string
+	files := entries[:0]
+	for _, e := range entries {
+		mode := e.mode
+		if mode&(os.ModeIrregular|os.ModeSymlink) != 0 {
+			// Symlinks to files are followed, symlinks to directories are not (they could loop).
+			info, err := os.Stat(filepath.Join(dir, e.name))
+			if err != nil || (info.IsDir() && mode&os.ModeSymlink != 0) {
+				continue
+			}
+			mode = info.Mode().Type()
+		}
+		switch {
+		case mode.IsDir():
+			subdirs = append(subdirs, filepath.Join(dir, e.name))
+		case mode.IsRegular() && w.selected(e.name):
+			files = append(files, e)
+		}
+	}
+	sort.Slice(files, func(i, j int) bool {
+		if files[i].inode != files[j].inode {
+			return files[i].inode < files[j].inode
+		}
+		return files[i].name < files[j].name
+	})
+	paths := make([]string, len(files))
+	for i, file := range files {
+		paths[i] = filepath.Join(dir, file.name)
+	}
+	return subdirs, paths, nil
+}
+
+func (w *walker) selected(name string) bool {
+	if w.options.Extensions == nil {
+		return true
+	}
+	dot := strings.LastIndexByte(name, '.')
+	return dot >= 0 && w.options.Extensions[strings.ToLower(name[dot+1:])]
+}
+
+// emitBatch emits files in order. emit blocks while its consumer is busy, so a file is prefetched about as many files
+// ahead of being read as the consumer queues.
+func (w *walker) emitBatch(paths []string) bool {
+	w.emitMutex.Lock()
+	defer w.emitMutex.Unlock()
+	for _, path := range paths {
+		if w.options.Readahead > 0 {
+			w.prefetch(path)
+		}
+		if !w.emit(path) {
+			return false
+		}
+	}
+	return true
+}
+
+func (w *walker) prefetch(path string) {
+	if w.options.NeedsRead != nil {
+		info, err := os.Stat(path)
+		if err != nil || !w.options.NeedsRead(path, info) {
+			return
+		}
+	}
+	if err := readahead(path, w.options.Readahead); err != nil {
+		logrus.Debugf("walk: readahead of '%s' failed: %v", path, err)
+	}
+}
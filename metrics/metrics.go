@@ -0,0 +1,191 @@
+// Package metrics aggregates the per-file transcode pipeline counters reported by the native workers into histograms
+// and totals, and exposes them in the Prometheus text format.
+package metrics
+
+import (
+	"io"
+	"sort"
+	"sync"
+	"time"
+)
+
+// Stages as reported by native/metrics.c, in pipeline order.
+var Stages = []string{"probe", "demux", "decode", "filter", "encode", "mux"}
+
+// StageTotals are the counters of a single stage for a single file.
+type StageTotals struct {
+	Calls   uint64 `json:"calls"`
+	WallNs  uint64 `json:"wall_ns"`
+	CpuNs   uint64 `json:"cpu_ns"`
+	Bytes   uint64 `json:"bytes"`
+	Samples uint64 `json:"samples"`
+}
+
+// Memory is what happened to a worker's memory budget (see native/membudget.h) while it processed a file.
+type Memory struct {
+	PeakBytes    uint64 `json:"peak_bytes"`
+	Reservations uint64 `json:"reservations"`
+	Denied       uint64 `json:"denied"`
+	Spills       uint64 `json:"spills"`
+	SpilledBytes uint64 `json:"spilled_bytes"`
+	Waits        uint64 `json:"waits"`
+	WaitNs       uint64 `json:"wait_ns"`
+}
+
+// File is what a native worker reports with every response.
+type File struct {
+	WallNs     uint64                 `json:"wall_ns"`
+	CpuNs      uint64                 `json:"cpu_ns"`
+	Transcodes uint64                 `json:"transcodes"`
+	Stages     map[string]StageTotals `json:"stages"`
+	Memory     *Memory                `json:"memory"`
+}
+
+// Exponential buckets from 1ms to ~9 minutes (in seconds). Wide enough for tiny files on fast storage as well as
+// full-length fingerprints of hours long mixes.
+var bucketBounds = func() []float64 {
+	bounds := make([]float64, 0, 20)
+	for b := 0.001; b < 600; b *= 2 {
+		bounds = append(bounds, b)
+	}
+	return bounds
+}()
+
+type histogram struct {
+	counts []uint64 // per bucket, not cumulative. The last one is +Inf.
+	sum    float64
+	count  uint64
+}
+
+func newHistogram() *histogram {
+	return &histogram{counts: make([]uint64, len(bucketBounds)+1)}
+}
+
+func (h *histogram) observe(v float64) {
+	i := sort.SearchFloat64s(bucketBounds, v)
+	h.counts[i]++
+	h.sum += v
+	h.count++
+}
+
+type stageKey struct {
+	stage string
+	codec string
+}
+
+type stageStats struct {
+	wall       *histogram // per file wall seconds spent in the stage
+	cpuSeconds float64
+	calls      uint64
+	bytes      uint64
+	samples    uint64
+}
+
+type fileKey struct {
+	codec  string
+	result string
+}
+
+type fileStats struct {
+	files      uint64
+	wall       *histogram // only files the worker reported metrics for
+	cpuSeconds float64
+}
+
+// Collector writes metrics owned by another component (e.g. the queue depths of a running import) in the Prometheus
+// text format, see Header.
+type Collector func(w io.Writer)
+
+// Registry aggregates per-file metrics. Safe for concurrent use.
+type Registry struct {
+	mu     sync.Mutex
+	stages map[stageKey]*stageStats
+	files  map[fileKey]*fileStats
+	// memory sums the per-file memory counters, but PeakBytes is the largest peak of any file.
+	memory     Memory
+	collectors map[int]Collector
+	nextID     int
+}
+
+func NewRegistry() *Registry {
+	return &Registry{
+		stages:     map[stageKey]*stageStats{},
+		files:      map[fileKey]*fileStats{},
+		collectors: map[int]Collector{},
+	}
+}
+
+// Register adds a collector to every scrape until the returned function is called.
+func (r *Registry) Register(collector Collector) (unregister func()) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	id := r.nextID
+	r.nextID++
+	r.collectors[id] = collector
+	return func() {
+		r.mu.Lock()
+		defer r.mu.Unlock()
+		delete(r.collectors, id)
+	}
+}
+
+// Default is the registry the native worker pool reports to.
+var Default = NewRegistry()
+
+func seconds(ns uint64) float64 {
+	return (time.Duration(ns)).Seconds()
+}
+
+// ObserveFile records the metrics of one processed file. codec labels the results (usually the decoder of the first
+// audio stream), so pathological codecs stand out. A nil file (e.g. the worker crashed) only counts the file.
+func (r *Registry) ObserveFile(codec string, ok bool, file *File) {
+	if codec == "" {
+		codec = "unknown"
+	}
+	result := "ok"
+	if !ok {
+		result = "error"
+	}
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	fk := fileKey{codec: codec, result: result}
+	fs, found := r.files[fk]
+	if !found {
+		fs = &fileStats{wall: newHistogram()}
+		r.files[fk] = fs
+	}
+	fs.files++
+	if file == nil {
+		return
+	}
+	fs.wall.observe(seconds(file.WallNs))
+	fs.cpuSeconds += seconds(file.CpuNs)
+
+	if m := file.Memory; m != nil {
+		if m.PeakBytes > r.memory.PeakBytes {
+			r.memory.PeakBytes = m.PeakBytes
+		}
+		r.memory.Reservations += m.Reservations
+		r.memory.Denied += m.Denied
+		r.memory.Spills += m.Spills
+		r.memory.SpilledBytes += m.SpilledBytes
+		r.memory.Waits += m.Waits
+		r.memory.WaitNs += m.WaitNs
+	}
+
+	for stage, totals := range file.Stages {
+		sk := stageKey{stage: stage, codec: codec}
+		ss, found := r.stages[sk]
+		if !found {
+			ss = &stageStats{wall: newHistogram()}
+			r.stages[sk] = ss
+		}
+		ss.wall.observe(seconds(totals.WallNs))
+		ss.cpuSeconds += seconds(totals.CpuNs)
+		ss.calls += totals.Calls
+		ss.bytes += totals.Bytes
+		ss.samples += totals.Samples
+	}
+}
@@ -0,0 +1,155 @@
+package metrics
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"net/http"
+	"sort"
+	"strconv"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+)
+
+func formatFloat(v float64) string {
+	return strconv.FormatFloat(v, 'g', -1, 64)
+}
+
+func writeHistogram(w io.Writer, name string, labels string, h *histogram) {
+	var cumulative uint64
+	for i, bound := range bucketBounds {
+		cumulative += h.counts[i]
+		fmt.Fprintf(w, "%s_bucket{%s,le=\"%s\"} %d\n", name, labels, formatFloat(bound), cumulative)
+	}
+	cumulative += h.counts[len(bucketBounds)]
+	fmt.Fprintf(w, "%s_bucket{%s,le=\"+Inf\"} %d\n", name, labels, cumulative)
+	fmt.Fprintf(w, "%s_sum{%s} %s\n", name, labels, formatFloat(h.sum))
+	fmt.Fprintf(w, "%s_count{%s} %d\n", name, labels, h.count)
+}
+
+// Header writes the HELP and TYPE lines of a metric.
+func Header(w io.Writer, name, kind, help string) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, kind)
+}
+
+// WriteText writes all metrics in the Prometheus text exposition format.
+func (r *Registry) WriteText(out io.Writer) error {
+	w := bufio.NewWriter(out)
+
+	r.mu.Lock()
+	stageKeys := make([]stageKey, 0, len(r.stages))
+	for k := range r.stages {
+		stageKeys = append(stageKeys, k)
+	}
+	sort.Slice(stageKeys, func(i, j int) bool {
+		if stageKeys[i].stage != stageKeys[j].stage {
+			return stageKeys[i].stage < stageKeys[j].stage
+		}
+		return stageKeys[i].codec < stageKeys[j].codec
+	})
+	fileKeys := make([]fileKey, 0, len(r.files))
+	for k := range r.files {
+		fileKeys = append(fileKeys, k)
+	}
+	sort.Slice(fileKeys, func(i, j int) bool {
+		if fileKeys[i].codec != fileKeys[j].codec {
+			return fileKeys[i].codec < fileKeys[j].codec
+		}
+		return fileKeys[i].result < fileKeys[j].result
+	})
+
+	stageLabels := func(k stageKey) string { return fmt.Sprintf("stage=%q,codec=%q", k.stage, k.codec) }
+
+	Header(w, "audiofs_transcode_stage_seconds", "histogram", "Wall time per file spent in a transcode pipeline stage.")
+	for _, k := range stageKeys {
+		writeHistogram(w, "audiofs_transcode_stage_seconds", stageLabels(k), r.stages[k].wall)
+	}
+	Header(w, "audiofs_transcode_stage_cpu_seconds_total", "counter", "CPU time spent in a transcode pipeline stage.")
+	for _, k := range stageKeys {
+		fmt.Fprintf(w, "audiofs_transcode_stage_cpu_seconds_total{%s} %s\n", stageLabels(k), formatFloat(r.stages[k].cpuSeconds))
+	}
+	Header(w, "audiofs_transcode_stage_calls_total", "counter", "Calls into a transcode pipeline stage.")
+	for _, k := range stageKeys {
+		fmt.Fprintf(w, "audiofs_transcode_stage_calls_total{%s} %d\n", stageLabels(k), r.stages[k].calls)
+	}
+	Header(w, "audiofs_transcode_stage_bytes_total", "counter", "Compressed bytes read or written by a transcode pipeline stage.")
+	for _, k := range stageKeys {
+		fmt.Fprintf(w, "audiofs_transcode_stage_bytes_total{%s} %d\n", stageLabels(k), r.stages[k].bytes)
+	}
+	Header(w, "audiofs_transcode_stage_samples_total", "counter", "Samples per channel produced by a transcode pipeline stage.")
+	for _, k := range stageKeys {
+		fmt.Fprintf(w, "audiofs_transcode_stage_samples_total{%s} %d\n", stageLabels(k), r.stages[k].samples)
+	}
+
+	fileLabels := func(k fileKey) string { return fmt.Sprintf("codec=%q,result=%q", k.codec, k.result) }
+
+	Header(w, "audiofs_files_total", "counter", "Processed files, including those a worker crashed on.")
+	for _, k := range fileKeys {
+		fmt.Fprintf(w, "audiofs_files_total{%s} %d\n", fileLabels(k), r.files[k].files)
+	}
+	Header(w, "audiofs_file_seconds", "histogram", "Wall time per processed file.")
+	for _, k := range fileKeys {
+		writeHistogram(w, "audiofs_file_seconds", fileLabels(k), r.files[k].wall)
+	}
+	Header(w, "audiofs_file_cpu_seconds_total", "counter", "CPU time spent on processed files.")
+	for _, k := range fileKeys {
+		fmt.Fprintf(w, "audiofs_file_cpu_seconds_total{%s} %s\n", fileLabels(k), formatFloat(r.files[k].cpuSeconds))
+	}
+
+	Header(w, "audiofs_memory_peak_bytes", "gauge", "Most buffer memory a native worker held at once for a single file.")
+	fmt.Fprintf(w, "audiofs_memory_peak_bytes %d\n", r.memory.PeakBytes)
+	Header(w, "audiofs_memory_reservations_total", "counter", "Buffer memory reservations granted by the native memory budget.")
+	fmt.Fprintf(w, "audiofs_memory_reservations_total %d\n", r.memory.Reservations)
+	Header(w, "audiofs_memory_denied_total", "counter", "Buffer memory reservations denied by the native memory budget.")
+	fmt.Fprintf(w, "audiofs_memory_denied_total %d\n", r.memory.Denied)
+	Header(w, "audiofs_memory_spills_total", "counter", "Buffers moved to a spill file, as the memory budget was used up.")
+	fmt.Fprintf(w, "audiofs_memory_spills_total %d\n", r.memory.Spills)
+	Header(w, "audiofs_memory_spilled_bytes_total", "counter", "Bytes of buffers written to spill files.")
+	fmt.Fprintf(w, "audiofs_memory_spilled_bytes_total %d\n", r.memory.SpilledBytes)
+	Header(w, "audiofs_memory_waits_total", "counter", "In-memory outputs which waited for room in the memory budget.")
+	fmt.Fprintf(w, "audiofs_memory_waits_total %d\n", r.memory.Waits)
+	Header(w, "audiofs_memory_wait_seconds_total", "counter", "Time in-memory outputs waited for room in the memory budget.")
+	fmt.Fprintf(w, "audiofs_memory_wait_seconds_total %s\n", formatFloat(seconds(r.memory.WaitNs)))
+
+	ids := make([]int, 0, len(r.collectors))
+	for id := range r.collectors {
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	for _, id := range ids {
+		r.collectors[id](w)
+	}
+	r.mu.Unlock()
+
+	return w.Flush()
+}
+
+// Handler serves the registry in the Prometheus text format.
+func (r *Registry) Handler() http.Handler {
+	return http.HandlerFunc(func(w http.ResponseWriter, req *http.Request) {
+		w.Header().Set("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+		_ = r.WriteText(w)
+	})
+}
+
+// ListenAndServe serves the default registry on /metrics.
+func ListenAndServe(addr string) error {
+	mux := http.NewServeMux()
+	mux.Handle("/metrics", Default.Handler())
+	return http.ListenAndServe(addr, mux)
+}
+
+// ServeConfigured serves the default registry on `metrics.listen` in the background, unless it is empty.
+func ServeConfigured() {
+	addr := config.Config.GetString("metrics.listen")
+	if addr == "" {
+		return
+	}
+	go func() {
+		logrus.Infof("serving metrics on http://%s/metrics", addr)
+		if err := ListenAndServe(addr); err != nil {
+			logrus.Errorf("metrics endpoint: %v", err)
+		}
+	}()
+}
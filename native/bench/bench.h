@@ -0,0 +1,78 @@
+//
+// Shared helpers for the native benchmarks. Every result is printed as one JSON object per line to stdout, so runs can
+// be collected and compared between releases. Logging goes to stderr as usual.
+//
+
+#ifndef NATIVE_BENCH_BENCH_H
+#define NATIVE_BENCH_BENCH_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * bench_report_ops: print a single benchmark result covering `ops` repetitions
+ *
+ * @param suite         benchmark binary / area (e.g. 'fingerprint')
+ * @param bench         benchmark name
+ * @param variant       input variant (e.g. '7.1@192000/fltp')
+ * @param ops           number of repetitions covered by the totals below
+ * @param wall_seconds  measured wall time, in total
+ * @param bytes         bytes processed in total (0 if not applicable)
+ * @param audio_seconds seconds of audio processed in total (0 if not applicable)
+ */
+static inline void bench_report_ops(
+    const char *suite,
+    const char *bench,
+    const char *variant,
+    uint64_t    ops,
+    double      wall_seconds,
+    uint64_t    bytes,
+    double      audio_seconds) {
+    double gb_per_s  = wall_seconds > 0 ? (double)bytes / wall_seconds / 1e9 : 0;
+    double realtime  = wall_seconds > 0 ? audio_seconds / wall_seconds : 0;
+    double ns_per_op = ops > 0 ? wall_seconds * 1e9 / (double)ops : 0;
+    fprintf(
+        stdout,
+        "{\"suite\":\"%s\",\"bench\":\"%s\",\"variant\":\"%s\",\"ops\":%" PRIu64 ",\"ns_per_op\":%.0f,"
+        "\"wall_s\":%.6f,\"bytes\":%" PRIu64 ",\"gb_per_s\":%.3f,\"audio_s\":%.3f,\"realtime\":%.2f}\n",
+        suite,
+        bench,
+        variant,
+        ops,
+        ns_per_op,
+        wall_seconds,
+        bytes,
+        gb_per_s,
+        audio_seconds,
+        realtime);
+    fflush(stdout);
+}
+
+/**
+ * bench_report: print a single benchmark result
+ *
+ * @param suite         benchmark binary / area (e.g. 'fingerprint')
+ * @param bench         benchmark name
+ * @param variant       input variant (e.g. '7.1@192000/fltp')
+ * @param wall_seconds  measured wall time
+ * @param bytes         bytes processed (0 if not applicable)
+ * @param audio_seconds seconds of audio processed (0 if not applicable)
+ */
+static inline void bench_report(
+    const char *suite,
+    const char *bench,
+    const char *variant,
+    double      wall_seconds,
+    uint64_t    bytes,
+    double      audio_seconds) {
+    bench_report_ops(suite, bench, variant, 1, wall_seconds, bytes, audio_seconds);
+}
+
+#endif // NATIVE_BENCH_BENCH_H
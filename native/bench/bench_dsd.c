@@ -0,0 +1,250 @@
+//
+// DSD to PCM conversion: every FIR kernel is checked against the scalar one, then the converter is compared with
+// libav's decoder followed by swresample to the same rate, as realtime multiples.
+//
+
+#include "../dsd.h"
+#include "../macros.h"
+#include "bench.h"
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#include <math.h>
+#include <string.h>
+
+#define BENCH_SECONDS     5 // of audio per variant
+#define BENCH_PACKET      4096 // bytes per channel per packet, like DSF's blocks
+#define BENCH_TONE        1000.0
+#define BENCH_AMPLITUDE   0.5
+#define KERNEL_SAMPLES    (64 * 1024)
+#define KERNEL_TOLERANCE  1e-5
+
+static const int32_t dsd_rates[] = {2822400, 5644800, 11289600}; // DSD64, DSD128, DSD256
+static const int     channels[]  = {2, 6};
+static const int32_t pcm_rates[] = {88200, 176400};
+
+/**
+ * Fills planar MSB first DSD with a sine per channel, from a second order sigma-delta modulator.
+ */
+static void synthesize(uint8_t *dst, int nb_channels, int32_t bit_rate, size_t bytes) {
+    for (int c = 0; c < nb_channels; c++) {
+        double v1 = 0, v2 = 0, y = -1;
+        for (size_t i = 0; i < bytes; i++) {
+            uint8_t byte = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                double t = (double)(i * 8 + bit) / bit_rate;
+                double x = BENCH_AMPLITUDE * sin(2 * M_PI * BENCH_TONE * (c + 1) * t);
+                v1 += x - y;
+                v2 += v1 - y;
+                y    = v2 >= 0 ? 1 : -1;
+                byte = (uint8_t)(byte << 1 | (y > 0));
+            }
+            dst[c * bytes + i] = byte;
+        }
+    }
+}
+
+static int check_kernels(void) {
+    const dsd_kernels *supported[4];
+    size_t             count  = dsd_kernels_supported(supported, sizeof(supported) / sizeof(supported[0]));
+    int                failed = 0;
+
+    for (int ratio = DSD_MIN_RATIO; ratio <= DSD_MAX_RATIO; ratio *= 2) {
+        const dsd_filter *filter = dsd_filter_get(ratio);
+        size_t            size   = KERNEL_SAMPLES * ratio / 8 + filter->bytes;
+        uint8_t *         src    = AUDIOFS_MALLOC(size);
+        float *           ref    = AUDIOFS_CALLOC(KERNEL_SAMPLES, sizeof(float));
+        float *           dst    = AUDIOFS_CALLOC(KERNEL_SAMPLES, sizeof(float));
+        uint32_t          seed   = 0x1234567;
+        for (size_t i = 0; i < size; i++) {
+            seed   = seed * 1664525 + 1013904223;
+            src[i] = (uint8_t)(seed >> 24);
+        }
+
+        supported[0]->fir(ref, src, KERNEL_SAMPLES, filter);
+        for (size_t k = 0; k < count; k++) {
+            double worst = 0;
+            supported[k]->fir(dst, src, KERNEL_SAMPLES, filter);
+            for (size_t i = 0; i < KERNEL_SAMPLES; i++) { worst = MAX(worst, fabs((double)ref[i] - dst[i])); }
+            if (worst > KERNEL_TOLERANCE) {
+                errorf("ratio %d: %s output differs from scalar by %g\n", ratio, supported[k]->name, worst);
+                failed = 1;
+                continue;
+            }
+
+            char variant[32];
+            snprintf(variant, sizeof(variant), "%s/%d", supported[k]->name, ratio);
+            double start = bench_now();
+            supported[k]->fir(dst, src, KERNEL_SAMPLES, filter);
+            bench_report_ops("dsd", "fir", variant, KERNEL_SAMPLES, bench_now() - start, size, 0);
+        }
+        AUDIOFS_FREE(src);
+        AUDIOFS_FREE(ref);
+        AUDIOFS_FREE(dst);
+    }
+    return failed;
+}
+
+/**
+ * Converts all input with the DSD converter.
+ *
+ * @return peak of the first channel after the first second, or a negative value on error
+ */
+static double run_converter(
+    const uint8_t *        dsd,
+    size_t                 bytes,
+    const AVChannelLayout *layout,
+    int32_t                bit_rate,
+    int32_t                pcm_rate,
+    int64_t *              samples) {
+    dsd_converter *conv   = dsd_converter_alloc(AV_CODEC_ID_DSD_MSBF_PLANAR, layout, bit_rate, pcm_rate, 0);
+    AVPacket *     packet = av_packet_alloc();
+    AVFrame *      frame  = av_frame_alloc();
+    double         peak   = 0;
+    int            ret    = 0;
+
+    *samples = 0;
+    if (conv == NULL || packet == NULL || frame == NULL
+        || av_new_packet(packet, BENCH_PACKET * layout->nb_channels) < 0) {
+        peak = -1;
+        goto end;
+    }
+    for (size_t offset = 0; ret >= 0; offset += BENCH_PACKET) {
+        if (offset < bytes) {
+            size_t length = MIN(BENCH_PACKET, bytes - offset);
+            for (int c = 0; c < layout->nb_channels; c++) {
+                memcpy(packet->data + c * length, dsd + c * bytes + offset, length);
+            }
+            packet->size = (int)(length * layout->nb_channels);
+            ret          = dsd_converter_send(conv, packet);
+        } else {
+            ret = dsd_converter_send(conv, NULL);
+        }
+        while (ret >= 0 && (ret = dsd_converter_receive(conv, frame)) >= 0) {
+            const float *left = (const float *)frame->extended_data[0];
+            for (int i = 0; i < frame->nb_samples; i++) {
+                if (*samples + i >= pcm_rate) { peak = MAX(peak, fabs(left[i])); }
+            }
+            *samples += frame->nb_samples;
+        }
+        if (ret == AVERROR(EAGAIN)) { ret = 0; }
+    }
+    if (ret != AVERROR_EOF) { peak = -1; }
+
+end:
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    dsd_converter_free(&conv);
+    return peak;
+}
+
+/**
+ * Converts all input with libav's DSD decoder and swresample.
+ *
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static int run_libav(
+    const uint8_t *        dsd,
+    size_t                 bytes,
+    const AVChannelLayout *layout,
+    int32_t                bit_rate,
+    int32_t                pcm_rate,
+    int64_t *              samples) {
+    const AVCodec * codec   = avcodec_find_decoder(AV_CODEC_ID_DSD_MSBF_PLANAR);
+    AVCodecContext *dec_ctx = codec != NULL ? avcodec_alloc_context3(codec) : NULL;
+    SwrContext *    swr     = swr_alloc();
+    AVPacket *      packet  = av_packet_alloc();
+    AVFrame *       decoded = av_frame_alloc();
+    AVFrame *       frame   = av_frame_alloc();
+    int             ret     = AVERROR(ENOMEM);
+
+    *samples = 0;
+    if (dec_ctx == NULL || swr == NULL || packet == NULL || decoded == NULL || frame == NULL) { goto end; }
+    dec_ctx->sample_rate = bit_rate / 8;
+    if ((ret = av_channel_layout_copy(&dec_ctx->ch_layout, layout)) < 0) { goto end; }
+    if ((ret = avcodec_open2(dec_ctx, codec, NULL)) < 0) { goto end; }
+    if ((ret = av_new_packet(packet, BENCH_PACKET * layout->nb_channels)) < 0) { goto end; }
+
+    av_opt_set_chlayout(swr, "in_chlayout", layout, 0);
+    av_opt_set_chlayout(swr, "out_chlayout", layout, 0);
+    av_opt_set_int(swr, "in_sample_rate", dec_ctx->sample_rate, 0);
+    av_opt_set_int(swr, "out_sample_rate", pcm_rate, 0);
+    av_opt_set_sample_fmt(swr, "in_sample_fmt", dec_ctx->sample_fmt, 0);
+    av_opt_set_sample_fmt(swr, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
+    if ((ret = swr_init(swr)) < 0) { goto end; }
+
+    for (size_t offset = 0; offset < bytes; offset += BENCH_PACKET) {
+        size_t length = MIN(BENCH_PACKET, bytes - offset);
+        for (int c = 0; c < layout->nb_channels; c++) {
+            memcpy(packet->data + c * length, dsd + c * bytes + offset, length);
+        }
+        packet->size = (int)(length * layout->nb_channels);
+        if ((ret = avcodec_send_packet(dec_ctx, packet)) < 0) { goto end; }
+        while ((ret = avcodec_receive_frame(dec_ctx, decoded)) >= 0) {
+            av_frame_unref(frame);
+            frame->format      = AV_SAMPLE_FMT_FLTP;
+            frame->sample_rate = pcm_rate;
+            if ((ret = av_channel_layout_copy(&frame->ch_layout, layout)) < 0) { goto end; }
+            if ((ret = swr_convert_frame(swr, frame, decoded)) < 0) { goto end; }
+            *samples += frame->nb_samples;
+        }
+        if (ret != AVERROR(EAGAIN)) { goto end; }
+    }
+    ret = 0;
+
+end:
+    av_frame_free(&frame);
+    av_frame_free(&decoded);
+    av_packet_free(&packet);
+    swr_free(&swr);
+    avcodec_free_context(&dec_ctx);
+    return ret;
+}
+
+int main(void) {
+    int failed = check_kernels();
+
+    for (size_t r = 0; r < sizeof(dsd_rates) / sizeof(dsd_rates[0]); r++) {
+        for (size_t c = 0; c < sizeof(channels) / sizeof(channels[0]); c++) {
+            AVChannelLayout layout;
+            size_t          bytes = (size_t)dsd_rates[r] / 8 * BENCH_SECONDS;
+            uint8_t *       dsd   = AUDIOFS_MALLOC(bytes * channels[c]);
+            if (dsd == NULL) {
+                errorf("Could not allocate benchmark buffers\n");
+                return 1;
+            }
+            av_channel_layout_default(&layout, channels[c]);
+            synthesize(dsd, channels[c], dsd_rates[r], bytes);
+
+            for (size_t p = 0; p < sizeof(pcm_rates) / sizeof(pcm_rates[0]); p++) {
+                char    variant[64];
+                int64_t samples = 0;
+                snprintf(variant, sizeof(variant), "DSD%d/%dch@%d", dsd_rates[r] / 44100, channels[c], pcm_rates[p]);
+
+                double start = bench_now();
+                double peak  = run_converter(dsd, bytes, &layout, dsd_rates[r], pcm_rates[p], &samples);
+                double wall  = bench_now() - start;
+                // The tone is far below the filter's cutoff, so it has to come out at its original level.
+                if (peak < 0 || fabs(peak - BENCH_AMPLITUDE) > 0.01 * BENCH_AMPLITUDE
+                    || samples != (int64_t)pcm_rates[p] * BENCH_SECONDS) {
+                    errorf("%s: converted %" PRId64 " samples with peak %f\n", variant, samples, peak);
+                    failed = 1;
+                } else {
+                    bench_report("dsd", "converter", variant, wall, bytes * channels[c], BENCH_SECONDS);
+                }
+
+                start   = bench_now();
+                int ret = run_libav(dsd, bytes, &layout, dsd_rates[r], pcm_rates[p], &samples);
+                wall    = bench_now() - start;
+                if (ret < 0) {
+                    errorf("%s: libav conversion failed: %s\n", variant, av_err2str(ret));
+                    failed = 1;
+                } else {
+                    bench_report("dsd", "libav+swr", variant, wall, bytes * channels[c], BENCH_SECONDS);
+                }
+            }
+            av_channel_layout_uninit(&layout);
+            AUDIOFS_FREE(dsd);
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,169 @@
+//
+// Benchmarks the fingerprint conversion plan against the previous pipeline (resample to 44.1 kHz keeping the source
+// layout, let chromaprint downmix and resample internally), focusing on hi-res multichannel sources.
+//
+
+#include "../resampler.h"
+#include "../util.h"
+#include "bench.h"
+#include <chromaprint.h>
+#include <libavutil/channel_layout.h>
+#include <math.h>
+
+// defined in libav.c
+extern decoder_context *decoder_context_alloc(AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *codec_ctx);
+extern void             decoder_context_free(decoder_context **ctx);
+extern decoder_context *
+           fingerprint_conversion_alloc(AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *codec_ctx);
+extern int change_target_format(
+    struct decoder_context *ctx,
+    enum AVSampleFormat     target_fmt,
+    u_int8_t                target_depth,
+    int32_t                 target_rate,
+    const AVChannelLayout * target_layout);
+
+#define BENCH_AUDIO_SECONDS 60
+#define BENCH_FRAME_SAMPLES 4096
+
+typedef enum { PLAN, PLAN_DITHERED, LEGACY } variant;
+
+static const char *variant_names[] = {"fingerprint_plan", "fingerprint_plan_dithered", "legacy_44100"};
+
+typedef struct source {
+    AVChannelLayout     layout;
+    int32_t             sample_rate;
+    enum AVSampleFormat sample_fmt;
+} source;
+
+static void fill_frame(AVFrame *frame, int64_t offset) {
+    int channels = frame->ch_layout.nb_channels;
+    for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < frame->nb_samples; i++) {
+            double v = 0.5 * sin(2 * M_PI * (220.0 * (c + 1)) * (double)(offset + i) / frame->sample_rate);
+            switch (frame->format) {
+                case AV_SAMPLE_FMT_FLTP:
+                    ((float *)frame->extended_data[c])[i] = (float)v;
+                    break;
+                case AV_SAMPLE_FMT_S32P:
+                    ((int32_t *)frame->extended_data[c])[i] = (int32_t)(v * INT32_MAX);
+                    break;
+                case AV_SAMPLE_FMT_S16:
+                default:
+                    ((int16_t *)frame->data[0])[i * channels + c] = (int16_t)(v * INT16_MAX);
+                    break;
+            }
+        }
+    }
+}
+
+static decoder_context *plan_for(variant v, AVCodecContext *codec_ctx) {
+    AVChannelLayout  mono = (AVChannelLayout)AV_CHANNEL_LAYOUT_MONO;
+    decoder_context *ctx  = NULL;
+    switch (v) {
+        case PLAN:
+            return fingerprint_conversion_alloc(NULL, NULL, codec_ctx);
+        case PLAN_DITHERED:
+            ctx = decoder_context_alloc(NULL, NULL, codec_ctx);
+            if (change_target_format(ctx, AV_SAMPLE_FMT_S16, 16, FINGERPRINT_SAMPLE_RATE, &mono) < 0
+                || set_dither_settings(ctx, DITHER_DEFAULT, SWR_ENGINE_SWR) < 0
+                || setup_swr(ctx, DITHER_DEFAULT, SWR_ENGINE_SWR) < 0) {
+                decoder_context_free(&ctx);
+            }
+            return ctx;
+        case LEGACY:
+        default:
+            ctx = decoder_context_alloc(NULL, NULL, codec_ctx);
+            if (change_target_format(ctx, AV_SAMPLE_FMT_S16, 16, 44100, NULL) < 0
+                || setup_swr(ctx, SWR_DITHER_NONE, SWR_ENGINE_SWR) < 0) {
+                decoder_context_free(&ctx);
+            }
+            return ctx;
+    }
+}
+
+static int run(const source *src, variant v) {
+    char                variant_name[128];
+    char                layout_name[64];
+    AVCodecContext *    codec_ctx   = avcodec_alloc_context3(NULL);
+    AVFrame *           in          = av_frame_alloc();
+    AVFrame *           out         = av_frame_alloc();
+    ChromaprintContext *chromaprint = chromaprint_new(CHROMAPRINT_ALGORITHM_DEFAULT);
+    decoder_context *   ctx         = NULL;
+    int                 ret         = -1;
+
+    av_channel_layout_describe(&src->layout, layout_name, sizeof(layout_name));
+    snprintf(
+        variant_name,
+        sizeof(variant_name),
+        "%s@%d/%s",
+        layout_name,
+        src->sample_rate,
+        av_get_sample_fmt_name(src->sample_fmt));
+
+    codec_ctx->sample_fmt  = src->sample_fmt;
+    codec_ctx->sample_rate = src->sample_rate;
+    if (av_channel_layout_copy(&codec_ctx->ch_layout, &src->layout) < 0) { goto end; }
+
+    in->format      = src->sample_fmt;
+    in->sample_rate = src->sample_rate;
+    in->nb_samples  = BENCH_FRAME_SAMPLES;
+    if (av_channel_layout_copy(&in->ch_layout, &src->layout) < 0 || av_frame_get_buffer(in, 0) < 0) { goto end; }
+
+    if ((ctx = plan_for(v, codec_ctx)) == NULL || ctx->swrContext == NULL) { goto end; }
+    if (!chromaprint_start(chromaprint, ctx->override_sample_rate, ctx->override_channels)) { goto end; }
+
+    int64_t total = (int64_t)BENCH_AUDIO_SECONDS * src->sample_rate;
+    double  start = bench_now();
+    for (int64_t offset = 0; offset < total; offset += BENCH_FRAME_SAMPLES) {
+        // Generating the input is not part of what we measure.
+        double pause = bench_now();
+        fill_frame(in, offset);
+        start += bench_now() - pause;
+
+        out->format      = ctx->override_sample_fmt;
+        out->sample_rate = ctx->override_sample_rate;
+        av_channel_layout_copy(&out->ch_layout, &ctx->override_channel_layout);
+        if (swr_convert_frame(ctx->swrContext, out, in) < 0) { goto end; }
+        chromaprint_feed(chromaprint, (const int16_t *)out->data[0], out->nb_samples * ctx->override_channels);
+        av_frame_unref(out);
+    }
+    chromaprint_finish(chromaprint);
+    double wall = bench_now() - start;
+
+    bench_report(
+        "fingerprint",
+        variant_names[v],
+        variant_name,
+        wall,
+        (uint64_t)total * src->layout.nb_channels * av_get_bytes_per_sample(src->sample_fmt),
+        BENCH_AUDIO_SECONDS);
+    ret = 0;
+
+end:
+    if (ret < 0) { errorf("%s: %s failed\n", variant_names[v], variant_name); }
+    chromaprint_free(chromaprint);
+    decoder_context_free(&ctx);
+    av_frame_free(&in);
+    av_frame_free(&out);
+    avcodec_free_context(&codec_ctx);
+    return ret;
+}
+
+int main(void) {
+    const source sources[] = {
+        {AV_CHANNEL_LAYOUT_STEREO, 44100, AV_SAMPLE_FMT_S16},
+        {AV_CHANNEL_LAYOUT_STEREO, 96000, AV_SAMPLE_FMT_S32P},
+        {AV_CHANNEL_LAYOUT_STEREO, 192000, AV_SAMPLE_FMT_S32P},
+        {AV_CHANNEL_LAYOUT_5POINT1, 48000, AV_SAMPLE_FMT_FLTP},
+        {AV_CHANNEL_LAYOUT_5POINT1, 96000, AV_SAMPLE_FMT_S32P},
+        {AV_CHANNEL_LAYOUT_7POINT1, 96000, AV_SAMPLE_FMT_FLTP},
+        {AV_CHANNEL_LAYOUT_7POINT1, 192000, AV_SAMPLE_FMT_S32P},
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        for (variant v = PLAN; v <= LEGACY; v++) { failed |= run(&sources[i], v); }
+    }
+
+    return failed ? 1 : 0;
+}
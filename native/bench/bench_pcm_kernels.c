@@ -0,0 +1,142 @@
+//
+// Per-kernel throughput of the PCM conversion kernels, for every instruction set the CPU supports. Every vectorized
+// result is checked against the scalar kernels first.
+//
+
+#include "../macros.h"
+#include "../pcm_kernels.h"
+#include "bench.h"
+#include <string.h>
+
+#define BENCH_SAMPLES     (4 * 1024 * 1024) // per channel
+#define BENCH_MIN_SECONDS 0.5
+
+typedef enum {
+    S16_TO_BE,
+    S32_TO_BE,
+    S32_TO_S24BE,
+    S32_TO_S24LE,
+    INTERLEAVE_S16,
+    INTERLEAVE_S32,
+    SWAP16,
+    SWAP24,
+    SWAP32,
+    KERNEL_COUNT
+} kernel;
+
+static const char *kernel_names[] = {
+    "s16_to_be",
+    "s32_to_be",
+    "s32_to_s24be",
+    "s32_to_s24le",
+    "interleave_s16_stereo",
+    "interleave_s32_stereo",
+    "swap16",
+    "swap24",
+    "swap32",
+};
+
+static int16_t *left16, *right16;
+static int32_t *left32, *right32;
+
+/**
+ * Runs a kernel once over the whole input.
+ *
+ * @return bytes read from the input
+ */
+static uint64_t run_kernel(const pcm_kernels *k, kernel which, uint8_t *dst) {
+    const int16_t *planes16[2] = {left16, right16};
+    const int32_t *planes32[2] = {left32, right32};
+    switch (which) {
+        case S16_TO_BE:
+            k->s16_to_be(dst, left16, BENCH_SAMPLES);
+            return BENCH_SAMPLES * sizeof(int16_t);
+        case S32_TO_BE:
+            k->s32_to_be(dst, left32, BENCH_SAMPLES);
+            return BENCH_SAMPLES * sizeof(int32_t);
+        case S32_TO_S24BE:
+            k->s32_to_s24be(dst, left32, BENCH_SAMPLES);
+            return BENCH_SAMPLES * sizeof(int32_t);
+        case S32_TO_S24LE:
+            k->s32_to_s24le(dst, left32, BENCH_SAMPLES);
+            return BENCH_SAMPLES * sizeof(int32_t);
+        case INTERLEAVE_S16:
+            k->interleave_s16((int16_t *)dst, planes16, 2, BENCH_SAMPLES);
+            return 2 * BENCH_SAMPLES * sizeof(int16_t);
+        case INTERLEAVE_S32:
+            k->interleave_s32((int32_t *)dst, planes32, 2, BENCH_SAMPLES);
+            return 2 * BENCH_SAMPLES * sizeof(int32_t);
+        case SWAP16:
+            k->swap16(dst, (const uint8_t *)left16, BENCH_SAMPLES);
+            return BENCH_SAMPLES * 2;
+        case SWAP24:
+            // Reads the noise as packed 24-bit samples.
+            k->swap24(dst, (const uint8_t *)left32, BENCH_SAMPLES);
+            return BENCH_SAMPLES * 3;
+        case SWAP32:
+        default:
+            k->swap32(dst, (const uint8_t *)left32, BENCH_SAMPLES);
+            return BENCH_SAMPLES * 4;
+    }
+}
+
+int main(void) {
+    const pcm_kernels *supported[4];
+    size_t             count     = pcm_kernels_supported(supported, sizeof(supported) / sizeof(supported[0]));
+    size_t             dst_size  = 2 * BENCH_SAMPLES * sizeof(int32_t);
+    uint8_t *          reference = AUDIOFS_MALLOC(dst_size);
+    uint8_t *          dst       = AUDIOFS_MALLOC(dst_size);
+    int                failed    = 0;
+
+    left16  = AUDIOFS_CALLOC(BENCH_SAMPLES, sizeof(int16_t));
+    right16 = AUDIOFS_CALLOC(BENCH_SAMPLES, sizeof(int16_t));
+    left32  = AUDIOFS_CALLOC(BENCH_SAMPLES, sizeof(int32_t));
+    right32 = AUDIOFS_CALLOC(BENCH_SAMPLES, sizeof(int32_t));
+    if (!reference || !dst || !left16 || !right16 || !left32 || !right32) {
+        errorf("Could not allocate benchmark buffers\n");
+        return 1;
+    }
+
+    // Deterministic noise, so runs are comparable.
+    uint32_t seed = 0x1234567;
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        seed       = seed * 1664525 + 1013904223;
+        left16[i]  = (int16_t)(seed >> 16);
+        right16[i] = (int16_t)seed;
+        left32[i]  = (int32_t)(seed & 0xffffff00); // 24-in-32, as libav stores it
+        right32[i] = (int32_t)(~seed & 0xffffff00);
+    }
+
+    for (kernel which = 0; which < KERNEL_COUNT; which++) {
+        memset(reference, 0, dst_size);
+        run_kernel(supported[0], which, reference);
+
+        for (size_t i = 0; i < count; i++) {
+            memset(dst, 0, dst_size);
+            run_kernel(supported[i], which, dst);
+            if (0 != memcmp(reference, dst, dst_size)) {
+                errorf("%s: %s output differs from scalar\n", kernel_names[which], supported[i]->name);
+                failed = 1;
+                continue;
+            }
+
+            uint64_t bytes = 0;
+            double   start = bench_now();
+            double   wall  = 0;
+            do {
+                bytes += run_kernel(supported[i], which, dst);
+                wall = bench_now() - start;
+            } while (wall < BENCH_MIN_SECONDS);
+
+            bench_report("pcm_kernels", kernel_names[which], supported[i]->name, wall, bytes, 0);
+        }
+    }
+
+    AUDIOFS_FREE(reference);
+    AUDIOFS_FREE(dst);
+    AUDIOFS_FREE(left16);
+    AUDIOFS_FREE(right16);
+    AUDIOFS_FREE(left32);
+    AUDIOFS_FREE(right32);
+    return failed;
+}
@@ -0,0 +1,305 @@
+//
+// Benchmarks the native hot paths over the synthetic corpus (run `corpus` first): probing files via
+// get_metadate_from_file, transcoding via do_transcode and pulled jobs, and the custom_avio backends. The raw PCM path
+// of do_transcode is checked against decoding first, and pulled output against do_transcode's.
+//
+// Usage: bench_pipeline [corpus directory]
+//
+
+#include "../custom_avio.h"
+#include "../macros.h"
+#include "../membudget.h"
+#include "../transcode.h"
+#include "../util.h"
+#include "bench.h"
+#include "corpus.h"
+#include <libavutil/intreadwrite.h>
+#include <string.h>
+#include <unistd.h>
+
+// defined in libav.c
+extern void  audiofs_libav_setup();
+extern char *get_metadate_from_file(char *path, const fingerprint_options *fingerprint);
+// defined in transcode.c
+extern audiofs_avio_handle *do_transcode(
+    const char *            from_path,
+    AVFormatContext *       from_context,
+    const char *            to,
+    const AVOutputFormat *  oformat,
+    const char *            format_name,
+    const transcode_window *window);
+extern bool transcode_raw_pcm;
+
+// Short inputs are repeated until this much time was spent, so per-file overhead is measured reliably.
+#define BENCH_MIN_SECONDS 0.5
+// Transcoding to memory keeps the whole output around, so skip the hours long inputs there.
+#define BENCH_TRANSCODE_MAX_SECONDS 600
+#define BENCH_AVIO_BYTES            (16 * 1024 * 1024)
+// What transcode.c passes to avio_alloc_context
+#define BENCH_AVIO_CHUNK 4096
+// Bytes per transcode_job_pull, like a FUSE read or an HTTP response chunk
+#define BENCH_PULL_CHUNK (128 * 1024)
+
+static int bench_metadata(const char *path, const corpus_entry *entry, const fingerprint_options *fingerprint) {
+    uint64_t ops   = 0;
+    double   start = bench_now();
+    double   wall  = 0;
+
+    do {
+        char *json = get_metadate_from_file((char *)path, fingerprint);
+        if (json == NULL) {
+            errorf("%s: get_metadate_from_file failed\n", entry->name);
+            return 1;
+        }
+        AUDIOFS_FREE(json);
+        ops++;
+        wall = bench_now() - start;
+    } while (wall < BENCH_MIN_SECONDS);
+
+    double audio = fingerprint->length > 0 ? MIN(entry->seconds, fingerprint->length) : entry->seconds;
+    bench_report_ops(
+        "pipeline",
+        fingerprint->length > 0 ? "metadata" : "metadata_full",
+        entry->name,
+        ops,
+        wall,
+        0,
+        audio * (double)ops);
+    return 0;
+}
+
+static int bench_transcode(const char *path, const corpus_entry *entry, const char *format_name) {
+    char     bench_name[64];
+    uint64_t ops   = 0;
+    uint64_t bytes = 0;
+    double   start = bench_now();
+    double   wall  = 0;
+
+    do {
+        audiofs_avio_handle *output = do_transcode(path, NULL, "memory", NULL, format_name, NULL);
+        if (output == NULL) {
+            errorf("%s: do_transcode to %s failed\n", entry->name, format_name);
+            return 1;
+        }
+        bytes += audiofs_avio_get_size(output);
+        audiofs_avio_close(&output);
+        ops++;
+        wall = bench_now() - start;
+    } while (wall < BENCH_MIN_SECONDS);
+
+    snprintf(bench_name, sizeof(bench_name), "transcode_%s", format_name);
+    bench_report_ops("pipeline", bench_name, entry->name, ops, wall, bytes, entry->seconds * (double)ops);
+    return 0;
+}
+
+/**
+ * check_raw_pcm: compare the output of the raw PCM path with the output of decoding, byte for byte
+ *
+ * @return 0 if both are identical
+ */
+static int check_raw_pcm(const char *path, const corpus_entry *entry, const char *format_name) {
+    audiofs_avio_handle *outputs[2] = {NULL, NULL};
+    int                  failed     = 1;
+
+    for (int raw = 0; raw < 2; raw++) {
+        transcode_raw_pcm = raw;
+        outputs[raw]      = do_transcode(path, NULL, "memory", NULL, format_name, NULL);
+    }
+    transcode_raw_pcm = true;
+
+    if (outputs[0] != NULL && outputs[1] != NULL) {
+        off_t size = audiofs_avio_get_size(outputs[0]);
+        failed     = size != audiofs_avio_get_size(outputs[1])
+                 || 0 != memcmp(outputs[0]->buffer->data, outputs[1]->buffer->data, size);
+    }
+    if (failed) { errorf("%s: raw PCM %s output differs from decoding\n", entry->name, format_name); }
+
+    for (int raw = 0; raw < 2; raw++) {
+        if (outputs[raw] != NULL) { audiofs_avio_close(&outputs[raw]); }
+    }
+    return failed;
+}
+
+/**
+ * lossy_entry: whether the entry's duration is an estimate, which pulled aiff and wav outputs are sized by
+ */
+static bool lossy_entry(const corpus_entry *entry) {
+    // Only lossy entries have a bit rate.
+    return entry->bit_rate > 0;
+}
+
+/**
+ * bench_pull: pull a transcode job's output in chunks, reporting the time to the first chunk and the total
+ *
+ * Unlike bench_transcode, this also runs on the hours long inputs: only a chunk of output is held at a time.
+ *
+ * The output's header has to match its size. With a reference, it has to be identical, unless the input is lossy and
+ * its estimated duration made the output shorter or longer.
+ *
+ * @param reference output of do_transcode to compare with, or NULL
+ * @return 0 on success
+ */
+static int bench_pull(
+    const char *               path,
+    const corpus_entry *       entry,
+    const char *               format_name,
+    const audiofs_avio_handle *reference) {
+    char           bench_name[64];
+    uint8_t *      chunk     = AUDIOFS_MALLOC(BENCH_PULL_CHUNK);
+    uint64_t       bytes     = 0;
+    uint64_t       differing = 0;
+    uint8_t        header[8] = {0};
+    double         start     = bench_now();
+    double         first     = 0;
+    transcode_job *job       = transcode_job_open(path, NULL, NULL, format_name, NULL);
+    int            ret       = 0;
+
+    if (chunk == NULL || job == NULL) {
+        errorf("%s: could not start pulling %s\n", entry->name, format_name);
+        AUDIOFS_FREE(chunk);
+        transcode_job_close(&job);
+        return 1;
+    }
+    while ((ret = transcode_job_pull(job, chunk, BENCH_PULL_CHUNK)) > 0) {
+        if (bytes == 0) { first = bench_now() - start; }
+        if (bytes < sizeof(header)) { memcpy(header + bytes, chunk, MIN(sizeof(header) - bytes, (uint64_t)ret)); }
+        if (reference != NULL) {
+            uint64_t size = (uint64_t)audiofs_avio_get_size((audiofs_avio_handle *)reference);
+            for (int i = 0; i < ret; i++) {
+                differing += bytes + i >= size || chunk[i] != ((const uint8_t *)reference->buffer->data)[bytes + i];
+            }
+        }
+        bytes += ret;
+    }
+    double wall = bench_now() - start;
+    transcode_job_close(&job);
+    AUDIOFS_FREE(chunk);
+
+    if (ret < 0) {
+        errorf("%s: pulling %s failed\n", entry->name, format_name);
+        return 1;
+    }
+    uint32_t size = 0 == memcmp(header, "FORM", 4) ? AV_RB32(header + 4) : AV_RL32(header + 4);
+    if (size != bytes - 8) {
+        errorf("%s: pulled %s output of %" PRIu64 " bytes says it has %" PRIu32 "\n", entry->name, format_name, bytes,
+               size + 8);
+        return 1;
+    }
+    if (reference != NULL) {
+        bool same_size = bytes == (uint64_t)audiofs_avio_get_size((audiofs_avio_handle *)reference);
+        if (same_size ? differing > 0 : !lossy_entry(entry)) {
+            errorf(
+                "%s: pulled %s output differs from do_transcode's (%" PRIu64 " bytes, %" PRIu64 " differing)\n",
+                entry->name,
+                format_name,
+                bytes,
+                differing);
+            return 1;
+        }
+    }
+
+    snprintf(bench_name, sizeof(bench_name), "pull_first_chunk_%s", format_name);
+    bench_report("pipeline", bench_name, entry->name, first, 0, 0);
+    snprintf(bench_name, sizeof(bench_name), "pull_%s", format_name);
+    bench_report("pipeline", bench_name, entry->name, wall, bytes, entry->seconds);
+    return 0;
+}
+
+/**
+ * check_pull: pull an output and compare it with do_transcode's
+ *
+ * @return 0 if both are the same (see bench_pull)
+ */
+static int check_pull(const char *path, const corpus_entry *entry, const char *format_name) {
+    audiofs_avio_handle *reference = do_transcode(path, NULL, "memory", NULL, format_name, NULL);
+    if (reference == NULL) {
+        errorf("%s: do_transcode to %s failed\n", entry->name, format_name);
+        return 1;
+    }
+    int failed = bench_pull(path, entry, format_name, reference);
+    audiofs_avio_close(&reference);
+    return failed;
+}
+
+/**
+ * bench_avio: write and read back BENCH_AVIO_BYTES through a backend
+ *
+ * @param backend   'memory' or a filename
+ * @param variant   reported variant, e.g. the backend
+ */
+static int bench_avio(const char *backend, const char *variant) {
+    uint8_t *            chunk  = AUDIOFS_CALLOC(1, BENCH_AVIO_CHUNK);
+    audiofs_avio_handle *handle = audiofs_avio_open(backend);
+    int                  ret    = 1;
+    double               start;
+
+    if (chunk == NULL || handle == NULL) { goto end; }
+
+    start = bench_now();
+    for (uint64_t written = 0; written < BENCH_AVIO_BYTES; written += BENCH_AVIO_CHUNK) {
+        if (audiofs_avio_write(handle, chunk, BENCH_AVIO_CHUNK) != BENCH_AVIO_CHUNK) { goto end; }
+    }
+    bench_report("avio", "write", variant, bench_now() - start, BENCH_AVIO_BYTES, 0);
+
+    if (audiofs_avio_seek(handle, 0, SEEK_SET) != 0) { goto end; }
+    start = bench_now();
+    for (uint64_t read = 0; read < BENCH_AVIO_BYTES; read += BENCH_AVIO_CHUNK) {
+        if (audiofs_avio_read(handle, chunk, BENCH_AVIO_CHUNK) != BENCH_AVIO_CHUNK) { goto end; }
+    }
+    bench_report("avio", "read", variant, bench_now() - start, BENCH_AVIO_BYTES, 0);
+    ret = 0;
+
+end:
+    if (ret != 0) { errorf("avio benchmark on '%s' failed\n", variant); }
+    if (handle != NULL) { audiofs_avio_close(&handle); }
+    AUDIOFS_FREE(chunk);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    const char *              dir         = corpus_dir(argc, argv);
+    const fingerprint_options bounded     = {.length = FINGERPRINT_DEFAULT_LENGTH, .second_window_offset = 0};
+    const fingerprint_options full        = {.length = 0, .second_window_offset = 0};
+    int                       failed      = 0;
+    size_t                    benchmarked = 0;
+    char                      path[4096];
+
+    audiofs_libav_setup();
+
+    for (size_t i = 0; i < CORPUS_ENTRY_COUNT; i++) {
+        const corpus_entry *entry = &corpus_entries[i];
+        if (access(corpus_path(path, sizeof(path), dir, entry), R_OK) != 0) { continue; }
+        benchmarked++;
+
+        failed |= bench_metadata(path, entry, &bounded);
+        failed |= bench_metadata(path, entry, &full);
+        if (entry->seconds <= BENCH_TRANSCODE_MAX_SECONDS) {
+            if (0 == strncmp(entry->encoder, "pcm_", 4)) {
+                failed |= check_raw_pcm(path, entry, "aiff");
+                failed |= check_raw_pcm(path, entry, "wav");
+            }
+            failed |= bench_transcode(path, entry, "aiff");
+            failed |= bench_transcode(path, entry, "wav");
+            failed |= check_pull(path, entry, "aiff");
+            failed |= check_pull(path, entry, "wav");
+        } else {
+            failed |= bench_pull(path, entry, "aiff", NULL);
+            failed |= bench_pull(path, entry, "wav", NULL);
+        }
+    }
+    if (benchmarked == 0) {
+        errorf("No corpus found in '%s'. Run `corpus %s` first.\n", dir, dir);
+        failed = 1;
+    }
+
+    failed |= bench_avio("memory", "memory");
+    // A budget far below the output makes the memory backend spill (see membudget.h) after its first megabyte.
+    membudget_limit = 1024 * 1024;
+    failed |= bench_avio("memory", "memory_spilled");
+    membudget_limit = 0;
+    snprintf(path, sizeof(path), "%s/avio.tmp", dir);
+    failed |= bench_avio(path, path);
+    unlink(path);
+
+    return failed;
+}
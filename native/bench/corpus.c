@@ -0,0 +1,274 @@
+//
+// Generates the synthetic benchmark corpus (see corpus.h) with the bundled FFmpeg: aevalsrc/anoisesrc feed the enabled
+// encoders and muxers. Existing files are kept unless the corpus version changed, so this is cheap to run before every
+// benchmark. A manifest (one JSON object per line) describes the generated files for the Go benchmarks.
+//
+// Usage: corpus [directory]
+//
+
+#include "../macros.h"
+#include "../util.h"
+#include "corpus.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CORPUS_NOISE_SEED 0x5eed
+
+/**
+ * source_spec: filter graph description producing the entry's audio in the encoder's format
+ *
+ * @return 0 on success, AVERROR otherwise
+ */
+static int source_spec(char *buf, size_t size, const corpus_entry *entry, const AVChannelLayout *layout) {
+    char   exprs[1024] = {0};
+    size_t used        = 0;
+    int    written;
+
+    if (entry->source == CORPUS_TONES) {
+        // One tone per channel, slowly modulated, with a little noise on top. random(c) keeps its state in variable c.
+        for (int c = 0; c < layout->nb_channels; c++) {
+            written = snprintf(
+                exprs + used,
+                sizeof(exprs) - used,
+                "%s0.3*sin(2*PI*%d*t)*(0.6+0.4*sin(2*PI*0.25*t))+0.02*(2*random(%d)-1)",
+                c > 0 ? "|" : "",
+                110 + 55 * c,
+                c % 10);
+            if (written < 0 || (size_t)written >= sizeof(exprs) - used) { return AVERROR(ENOMEM); }
+            used += written;
+        }
+        written = snprintf(
+            buf,
+            size,
+            "aevalsrc=exprs=%s:c=%s:s=%d:d=%g,aformat=sample_fmts=%s:sample_rates=%d:channel_layouts=%s",
+            exprs,
+            entry->layout,
+            entry->sample_rate,
+            entry->seconds,
+            entry->sample_fmt,
+            entry->sample_rate,
+            entry->layout);
+    } else {
+        written = snprintf(
+            buf,
+            size,
+            "anoisesrc=c=pink:a=0.25:r=%d:d=%g:s=%d,aformat=sample_fmts=%s:sample_rates=%d:channel_layouts=%s",
+            entry->sample_rate,
+            entry->seconds,
+            CORPUS_NOISE_SEED,
+            entry->sample_fmt,
+            entry->sample_rate,
+            entry->layout);
+    }
+    return written < 0 || (size_t)written >= size ? AVERROR(ENOMEM) : 0;
+}
+
+/**
+ * encode_write: send a frame (NULL to flush) to the encoder and mux everything it returns
+ */
+static int encode_write(AVFormatContext *ofmt_ctx, AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *packet) {
+    int ret = avcodec_send_frame(enc_ctx, frame);
+    if (ret < 0) { return ret; }
+
+    while ((ret = avcodec_receive_packet(enc_ctx, packet)) >= 0) {
+        packet->stream_index = 0;
+        av_packet_rescale_ts(packet, enc_ctx->time_base, ofmt_ctx->streams[0]->time_base);
+        if ((ret = av_interleaved_write_frame(ofmt_ctx, packet)) < 0) { return ret; }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/**
+ * generate: write a single corpus entry to `path`
+ *
+ * @return 0 on success, AVERROR otherwise. AVERROR_ENCODER_NOT_FOUND/AVERROR_MUXER_NOT_FOUND if this build lacks
+ *         the required components.
+ */
+static int generate(const char *path, const corpus_entry *entry) {
+    const AVCodec *  encoder   = avcodec_find_encoder_by_name(entry->encoder);
+    AVFormatContext *ofmt_ctx  = NULL;
+    AVCodecContext * enc_ctx   = NULL;
+    AVFilterGraph *  graph     = NULL;
+    AVFilterContext *sink      = NULL;
+    AVFilterInOut *  inputs    = NULL;
+    AVFrame *        frame     = av_frame_alloc();
+    AVPacket *       packet    = av_packet_alloc();
+    AVStream *       stream    = NULL;
+    AVRational       sink_tb   = {0, 1};
+    char             spec[2048];
+    int              ret;
+
+    if (frame == NULL || packet == NULL) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (encoder == NULL) {
+        ret = AVERROR_ENCODER_NOT_FOUND;
+        goto end;
+    }
+    if ((ret = avformat_alloc_output_context2(&ofmt_ctx, NULL, entry->muxer, path)) < 0) {
+        ret = AVERROR_MUXER_NOT_FOUND;
+        goto end;
+    }
+
+    // region encoder
+    if (!(stream = avformat_new_stream(ofmt_ctx, NULL)) || !(enc_ctx = avcodec_alloc_context3(encoder))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = av_channel_layout_from_string(&enc_ctx->ch_layout, entry->layout)) < 0) { goto end; }
+    enc_ctx->sample_rate         = entry->sample_rate;
+    enc_ctx->sample_fmt          = av_get_sample_fmt(entry->sample_fmt);
+    enc_ctx->bits_per_raw_sample = entry->depth;
+    enc_ctx->bit_rate            = entry->bit_rate;
+    enc_ctx->time_base           = (AVRational){1, entry->sample_rate};
+    if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) { enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER; }
+
+    if ((ret = avcodec_open2(enc_ctx, encoder, NULL)) < 0) { goto end; }
+    if ((ret = avcodec_parameters_from_context(stream->codecpar, enc_ctx)) < 0) { goto end; }
+    stream->time_base = enc_ctx->time_base;
+    // endregion encoder
+
+    // region source
+    if (!(graph = avfilter_graph_alloc()) || !(inputs = avfilter_inout_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avfilter_graph_create_filter(&sink, avfilter_get_by_name("abuffersink"), "out", NULL, NULL, graph))
+        < 0) {
+        goto end;
+    }
+    inputs->name       = av_strdup("out");
+    inputs->filter_ctx = sink;
+    inputs->pad_idx    = 0;
+    inputs->next       = NULL;
+
+    if ((ret = source_spec(spec, sizeof(spec), entry, &enc_ctx->ch_layout)) < 0) { goto end; }
+    debugf("%s: %s\n", entry->name, spec);
+    if ((ret = avfilter_graph_parse_ptr(graph, spec, &inputs, NULL, NULL)) < 0) { goto end; }
+    if ((ret = avfilter_graph_config(graph, NULL)) < 0) { goto end; }
+    if (enc_ctx->frame_size > 0 && !(encoder->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) {
+        av_buffersink_set_frame_size(sink, enc_ctx->frame_size);
+    }
+    sink_tb = av_buffersink_get_time_base(sink);
+    // endregion source
+
+    if ((ret = avio_open(&ofmt_ctx->pb, path, AVIO_FLAG_WRITE)) < 0) { goto end; }
+    if ((ret = avformat_write_header(ofmt_ctx, NULL)) < 0) { goto end; }
+
+    while ((ret = av_buffersink_get_frame(sink, frame)) >= 0) {
+        frame->pts = av_rescale_q(frame->pts, sink_tb, enc_ctx->time_base);
+        ret        = encode_write(ofmt_ctx, enc_ctx, frame, packet);
+        av_frame_unref(frame);
+        if (ret < 0) { goto end; }
+    }
+    if (ret != AVERROR_EOF) { goto end; }
+
+    if ((ret = encode_write(ofmt_ctx, enc_ctx, NULL, packet)) < 0) { goto end; }
+    ret = av_write_trailer(ofmt_ctx);
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_graph_free(&graph);
+    avcodec_free_context(&enc_ctx);
+    if (ofmt_ctx != NULL) { avio_closep(&ofmt_ctx->pb); }
+    avformat_free_context(ofmt_ctx);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    return ret;
+}
+
+/**
+ * manifest_version: corpus version the manifest in `dir` was written for
+ *
+ * @return version, or -1 if there is no manifest
+ */
+static int manifest_version(const char *dir) {
+    char  path[4096];
+    int   version = -1;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, CORPUS_MANIFEST);
+    if ((file = fopen(path, "r")) == NULL) { return -1; }
+    if (1 != fscanf(file, "{\"version\":%d", &version)) { version = -1; }
+    fclose(file);
+    return version;
+}
+
+static int write_manifest(const char *dir) {
+    char  path[4096];
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, CORPUS_MANIFEST);
+    if ((file = fopen(path, "w")) == NULL) { return AVERROR(errno); }
+
+    for (size_t i = 0; i < CORPUS_ENTRY_COUNT; i++) {
+        const corpus_entry *entry = &corpus_entries[i];
+        struct stat         st;
+        if (stat(corpus_path(path, sizeof(path), dir, entry), &st) != 0) { continue; }
+        fprintf(
+            file,
+            "{\"version\":%d,\"file\":\"%s\",\"muxer\":\"%s\",\"encoder\":\"%s\",\"sample_fmt\":\"%s\",\"depth\":%d,"
+            "\"sample_rate\":%d,\"layout\":\"%s\",\"seconds\":%g,\"bytes\":%" PRId64 "}\n",
+            CORPUS_VERSION,
+            entry->name,
+            entry->muxer,
+            entry->encoder,
+            entry->sample_fmt,
+            entry->depth,
+            entry->sample_rate,
+            entry->layout,
+            entry->seconds,
+            (int64_t)st.st_size);
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *dir        = corpus_dir(argc, argv);
+    bool        regenerate = false;
+    int         failed     = 0;
+    char        path[4096];
+    char        tmp_path[4096 + 8];
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        errorf("Could not create corpus directory '%s'\n", dir);
+        return 1;
+    }
+    regenerate = manifest_version(dir) != CORPUS_VERSION;
+
+    for (size_t i = 0; i < CORPUS_ENTRY_COUNT; i++) {
+        const corpus_entry *entry = &corpus_entries[i];
+        corpus_path(path, sizeof(path), dir, entry);
+        if (!regenerate && access(path, F_OK) == 0) { continue; }
+
+        infof("generating %s (%g s)\n", entry->name, entry->seconds);
+        // Write next to the target and rename, so an interrupted run never leaves a truncated file behind.
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        int ret = generate(tmp_path, entry);
+        if (ret == AVERROR_ENCODER_NOT_FOUND || ret == AVERROR_MUXER_NOT_FOUND) {
+            warnf("skipping %s: %s/%s not available in this build\n", entry->name, entry->encoder, entry->muxer);
+            unlink(tmp_path);
+            continue;
+        }
+        if (ret < 0 || rename(tmp_path, path) != 0) {
+            errorf("Could not generate %s: %s\n", entry->name, av_err2str(ret));
+            unlink(tmp_path);
+            failed = 1;
+        }
+    }
+
+    if (write_manifest(dir) < 0) {
+        errorf("Could not write the corpus manifest\n");
+        failed = 1;
+    }
+    return failed;
+}
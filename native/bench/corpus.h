@@ -0,0 +1,90 @@
+//
+// The synthetic benchmark corpus. `corpus` generates it with the bundled FFmpeg, the other benchmarks (native and Go)
+// read it. Files are deterministic, so results are comparable between machines and releases as long as the corpus
+// version is the same.
+//
+
+#ifndef NATIVE_BENCH_CORPUS_H
+#define NATIVE_BENCH_CORPUS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Bump when changing the table, so stale corpora are regenerated.
+#define CORPUS_VERSION 1
+#define CORPUS_DEFAULT_DIR "bench-corpus"
+#define CORPUS_MANIFEST "manifest.jsonl"
+
+typedef enum {
+    // Per channel sines plus a bit of noise (aevalsrc). Compresses like music.
+    CORPUS_TONES,
+    // Pink noise (anoisesrc). Worst case for lossless codecs.
+    CORPUS_NOISE,
+} corpus_source;
+
+typedef struct corpus_entry {
+    const char *  name;       // file name inside the corpus directory
+    const char *  muxer;      // output format
+    const char *  encoder;    // encoder
+    const char *  sample_fmt; // sample format fed to the encoder
+    int           depth;      // bits_per_raw_sample, 0 for the sample format's width
+    int           sample_rate;
+    const char *  layout;
+    double        seconds;
+    int64_t       bit_rate; // lossy codecs only
+    corpus_source source;
+} corpus_entry;
+
+// Only encoders which build_ffmpeg.sh enables: it does not link any external codec library (LAME, libopus, libvorbis),
+// so lossy entries use the native AAC and AC-3 encoders.
+static const corpus_entry corpus_entries[] = {
+    // tiny files: per-file overhead dominates
+    {"tiny_pcm_s16_44100_mono.wav", "wav", "pcm_s16le", "s16", 0, 44100, "mono", 0.05, 0, CORPUS_TONES},
+    {"tiny_flac_s16_44100_stereo.flac", "flac", "flac", "s16", 0, 44100, "stereo", 1, 0, CORPUS_TONES},
+    {"tiny_aac_44100_stereo.m4a", "ipod", "aac", "fltp", 0, 44100, "stereo", 1, 192000, CORPUS_TONES},
+
+    // typical tracks
+    {"flac_s16_44100_stereo.flac", "flac", "flac", "s16", 0, 44100, "stereo", 240, 0, CORPUS_TONES},
+    {"flac_s16_44100_stereo_noise.flac", "flac", "flac", "s16", 0, 44100, "stereo", 240, 0, CORPUS_NOISE},
+    {"flac_s24_96000_stereo.flac", "flac", "flac", "s32", 24, 96000, "stereo", 240, 0, CORPUS_TONES},
+    {"flac_s24_192000_7.1.flac", "flac", "flac", "s32", 24, 192000, "7.1", 60, 0, CORPUS_TONES},
+    {"alac_s24_96000_stereo.m4a", "ipod", "alac", "s32p", 24, 96000, "stereo", 240, 0, CORPUS_TONES},
+    {"wavpack_s24_48000_5.1.mka", "matroska", "wavpack", "s32p", 24, 48000, "5.1", 120, 0, CORPUS_TONES},
+    {"tta_s16_44100_stereo.tta", "tta", "tta", "s16", 0, 44100, "stereo", 240, 0, CORPUS_TONES},
+    {"pcm_s16_44100_stereo.wav", "wav", "pcm_s16le", "s16", 0, 44100, "stereo", 240, 0, CORPUS_TONES},
+    {"pcm_s24_48000_5.1.wav", "wav", "pcm_s24le", "s32", 24, 48000, "5.1", 120, 0, CORPUS_NOISE},
+    {"pcm_s24_96000_stereo.aiff", "aiff", "pcm_s24be", "s32", 24, 96000, "stereo", 240, 0, CORPUS_TONES},
+    {"pcm_f32_192000_stereo.w64", "w64", "pcm_f32le", "flt", 0, 192000, "stereo", 60, 0, CORPUS_NOISE},
+    {"aac_48000_stereo.m4a", "ipod", "aac", "fltp", 0, 48000, "stereo", 240, 256000, CORPUS_TONES},
+    {"ac3_48000_5.1.ac3", "ac3", "ac3", "fltp", 0, 48000, "5.1", 120, 448000, CORPUS_TONES},
+
+    // hours long: DJ mixes, audio books
+    {"long_flac_s16_44100_stereo.flac", "flac", "flac", "s16", 0, 44100, "stereo", 3 * 3600, 0, CORPUS_TONES},
+    {"long_aac_44100_stereo.m4a", "ipod", "aac", "fltp", 0, 44100, "stereo", 2 * 3600, 128000, CORPUS_TONES},
+};
+
+#define CORPUS_ENTRY_COUNT (sizeof(corpus_entries) / sizeof(corpus_entries[0]))
+
+/**
+ * corpus_dir: the corpus directory
+ *
+ * @return the first command line argument if present, $AUDIOFS_BENCH_CORPUS if set, CORPUS_DEFAULT_DIR otherwise
+ */
+static inline const char *corpus_dir(int argc, char **argv) {
+    if (argc > 1) { return argv[1]; }
+    const char *env = getenv("AUDIOFS_BENCH_CORPUS");
+    return env != NULL && env[0] != '\0' ? env : CORPUS_DEFAULT_DIR;
+}
+
+/**
+ * corpus_path: full path of an entry
+ *
+ * @return `buf`
+ */
+static inline char *corpus_path(char *buf, size_t size, const char *dir, const corpus_entry *entry) {
+    snprintf(buf, size, "%s/%s", dir, entry->name);
+    return buf;
+}
+
+#endif // NATIVE_BENCH_CORPUS_H
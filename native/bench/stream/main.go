@@ -0,0 +1,63 @@
+//go:build cgo
+
+// Command stream measures what moving transcoded output into Go costs per cgo crossing, how that adds up per GB at
+// different chunk sizes, and the throughput of native.Stream.WriteTo at those sizes. It prints one JSON object per
+// result, like the other benchmarks.
+//
+// Usage: stream <audio file> [format]
+package main
+
+import (
+	"fmt"
+	"io"
+	"os"
+	"time"
+
+	"gitlab.com/t4cc0re/audiofs/bench"
+	"gitlab.com/t4cc0re/audiofs/native"
+)
+
+const crossings = 1000000
+
+var chunks = []int{4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20}
+
+func main() {
+	if len(os.Args) < 2 {
+		fmt.Fprintln(os.Stderr, "usage: stream <audio file> [format]")
+		os.Exit(2)
+	}
+	path, format := os.Args[1], "aiff"
+	if len(os.Args) > 2 {
+		format = os.Args[2]
+	}
+
+	cost, err := native.StreamPullCost(path, format, crossings)
+	if err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		os.Exit(1)
+	}
+	bench.NewResult("stream", "crossing", format, crossings, cost*crossings, 0, 0).Print()
+
+	for _, chunk := range chunks {
+		variant := fmt.Sprintf("%s/%dK", format, chunk>>10)
+
+		// Only the crossings, as if the transcode was free: wall time is the overhead per GB.
+		perGB := int64(1e9+chunk-1) / int64(chunk)
+		bench.NewResult("stream", "cgo_overhead_per_gb", variant, perGB, cost*time.Duration(perGB), 1e9, 0).Print()
+
+		s, err := native.OpenStream(path, format, chunk)
+		if err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			os.Exit(1)
+		}
+		start := time.Now()
+		n, err := s.WriteTo(io.Discard)
+		wall := time.Since(start)
+		s.Close()
+		if err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			os.Exit(1)
+		}
+		bench.NewResult("stream", "write_to", variant, (n+int64(chunk)-1)/int64(chunk), wall, n, 0).Print()
+	}
+}
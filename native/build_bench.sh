@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+
+set -eufo pipefail
+
+# Builds one binary per bench/*.c into the directory passed as 2nd argument. Benchmarks link all native sources, but
+# bring their own main().
+
+OUTPUT="${2}"
+mkdir -p "${OUTPUT}"
+
+find bench -type f -maxdepth 1 -name '*.c' | sort | while read -r bench; do
+  echo "building ${bench}"
+  AUDIOFS_EXTRA_CFLAGS='-DAUDIOFS_BENCH=1' AUDIOFS_EXTRA_SOURCES="${bench}" \
+    ./build_native.sh "${1}" "${OUTPUT}/$(basename "${bench}" .c)"
+done
@@ -46,4 +46,4 @@ LDFLAGS="${STATIC_FLAG} -L${DEP_DIR}/built/lib ${LDFLAGS}"
 export CFLAGS
 export LDFLAGS
 
-"${CC}" -o "${OUTPUT}" ${CFLAGS} ${LDFLAGS} $(find . -type f -maxdepth 1 -name '*.c')
+"${CC}" -o "${OUTPUT}" ${CFLAGS} ${AUDIOFS_EXTRA_CFLAGS:-} ${LDFLAGS} $(find . -type f -maxdepth 1 -name '*.c') ${AUDIOFS_EXTRA_SOURCES:-}
@@ -0,0 +1,215 @@
+//
+// Conversion plan cache. See conversion_plan.h.
+//
+// Plans are shared by all threads under plans_mutex. A plan in use belongs to one context until it is released, so
+// swr_init runs outside the lock: only finding and claiming a slot is serialized.
+//
+
+#include "conversion_plan.h"
+#include "util.h"
+#include <assert.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#include <math.h>
+#include <pthread.h>
+
+// swr options which change the output. Everything else (e.g. log level) does not make a plan different.
+static const char *const int_options[] = {
+    "resampler",
+    "dither_method",
+    "output_sample_bits",
+    "filter_size",
+    "phase_shift",
+    "linear_interp",
+    "exact_rational",
+    "filter_type",
+    "cheby",
+    "internal_sample_fmt",
+    "matrix_encoding",
+};
+static const char *const double_options[] = {
+    "cutoff",
+    "precision",
+    "kaiser_beta",
+    "dither_scale",
+    "center_mix_level",
+    "surround_mix_level",
+    "lfe_mix_level",
+    "rematrix_volume",
+};
+
+#define INT_OPTIONS    (sizeof(int_options) / sizeof(int_options[0]))
+#define DOUBLE_OPTIONS (sizeof(double_options) / sizeof(double_options[0]))
+
+typedef struct conversion_plan {
+    SwrContext *swr; // NULL if the slot is empty
+    bool        in_use;
+    uint64_t    last_used;
+
+    enum AVSampleFormat in_fmt;
+    enum AVSampleFormat out_fmt;
+    int32_t             in_rate;
+    int32_t             out_rate;
+    AVChannelLayout     in_layout;
+    AVChannelLayout     out_layout;
+    int64_t             ints[INT_OPTIONS];
+    double              doubles[DOUBLE_OPTIONS];
+} conversion_plan;
+
+static conversion_plan plans[CONVERSION_PLAN_CACHE_SIZE];
+static uint64_t        plan_clock;
+static pthread_mutex_t plans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * plan_describe: fill a plan's key from a configured context
+ *
+ * INTERNAL
+ *
+ * @return 0 on success, or an AVERROR code in case of error
+ */
+static int plan_describe(conversion_plan *plan, const decoder_context *ctx) {
+    int ret;
+
+    plan->in_fmt   = ctx->sample_fmt;
+    plan->out_fmt  = ctx->override_sample_fmt;
+    plan->in_rate  = ctx->sample_rate;
+    plan->out_rate = ctx->override_sample_rate;
+    if ((ret = av_channel_layout_copy(&plan->in_layout, &ctx->channel_layout)) < 0) { return ret; }
+    if ((ret = av_channel_layout_copy(&plan->out_layout, &ctx->override_channel_layout)) < 0) { return ret; }
+
+    for (size_t i = 0; i < INT_OPTIONS; i++) {
+        // Options missing from this build read as a sentinel, which still compares equal.
+        if (av_opt_get_int(ctx->swrContext, int_options[i], 0, &plan->ints[i]) < 0) { plan->ints[i] = INT64_MIN; }
+    }
+    for (size_t i = 0; i < DOUBLE_OPTIONS; i++) {
+        if (av_opt_get_double(ctx->swrContext, double_options[i], 0, &plan->doubles[i]) < 0) {
+            plan->doubles[i] = -INFINITY;
+        }
+    }
+    return 0;
+}
+
+static bool plan_equals(const conversion_plan *a, const conversion_plan *b) {
+    return a->in_fmt == b->in_fmt && a->out_fmt == b->out_fmt && a->in_rate == b->in_rate && a->out_rate == b->out_rate
+        && 0 == av_channel_layout_compare(&a->in_layout, &b->in_layout)
+        && 0 == av_channel_layout_compare(&a->out_layout, &b->out_layout)
+        && 0 == memcmp(a->ints, b->ints, sizeof(a->ints)) && 0 == memcmp(a->doubles, b->doubles, sizeof(a->doubles));
+}
+
+static void plan_clear(conversion_plan *plan) {
+    swr_free(&plan->swr);
+    av_channel_layout_uninit(&plan->in_layout);
+    av_channel_layout_uninit(&plan->out_layout);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/**
+ * plan_claim: mark an idle matching plan as in use
+ *
+ * INTERNAL. The caller holds plans_mutex.
+ *
+ * @return the claimed plan, or NULL if no idle plan matches
+ */
+static conversion_plan *plan_claim(const conversion_plan *wanted) {
+    for (size_t i = 0; i < CONVERSION_PLAN_CACHE_SIZE; i++) {
+        conversion_plan *plan = &plans[i];
+        if (plan->in_use || plan->swr == NULL || !plan_equals(plan, wanted)) { continue; }
+        plan->in_use    = true;
+        plan->last_used = ++plan_clock;
+        return plan;
+    }
+    return NULL;
+}
+
+/**
+ * plan_victim: the slot a new plan replaces
+ *
+ * INTERNAL. The caller holds plans_mutex.
+ *
+ * @return an empty slot, else the least recently used idle plan, or NULL if all plans are in use
+ */
+static conversion_plan *plan_victim(void) {
+    conversion_plan *victim = NULL;
+
+    for (size_t i = 0; i < CONVERSION_PLAN_CACHE_SIZE; i++) {
+        conversion_plan *plan = &plans[i];
+        if (plan->in_use) { continue; }
+        if (plan->swr == NULL) { return plan; }
+        if (victim == NULL || plan->last_used < victim->last_used) { victim = plan; }
+    }
+    return victim;
+}
+
+int conversion_plan_init(decoder_context *ctx) {
+    conversion_plan  wanted = {0};
+    conversion_plan *plan;
+    int              ret;
+
+    assert(context_ok(ctx));
+    if (ctx->swrContext == NULL) { return AVERROR(EINVAL); }
+
+    if ((ret = plan_describe(&wanted, ctx)) < 0) {
+        ret = swr_init(ctx->swrContext);
+        goto end;
+    }
+
+    pthread_mutex_lock(&plans_mutex);
+    plan = plan_claim(&wanted);
+    pthread_mutex_unlock(&plans_mutex);
+    if (plan != NULL) {
+        // Reset instead of rebuilding: swr_init keeps the resampler's filter bank if its parameters did not change.
+        if (swr_init(plan->swr) >= 0) {
+            debugf("reusing conversion plan %td\n", plan - plans);
+            swr_free(&ctx->swrContext);
+            ctx->swrContext = plan->swr;
+            goto end;
+        }
+        pthread_mutex_lock(&plans_mutex);
+        plan_clear(plan);
+        pthread_mutex_unlock(&plans_mutex);
+    }
+
+    if ((ret = swr_init(ctx->swrContext)) < 0) { goto end; }
+    pthread_mutex_lock(&plans_mutex);
+    // With all plans in use (concurrent conversions), this one is freed on release.
+    if ((plan = plan_victim()) != NULL) {
+        plan_clear(plan);
+        *plan           = wanted;
+        plan->swr       = ctx->swrContext;
+        plan->in_use    = true;
+        plan->last_used = ++plan_clock;
+        pthread_mutex_unlock(&plans_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&plans_mutex);
+
+end:
+    av_channel_layout_uninit(&wanted.in_layout);
+    av_channel_layout_uninit(&wanted.out_layout);
+    return ret;
+}
+
+void conversion_plan_release(SwrContext **swr) {
+    if (swr == NULL || *swr == NULL) { return; }
+
+    pthread_mutex_lock(&plans_mutex);
+    for (size_t i = 0; i < CONVERSION_PLAN_CACHE_SIZE; i++) {
+        if (plans[i].swr == *swr) {
+            plans[i].in_use = false;
+            *swr            = NULL;
+            pthread_mutex_unlock(&plans_mutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&plans_mutex);
+    swr_free(swr);
+}
+
+void conversion_plan_cache_clear(void) {
+    pthread_mutex_lock(&plans_mutex);
+    for (size_t i = 0; i < CONVERSION_PLAN_CACHE_SIZE; i++) {
+        if (!plans[i].in_use) { plan_clear(&plans[i]); }
+    }
+    pthread_mutex_unlock(&plans_mutex);
+}
@@ -0,0 +1,37 @@
+//
+// Cache of initialized resampler contexts ("conversion plans"), so consecutive files with the same formats do not pay
+// for swr_init's filter design again. See conversion_plan.c.
+//
+
+#ifndef NATIVE_CONVERSION_PLAN_H
+#define NATIVE_CONVERSION_PLAN_H
+
+#include "types.h"
+
+// Distinct conversions in a collection are few (a handful of rates and layouts), so a small cache covers them.
+#define CONVERSION_PLAN_CACHE_SIZE 8
+
+/**
+ * conversion_plan_init: initialize the configured ctx->swrContext, or swap it for a cached identical plan
+ *
+ * The plan is identified by the context's input and output formats and the swr options which change the result
+ * (engine, dither, filter settings, ...). A cached plan is reset to a clean state, which keeps its filter bank.
+ *
+ * @param ctx   decoder context with override_* set by change_target_format and an uninitialized, configured swrContext
+ * @return 0 on success, or an AVERROR code in case of error
+ */
+int conversion_plan_init(decoder_context *ctx);
+
+/**
+ * conversion_plan_release: hand a context back to the cache, or free it if it is not cached
+ *
+ * @param swr   reference to the context. Set to NULL afterwards.
+ */
+void conversion_plan_release(SwrContext **swr);
+
+/**
+ * conversion_plan_cache_clear: free all cached plans which are not in use
+ */
+void conversion_plan_cache_clear(void);
+
+#endif // NATIVE_CONVERSION_PLAN_H
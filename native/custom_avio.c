@@ -4,8 +4,11 @@
 
 #include "custom_avio.h"
 #include "macros.h"
+#include "membudget.h"
 #include "util.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <libavutil/error.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -20,9 +23,10 @@ __attribute__((__nonnull__)) int audiofs_avio_read(void *opaque, uint8_t *buf, i
     }
     uint64_t bs64 = buf_size;
     if (handle->in_memory) {
+        if (handle->position >= handle->apparent_size) { return AVERROR_EOF; }
         uint64_t end_position = MIN(handle->position + bs64, handle->apparent_size);
         uint64_t read_count   = end_position - handle->position;
-        memcpy(buf, handle->buffer->data, read_count);
+        memcpy(buf, (uint8_t *)handle->buffer->data + handle->position, read_count);
         handle->position = end_position;
         return INT32(read_count);
     } else {
@@ -79,9 +83,10 @@ __attribute__((__nonnull__)) int audiofs_avio_write(void *opaque, uint8_t *buf,
             return -1;
         }
         debugf("Writing %" PRIu64 " bytes to %p\n", bs64, handle);
-        memcpy(handle->buffer->data, buf, bs64);
+        memcpy((uint8_t *)handle->buffer->data + handle->position, buf, bs64);
         handle->position += bs64;
-        handle->apparent_size += bs64;
+        // Writes after a seek backwards (e.g. the WAV/AIFF header rewrite) do not grow the file.
+        handle->apparent_size = MAX(handle->apparent_size, handle->position);
         return INT32(bs64);
     } else {
         int ret = INT32(write(handle->file, buf, buf_size));
@@ -149,9 +154,11 @@ __attribute__((__nonnull__)) void *audiofs_avio_open(const char *filename) {
 
     if (0 == memcmp(filename, "memory", strlen(filename))) {
         infof("using memory buffer");
-        file           = 0;
+        file = 0;
+        // New outputs wait while the budget is used up, rather than spilling right away.
+        membudget_admit();
         handle->buffer = audiofs_buffer_alloc(1024);
-        if (handle->buffer < 0) {
+        if (handle->buffer == NULL) {
             errorf("Failed to allocate shared memory buffer");
             goto error;
         }
@@ -162,8 +169,8 @@ __attribute__((__nonnull__)) void *audiofs_avio_open(const char *filename) {
         handle->position      = 0;
     } else {
         infof("file output requested. opening '%s'", filename);
-        // Because someone explicitly wants stuff written to a file, we use O_SYNC to ensure everything is perfect.
-        file = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_SYNC, 0666);
+        // Synced once on close. O_SYNC would wait for the disk on every (4 KiB) write of the muxer.
+        file = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
         if (file < 0) {
             errorf("Failed to open file");
             return NULL;
@@ -180,15 +187,16 @@ error:
     return NULL;
 }
 
-__attribute__((__nonnull__)) void audiofs_avio_close(audiofs_avio_handle **handle) {
+__attribute__((__nonnull__)) int audiofs_avio_close(audiofs_avio_handle **handle) {
+    int ret = 0;
     if ((*handle)->in_memory) {
-        AUDIOFS_FREE((*handle)->buffer);
+        audiofs_buffer_free(&(*handle)->buffer);
     } else {
-        // We might change the way this works, but currently, `sync` is provided by O_SYNC in `audiofs_avio_open`.
-        // TODO: Error checking
-        close((*handle)->file);
+        if (fsync((*handle)->file) != 0) { ret = AVERROR(errno); }
+        if (close((*handle)->file) != 0 && ret == 0) { ret = AVERROR(errno); }
     }
     AUDIOFS_FREE(*handle);
+    return ret;
 }
 
 __attribute__((__nonnull__)) __attribute((pure)) off_t audiofs_avio_get_size(audiofs_avio_handle *handle) {
@@ -61,8 +61,10 @@ int64_t audiofs_avio_seek(void *opaque, int64_t offset, int whence);
 /**
  * Create a new file handle to be used as an opaque pointer in FFmpeg.
  *
- * A memory backed file is possible. It will not be written to the filesystem and vanishes on close.
- * A filesystem backed file is opened with O_SYNC and any existing contents are truncated. No auto deletion on close.
+ * A memory backed file is possible. It will not be written to the filesystem and vanishes on close. It counts against
+ * the memory budget: opening one waits while the budget is used up, and it spills to a temporary file once the budget
+ * has no room for it to grow (see membudget.h).
+ * A filesystem backed file is truncated if it exists, and synced on close. No auto deletion on close.
  *
  * Currently the returned value is just a file handle (int) cast to a void*, but this might change, so do not rely on
  * this!
@@ -82,8 +84,9 @@ void *audiofs_avio_open(const char *filename);
  * Any memory allocated by `audiofs_avio_open` is freed. Any file handles are closed.
  *
  * @param opaque reference to AudioFS AVIO handle
+ * @return 0, or a negative AVERROR if syncing or closing the file failed
  */
-void audiofs_avio_close(audiofs_avio_handle **handle);
+int audiofs_avio_close(audiofs_avio_handle **handle);
 
 /**
  * Returns (file) size from a AudioFS AVIO handle.
@@ -0,0 +1,507 @@
+//
+// DSD to PCM conversion by FIR decimation.
+//
+// A DSD stream is a 1-bit signal at 64 or more times 44.1 kHz. Low pass filtering and decimating it gives PCM. The
+// filter is applied through lookup tables: every input byte holds 8 bits, so the filter's contribution of a byte is one
+// of 256 precomputed values, and an output sample is the sum of one lookup per byte the filter covers. That replaces 8
+// multiply-adds per byte with a single load, and the vectorized kernel does 8 of those loads per gather.
+//
+// libav's DSD decoder only decimates by 8, so DSD64 comes out at 352.8 kHz and has to go through swresample to reach a
+// usable rate. Going to 88.2/176.4 kHz in a single step skips that, and the output size drops accordingly.
+//
+// Channels are independent, and every output sample only depends on the input, so the work is split into channels and
+// time blocks, which a small thread pool per converter works on.
+//
+
+#include "dsd.h"
+#include "macros.h"
+#include <libavutil/mem.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && (defined(__x86_64__) || defined(__i386__))
+#    define AUDIOFS_DSD_KERNELS_X86 1
+#    include <immintrin.h>
+#endif
+
+int32_t dsd_output_rate = DSD_DEFAULT_OUTPUT_RATE;
+int32_t dsd_threads     = 0;
+
+// Filter length in input bytes per ratio. 16 * ratio taps with a Kaiser window give a transition band of half the
+// output rate, centered on its Nyquist frequency, with about 120 dB of stop band attenuation. Aliases only fold back
+// above a quarter of the output rate (22.05 kHz for 88.2 kHz), so the audio band stays clean.
+#define DSD_FILTER_BYTES(ratio) (2 * (ratio))
+#define DSD_KAISER_BETA         12.0
+// Fresh input per channel to gather before converting, so the threads get enough work.
+#define DSD_BATCH_BYTES (64 * 1024)
+// Digital silence, an idle pattern with as many ones as zeros.
+#define DSD_SILENCE 0x69
+// Shortest time block worth handing to another thread, in output samples
+#define DSD_MIN_BLOCK 256
+
+// region filter
+
+static dsd_filter *    filters[9]; // by log2(ratio)
+static pthread_mutex_t filters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Modified Bessel function of the first kind, order 0 (series expansion)
+static double bessel_i0(double x) {
+    double sum  = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 64; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-17) { break; }
+    }
+    return sum;
+}
+
+/**
+ * dsd_filter_design: design a Kaiser windowed sinc low pass for a ratio and turn it into lookup tables
+ *
+ * INTERNAL
+ *
+ * @return filter (owned by the cache), or NULL on error
+ */
+static dsd_filter *dsd_filter_design(int ratio) {
+    int         bytes  = DSD_FILTER_BYTES(ratio);
+    int         taps   = 8 * bytes;
+    double      cutoff = 0.5 / ratio; // output Nyquist, relative to the input rate
+    double *    h      = AUDIOFS_CALLOC(taps, sizeof(double));
+    float *     tables = AUDIOFS_CALLOC(bytes * 256, sizeof(float));
+    dsd_filter *filter = AUDIOFS_MALLOC(sizeof(dsd_filter));
+    double      sum    = 0;
+
+    if (h == NULL || tables == NULL || filter == NULL) {
+        AUDIOFS_FREE(h);
+        AUDIOFS_FREE(tables);
+        AUDIOFS_FREE(filter);
+        return NULL;
+    }
+
+    double center = (taps - 1) / 2.0;
+    double norm   = bessel_i0(DSD_KAISER_BETA);
+    for (int n = 0; n < taps; n++) {
+        double t      = n - center;
+        double x      = 2.0 * cutoff * t;
+        double sinc   = x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        double r      = t / center;
+        double window = bessel_i0(DSD_KAISER_BETA * sqrt(MAX(0.0, 1.0 - r * r))) / norm;
+        h[n]          = sinc * window;
+        sum += h[n];
+    }
+
+    // Unity gain at DC: a stream of all ones is 1.0, all zeros is -1.0.
+    for (int k = 0; k < bytes; k++) {
+        for (int b = 0; b < 256; b++) {
+            double v = 0;
+            for (int i = 0; i < 8; i++) {
+                // MSB first: bit 7 is the oldest sample
+                v += ((b >> (7 - i)) & 1 ? 1.0 : -1.0) * h[8 * k + i] / sum;
+            }
+            tables[k * 256 + b] = (float)v;
+        }
+    }
+    AUDIOFS_FREE(h);
+
+    filter->ratio  = ratio;
+    filter->bytes  = bytes;
+    filter->tables = tables;
+    return filter;
+}
+
+const dsd_filter *dsd_filter_get(int ratio) {
+    int index = 0;
+    if (ratio < DSD_MIN_RATIO || ratio > DSD_MAX_RATIO || (ratio & (ratio - 1)) != 0) { return NULL; }
+    while ((1 << index) < ratio) { index++; }
+
+    pthread_mutex_lock(&filters_mutex);
+    if (filters[index] == NULL) {
+        infof("designing DSD decimation filter for ratio %d\n", ratio);
+        filters[index] = dsd_filter_design(ratio);
+    }
+    dsd_filter *filter = filters[index];
+    pthread_mutex_unlock(&filters_mutex);
+    return filter;
+}
+
+// endregion filter
+// region kernels
+
+static void fir_scalar(float *dst, const uint8_t *src, size_t samples, const dsd_filter *filter) {
+    const size_t step = (size_t)filter->ratio / 8;
+    for (size_t j = 0; j < samples; j++) {
+        const uint8_t *p   = src + j * step;
+        float          acc = 0;
+        for (int k = 0; k < filter->bytes; k++) { acc += filter->tables[k * 256 + p[k]]; }
+        dst[j] = acc;
+    }
+}
+
+static const dsd_kernels scalar_kernels = {.name = "scalar", .fir = fir_scalar};
+
+#ifdef AUDIOFS_DSD_KERNELS_X86
+// Gathers the lookups of 8 input bytes at once. Two accumulators hide the gather latency; bytes is a multiple of 16.
+__attribute__((target("avx2"))) static void
+fir_avx2(float *dst, const uint8_t *src, size_t samples, const dsd_filter *filter) {
+    const __m256i first  = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+    const __m256i stride = _mm256_set1_epi32(8 * 256);
+    const size_t  step   = (size_t)filter->ratio / 8;
+    for (size_t j = 0; j < samples; j++) {
+        const uint8_t *p      = src + j * step;
+        __m256         a      = _mm256_setzero_ps();
+        __m256         b      = _mm256_setzero_ps();
+        __m256i        offset = first;
+        for (int k = 0; k < filter->bytes; k += 16) {
+            __m256i lo = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + k))), offset);
+            offset     = _mm256_add_epi32(offset, stride);
+            __m256i hi = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + k + 8))), offset);
+            offset     = _mm256_add_epi32(offset, stride);
+            a          = _mm256_add_ps(a, _mm256_i32gather_ps(filter->tables, lo, 4));
+            b          = _mm256_add_ps(b, _mm256_i32gather_ps(filter->tables, hi, 4));
+        }
+        a        = _mm256_add_ps(a, b);
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        s        = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s        = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        dst[j]   = _mm_cvtss_f32(s);
+    }
+}
+
+static const dsd_kernels avx2_kernels = {.name = "avx2", .fir = fir_avx2};
+#endif // AUDIOFS_DSD_KERNELS_X86
+
+size_t dsd_kernels_supported(const dsd_kernels **out, size_t max) {
+    size_t n = 0;
+    if (n < max) { out[n++] = &scalar_kernels; }
+#ifdef AUDIOFS_DSD_KERNELS_X86
+    __builtin_cpu_init();
+    if (n < max && __builtin_cpu_supports("avx2")) { out[n++] = &avx2_kernels; }
+#endif
+    return n;
+}
+
+static const dsd_kernels *selected_kernels = &scalar_kernels;
+static pthread_once_t     kernels_once     = PTHREAD_ONCE_INIT;
+
+static void dsd_kernels_select(void) {
+    const dsd_kernels *supported[2];
+    size_t             n = dsd_kernels_supported(supported, sizeof(supported) / sizeof(supported[0]));
+    selected_kernels     = supported[n - 1];
+    infof("using %s DSD kernels\n", selected_kernels->name);
+}
+
+const dsd_kernels *dsd_kernels_get(void) {
+    pthread_once(&kernels_once, dsd_kernels_select);
+    return selected_kernels;
+}
+
+// endregion kernels
+// region converter
+
+typedef struct dsd_job {
+    float *        dst;
+    const uint8_t *src;
+    size_t         samples;
+} dsd_job;
+
+struct dsd_converter {
+    const dsd_filter * filter;
+    const dsd_kernels *kernels;
+    size_t             step; // input bytes per output sample
+    int32_t            rate;
+    bool               planar;
+    bool               lsbf;
+    uint8_t            reverse[256]; // bit reversal, for LSB first input
+    AVChannelLayout    layout;
+    int                channels;
+
+    // Input per channel, MSB first, starting with the history still needed by the next output sample.
+    uint8_t **input;
+    size_t    fill;
+    size_t    capacity;
+    bool      flushing;
+
+    // Thread pool. The calling thread works on the jobs, too, so there are `nb_threads - 1` threads.
+    int             nb_threads;
+    pthread_t *     threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t  work;
+    pthread_cond_t  done;
+    bool            stopping;
+    uint64_t        generation;
+    dsd_job *       jobs;
+    int             nb_jobs;
+    int             job_count;
+    int             next_job;
+    int             jobs_done;
+};
+
+bool dsd_codec(enum AVCodecID codec_id) {
+    switch (codec_id) {
+        case AV_CODEC_ID_DSD_LSBF:
+        case AV_CODEC_ID_DSD_MSBF:
+        case AV_CODEC_ID_DSD_LSBF_PLANAR:
+        case AV_CODEC_ID_DSD_MSBF_PLANAR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * dsd_work: run jobs of the current batch until there are none left
+ *
+ * INTERNAL
+ */
+static void dsd_work(dsd_converter *conv) {
+    for (;;) {
+        pthread_mutex_lock(&conv->mutex);
+        if (conv->next_job >= conv->job_count) {
+            pthread_mutex_unlock(&conv->mutex);
+            return;
+        }
+        dsd_job *job = &conv->jobs[conv->next_job++];
+        pthread_mutex_unlock(&conv->mutex);
+
+        conv->kernels->fir(job->dst, job->src, job->samples, conv->filter);
+
+        pthread_mutex_lock(&conv->mutex);
+        if (++conv->jobs_done == conv->job_count) { pthread_cond_signal(&conv->done); }
+        pthread_mutex_unlock(&conv->mutex);
+    }
+}
+
+static void *dsd_thread(void *arg) {
+    dsd_converter *conv = arg;
+    uint64_t       seen = 0;
+
+    pthread_mutex_lock(&conv->mutex);
+    for (;;) {
+        while (!conv->stopping && conv->generation == seen) { pthread_cond_wait(&conv->work, &conv->mutex); }
+        if (conv->stopping) { break; }
+        seen = conv->generation;
+        pthread_mutex_unlock(&conv->mutex);
+        dsd_work(conv);
+        pthread_mutex_lock(&conv->mutex);
+    }
+    pthread_mutex_unlock(&conv->mutex);
+    return NULL;
+}
+
+/**
+ * dsd_run: run `count` jobs on the pool and wait for them
+ *
+ * INTERNAL
+ */
+static void dsd_run(dsd_converter *conv, int count) {
+    pthread_mutex_lock(&conv->mutex);
+    conv->job_count = count;
+    conv->next_job  = 0;
+    conv->jobs_done = 0;
+    conv->generation++;
+    pthread_cond_broadcast(&conv->work);
+    pthread_mutex_unlock(&conv->mutex);
+
+    dsd_work(conv);
+
+    pthread_mutex_lock(&conv->mutex);
+    while (conv->jobs_done < conv->job_count) { pthread_cond_wait(&conv->done, &conv->mutex); }
+    pthread_mutex_unlock(&conv->mutex);
+}
+
+dsd_converter *dsd_converter_alloc(
+    enum AVCodecID codec_id, const AVChannelLayout *layout, int32_t bit_rate, int32_t out_rate, int32_t threads) {
+    AUDIOFS_PRINTVAL(bit_rate, "d");
+    AUDIOFS_PRINTVAL(out_rate, "d");
+    if (!dsd_codec(codec_id) || layout->nb_channels < 1 || bit_rate <= 0 || out_rate <= 0) { return NULL; }
+
+    // The highest rate at or above out_rate: the lowest ratio is tried last.
+    int ratio = DSD_MAX_RATIO;
+    while (ratio > DSD_MIN_RATIO && bit_rate / ratio < out_rate) { ratio /= 2; }
+    if (bit_rate % ratio != 0 || bit_rate / ratio < out_rate) {
+        warnf("DSD bit rate %d cannot be decimated to %d Hz\n", bit_rate, out_rate);
+        return NULL;
+    }
+    const dsd_filter *filter = dsd_filter_get(ratio);
+    if (filter == NULL) { return NULL; }
+
+    dsd_converter *conv = AUDIOFS_MALLOC(sizeof(dsd_converter));
+    if (conv == NULL) { return NULL; }
+    conv->filter   = filter;
+    conv->kernels  = dsd_kernels_get();
+    conv->step     = (size_t)ratio / 8;
+    conv->rate     = bit_rate / ratio;
+    conv->planar   = codec_id == AV_CODEC_ID_DSD_LSBF_PLANAR || codec_id == AV_CODEC_ID_DSD_MSBF_PLANAR;
+    conv->lsbf     = codec_id == AV_CODEC_ID_DSD_LSBF_PLANAR || codec_id == AV_CODEC_ID_DSD_LSBF;
+    conv->channels = layout->nb_channels;
+    for (int b = 0; b < 256; b++) {
+        uint8_t r = 0;
+        for (int i = 0; i < 8; i++) { r |= ((b >> i) & 1) << (7 - i); }
+        conv->reverse[b] = r;
+    }
+    pthread_mutex_init(&conv->mutex, NULL);
+    pthread_cond_init(&conv->work, NULL);
+    pthread_cond_init(&conv->done, NULL);
+
+    if (threads <= 0) { threads = MIN(conv->channels, (int32_t)sysconf(_SC_NPROCESSORS_ONLN)); }
+    conv->nb_threads = WITHIN_BOUNDS(1, threads, 64);
+    // Every channel is split into as many time blocks as needed to keep all threads busy.
+    conv->nb_jobs = conv->channels * ((conv->nb_threads + conv->channels - 1) / conv->channels);
+
+    conv->input   = AUDIOFS_CALLOC(conv->channels, sizeof(uint8_t *));
+    conv->jobs    = AUDIOFS_CALLOC(conv->nb_jobs, sizeof(dsd_job));
+    conv->threads = AUDIOFS_CALLOC(conv->nb_threads, sizeof(pthread_t));
+    if (conv->input == NULL || conv->jobs == NULL || conv->threads == NULL
+        || av_channel_layout_copy(&conv->layout, layout) < 0) {
+        goto error;
+    }
+    conv->capacity = filter->bytes + 2 * DSD_BATCH_BYTES;
+    for (int c = 0; c < conv->channels; c++) {
+        if ((conv->input[c] = av_malloc(conv->capacity)) == NULL) { goto error; }
+    }
+    dsd_converter_reset(conv);
+
+    for (int i = 0; i < conv->nb_threads - 1; i++) {
+        if (pthread_create(&conv->threads[i], NULL, dsd_thread, conv) != 0) {
+            // Fewer threads work as well.
+            warnf("could only start %d DSD conversion threads\n", i);
+            conv->nb_threads = i + 1;
+            break;
+        }
+    }
+
+    infof(
+        "converting DSD (%d bit/s) to %d Hz with %s kernels on %d threads\n",
+        bit_rate,
+        conv->rate,
+        conv->kernels->name,
+        conv->nb_threads);
+    return conv;
+
+error:
+    errorf("Could not set up DSD conversion\n");
+    conv->nb_threads = 1; // no threads were started
+    dsd_converter_free(&conv);
+    return NULL;
+}
+
+int32_t dsd_converter_rate(const dsd_converter *conv) { return conv->rate; }
+
+void dsd_converter_reset(dsd_converter *conv) {
+    // Half a filter of silence as history centers the first output sample on the first input byte: the filter is
+    // symmetric, so the output has no delay.
+    conv->fill     = conv->filter->bytes / 2;
+    conv->flushing = false;
+    for (int c = 0; c < conv->channels; c++) { memset(conv->input[c], DSD_SILENCE, conv->fill); }
+}
+
+int dsd_converter_send(dsd_converter *conv, const AVPacket *pkt) {
+    if (conv->flushing) { return AVERROR_EOF; }
+
+    size_t length = 0;
+    if (pkt == NULL) {
+        // Push the last input through the filter's center, so the output is as long as the input.
+        length         = conv->filter->bytes / 2 - conv->step;
+        conv->flushing = true;
+    } else {
+        length = (size_t)pkt->size / conv->channels;
+    }
+
+    if (conv->fill + length > conv->capacity) {
+        size_t capacity = MAX(conv->capacity * 2, conv->fill + length);
+        for (int c = 0; c < conv->channels; c++) {
+            uint8_t *input = av_realloc(conv->input[c], capacity);
+            if (input == NULL) { return AVERROR(ENOMEM); }
+            conv->input[c] = input;
+        }
+        conv->capacity = capacity;
+    }
+
+    for (int c = 0; c < conv->channels; c++) {
+        uint8_t *dst = conv->input[c] + conv->fill;
+        if (pkt == NULL) {
+            memset(dst, DSD_SILENCE, length);
+        } else if (conv->planar) {
+            const uint8_t *src = pkt->data + c * length;
+            if (conv->lsbf) {
+                for (size_t i = 0; i < length; i++) { dst[i] = conv->reverse[src[i]]; }
+            } else {
+                memcpy(dst, src, length);
+            }
+        } else {
+            const uint8_t *src = pkt->data + c;
+            for (size_t i = 0; i < length; i++) {
+                uint8_t b = src[i * conv->channels];
+                dst[i]    = conv->lsbf ? conv->reverse[b] : b;
+            }
+        }
+    }
+    conv->fill += length;
+    return 0;
+}
+
+int dsd_converter_receive(dsd_converter *conv, AVFrame *frame) {
+    size_t bytes     = (size_t)conv->filter->bytes;
+    size_t available = conv->fill >= bytes ? (conv->fill - bytes) / conv->step + 1 : 0;
+    int    ret;
+
+    if (!conv->flushing && conv->fill < bytes + DSD_BATCH_BYTES) { return AVERROR(EAGAIN); }
+    if (available == 0) { return conv->flushing ? AVERROR_EOF : AVERROR(EAGAIN); }
+
+    av_frame_unref(frame);
+    frame->format      = AV_SAMPLE_FMT_FLTP;
+    frame->nb_samples  = (int)available;
+    frame->sample_rate = conv->rate;
+    if ((ret = av_channel_layout_copy(&frame->ch_layout, &conv->layout)) < 0) { return ret; }
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0) { return ret; }
+
+    int blocks = conv->nb_jobs / conv->channels;
+    blocks     = (int)MAX(1, MIN((size_t)blocks, available / DSD_MIN_BLOCK));
+    int count  = 0;
+    for (int c = 0; c < conv->channels; c++) {
+        for (int b = 0; b < blocks; b++) {
+            size_t start              = available * b / blocks;
+            size_t end                = available * (b + 1) / blocks;
+            conv->jobs[count].dst     = (float *)frame->extended_data[c] + start;
+            conv->jobs[count].src     = conv->input[c] + start * conv->step;
+            conv->jobs[count].samples = end - start;
+            count++;
+        }
+    }
+    dsd_run(conv, count);
+
+    size_t consumed = available * conv->step;
+    for (int c = 0; c < conv->channels; c++) {
+        memmove(conv->input[c], conv->input[c] + consumed, conv->fill - consumed);
+    }
+    conv->fill -= consumed;
+    return 0;
+}
+
+void dsd_converter_free(dsd_converter **conv) {
+    if (conv == NULL || *conv == NULL) { return; }
+    dsd_converter *c = *conv;
+
+    pthread_mutex_lock(&c->mutex);
+    c->stopping = true;
+    pthread_cond_broadcast(&c->work);
+    pthread_mutex_unlock(&c->mutex);
+    for (int i = 0; i < c->nb_threads - 1; i++) { pthread_join(c->threads[i], NULL); }
+
+    if (c->input != NULL) {
+        for (int i = 0; i < c->channels; i++) { av_freep(&c->input[i]); }
+    }
+    AUDIOFS_FREE(c->input);
+    AUDIOFS_FREE(c->jobs);
+    AUDIOFS_FREE(c->threads);
+    av_channel_layout_uninit(&c->layout);
+    pthread_cond_destroy(&c->work);
+    pthread_cond_destroy(&c->done);
+    pthread_mutex_destroy(&c->mutex);
+    AUDIOFS_FREE(*conv);
+}
+
+// endregion converter
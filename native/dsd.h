@@ -0,0 +1,121 @@
+//
+// DSD to PCM conversion. See dsd.c.
+//
+
+#ifndef NATIVE_DSD_H
+#define NATIVE_DSD_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DSD_DEFAULT_OUTPUT_RATE 88200
+// Supported decimation ratios (DSD bit rate / PCM rate), powers of two in between.
+#define DSD_MIN_RATIO 8
+#define DSD_MAX_RATIO 256
+
+// Set from the command line (-dsd-rate, -dsd-threads). A rate of 0 leaves DSD to libav's decoder and swresample.
+extern int32_t dsd_output_rate;
+extern int32_t dsd_threads; // 0: one thread per channel, at most one per CPU
+
+/**
+ * A decimation filter, stored as lookup tables: one table per byte of input covered by the filter, holding the
+ * filter's response to each of the 256 bit patterns of that byte. An output sample is the sum of `bytes` lookups.
+ */
+typedef struct dsd_filter {
+    int          ratio; // input bits per output sample
+    int          bytes; // input bytes covered per output sample, a multiple of 16
+    const float *tables; // bytes * 256 entries, table k at k * 256
+} dsd_filter;
+
+typedef struct dsd_kernels {
+    const char *name;
+    // Computes `samples` outputs. Output j reads the MSB first bytes src[j * ratio / 8] to src[j * ratio / 8 + bytes].
+    void (*fir)(float *dst, const uint8_t *src, size_t samples, const dsd_filter *filter);
+} dsd_kernels;
+
+/**
+ * dsd_filter_get: the decimation filter for a ratio. Filters are designed once and kept for the process' lifetime.
+ *
+ * @param ratio power of two between DSD_MIN_RATIO and DSD_MAX_RATIO
+ * @return filter, or NULL if the ratio is not supported or allocating failed
+ */
+const dsd_filter *dsd_filter_get(int ratio);
+
+/**
+ * dsd_kernels_get: returns the fastest FIR kernel the running CPU supports
+ */
+const dsd_kernels *dsd_kernels_get(void);
+
+/**
+ * dsd_kernels_supported: lists every FIR kernel the running CPU supports, scalar first
+ *
+ * @param out   array receiving the kernels
+ * @param max   size of `out`
+ * @return number of kernels written to `out`
+ */
+size_t dsd_kernels_supported(const dsd_kernels **out, size_t max);
+
+typedef struct dsd_converter dsd_converter;
+
+/**
+ * dsd_codec: whether a codec is DSD, which dsd_converter_alloc takes
+ */
+bool dsd_codec(enum AVCodecID codec_id);
+
+/**
+ * dsd_converter_alloc: set up a DSD to PCM converter
+ *
+ * The output rate is the highest rate of the source's family (44.1 or 48 kHz multiples) which is at least `out_rate`
+ * and reachable by a supported ratio, e.g. 88200 gives 88200 for DSD64 and 96000 for 48 kHz based DSD64.
+ *
+ * @param codec_id  one of the DSD codecs (dsd_codec)
+ * @param layout    channel layout of the stream
+ * @param bit_rate  DSD bit rate per channel, e.g. 2822400 for DSD64
+ * @param out_rate  requested PCM rate
+ * @param threads   number of threads to convert with (including the caller's). 0: one per channel, at most one per CPU
+ * @return converter (free via dsd_converter_free), or NULL if the stream is not supported or on error
+ */
+dsd_converter *dsd_converter_alloc(
+    enum AVCodecID codec_id, const AVChannelLayout *layout, int32_t bit_rate, int32_t out_rate, int32_t threads);
+
+/**
+ * dsd_converter_rate: the PCM rate a converter outputs
+ */
+int32_t dsd_converter_rate(const dsd_converter *conv);
+
+/**
+ * dsd_converter_send: queue a packet of DSD for conversion, like avcodec_send_packet
+ *
+ * @param pkt   demuxed packet, or NULL to flush the remaining input
+ * @return 0 on success, a negative AVERROR on failure
+ */
+int dsd_converter_send(dsd_converter *conv, const AVPacket *pkt);
+
+/**
+ * dsd_converter_receive: get converted samples, like avcodec_receive_frame
+ *
+ * Input is converted in batches, so the work can be spread across threads.
+ *
+ * @param frame receives planar float samples (AV_SAMPLE_FMT_FLTP)
+ * @return 0 on success, AVERROR(EAGAIN) if more input is needed, AVERROR_EOF once flushed and drained, or another
+ *         negative AVERROR on failure
+ */
+int dsd_converter_receive(dsd_converter *conv, AVFrame *frame);
+
+/**
+ * dsd_converter_reset: drop buffered input, e.g. after seeking
+ */
+void dsd_converter_reset(dsd_converter *conv);
+
+/**
+ * dsd_converter_free: stop the converter's threads and free it
+ *
+ * @param conv  reference to the converter. Set to NULL afterwards.
+ */
+void dsd_converter_free(dsd_converter **conv);
+
+#endif // NATIVE_DSD_H
@@ -65,10 +65,22 @@ func get_setting_int(setting *C.char) C.int {
 	return C.int(config.Config.GetInt(str))
 }
 
-func GetMetadataFromFile(path string) (*types.FileMetadata, error) {
+func GetMetadataFromFile(path string, careful bool) (*types.FileMetadata, error) {
 	cstr := C.CString(path)
 	defer C.free(unsafe.Pointer(cstr))
-	metadata := C.get_metadate_from_file(cstr)
+	fingerprint := C.fingerprint_options{}
+	if !careful {
+		// Careful mode always fingerprints the full stream
+		fingerprint.length = C.int32_t(config.Config.GetInt("fingerprint.length"))
+		switch second := config.Config.GetString("fingerprint.second_window"); second {
+		case "":
+		case "middle":
+			fingerprint.second_window_offset = C.FINGERPRINT_WINDOW_MIDDLE
+		default:
+			fingerprint.second_window_offset = C.int32_t(config.Config.GetInt("fingerprint.second_window"))
+		}
+	}
+	metadata := C.get_metadate_from_file(cstr, &fingerprint)
 	if metadata == nil {
 		return nil, errors.New("asdf")
 	}
@@ -5,6 +5,7 @@
 #ifndef NATIVE_GOLANG_GLUE_H
 #define NATIVE_GOLANG_GLUE_H
 
+#include "transcode.h"
 #include "types.h"
 #include <stdlib.h>
 
@@ -13,7 +14,7 @@
 
 // region libav.c
 extern void  audiofs_libav_setup();
-extern char *get_metadate_from_file(char *path);
+extern char *get_metadate_from_file(char *path, const fingerprint_options *fingerprint);
 extern char *chromaprint_from_file(const char *path);
 // endregion libav.c
 
@@ -1,24 +1,38 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memmem
+#endif
 #include <chromaprint.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <jansson.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/dict.h>
 #include <libavutil/samplefmt.h>
+#include <libavutil/sha.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "conversion_plan.h"
 #include "custom_avio.h"
+#include "dsd.h"
 #include "macros.h"
+#include "membudget.h"
+#include "metrics.h"
 #include "resampler.h"
+#include "transcode.h"
 #include "util.h"
 
 // defined in transcode.c
 extern audiofs_avio_handle *do_transcode(
-    const char *          from_path,
-    AVFormatContext *     from_context,
-    const char *          to,
-    const AVOutputFormat *oformat,
-    const char *          format_name);
+    const char *            from_path,
+    AVFormatContext *       from_context,
+    const char *            to,
+    const AVOutputFormat *  oformat,
+    const char *            format_name,
+    const transcode_window *window);
 
 audiofs_buffer *test_buffer;
 
@@ -35,6 +49,8 @@ __attribute__((used)) void audiofs_libav_setup() {
 
     // make jansson use logged allocs
     json_set_alloc_funcs(jansson_custom_malloc, jansson_custom_free);
+
+    resampler_detect_capabilities();
 }
 
 /**
@@ -110,7 +126,7 @@ static void fix_depth(struct decoder_context *ctx) {
  * existing). NOTE: planar audio will always be changed no packed
  * @param target_depth  force a sample depth (0 to keep existing)
  * @param target_rate   force a rate (0 to keep existing)
- * @param forceStereo   force stereo (false to keep channel layout)
+ * @param target_layout force a channel layout, e.g. stereo or mono downmix (NULL to keep channel layout)
  *
  * @return int          negative on error
  */
@@ -119,21 +135,21 @@ int change_target_format(
     enum AVSampleFormat     target_fmt,
     u_int8_t                target_depth,
     int32_t                 target_rate,
-    bool                    forceStereo) {
+    const AVChannelLayout * target_layout) {
     if (!context_ok(ctx)) { return -1; }
 
     AUDIOFS_PRINTVAL(ctx, "p");
     AUDIOFS_PRINTVAL(target_fmt, "d");
     AUDIOFS_PRINTVAL(target_depth, "d");
     AUDIOFS_PRINTVAL(target_rate, "d");
-    AUDIOFS_PRINTVAL(forceStereo, "d");
+    AUDIOFS_PRINTVAL(target_layout, "p");
     //    AUDIOFS_PRINTVAL(ctx->channel_layout, PRIu64);
     AUDIOFS_PRINTVAL(ctx->depth, "d");
     AUDIOFS_PRINTVAL(ctx->sample_fmt, "d");
     AUDIOFS_PRINTVAL(ctx->sample_rate, "d");
     AUDIOFS_PRINTVAL(ctx->swrContext, "p");
 
-    ctx->override_channel_layout = ctx->channel_layout;
+    if (av_channel_layout_copy(&ctx->override_channel_layout, &ctx->channel_layout) < 0) { return -1; }
     ctx->override_channels       = ctx->channel_layout.nb_channels;
     ctx->override_depth          = ctx->depth;
     ctx->override_sample_fmt     = ctx->sample_fmt;
@@ -188,9 +204,9 @@ int change_target_format(
         ctx->override_sample_rate = ctx->sample_rate;
     }
 
-    if (forceStereo && ctx->channel_layout.nb_channels != 2) {
-        ctx->override_channels       = 2;
-        ctx->override_channel_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO_DOWNMIX;
+    if (target_layout != NULL && 0 != av_channel_layout_compare(target_layout, &ctx->channel_layout)) {
+        if (av_channel_layout_copy(&ctx->override_channel_layout, target_layout) < 0) { return -1; }
+        ctx->override_channels = target_layout->nb_channels;
     }
 
     if (target_fmt != AV_SAMPLE_FMT_NONE) {
@@ -201,9 +217,13 @@ int change_target_format(
 
     ctx->override_depth = sample_bits_by_format(ctx->override_sample_fmt, ctx->override_depth);
 
-    if (0 == av_channel_layout_compare(&ctx->override_channel_layout, &ctx->channel_layout)
+    if (0 != av_channel_layout_compare(&ctx->override_channel_layout, &ctx->channel_layout)
         || ctx->override_channels != ctx->channel_layout.nb_channels || ctx->override_depth != ctx->depth
         || ctx->override_sample_fmt != ctx->sample_fmt || ctx->override_sample_rate != ctx->sample_rate) {
+        // An initialized context may be a cached plan, which must not be reconfigured in place.
+        if (ctx->swrContext != NULL && swr_is_initialized(ctx->swrContext)) {
+            conversion_plan_release(&ctx->swrContext);
+        }
         if (ctx->swrContext == NULL) {
             ctx->swrContext = swr_alloc();
             if (ctx->swrContext == NULL) {
@@ -212,7 +232,7 @@ int change_target_format(
             }
         }
     } else {
-        if (ctx->swrContext != NULL) { swr_free(&ctx->swrContext); }
+        conversion_plan_release(&ctx->swrContext);
     }
 
     AUDIOFS_PRINTVAL(ctx->override_channels, "d");
@@ -226,8 +246,262 @@ int change_target_format(
     return 0;
 }
 
+/**
+ * fingerprint_window: run the chromaprint muxer over a window of the first audio stream
+ *
+ * INTERNAL
+ *
+ * @param fmt_ctx   opened input context. Its read position is changed.
+ * @param window    part of the stream to fingerprint
+ *
+ * @return the fingerprint (caller frees via AUDIOFS_FREE), or NULL on error
+ */
+static char *fingerprint_window(AVFormatContext *fmt_ctx, const transcode_window *window) {
+    AUDIOFS_PRINTVAL(window->start, PRId64);
+    AUDIOFS_PRINTVAL(window->duration, PRId64);
+
+    audiofs_avio_handle *avio_handle = do_transcode(NULL, fmt_ctx, "memory", NULL, "chromaprint", window);
+    if (avio_handle == NULL) {
+        errorf("do_transcode failed\n");
+        return NULL;
+    }
+    infof("do_transcode: ok\n");
+
+    off_t size = audiofs_avio_get_size(avio_handle);
+    if (size <= 0) {
+        errorf("returned file handle is has 0 bytes.");
+        audiofs_avio_close(&avio_handle);
+        return NULL;
+    }
+
+    char *chromaprint = AUDIOFS_MALLOC(size + 1);
+    if (chromaprint != NULL) {
+        memcpy(chromaprint, avio_handle->buffer->data, size);
+        chromaprint[size] = '\0';
+    }
+    infof("Chromaprint: %s\n", chromaprint);
+
+    // Close the AVIO buffer:
+    audiofs_avio_close(&avio_handle);
+    return chromaprint;
+}
+
+/**
+ * second_window_start: where the optional second fingerprint window starts
+ *
+ * INTERNAL
+ *
+ * @param fmt_ctx       opened input context
+ * @param fingerprint   fingerprint options
+ *
+ * @return start in AV_TIME_BASE units, or -1 if no second window is to be fingerprinted
+ */
+static int64_t second_window_start(AVFormatContext *fmt_ctx, const fingerprint_options *fingerprint) {
+    // A second window only makes sense if the first one does not already cover the whole stream.
+    if (fingerprint->length <= 0 || fingerprint->second_window_offset == 0 || fmt_ctx->duration <= 0) { return -1; }
+
+    int64_t length = (int64_t)fingerprint->length * AV_TIME_BASE;
+    int64_t start  = 0;
+    if (fingerprint->second_window_offset == FINGERPRINT_WINDOW_MIDDLE) {
+        // Only long mixes benefit from this. Short tracks are covered well enough by the first window.
+        if (fmt_ctx->duration < 2 * length) { return -1; }
+        start = (fmt_ctx->duration - length) / 2;
+    } else {
+        start = (int64_t)fingerprint->second_window_offset * AV_TIME_BASE;
+    }
+
+    if (start < length || start >= fmt_ctx->duration) { return -1; }
+    return start;
+}
+
+/**
+ * find_in_file: locate bytes in a file, e.g. an embedded picture
+ *
+ * INTERNAL
+ *
+ * @return offset of the first occurrence, or -1 if the bytes are not stored contiguously (e.g. base64 in Ogg, or
+ *         unsynchronised ID3v2) or the file cannot be read
+ */
+static int64_t find_in_file(const char *path, const uint8_t *data, size_t size) {
+    struct stat info;
+    int64_t     offset = -1;
+    int         file   = open(path, O_RDONLY);
+
+    if (file < 0) { return -1; }
+    if (fstat(file, &info) == 0 && info.st_size > 0 && (size_t)info.st_size >= size && size > 0) {
+        uint8_t *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapped != MAP_FAILED) {
+            const uint8_t *found = memmem(mapped, info.st_size, data, size);
+            if (found != NULL) { offset = found - mapped; }
+            munmap(mapped, info.st_size);
+        }
+    }
+    close(file);
+    return offset;
+}
+
+/**
+ * attached_pic_json: describe a stream's attached picture (cover art) by its SHA-256, size and location in the file,
+ * so it can be stored once however many files embed it
+ *
+ * INTERNAL
+ *
+ * @return JSON object, or NULL if the stream has no attached picture
+ */
+static json_t *attached_pic_json(const char *path, const AVStream *stream) {
+    const AVPacket *pic = &stream->attached_pic;
+    uint8_t         digest[32];
+    char            hex[2 * sizeof(digest) + 1];
+
+    if (!(stream->disposition & AV_DISPOSITION_ATTACHED_PIC) || pic->data == NULL || pic->size <= 0) { return NULL; }
+
+    struct AVSHA *sha = av_sha_alloc();
+    if (sha == NULL) { return NULL; }
+    av_sha_init(sha, 256);
+    av_sha_update(sha, pic->data, pic->size);
+    av_sha_final(sha, digest);
+    av_free(sha);
+    for (size_t i = 0; i < sizeof(digest); i++) { snprintf(hex + 2 * i, 3, "%02x", digest[i]); }
+
+    json_t *json = json_object();
+    json_object_set_new(json, "sha256", json_string(hex));
+    json_object_set_new(json, "size", json_integer(pic->size));
+    json_object_set_new(json, "offset", json_integer(find_in_file(path, pic->data, pic->size)));
+    return json;
+}
+
+/**
+ * decoder_context_alloc: create a decoder_context describing an opened decoder
+ *
+ * @param fmt_ctx       input format context (may be NULL)
+ * @param stream        decoded stream (may be NULL)
+ * @param codec_ctx     opened decoder
+ *
+ * @return decoder_context (free via decoder_context_free), or NULL on error
+ */
+decoder_context *decoder_context_alloc(AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *codec_ctx) {
+    AUDIOFS_PRINTVAL(codec_ctx, "p");
+    if (codec_ctx == NULL) { return NULL; }
+
+    decoder_context *ctx = AUDIOFS_MALLOC(sizeof(decoder_context));
+    if (ctx == NULL) { return NULL; }
+
+    ctx->cookieA         = _AUDIOFS_CONTEXT_MAGIC_A;
+    ctx->cookieB         = _AUDIOFS_CONTEXT_MAGIC_B;
+    ctx->avFormatContext = fmt_ctx;
+    ctx->avStream        = stream;
+    ctx->avCodecContext  = codec_ctx;
+    ctx->avCodec         = (AVCodec *)codec_ctx->codec;
+    ctx->sample_fmt      = codec_ctx->sample_fmt;
+    ctx->sample_rate     = codec_ctx->sample_rate;
+    ctx->depth           = (u_int8_t)codec_ctx->bits_per_raw_sample;
+    ctx->dither          = DITHER_DEFAULT;
+    ctx->resampler       = SWR_ENGINE_SWR;
+    if (av_channel_layout_copy(&ctx->channel_layout, &codec_ctx->ch_layout) < 0) {
+        AUDIOFS_FREE(ctx);
+        return NULL;
+    }
+
+    fix_depth(ctx);
+    if (ctx->depth == 0) { ctx->depth = sample_bits_by_format(ctx->sample_fmt, 0); }
+    detect_dsd(ctx);
+
+    return ctx;
+}
+
+/**
+ * decoder_context_free: free a decoder_context and its resampler
+ *
+ * @param ctx   reference to the decoder_context. Set to NULL afterwards.
+ */
+void decoder_context_free(decoder_context **ctx) {
+    if (ctx == NULL || !context_ok(*ctx)) { return; }
+
+    conversion_plan_release(&(*ctx)->swrContext);
+    av_channel_layout_uninit(&(*ctx)->channel_layout);
+    av_channel_layout_uninit(&(*ctx)->override_channel_layout);
+    AUDIOFS_FREE(*ctx);
+}
+
+/**
+ * fingerprint_conversion_alloc: plan the conversion of a decoded stream into what chromaprint works with internally
+ *
+ * Chromaprint downmixes to mono and resamples to FINGERPRINT_SAMPLE_RATE on its own. Doing both in a single swr step
+ * straight from the decoder's format saves resampling to an intermediate rate first and keeps >2 channel sources
+ * (which the chromaprint muxer rejects) working.
+ *
+ * @param fmt_ctx       input format context (may be NULL)
+ * @param stream        decoded stream (may be NULL)
+ * @param codec_ctx     opened decoder
+ *
+ * @return decoder_context with an initialized swrContext, or with a NULL swrContext if the decoder output can be
+ *         passed as-is. NULL on error.
+ */
+decoder_context *fingerprint_conversion_alloc(AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *codec_ctx) {
+    AVChannelLayout  mono = (AVChannelLayout)AV_CHANNEL_LAYOUT_MONO;
+    decoder_context *ctx  = decoder_context_alloc(fmt_ctx, stream, codec_ctx);
+    if (ctx == NULL) { return NULL; }
+
+    if (change_target_format(ctx, AV_SAMPLE_FMT_S16, 16, FINGERPRINT_SAMPLE_RATE, &mono) < 0) { goto error; }
+
+    if (ctx->swrContext != NULL && setup_fingerprint_swr(ctx) < 0) { goto error; }
+
+    return ctx;
+
+error:
+    errorf("Could not set up fingerprint conversion\n");
+    decoder_context_free(&ctx);
+    return NULL;
+}
+
+/**
+ * transcode_conversion_alloc: plan the conversion of a decoded stream into what an encoder takes
+ *
+ * Uses swr's defaults (no dither, swr engine), which is what an auto-inserted aresample filter does. The conversion
+ * runs through a cached plan, so consecutive transcodes with the same formats skip swr's filter design.
+ *
+ * @param fmt_ctx   input format context (may be NULL)
+ * @param stream    decoded stream (may be NULL)
+ * @param dec_ctx   opened decoder
+ * @param enc_ctx   opened encoder
+ *
+ * @return decoder_context with an initialized swrContext, or with a NULL swrContext if the decoder output can be
+ *         passed as-is. NULL on error.
+ */
+decoder_context *transcode_conversion_alloc(
+    AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *dec_ctx, const AVCodecContext *enc_ctx) {
+    decoder_context *ctx = decoder_context_alloc(fmt_ctx, stream, dec_ctx);
+    if (ctx == NULL) { return NULL; }
+
+    if (change_target_format(ctx, enc_ctx->sample_fmt, 0, enc_ctx->sample_rate, &enc_ctx->ch_layout) < 0) {
+        goto error;
+    }
+    // change_target_format always targets packed formats, but some encoders take planar ones.
+    if (ctx->override_sample_fmt != enc_ctx->sample_fmt) {
+        ctx->override_sample_fmt = enc_ctx->sample_fmt;
+        if (ctx->swrContext == NULL && (ctx->swrContext = swr_alloc()) == NULL) { goto error; }
+    }
+
+    if (ctx->swrContext != NULL && setup_swr(ctx, SWR_DITHER_NONE, SWR_ENGINE_SWR) < 0) { goto error; }
+
+    return ctx;
+
+error:
+    errorf("Could not set up transcode conversion\n");
+    decoder_context_free(&ctx);
+    return NULL;
+}
+
+/**
+ * get_metadate_from_file: probe a file and return all metadata as a JSON string
+ *
+ * @param path          file to probe
+ * @param fingerprint   which part of the audio to fingerprint. NULL fingerprints the full stream.
+ *
+ * @return JSON string (caller frees), or NULL on error
+ */
 __attribute__((used)) __attribute__((hot)) __attribute__((warn_unused_result)) char *
-get_metadate_from_file(char *path) {
+get_metadate_from_file(char *path, const fingerprint_options *fingerprint) {
     // region variables
     infof("getting metadata from '%s'", path);
     AVFormatContext *  fmt_ctx = avformat_alloc_context();
@@ -238,28 +512,42 @@ get_metadate_from_file(char *path) {
     json_t *           json_file_format      = json_object();
     json_t *           json_file_metadata    = json_object();
     json_t *           json_streams_array    = json_array();
-    json_t **          json_streams          = AUDIOFS_CALLOC(fmt_ctx->nb_streams, sizeof(json_t *));
-    json_t **          json_streams_metadata = AUDIOFS_CALLOC(fmt_ctx->nb_streams, sizeof(json_t *));
-    json_t **          json_streams_codec    = AUDIOFS_CALLOC(fmt_ctx->nb_streams, sizeof(json_t *));
-    char *json_str = "";
+    json_t **          json_streams          = NULL;
+    json_t **          json_streams_metadata = NULL;
+    json_t **          json_streams_codec    = NULL;
+    unsigned int       nb_streams            = 0;
+    char *             json_str              = NULL;
+    // Without options, fingerprint everything. This is what `--careful` relies on.
+    const fingerprint_options full_length = {.length = 0, .second_window_offset = 0};
+    if (fingerprint == NULL) { fingerprint = &full_length; }
 
     // endregion variables
 
     // Everything is now allocated. Let's open the file!
-    ret = avformat_open_input(&fmt_ctx, path, NULL, NULL);
-    if (ret < 0) { return 0; }
+    metrics_span probe = metrics_start();
+    ret                = avformat_open_input(&fmt_ctx, path, NULL, NULL);
+    if (ret < 0) { goto end; }
 
     // Retrieve the stream information
     ret = avformat_find_stream_info(fmt_ctx, NULL);
-    if (ret < 0) {
-        avformat_close_input(&fmt_ctx);
-        return 0;
+    metrics_stop(&probe, METRICS_STAGE_PROBE, fmt_ctx->pb ? avio_tell(fmt_ctx->pb) : 0, 0);
+    if (ret < 0) { goto end; }
+
+    // The stream count is only known now.
+    nb_streams            = fmt_ctx->nb_streams;
+    json_streams          = AUDIOFS_CALLOC(nb_streams, sizeof(json_t *));
+    json_streams_metadata = AUDIOFS_CALLOC(nb_streams, sizeof(json_t *));
+    json_streams_codec    = AUDIOFS_CALLOC(nb_streams, sizeof(json_t *));
+    if (nb_streams > 0 && (!json_streams || !json_streams_metadata || !json_streams_codec)) {
+        nb_streams = 0;
+        goto end;
     }
 
     // region JSON setup
-    json_object_set_new(json, "file", json_file);
-    json_object_set_new(json_file, "metadata", json_file_metadata);
-    json_object_set_new(json_file, "format", json_file_format);
+    // Not stealing references, so every error path can release everything the same way.
+    json_object_set(json, "file", json_file);
+    json_object_set(json_file, "metadata", json_file_metadata);
+    json_object_set(json_file, "format", json_file_format);
     json_object_set(json, "streams", json_streams_array);
     for (unsigned int i = 0; i < fmt_ctx->nb_streams; ++i) {
         // Add entries to json array, so we can easily manipulate them later.
@@ -301,34 +589,28 @@ get_metadate_from_file(char *path) {
         if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
             // TODO: Make do_transcode handle a passed stream ID.
             /// Hook into transcoding pipeline
-            audiofs_avio_handle *avio_handle = do_transcode(NULL, fmt_ctx, "memory", NULL, "chromaprint");
-            infof("do_transcode: ok\n");
-            off_t size = audiofs_avio_get_size(avio_handle);
-            // char *mapped;
-
-            if (size <= 0) {
-                errorf("returned file handle is has 0 bytes.");
-                audiofs_avio_close(&avio_handle);
-                goto end;
-            }
-
-            char * chromaprint = AUDIOFS_MALLOC(size + 1);
-            strncpy(chromaprint, avio_handle->buffer->data, size);
-
-            //            infof("size: %lld\n", s.st_size);
-
-            /* Memory-map the file. */
-            //            mapped = mmap(0, s.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, handle, 0); // TODO check
-            //            pointer mapped[s.st_size] = '\0';
-            infof("mapped: %p\n", avio_handle->buffer->data);
-
-            infof("Chromaprint: %s\n", chromaprint);
+            transcode_window window = {.start = 0, .duration = (int64_t)fingerprint->length * AV_TIME_BASE};
+            char *           chromaprint = fingerprint_window(fmt_ctx, &window);
+            if (chromaprint == NULL) { goto end; }
 
             json_object_set_new(json_streams[i], "chromaprint", json_string(chromaprint));
-
-            // Close the AVIO buffer:
-            //            munmap(mapped, s.st_size + 1);
-            audiofs_avio_close(&avio_handle);
+            json_object_set_new(json_streams[i], "chromaprint_length", json_integer(fingerprint->length));
+            AUDIOFS_FREE(chromaprint);
+
+            window.start = second_window_start(fmt_ctx, fingerprint);
+            if (window.start > 0) {
+                chromaprint = fingerprint_window(fmt_ctx, &window);
+                if (chromaprint != NULL) {
+                    json_object_set_new(json_streams[i], "chromaprint_second", json_string(chromaprint));
+                    json_object_set_new(
+                        json_streams[i],
+                        "chromaprint_second_offset",
+                        json_integer(window.start / AV_TIME_BASE));
+                    AUDIOFS_FREE(chromaprint);
+                } else {
+                    warnf("Could not fingerprint second window at %" PRId64 "\n", window.start);
+                }
+            }
         }
 
         json_object_set_new(json_streams[i], "index", json_integer(fmt_ctx->streams[i]->index));
@@ -391,7 +673,8 @@ get_metadate_from_file(char *path) {
             json_integer(fmt_ctx->streams[i]->codecpar->ch_layout.nb_channels));
 
         // TODO fmt_ctx->streams[i]->side_data
-        // TODO AVPacket 	attached_pic
+        json_t *attached_pic = attached_pic_json(path, stream);
+        if (attached_pic != NULL) { json_object_set_new(json_streams[i], "attached_pic", attached_pic); }
 
         // Retrieve the stream metadata
         while ((tag = av_dict_get(stream->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
@@ -403,19 +686,19 @@ get_metadate_from_file(char *path) {
     // TODO: Dump to audiofs_buffer and return pointer to THAT.
     json_str = json_dumps(json, JSON_COMPACT | JSON_SORT_KEYS);
 
+end:
     // Free the JSON objects
-    for (unsigned int i = 0; i < fmt_ctx->nb_streams; ++i) {
+    for (unsigned int i = 0; i < nb_streams; ++i) {
         json_decref(json_streams[i]);
         json_decref(json_streams_metadata[i]);
         json_decref(json_streams_codec[i]);
     }
+    json_decref(json_streams_array);
     json_decref(json_file_metadata);
     json_decref(json_file_format);
     json_decref(json_file);
     json_decref(json);
 
-end:
-
     AUDIOFS_FREE(json_streams);
     AUDIOFS_FREE(json_streams_metadata);
     AUDIOFS_FREE(json_streams_codec);
@@ -426,15 +709,237 @@ end:
     return json_str;
 }
 
-#ifndef AUDIOFS_CGO
+#if !defined(AUDIOFS_CGO) && !defined(AUDIOFS_BENCH)
+
+static void usage(const char *argv0) {
+    errorf("Usage: %s [-length SECS] [-second-window SECS|middle] <input file>\n", argv0);
+    errorf("       %s [-length SECS] [-second-window SECS|middle] -worker\n", argv0);
+    errorf("  -length SECS                  fingerprint only the first SECS seconds (default: %d, 0 for the full "
+           "stream)\n",
+           FINGERPRINT_DEFAULT_LENGTH);
+    errorf("  -second-window SECS|middle    additionally fingerprint SECS seconds starting at the given offset\n");
+    errorf("  -worker                       read NDJSON requests from stdin and write NDJSON results to stdout\n");
+    errorf("  -dsd-rate HZ                  convert DSD to at least HZ (default: %d, 0 leaves DSD to libav)\n",
+           DSD_DEFAULT_OUTPUT_RATE);
+    errorf("  -dsd-threads N                threads per DSD conversion (default: 0, one per channel and CPU)\n");
+    errorf("  -threads N                    threads per file, for codecs and DSD conversion (default: 0, no limit)\n");
+    errorf("  -memory-budget BYTES          heap memory of in-memory outputs, beyond which they spill to disk (default: "
+           "0, no limit)\n");
+    errorf("  -memory-wait MS               how long a new in-memory output waits for room in the budget (default: "
+           "%d)\n",
+           MEMBUDGET_DEFAULT_MAX_WAIT_MS);
+    errorf("  -spill-dir DIR                directory of spill files (default: $TMPDIR, or /tmp)\n");
+}
+
+static int32_t parse_second_window(const char *value) {
+    if (0 == strcmp(value, "middle")) { return FINGERPRINT_WINDOW_MIDDLE; }
+    return MAX(atoi(value), 0);
+}
+
+/**
+ * worker_respond_error: write an error response for request `id`
+ *
+ * @param metrics   per-file metrics, or NULL
+ */
+static void worker_respond_error(json_int_t id, const char *error, json_t *metrics) {
+    json_t *response = json_object();
+    json_object_set_new(response, "id", json_integer(id));
+    json_object_set_new(response, "error", json_string(error));
+    if (metrics != NULL) { json_object_set(response, "metrics", metrics); }
+    char *line = json_dumps(response, JSON_COMPACT);
+    if (line != NULL) { fprintf(stdout, "%s\n", line); }
+    AUDIOFS_FREE(line);
+    json_decref(response);
+}
+
+/**
+ * worker_export: handle an export request, see worker_loop
+ *
+ * INTERNAL
+ */
+static void worker_export(json_int_t id, const char *path, json_t *request) {
+    const char *  output = json_string_value(json_object_get(request, "output"));
+    const char *  format = json_string_value(json_object_get(request, "format"));
+    json_t *      tags   = json_object_get(request, "tags");
+    AVDictionary *dict   = NULL;
+    const char *  key;
+    json_t *      value;
+
+    if (output == NULL) {
+        worker_respond_error(id, "missing output", NULL);
+        return;
+    }
+    json_object_foreach(tags, key, value) {
+        if (json_is_string(value)) { av_dict_set(&dict, key, json_string_value(value), 0); }
+    }
+
+    metrics_span span    = metrics_file_begin();
+    int          ret     = transcode_to_file(path, output, format != NULL ? format : "aiff", dict);
+    json_t *     metrics = metrics_file_json(metrics_file_end(&span));
+    av_dict_free(&dict);
+    if (ret < 0) {
+        worker_respond_error(id, av_err2str(ret), metrics);
+    } else {
+        json_t *response = json_object();
+        json_object_set_new(response, "id", json_integer(id));
+        json_object_set(response, "metrics", metrics);
+        char *line = json_dumps(response, JSON_COMPACT);
+        if (line != NULL) { fprintf(stdout, "%s\n", line); }
+        AUDIOFS_FREE(line);
+        json_decref(response);
+    }
+    json_decref(metrics);
+}
+
+/**
+ * worker_loop: serve metadata and export requests until stdin is closed
+ *
+ * Every line on stdin is one request:
+ *   {"id": 1, "path": "/some/file.flac", "length": 120, "second_window": "middle", "threads": 2}
+ *   {"id": 2, "op": "export", "path": "/some/file.flac", "output": "/out/file.aiff", "format": "aiff",
+ *    "tags": {"title": "..."}, "threads": 2}
+ * `length`, `second_window` and `threads` are optional and default to the command line options. `threads` is what
+ * the caller's scheduler granted the request (see transcode_threads). `op` defaults to reading metadata. Exports
+ * default to aiff and write nothing but `tags` (see transcode_to_file).
+ *
+ * Every request is answered with exactly one line on stdout, in order:
+ *   {"id": 1, "metadata": {...}, "metrics": {...}} or {"id": 1, "error": "...", "metrics": {...}}
+ * Exports answer {"id": 2, "metrics": {...}} on success. `metrics` holds the per-stage counters for this file (see
+ * metrics.h).
+ *
+ * Logging goes to stderr, so stdout carries nothing but responses.
+ *
+ * @param defaults  fingerprint options for requests which do not specify their own
+ *
+ * @return exit code
+ */
+static int worker_loop(const fingerprint_options *defaults) {
+    char *  line            = NULL;
+    size_t  line_cap        = 0;
+    int32_t default_threads = transcode_threads;
+    ssize_t line_len;
+
+    while ((line_len = getline(&line, &line_cap, stdin)) != -1) {
+        if (line_len <= 1) { continue; }
+
+        json_error_t error;
+        json_t *     request = json_loads(line, 0, &error);
+        if (request == NULL || !json_is_object(request)) {
+            worker_respond_error(-1, "malformed request", NULL);
+            fflush(stdout);
+            json_decref(request);
+            continue;
+        }
+
+        json_int_t          id          = json_integer_value(json_object_get(request, "id"));
+        const char *        path        = json_string_value(json_object_get(request, "path"));
+        json_t *            length      = json_object_get(request, "length");
+        json_t *            second      = json_object_get(request, "second_window");
+        json_t *            threads     = json_object_get(request, "threads");
+        const char *        op          = json_string_value(json_object_get(request, "op"));
+        fingerprint_options fingerprint = *defaults;
+        if (json_is_integer(length)) { fingerprint.length = MAX((int32_t)json_integer_value(length), 0); }
+        if (json_is_string(second)) {
+            fingerprint.second_window_offset = parse_second_window(json_string_value(second));
+        }
+        transcode_threads = json_is_integer(threads) ? MAX((int32_t)json_integer_value(threads), 0) : default_threads;
+
+        if (path == NULL) {
+            worker_respond_error(id, "missing path", NULL);
+        } else if (op != NULL && 0 == strcmp(op, "export")) {
+            worker_export(id, path, request);
+        } else if (op != NULL && 0 != strcmp(op, "metadata")) {
+            worker_respond_error(id, "unknown op", NULL);
+        } else {
+            metrics_span span    = metrics_file_begin();
+            char *       json    = get_metadate_from_file((char *)path, &fingerprint);
+            json_t *     metrics = metrics_file_json(metrics_file_end(&span));
+            char *       stats   = json_dumps(metrics, JSON_COMPACT);
+            if (json == NULL) {
+                worker_respond_error(id, "could not read metadata", metrics);
+            } else {
+                fprintf(
+                    stdout,
+                    "{\"id\":%" JSON_INTEGER_FORMAT ",\"metadata\":%s,\"metrics\":%s}\n",
+                    id,
+                    json,
+                    stats != NULL ? stats : "null");
+                AUDIOFS_FREE(json);
+            }
+            AUDIOFS_FREE(stats);
+            json_decref(metrics);
+        }
+        fflush(stdout);
+        json_decref(request);
+    }
+
+    free(line);
+    return 0;
+}
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        errorf("Usage: %s <input file> <output file>\n", argv[0]);
+    static const struct option long_options[] = {
+        {"length", required_argument, NULL, 'l'},
+        {"second-window", required_argument, NULL, 's'},
+        {"worker", no_argument, NULL, 'w'},
+        {"dsd-rate", required_argument, NULL, 'r'},
+        {"dsd-threads", required_argument, NULL, 't'},
+        {"threads", required_argument, NULL, 'j'},
+        {"memory-budget", required_argument, NULL, 'm'},
+        {"memory-wait", required_argument, NULL, 'W'},
+        {"spill-dir", required_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0},
+    };
+    fingerprint_options fingerprint = {.length = FINGERPRINT_DEFAULT_LENGTH, .second_window_offset = 0};
+    bool                worker      = false;
+    int                 opt;
+
+    while ((opt = getopt_long_only(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                fingerprint.length = MAX(atoi(optarg), 0);
+                break;
+            case 's':
+                fingerprint.second_window_offset = parse_second_window(optarg);
+                break;
+            case 'w':
+                worker = true;
+                break;
+            case 'r':
+                dsd_output_rate = MAX(atoi(optarg), 0);
+                break;
+            case 't':
+                dsd_threads = MAX(atoi(optarg), 0);
+                break;
+            case 'j':
+                transcode_threads = MAX(atoi(optarg), 0);
+                break;
+            case 'm':
+                membudget_limit = strtoull(optarg, NULL, 10);
+                break;
+            case 'W':
+                membudget_max_wait_ms = MAX(atoll(optarg), 0);
+                break;
+            case 'd':
+                membudget_spill_dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (worker) {
+        audiofs_libav_setup();
+        return worker_loop(&fingerprint);
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
 
-    const char* json = get_metadate_from_file(argv[1]);
+    const char* json = get_metadate_from_file(argv[optind], &fingerprint);
 
     if (json == NULL) {
         return 1;
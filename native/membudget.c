@@ -0,0 +1,126 @@
+//
+// Process-wide memory budget of audiofs_buffers. See membudget.h.
+//
+
+#include "membudget.h"
+#include "macros.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t    membudget_limit       = 0;
+int64_t     membudget_max_wait_ms = MEMBUDGET_DEFAULT_MAX_WAIT_MS;
+const char *membudget_spill_dir   = NULL;
+
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  budget_freed = PTHREAD_COND_INITIALIZER;
+static membudget_stats budget_stats;
+
+static uint64_t membudget_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+bool membudget_reserve(uint64_t bytes) {
+    bool granted;
+    pthread_mutex_lock(&budget_mutex);
+    granted = membudget_limit == 0 || budget_stats.reserved + bytes <= membudget_limit;
+    if (granted) {
+        budget_stats.reserved += bytes;
+        budget_stats.peak = MAX(budget_stats.peak, budget_stats.reserved);
+        budget_stats.reservations++;
+    } else {
+        budget_stats.denied++;
+    }
+    pthread_mutex_unlock(&budget_mutex);
+    return granted;
+}
+
+void membudget_release(uint64_t bytes) {
+    if (bytes == 0) { return; }
+    pthread_mutex_lock(&budget_mutex);
+    budget_stats.reserved -= MIN(bytes, budget_stats.reserved);
+    pthread_cond_broadcast(&budget_freed);
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+void membudget_admit(void) {
+    if (membudget_limit == 0) { return; }
+
+    pthread_mutex_lock(&budget_mutex);
+    if (budget_stats.reserved >= membudget_limit && membudget_max_wait_ms > 0) {
+        uint64_t        start = membudget_now_ns();
+        struct timespec deadline;
+        // pthread_cond_timedwait waits against CLOCK_REALTIME by default.
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += membudget_max_wait_ms / 1000;
+        deadline.tv_nsec += (membudget_max_wait_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (budget_stats.reserved >= membudget_limit) {
+            if (pthread_cond_timedwait(&budget_freed, &budget_mutex, &deadline) == ETIMEDOUT) { break; }
+        }
+        budget_stats.waits++;
+        budget_stats.wait_ns += membudget_now_ns() - start;
+    }
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+int membudget_spill_open(void) {
+    const char *dir = membudget_spill_dir;
+    if (dir == NULL || dir[0] == '\0') { dir = getenv("TMPDIR"); }
+    if (dir == NULL || dir[0] == '\0') { dir = "/tmp"; }
+
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/audiofs-spill-XXXXXX", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        errorf("could not create a spill file in '%s'\n", dir);
+        return -1;
+    }
+    // Only the descriptor keeps it, so it vanishes with the buffer or the process.
+    unlink(path);
+    return fd;
+}
+
+void membudget_spilled(uint64_t bytes, bool new_spill) {
+    pthread_mutex_lock(&budget_mutex);
+    budget_stats.spilled_bytes += bytes;
+    if (new_spill) { budget_stats.spills++; }
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+membudget_stats membudget_snapshot(void) {
+    pthread_mutex_lock(&budget_mutex);
+    membudget_stats stats = budget_stats;
+    pthread_mutex_unlock(&budget_mutex);
+    return stats;
+}
+
+void membudget_reset_peak(void) {
+    pthread_mutex_lock(&budget_mutex);
+    budget_stats.peak = budget_stats.reserved;
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+json_t *membudget_stats_json(const membudget_stats *since, const membudget_stats *now) {
+    json_t *json = json_object();
+    json_object_set_new(json, "peak_bytes", json_integer((json_int_t)now->peak));
+    json_object_set_new(json, "reservations", json_integer((json_int_t)(now->reservations - since->reservations)));
+    json_object_set_new(json, "denied", json_integer((json_int_t)(now->denied - since->denied)));
+    json_object_set_new(json, "spills", json_integer((json_int_t)(now->spills - since->spills)));
+    json_object_set_new(
+        json, "spilled_bytes", json_integer((json_int_t)(now->spilled_bytes - since->spilled_bytes)));
+    json_object_set_new(json, "waits", json_integer((json_int_t)(now->waits - since->waits)));
+    json_object_set_new(json, "wait_ns", json_integer((json_int_t)(now->wait_ns - since->wait_ns)));
+    return json;
+}
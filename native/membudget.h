@@ -0,0 +1,91 @@
+//
+// Process-wide memory budget of audiofs_buffers, e.g. in-memory avio outputs.
+//
+// Buffers reserve their size before they allocate or grow. Once the budget is used up, a buffer spills: it continues
+// in an unlinked temporary file, mapped where its heap memory was, so users of buffer->data do not notice. The kernel
+// writes such pages back and drops them under pressure, which it cannot do with heap (or memfd) pages without swap.
+// New in-memory outputs first wait for room, for at most membudget_max_wait_ms, and spill from the start afterwards.
+//
+// Counters are cumulative per process. Workers report what changed while processing a file with its metrics.
+//
+
+#ifndef NATIVE_MEMBUDGET_H
+#define NATIVE_MEMBUDGET_H
+
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MEMBUDGET_DEFAULT_MAX_WAIT_MS 5000
+
+// Bytes all buffers of the process may hold on the heap together, 0 for no limit.
+extern uint64_t membudget_limit;
+// How long a new in-memory output waits for room before it spills instead.
+extern int64_t membudget_max_wait_ms;
+// Directory of spill files, or NULL for $TMPDIR (or /tmp).
+extern const char *membudget_spill_dir;
+
+typedef struct membudget_stats {
+    uint64_t reserved;      // bytes reserved right now
+    uint64_t peak;          // most bytes reserved at once (since membudget_reset_peak)
+    uint64_t reservations;  // reservations granted
+    uint64_t denied;        // reservations denied, which made a buffer spill or stay spilled
+    uint64_t spills;        // buffers moved to a spill file
+    uint64_t spilled_bytes; // bytes written to spill files: buffers as they were spilled, and their growth afterwards
+    uint64_t waits;         // new outputs which waited for room
+    uint64_t wait_ns;       // time they waited
+} membudget_stats;
+
+/**
+ * membudget_reserve: reserve heap memory for a buffer, if the budget has room
+ *
+ * @param bytes     bytes the buffer is about to allocate (or grow by)
+ * @return whether the memory may be allocated. If not, the buffer has to spill.
+ */
+bool membudget_reserve(uint64_t bytes);
+
+/**
+ * membudget_release: return memory reserved by membudget_reserve, and wake outputs waiting for it
+ */
+void membudget_release(uint64_t bytes);
+
+/**
+ * membudget_admit: wait until the budget has room for a new output, at most membudget_max_wait_ms
+ *
+ * Reserves nothing; the output's buffers do as they grow.
+ */
+void membudget_admit(void);
+
+/**
+ * membudget_spill_open: create an unlinked temporary file for a buffer to spill to
+ *
+ * @return file descriptor, or -1 on error (errno is set)
+ */
+int membudget_spill_open(void);
+
+/**
+ * membudget_spilled: account bytes written to a spill file
+ *
+ * @param bytes     bytes written
+ * @param new_spill whether a buffer just moved to its spill file
+ */
+void membudget_spilled(uint64_t bytes, bool new_spill);
+
+/**
+ * membudget_snapshot: current counters
+ */
+membudget_stats membudget_snapshot(void);
+
+/**
+ * membudget_reset_peak: start tracking the peak anew, from what is reserved right now
+ */
+void membudget_reset_peak(void);
+
+/**
+ * membudget_stats_json: serialize the counters which changed between two snapshots, and the peak of `now`
+ *
+ * @return new JSON object (caller owns the reference)
+ */
+json_t *membudget_stats_json(const membudget_stats *since, const membudget_stats *now);
+
+#endif // NATIVE_MEMBUDGET_H
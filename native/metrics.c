@@ -0,0 +1,55 @@
+//
+// Per-stage timing of the transcode pipeline. See metrics.h.
+//
+
+#include "metrics.h"
+#include <string.h>
+
+_Thread_local metrics_file metrics_current_file;
+
+static const char *stage_names[METRICS_STAGE_COUNT] = {
+    [METRICS_STAGE_PROBE]  = "probe",
+    [METRICS_STAGE_DEMUX]  = "demux",
+    [METRICS_STAGE_DECODE] = "decode",
+    [METRICS_STAGE_FILTER] = "filter",
+    [METRICS_STAGE_ENCODE] = "encode",
+    [METRICS_STAGE_MUX]    = "mux",
+};
+
+metrics_span metrics_file_begin(void) {
+    memset(&metrics_current_file, 0, sizeof(metrics_current_file));
+    membudget_reset_peak();
+    metrics_current_file.memory_begin = membudget_snapshot();
+    return metrics_start();
+}
+
+const metrics_file *metrics_file_end(const metrics_span *span) {
+    metrics_current_file.wall_ns    = metrics_clock_ns(CLOCK_MONOTONIC) - span->wall_ns;
+    metrics_current_file.cpu_ns     = metrics_clock_ns(CLOCK_THREAD_CPUTIME_ID) - span->cpu_ns;
+    metrics_current_file.memory_end = membudget_snapshot();
+    return &metrics_current_file;
+}
+
+json_t *metrics_file_json(const metrics_file *metrics) {
+    json_t *json   = json_object();
+    json_t *stages = json_object();
+
+    json_object_set_new(json, "wall_ns", json_integer((json_int_t)metrics->wall_ns));
+    json_object_set_new(json, "cpu_ns", json_integer((json_int_t)metrics->cpu_ns));
+    json_object_set_new(json, "transcodes", json_integer((json_int_t)metrics->transcodes));
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++) {
+        const metrics_stage_totals *totals = &metrics->stages[i];
+        if (totals->calls == 0) { continue; }
+
+        json_t *stage = json_object();
+        json_object_set_new(stage, "calls", json_integer((json_int_t)totals->calls));
+        json_object_set_new(stage, "wall_ns", json_integer((json_int_t)totals->wall_ns));
+        json_object_set_new(stage, "cpu_ns", json_integer((json_int_t)totals->cpu_ns));
+        json_object_set_new(stage, "bytes", json_integer((json_int_t)totals->bytes));
+        json_object_set_new(stage, "samples", json_integer((json_int_t)totals->samples));
+        json_object_set_new(stages, stage_names[i], stage);
+    }
+    json_object_set_new(json, "stages", stages);
+    json_object_set_new(json, "memory", membudget_stats_json(&metrics->memory_begin, &metrics->memory_end));
+    return json;
+}
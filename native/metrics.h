@@ -0,0 +1,103 @@
+//
+// Per-stage timing of the transcode pipeline.
+//
+// Always on: every stage call costs two clock reads at the start and two at the end. Counters are thread local and
+// cover the file currently being processed. Aggregation (histograms, totals across files) happens on the Go side,
+// which receives the per-file counters with every worker response.
+//
+
+#ifndef NATIVE_METRICS_H
+#define NATIVE_METRICS_H
+
+#include "membudget.h"
+#include <jansson.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef enum metrics_stage {
+    METRICS_STAGE_PROBE,  // avformat_open_input, avformat_find_stream_info
+    METRICS_STAGE_DEMUX,  // av_read_frame
+    METRICS_STAGE_DECODE, // avcodec_send_packet, avcodec_receive_frame
+    METRICS_STAGE_FILTER, // filter graph, swr conversion or PCM kernels
+    METRICS_STAGE_ENCODE, // avcodec_send_frame, avcodec_receive_packet
+    METRICS_STAGE_MUX,    // av_interleaved_write_frame, av_write_trailer
+    METRICS_STAGE_COUNT,
+} metrics_stage;
+
+typedef struct metrics_stage_totals {
+    uint64_t calls;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t bytes;   // compressed bytes read (probe, demux, decode) or written (encode, mux)
+    uint64_t samples; // samples per channel produced (decode, filter)
+} metrics_stage_totals;
+
+typedef struct metrics_file {
+    metrics_stage_totals stages[METRICS_STAGE_COUNT];
+    uint64_t             wall_ns;
+    uint64_t             cpu_ns;
+    uint64_t             transcodes; // do_transcode calls, e.g. 2 with a second fingerprint window
+    membudget_stats      memory_begin;
+    membudget_stats      memory_end; // reported as the difference to memory_begin, and the peak while processing
+} metrics_file;
+
+typedef struct metrics_span {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+} metrics_span;
+
+// defined in metrics.c
+extern _Thread_local metrics_file metrics_current_file;
+
+static inline uint64_t metrics_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline metrics_span metrics_start(void) {
+    return (metrics_span){
+        .wall_ns = metrics_clock_ns(CLOCK_MONOTONIC),
+        .cpu_ns  = metrics_clock_ns(CLOCK_THREAD_CPUTIME_ID),
+    };
+}
+
+/**
+ * metrics_stop: account the time since `span` was started to `stage`
+ *
+ * @param span      returned by metrics_start
+ * @param stage     stage to account to
+ * @param bytes     bytes processed by this call
+ * @param samples   samples (per channel) processed by this call
+ */
+static inline void metrics_stop(const metrics_span *span, metrics_stage stage, uint64_t bytes, uint64_t samples) {
+    metrics_stage_totals *totals = &metrics_current_file.stages[stage];
+    totals->calls++;
+    totals->wall_ns += metrics_clock_ns(CLOCK_MONOTONIC) - span->wall_ns;
+    totals->cpu_ns += metrics_clock_ns(CLOCK_THREAD_CPUTIME_ID) - span->cpu_ns;
+    totals->bytes += bytes;
+    totals->samples += samples;
+}
+
+/**
+ * metrics_file_begin: reset the counters of the calling thread and start timing a new file
+ *
+ * @return span to pass to metrics_file_end
+ */
+metrics_span metrics_file_begin(void);
+
+/**
+ * metrics_file_end: finish timing the current file
+ *
+ * @return the counters of the calling thread (valid until the next metrics_file_begin on it)
+ */
+const metrics_file *metrics_file_end(const metrics_span *span);
+
+/**
+ * metrics_file_json: serialize per-file counters
+ *
+ * @return new JSON object (caller owns the reference)
+ */
+json_t *metrics_file_json(const metrics_file *metrics);
+
+#endif // NATIVE_METRICS_H
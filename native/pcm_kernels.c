@@ -0,0 +1,483 @@
+//
+// Sample format conversion kernels for the PCM output path.
+//
+// Every kernel has a scalar version, which is endian neutral and handles all tails. The vectorized versions are only
+// built for little endian x86 (SSE4.1/AVX2, compiled via target attributes, so no global -m flags are required) and
+// aarch64 (NEON). The best supported set is picked at runtime.
+//
+
+#include "pcm_kernels.h"
+#include "macros.h"
+#include <pthread.h>
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#    if defined(__x86_64__) || defined(__i386__)
+#        define AUDIOFS_PCM_KERNELS_X86 1
+#        include <immintrin.h>
+#    elif defined(__aarch64__)
+#        define AUDIOFS_PCM_KERNELS_NEON 1
+#        include <arm_neon.h>
+#    endif
+#endif
+
+// region scalar
+
+static void s16_to_be_scalar(uint8_t *dst, const int16_t *src, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        uint16_t v     = (uint16_t)src[i];
+        dst[2 * i]     = (uint8_t)(v >> 8);
+        dst[2 * i + 1] = (uint8_t)v;
+    }
+}
+
+static void s32_to_be_scalar(uint8_t *dst, const int32_t *src, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        uint32_t v     = (uint32_t)src[i];
+        dst[4 * i]     = (uint8_t)(v >> 24);
+        dst[4 * i + 1] = (uint8_t)(v >> 16);
+        dst[4 * i + 2] = (uint8_t)(v >> 8);
+        dst[4 * i + 3] = (uint8_t)v;
+    }
+}
+
+static void s32_to_s24be_scalar(uint8_t *dst, const int32_t *src, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        uint32_t v     = (uint32_t)src[i];
+        dst[3 * i]     = (uint8_t)(v >> 24);
+        dst[3 * i + 1] = (uint8_t)(v >> 16);
+        dst[3 * i + 2] = (uint8_t)(v >> 8);
+    }
+}
+
+static void s32_to_s24le_scalar(uint8_t *dst, const int32_t *src, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        uint32_t v     = (uint32_t)src[i];
+        dst[3 * i]     = (uint8_t)(v >> 8);
+        dst[3 * i + 1] = (uint8_t)(v >> 16);
+        dst[3 * i + 2] = (uint8_t)(v >> 24);
+    }
+}
+
+static void interleave_s16_scalar(int16_t *dst, const int16_t *const *src, int channels, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        for (int c = 0; c < channels; c++) { dst[i * channels + c] = src[c][i]; }
+    }
+}
+
+static void interleave_s32_scalar(int32_t *dst, const int32_t *const *src, int channels, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        for (int c = 0; c < channels; c++) { dst[i * channels + c] = src[c][i]; }
+    }
+}
+
+/**
+ * Finishes an interleave that was vectorized up to sample `done`.
+ */
+static void interleave_s16_tail(int16_t *dst, const int16_t *const *src, int channels, size_t samples, size_t done) {
+    for (size_t i = done; i < samples; i++) {
+        for (int c = 0; c < channels; c++) { dst[i * channels + c] = src[c][i]; }
+    }
+}
+
+static void interleave_s32_tail(int32_t *dst, const int32_t *const *src, int channels, size_t samples, size_t done) {
+    for (size_t i = done; i < samples; i++) {
+        for (int c = 0; c < channels; c++) { dst[i * channels + c] = src[c][i]; }
+    }
+}
+
+static void swap16_scalar(uint8_t *dst, const uint8_t *src, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[2 * i]     = src[2 * i + 1];
+        dst[2 * i + 1] = src[2 * i];
+    }
+}
+
+static void swap24_scalar(uint8_t *dst, const uint8_t *src, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[3 * i]     = src[3 * i + 2];
+        dst[3 * i + 1] = src[3 * i + 1];
+        dst[3 * i + 2] = src[3 * i];
+    }
+}
+
+static void swap32_scalar(uint8_t *dst, const uint8_t *src, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[4 * i]     = src[4 * i + 3];
+        dst[4 * i + 1] = src[4 * i + 2];
+        dst[4 * i + 2] = src[4 * i + 1];
+        dst[4 * i + 3] = src[4 * i];
+    }
+}
+
+static const pcm_kernels scalar_kernels = {
+    .name           = "scalar",
+    .s16_to_be      = s16_to_be_scalar,
+    .s32_to_be      = s32_to_be_scalar,
+    .s32_to_s24be   = s32_to_s24be_scalar,
+    .s32_to_s24le   = s32_to_s24le_scalar,
+    .interleave_s16 = interleave_s16_scalar,
+    .interleave_s32 = interleave_s32_scalar,
+    .swap16         = swap16_scalar,
+    .swap24         = swap24_scalar,
+    .swap32         = swap32_scalar,
+};
+
+// endregion scalar
+
+#ifdef AUDIOFS_PCM_KERNELS_X86
+// region sse4
+
+__attribute__((target("sse4.1"))) static void s16_to_be_sse4(uint8_t *dst, const int16_t *src, size_t samples) {
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t        i    = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_shuffle_epi8(v, mask));
+    }
+    s16_to_be_scalar(dst + 2 * i, src + i, samples - i);
+}
+
+__attribute__((target("sse4.1"))) static void s32_to_be_sse4(uint8_t *dst, const int32_t *src, size_t samples) {
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t        i    = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_shuffle_epi8(v, mask));
+    }
+    s32_to_be_scalar(dst + 4 * i, src + i, samples - i);
+}
+
+// The 24-bit kernels write 16 bytes, of which 12 are valid. The next iteration overwrites the padding, so the loop
+// stops while there still is room for the full store.
+__attribute__((target("sse4.1"))) static void s32_to_s24be_sse4(uint8_t *dst, const int32_t *src, size_t samples) {
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+    size_t        i    = 0;
+    for (; i + 6 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 3 * i), _mm_shuffle_epi8(v, mask));
+    }
+    s32_to_s24be_scalar(dst + 3 * i, src + i, samples - i);
+}
+
+__attribute__((target("sse4.1"))) static void s32_to_s24le_sse4(uint8_t *dst, const int32_t *src, size_t samples) {
+    const __m128i mask = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+    size_t        i    = 0;
+    for (; i + 6 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 3 * i), _mm_shuffle_epi8(v, mask));
+    }
+    s32_to_s24le_scalar(dst + 3 * i, src + i, samples - i);
+}
+
+__attribute__((target("sse4.1"))) static void
+interleave_s16_sse4(int16_t *dst, const int16_t *const *src, int channels, size_t samples) {
+    size_t i = 0;
+    if (channels == 2) {
+        for (; i + 8 <= samples; i += 8) {
+            __m128i l = _mm_loadu_si128((const __m128i *)(src[0] + i));
+            __m128i r = _mm_loadu_si128((const __m128i *)(src[1] + i));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(l, r));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+        }
+    }
+    interleave_s16_tail(dst, src, channels, samples, i);
+}
+
+__attribute__((target("sse4.1"))) static void
+interleave_s32_sse4(int32_t *dst, const int32_t *const *src, int channels, size_t samples) {
+    size_t i = 0;
+    if (channels == 2) {
+        for (; i + 4 <= samples; i += 4) {
+            __m128i l = _mm_loadu_si128((const __m128i *)(src[0] + i));
+            __m128i r = _mm_loadu_si128((const __m128i *)(src[1] + i));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi32(l, r));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i + 4), _mm_unpackhi_epi32(l, r));
+        }
+    }
+    interleave_s32_tail(dst, src, channels, samples, i);
+}
+
+// The vectorized kernels are only built for little endian, where converting native samples to big endian is a swap.
+__attribute__((target("sse4.1"))) static void swap16_sse4(uint8_t *dst, const uint8_t *src, size_t samples) {
+    s16_to_be_sse4(dst, (const int16_t *)src, samples);
+}
+
+__attribute__((target("sse4.1"))) static void swap32_sse4(uint8_t *dst, const uint8_t *src, size_t samples) {
+    s32_to_be_sse4(dst, (const int32_t *)src, samples);
+}
+
+// Loads and stores 16 bytes, of which 12 are valid, like the 24-bit kernels above.
+__attribute__((target("sse4.1"))) static void swap24_sse4(uint8_t *dst, const uint8_t *src, size_t samples) {
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+    size_t        i    = 0;
+    for (; i + 6 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+        _mm_storeu_si128((__m128i *)(dst + 3 * i), _mm_shuffle_epi8(v, mask));
+    }
+    swap24_scalar(dst + 3 * i, src + 3 * i, samples - i);
+}
+
+static const pcm_kernels sse4_kernels = {
+    .name           = "sse4",
+    .s16_to_be      = s16_to_be_sse4,
+    .s32_to_be      = s32_to_be_sse4,
+    .s32_to_s24be   = s32_to_s24be_sse4,
+    .s32_to_s24le   = s32_to_s24le_sse4,
+    .interleave_s16 = interleave_s16_sse4,
+    .interleave_s32 = interleave_s32_sse4,
+    .swap16         = swap16_sse4,
+    .swap24         = swap24_sse4,
+    .swap32         = swap32_sse4,
+};
+
+// endregion sse4
+// region avx2
+
+__attribute__((target("avx2"))) static void s16_to_be_avx2(uint8_t *dst, const int16_t *src, size_t samples) {
+    const __m256i mask = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_shuffle_epi8(v, mask));
+    }
+    s16_to_be_sse4(dst + 2 * i, src + i, samples - i);
+}
+
+__attribute__((target("avx2"))) static void s32_to_be_avx2(uint8_t *dst, const int32_t *src, size_t samples) {
+    const __m256i mask = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + 4 * i), _mm256_shuffle_epi8(v, mask));
+    }
+    s32_to_be_sse4(dst + 4 * i, src + i, samples - i);
+}
+
+// Shuffles 12 valid bytes into the low part of each 128-bit lane, then moves the upper lane's bytes right behind the
+// lower one's, resulting in 24 valid bytes per 32 byte store.
+__attribute__((target("avx2"))) static void s32_to_s24be_avx2(uint8_t *dst, const int32_t *src, size_t samples) {
+    const __m256i mask = _mm256_setr_epi8(
+        3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1,
+        3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t        i       = 0;
+    for (; i + 11 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        v         = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), compact);
+        _mm256_storeu_si256((__m256i *)(dst + 3 * i), v);
+    }
+    s32_to_s24be_sse4(dst + 3 * i, src + i, samples - i);
+}
+
+__attribute__((target("avx2"))) static void s32_to_s24le_avx2(uint8_t *dst, const int32_t *src, size_t samples) {
+    const __m256i mask = _mm256_setr_epi8(
+        1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1,
+        1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t        i       = 0;
+    for (; i + 11 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        v         = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), compact);
+        _mm256_storeu_si256((__m256i *)(dst + 3 * i), v);
+    }
+    s32_to_s24le_sse4(dst + 3 * i, src + i, samples - i);
+}
+
+// unpacklo/hi work per 128-bit lane, so the lanes have to be put back in order afterwards.
+__attribute__((target("avx2"))) static void
+interleave_s16_avx2(int16_t *dst, const int16_t *const *src, int channels, size_t samples) {
+    size_t i = 0;
+    if (channels == 2) {
+        for (; i + 16 <= samples; i += 16) {
+            __m256i l  = _mm256_loadu_si256((const __m256i *)(src[0] + i));
+            __m256i r  = _mm256_loadu_si256((const __m256i *)(src[1] + i));
+            __m256i lo = _mm256_unpacklo_epi16(l, r);
+            __m256i hi = _mm256_unpackhi_epi16(l, r);
+            _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i *)(dst + 2 * i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    }
+    interleave_s16_tail(dst, src, channels, samples, i);
+}
+
+__attribute__((target("avx2"))) static void
+interleave_s32_avx2(int32_t *dst, const int32_t *const *src, int channels, size_t samples) {
+    size_t i = 0;
+    if (channels == 2) {
+        for (; i + 8 <= samples; i += 8) {
+            __m256i l  = _mm256_loadu_si256((const __m256i *)(src[0] + i));
+            __m256i r  = _mm256_loadu_si256((const __m256i *)(src[1] + i));
+            __m256i lo = _mm256_unpacklo_epi32(l, r);
+            __m256i hi = _mm256_unpackhi_epi32(l, r);
+            _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i *)(dst + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    }
+    interleave_s32_tail(dst, src, channels, samples, i);
+}
+
+__attribute__((target("avx2"))) static void swap16_avx2(uint8_t *dst, const uint8_t *src, size_t samples) {
+    s16_to_be_avx2(dst, (const int16_t *)src, samples);
+}
+
+__attribute__((target("avx2"))) static void swap32_avx2(uint8_t *dst, const uint8_t *src, size_t samples) {
+    s32_to_be_avx2(dst, (const int32_t *)src, samples);
+}
+
+// 8 samples are 24 bytes. The upper lane is loaded from byte 12 on, so both lanes start on a sample, and are compacted
+// the same way as in the 24-bit kernels above.
+__attribute__((target("avx2"))) static void swap24_avx2(uint8_t *dst, const uint8_t *src, size_t samples) {
+    const __m256i mask = _mm256_setr_epi8(
+        2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1,
+        2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+    const __m256i spread  = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t        i       = 0;
+    for (; i + 11 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 3 * i));
+        v         = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, spread), mask);
+        _mm256_storeu_si256((__m256i *)(dst + 3 * i), _mm256_permutevar8x32_epi32(v, compact));
+    }
+    swap24_sse4(dst + 3 * i, src + 3 * i, samples - i);
+}
+
+static const pcm_kernels avx2_kernels = {
+    .name           = "avx2",
+    .s16_to_be      = s16_to_be_avx2,
+    .s32_to_be      = s32_to_be_avx2,
+    .s32_to_s24be   = s32_to_s24be_avx2,
+    .s32_to_s24le   = s32_to_s24le_avx2,
+    .interleave_s16 = interleave_s16_avx2,
+    .interleave_s32 = interleave_s32_avx2,
+    .swap16         = swap16_avx2,
+    .swap24         = swap24_avx2,
+    .swap32         = swap32_avx2,
+};
+
+// endregion avx2
+#endif // AUDIOFS_PCM_KERNELS_X86
+
+#ifdef AUDIOFS_PCM_KERNELS_NEON
+// region neon
+
+static void s16_to_be_neon(uint8_t *dst, const int16_t *src, size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) { vst1q_u8(dst + 2 * i, vrev16q_u8(vld1q_u8((const uint8_t *)(src + i)))); }
+    s16_to_be_scalar(dst + 2 * i, src + i, samples - i);
+}
+
+static void s32_to_be_neon(uint8_t *dst, const int32_t *src, size_t samples) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) { vst1q_u8(dst + 4 * i, vrev32q_u8(vld1q_u8((const uint8_t *)(src + i)))); }
+    s32_to_be_scalar(dst + 4 * i, src + i, samples - i);
+}
+
+// Same overlapping store as the SSE4 version. Out of range table indices (0xff) produce 0.
+static void s32_to_s24be_neon(uint8_t *dst, const int32_t *src, size_t samples) {
+    static const uint8_t mask_bytes[16] = {3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, 0xff, 0xff, 0xff, 0xff};
+    const uint8x16_t     mask           = vld1q_u8(mask_bytes);
+    size_t               i              = 0;
+    for (; i + 6 <= samples; i += 4) {
+        vst1q_u8(dst + 3 * i, vqtbl1q_u8(vld1q_u8((const uint8_t *)(src + i)), mask));
+    }
+    s32_to_s24be_scalar(dst + 3 * i, src + i, samples - i);
+}
+
+static void s32_to_s24le_neon(uint8_t *dst, const int32_t *src, size_t samples) {
+    static const uint8_t mask_bytes[16] = {1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, 0xff, 0xff, 0xff, 0xff};
+    const uint8x16_t     mask           = vld1q_u8(mask_bytes);
+    size_t               i              = 0;
+    for (; i + 6 <= samples; i += 4) {
+        vst1q_u8(dst + 3 * i, vqtbl1q_u8(vld1q_u8((const uint8_t *)(src + i)), mask));
+    }
+    s32_to_s24le_scalar(dst + 3 * i, src + i, samples - i);
+}
+
+static void interleave_s16_neon(int16_t *dst, const int16_t *const *src, int channels, size_t samples) {
+    size_t i = 0;
+    if (channels == 2) {
+        for (; i + 8 <= samples; i += 8) {
+            int16x8x2_t v = {{vld1q_s16(src[0] + i), vld1q_s16(src[1] + i)}};
+            vst2q_s16(dst + 2 * i, v);
+        }
+    }
+    interleave_s16_tail(dst, src, channels, samples, i);
+}
+
+static void interleave_s32_neon(int32_t *dst, const int32_t *const *src, int channels, size_t samples) {
+    size_t i = 0;
+    if (channels == 2) {
+        for (; i + 4 <= samples; i += 4) {
+            int32x4x2_t v = {{vld1q_s32(src[0] + i), vld1q_s32(src[1] + i)}};
+            vst2q_s32(dst + 2 * i, v);
+        }
+    }
+    interleave_s32_tail(dst, src, channels, samples, i);
+}
+
+static void swap16_neon(uint8_t *dst, const uint8_t *src, size_t samples) {
+    s16_to_be_neon(dst, (const int16_t *)src, samples);
+}
+
+static void swap32_neon(uint8_t *dst, const uint8_t *src, size_t samples) {
+    s32_to_be_neon(dst, (const int32_t *)src, samples);
+}
+
+// De-interleaves 16 samples into their three bytes, and stores them back in reverse order.
+static void swap24_neon(uint8_t *dst, const uint8_t *src, size_t samples) {
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        uint8x16x3_t v       = vld3q_u8(src + 3 * i);
+        uint8x16x3_t swapped = {{v.val[2], v.val[1], v.val[0]}};
+        vst3q_u8(dst + 3 * i, swapped);
+    }
+    swap24_scalar(dst + 3 * i, src + 3 * i, samples - i);
+}
+
+static const pcm_kernels neon_kernels = {
+    .name           = "neon",
+    .s16_to_be      = s16_to_be_neon,
+    .s32_to_be      = s32_to_be_neon,
+    .s32_to_s24be   = s32_to_s24be_neon,
+    .s32_to_s24le   = s32_to_s24le_neon,
+    .interleave_s16 = interleave_s16_neon,
+    .interleave_s32 = interleave_s32_neon,
+    .swap16         = swap16_neon,
+    .swap24         = swap24_neon,
+    .swap32         = swap32_neon,
+};
+
+// endregion neon
+#endif // AUDIOFS_PCM_KERNELS_NEON
+
+size_t pcm_kernels_supported(const pcm_kernels **out, size_t max) {
+    size_t n = 0;
+    if (n < max) { out[n++] = &scalar_kernels; }
+#ifdef AUDIOFS_PCM_KERNELS_X86
+    __builtin_cpu_init();
+    if (n < max && __builtin_cpu_supports("sse4.1")) { out[n++] = &sse4_kernels; }
+    // The AVX2 kernels use the SSE4 ones for their tails.
+    if (n < max && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("avx2")) { out[n++] = &avx2_kernels; }
+#endif
+#ifdef AUDIOFS_PCM_KERNELS_NEON
+    if (n < max) { out[n++] = &neon_kernels; }
+#endif
+    return n;
+}
+
+static const pcm_kernels *selected_kernels = &scalar_kernels;
+static pthread_once_t     kernels_once     = PTHREAD_ONCE_INIT;
+
+static void pcm_kernels_select(void) {
+    const pcm_kernels *supported[4];
+    size_t             n = pcm_kernels_supported(supported, sizeof(supported) / sizeof(supported[0]));
+    selected_kernels     = supported[n - 1];
+    infof("using %s PCM conversion kernels\n", selected_kernels->name);
+}
+
+const pcm_kernels *pcm_kernels_get(void) {
+    pthread_once(&kernels_once, pcm_kernels_select);
+    return selected_kernels;
+}
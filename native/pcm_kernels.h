@@ -0,0 +1,56 @@
+//
+// Sample format conversion kernels for the PCM output path and the raw PCM path.
+//
+
+#ifndef NATIVE_PCM_KERNELS_H
+#define NATIVE_PCM_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A set of conversion kernels for one instruction set.
+ *
+ * All kernels take native endian input. 24-in-32 samples are expected the way libav stores them in
+ * AV_SAMPLE_FMT_S32(P): MSB aligned, with the lowest byte being padding. `samples` always counts single samples (not
+ * frames), except for the interleave kernels, where it is the number of samples per channel.
+ */
+typedef struct pcm_kernels {
+    const char *name;
+
+    // 16-bit native to big endian (pcm_s16be)
+    void (*s16_to_be)(uint8_t *dst, const int16_t *src, size_t samples);
+    // 32-bit native to big endian (pcm_s32be)
+    void (*s32_to_be)(uint8_t *dst, const int32_t *src, size_t samples);
+    // 24-in-32 to packed 24-bit big endian (pcm_s24be, AIFF)
+    void (*s32_to_s24be)(uint8_t *dst, const int32_t *src, size_t samples);
+    // 24-in-32 to packed 24-bit little endian (pcm_s24le, WAV)
+    void (*s32_to_s24le)(uint8_t *dst, const int32_t *src, size_t samples);
+    // planar to interleaved
+    void (*interleave_s16)(int16_t *dst, const int16_t *const *src, int channels, size_t samples);
+    void (*interleave_s32)(int32_t *dst, const int32_t *const *src, int channels, size_t samples);
+    // byte order reversal of packed samples, e.g. pcm_s24le to pcm_s24be. `dst` must not overlap `src`.
+    void (*swap16)(uint8_t *dst, const uint8_t *src, size_t samples);
+    void (*swap24)(uint8_t *dst, const uint8_t *src, size_t samples);
+    void (*swap32)(uint8_t *dst, const uint8_t *src, size_t samples);
+} pcm_kernels;
+
+/**
+ * pcm_kernels_get: returns the fastest kernel set the running CPU supports
+ *
+ * The CPU is checked once, subsequent calls are cheap.
+ */
+const pcm_kernels *pcm_kernels_get(void);
+
+/**
+ * pcm_kernels_supported: lists every kernel set the running CPU supports, scalar first
+ *
+ * Used for benchmarking and validating the vectorized kernels against the scalar ones.
+ *
+ * @param out   array receiving the kernel sets
+ * @param max   size of `out`
+ * @return number of kernel sets written to `out`
+ */
+size_t pcm_kernels_supported(const pcm_kernels **out, size_t max);
+
+#endif // NATIVE_PCM_KERNELS_H
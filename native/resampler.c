@@ -1,5 +1,6 @@
 
 #include "resampler.h"
+#include "conversion_plan.h"
 #include <assert.h>
 
 #include <libswresample/swresample.h>
@@ -86,19 +87,22 @@ end:
     return DITHER_DEFAULT;
 }
 
+// Engines swresample was built with. Detected once, see resampler_detect_capabilities.
+static bool           engine_supported[SWR_ENGINE_NB];
+static pthread_once_t capabilities_once = PTHREAD_ONCE_INIT;
+
 /**
+ * probe_resampler: check whether swresample can initialize a context with a resampling engine
  *
- * @param resampler if null-pointer, a default value is returned
- * @return -1 on error or enum SwrEngine (you have to cast)
+ * INTERNAL
+ *
+ * @param resampler engine name, as accepted by the "resampler" option
+ * @return true if the engine is usable
  */
-int get_supported_resampler(const char *resampler) {
-    SwrContext *   swr        = NULL;
-    bool           supported  = false;
-    enum SwrEngine swr_engine = (enum SwrEngine) - 1;
-    int            tmp_level  = 0;
-
-    // If we get a null value, skip all the validation and return SWR.
-    if (NULL == resampler) { return SWR_ENGINE_SWR; }
+static bool probe_resampler(const char *resampler) {
+    SwrContext *swr       = NULL;
+    bool        supported = false;
+    int         tmp_level = 0;
 
     AUDIOFS_PRINTVAL(resampler, "s");
     swr = swr_alloc();
@@ -106,7 +110,7 @@ int get_supported_resampler(const char *resampler) {
     if (swr == NULL) {
         errorf("Could not allocate context to check '%s' resampler\n", resampler);
         // No goto, as we don't swr_free() in this case
-        return swr_engine;
+        return false;
     }
     AVChannelLayout stereo = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
     if (0 != swr_alloc_set_opts2(&swr, &stereo, AV_SAMPLE_FMT_S16, 44100, &stereo, AV_SAMPLE_FMT_S16, 44100, 0, NULL)) {
@@ -124,19 +128,54 @@ int get_supported_resampler(const char *resampler) {
     av_log_set_level(tmp_level);
     AUDIOFS_PRINTVAL(supported, "d");
 
-    if (!supported) {
-        errorf("Could not initialize swresample with resampler '%s'\n", resampler);
-        goto end;
-    }
+end:
+    swr_free(&swr);
+    return supported;
+}
+
+static void detect_capabilities(void) {
+    engine_supported[SWR_ENGINE_SWR]  = probe_resampler("swr");
+    engine_supported[SWR_ENGINE_SOXR] = probe_resampler("soxr");
+    infof(
+        "resampling engines: swr %s, soxr %s\n",
+        engine_supported[SWR_ENGINE_SWR] ? "yes" : "no",
+        engine_supported[SWR_ENGINE_SOXR] ? "yes" : "no");
+}
+
+/**
+ * resampler_detect_capabilities: check which resampling engines are usable
+ *
+ * Runs once per process (called from audiofs_libav_setup), subsequent calls are no-ops. Dithers need no detection:
+ * they are part of swresample itself, and noise shaping falls back to triangular_hp at rates it has no filter for.
+ */
+void resampler_detect_capabilities(void) { pthread_once(&capabilities_once, detect_capabilities); }
 
+/**
+ *
+ * @param resampler if null-pointer, a default value is returned
+ * @return -1 on error or enum SwrEngine (you have to cast)
+ */
+int get_supported_resampler(const char *resampler) {
+    // If we get a null value, skip all the validation and return SWR.
+    if (NULL == resampler) { return SWR_ENGINE_SWR; }
+
+    AUDIOFS_PRINTVAL(resampler, "s");
+    resampler_detect_capabilities();
+
+    enum SwrEngine swr_engine;
     if (0 == strcmp(resampler, "soxr")) {
         swr_engine = SWR_ENGINE_SOXR;
-    } else {
+    } else if (0 == strcmp(resampler, "swr")) {
         swr_engine = SWR_ENGINE_SWR;
+    } else {
+        errorf("Resampler '%s' is unknown\n", resampler);
+        return -1;
     }
 
-end:
-    swr_free(&swr);
+    if (!engine_supported[swr_engine]) {
+        errorf("Could not initialize swresample with resampler '%s'\n", resampler);
+        return -1;
+    }
     return swr_engine;
 }
 
@@ -165,7 +204,7 @@ int setup_swr(struct decoder_context *ctx, enum SwrDitherType dither, enum SwrEn
     if (0 != av_opt_set_int(ctx->swrContext, "out_sample_fmt", ctx->override_sample_fmt, 0)) { return_break }
 
     debugf("initializing swr_context");
-    int ret = swr_init(ctx->swrContext);
+    int ret = conversion_plan_init(ctx);
     if (ret < 0) {
         errorf("%s", av_err2str(ret));
         AUDIOFS_PRINTVAL(ret, "d");
@@ -175,3 +214,37 @@ int setup_swr(struct decoder_context *ctx, enum SwrDitherType dither, enum SwrEn
 
     return 0;
 }
+
+/**
+ * setup_fingerprint_swr: configure and initialize swr for the fingerprint conversion plan
+ *
+ * Fingerprints gain nothing from dithering or a steep filter, which is what makes 5.1/7.1 and 192 kHz sources
+ * expensive. The filter mirrors the one chromaprint uses when it has to resample on its own.
+ *
+ * @param ctx   decoder context with override_* set by change_target_format
+ * @return 0 on success, or a negative value in case of error
+ */
+int setup_fingerprint_swr(struct decoder_context *ctx) {
+    int code;
+
+    assert(context_ok(ctx));
+
+    if (ctx->swrContext == NULL) { return -1; }
+
+    code = set_dither_settings(ctx, SWR_DITHER_NONE, SWR_ENGINE_SWR);
+    if (code < 0) { return code; }
+
+    code = av_opt_set_int(ctx->swrContext, "filter_size", 16, 0);
+    if (code < 0) { return code; }
+
+    code = av_opt_set_int(ctx->swrContext, "phase_shift", 8, 0);
+    if (code < 0) { return code; }
+
+    code = av_opt_set_int(ctx->swrContext, "linear_interp", 0, 0);
+    if (code < 0) { return code; }
+
+    code = av_opt_set_double(ctx->swrContext, "cutoff", 0.8, 0);
+    if (code < 0) { return code; }
+
+    return setup_swr(ctx, SWR_DITHER_NONE, SWR_ENGINE_SWR);
+}
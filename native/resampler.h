@@ -8,7 +8,9 @@
 int set_dither_settings(struct decoder_context *ctx, enum SwrDitherType dither, enum SwrEngine resampler);
 
 enum SwrDitherType dither_by_name(const char *dither);
+void               resampler_detect_capabilities(void);
 int                get_supported_resampler(const char *resampler);
 
 int setup_swr(struct decoder_context *ctx, enum SwrDitherType dither, enum SwrEngine resampler);
+int setup_fingerprint_swr(struct decoder_context *ctx);
 #endif // NATIVE_RESAMPLER_H
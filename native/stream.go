@@ -0,0 +1,314 @@
+package native
+
+/*
+#include "golang_glue.h"
+*/
+import "C"
+import (
+	"context"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"sync"
+	"unsafe"
+
+	"gitlab.com/t4cc0re/audiofs/lib/scheduler"
+)
+
+// DefaultStreamChunk is how much output a Stream moves per cgo call. A crossing costs in the order of 100ns, so at
+// this size it is noise next to the transcode itself, while reads stay within a few frames of memory.
+const DefaultStreamChunk = 256 << 10
+
+var ErrStreamClosed = errors.New("stream is closed")
+
+// Sizes of outputs which were read to the end once, so seeking relative to the end does not transcode them again.
+// Keyed by streamSizeKey.
+var streamSizes sync.Map
+
+type streamSizeKey struct {
+	path    string
+	format  string
+	size    int64
+	modTime int64
+}
+
+// Stream is the output of a transcode which is produced while it is read (transcode_job_open), so the first bytes are
+// available right away and memory stays bounded, no matter how long the input is.
+//
+// Output is pulled from the C side in chunks of at least `chunk` bytes, into Go memory: each cgo crossing moves a
+// whole chunk, and reads into buffers at least that large skip the copy. Seeking backwards restarts the transcode,
+// seeking forwards skips output. The size (io.SeekEnd) of aiff and wav outputs is known up front, as their header has
+// it (see transcode_job_size). For other formats, it is known after reading to the end once; before that, asking for
+// it transcodes the whole input once, so servers should check KnownSize first.
+//
+// Stream implements io.ReadSeekCloser and io.WriterTo, e.g. for http.ServeContent and io.Copy into files. It is not
+// safe for concurrent use.
+type Stream struct {
+	path   string
+	format string
+	key    streamSizeKey
+	chunk  int
+
+	job      *C.transcode_job
+	produced int64  // bytes pulled from the current job
+	buf      []byte // pulled, but not read yet: buf[off:] ends at `produced`
+	off      int
+	pos      int64 // read position, applied on the next read
+	closed   bool
+}
+
+// OpenStream starts transcoding the first audio stream of `path` into `format` (e.g. "aiff").
+//
+// chunk is the number of bytes moved per cgo call, DefaultStreamChunk if <= 0.
+func OpenStream(path, format string, chunk int) (*Stream, error) {
+	info, err := os.Stat(path)
+	if err != nil {
+		return nil, err
+	}
+	if chunk <= 0 {
+		chunk = DefaultStreamChunk
+	}
+	s := &Stream{
+		path:   path,
+		format: format,
+		key:    streamSizeKey{path: path, format: format, size: info.Size(), modTime: info.ModTime().UnixNano()},
+		chunk:  chunk,
+		buf:    make([]byte, 0, chunk),
+	}
+	if s.job, err = openJob(path, format); err != nil {
+		return nil, err
+	}
+	return s, nil
+}
+
+// Streams are read by someone waiting for them, so they run as scheduler.Interactive jobs. Their codec threads are
+// set once, as they are shared by every job of this process.
+var streamThreadsOnce sync.Once
+
+func openJob(path, format string) (*C.transcode_job, error) {
+	streamThreadsOnce.Do(func() {
+		C.transcode_threads = C.int32_t(scheduler.Threads(scheduler.Interactive))
+	})
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	cformat := C.CString(format)
+	defer C.free(unsafe.Pointer(cformat))
+
+	job := C.transcode_job_open(cpath, nil, nil, cformat, nil)
+	if job == nil {
+		return nil, fmt.Errorf("could not transcode '%s' to %s", path, format)
+	}
+	return job, nil
+}
+
+// pull fills p with the next output of job, in a single cgo call. Go memory may be passed for the duration of the call,
+// as it holds no Go pointers. The transcode only counts against the scheduler's budget while pulling.
+func pull(job *C.transcode_job, p []byte) (int, error) {
+	if len(p) == 0 {
+		return 0, nil
+	}
+	grant, err := scheduler.Default().Acquire(context.Background(), scheduler.Interactive, int(C.transcode_threads))
+	if err != nil {
+		return 0, err
+	}
+	n := C.transcode_job_pull(job, (*C.uint8_t)(unsafe.Pointer(&p[0])), C.int(len(p)))
+	grant.Release()
+	if n < 0 {
+		return 0, avError(n)
+	}
+	if n == 0 {
+		return 0, io.EOF
+	}
+	return int(n), nil
+}
+
+func avError(code C.int) error {
+	buf := make([]C.char, 128)
+	C.av_strerror(code, &buf[0], C.size_t(len(buf)))
+	return fmt.Errorf("transcode failed: %s", C.GoString(&buf[0]))
+}
+
+// pullInto pulls into p, which receives output from `s.produced` on.
+func (s *Stream) pullInto(p []byte) (int, error) {
+	n, err := pull(s.job, p)
+	s.produced += int64(n)
+	if err == io.EOF {
+		streamSizes.Store(s.key, s.produced)
+	}
+	return n, err
+}
+
+// fill replaces the buffer with the next chunk of output.
+func (s *Stream) fill() error {
+	n, err := s.pullInto(s.buf[:cap(s.buf)])
+	s.buf = s.buf[:n]
+	s.off = 0
+	return err
+}
+
+// reposition makes the next output byte (the buffer's, or the job's next one) the one at s.pos.
+func (s *Stream) reposition() error {
+	start := s.produced - int64(len(s.buf)-s.off)
+	if s.pos >= start && s.pos <= s.produced {
+		s.off += int(s.pos - start)
+		return nil
+	}
+	if s.pos < start {
+		job, err := openJob(s.path, s.format)
+		if err != nil {
+			return err
+		}
+		C.transcode_job_close(&s.job)
+		s.job = job
+		s.produced = 0
+	}
+	s.buf, s.off = s.buf[:0], 0
+	for s.produced < s.pos {
+		if err := s.fill(); err != nil {
+			// Past the end, reads return io.EOF like os.File's do.
+			return err
+		}
+		if s.produced > s.pos {
+			s.off = len(s.buf) - int(s.produced-s.pos)
+		}
+	}
+	return nil
+}
+
+// Read implements io.Reader. Reads of at least one chunk go straight into p.
+func (s *Stream) Read(p []byte) (int, error) {
+	if s.closed {
+		return 0, ErrStreamClosed
+	}
+	if err := s.reposition(); err != nil {
+		return 0, err
+	}
+	if s.off == len(s.buf) {
+		if len(p) >= s.chunk {
+			n, err := s.pullInto(p)
+			s.pos += int64(n)
+			return n, err
+		}
+		if err := s.fill(); err != nil && len(s.buf) == 0 {
+			return 0, err
+		}
+	}
+	n := copy(p, s.buf[s.off:])
+	s.off += n
+	s.pos += int64(n)
+	return n, nil
+}
+
+// WriteTo implements io.WriterTo, so io.Copy moves whole chunks without an intermediate buffer.
+func (s *Stream) WriteTo(w io.Writer) (int64, error) {
+	var written int64
+	if s.closed {
+		return 0, ErrStreamClosed
+	}
+	if err := s.reposition(); err != nil {
+		if err == io.EOF {
+			return 0, nil
+		}
+		return 0, err
+	}
+	for {
+		if s.off < len(s.buf) {
+			n, err := w.Write(s.buf[s.off:])
+			s.off += n
+			s.pos += int64(n)
+			written += int64(n)
+			if err != nil {
+				return written, err
+			}
+		}
+		if err := s.fill(); err != nil {
+			if err == io.EOF {
+				return written, nil
+			}
+			return written, err
+		}
+	}
+}
+
+// Seek implements io.Seeker. It only moves the read position; the transcode catches up on the next read.
+func (s *Stream) Seek(offset int64, whence int) (int64, error) {
+	if s.closed {
+		return 0, ErrStreamClosed
+	}
+	switch whence {
+	case io.SeekStart:
+	case io.SeekCurrent:
+		offset += s.pos
+	case io.SeekEnd:
+		size, err := s.Size()
+		if err != nil {
+			return 0, err
+		}
+		offset += size
+	default:
+		return 0, errors.New("invalid whence")
+	}
+	if offset < 0 {
+		return 0, errors.New("negative position")
+	}
+	s.pos = offset
+	return offset, nil
+}
+
+// KnownSize returns the output's size if it is known without transcoding: from the header of formats which have it,
+// or because a Stream of the same file and format was read to the end. Otherwise, a server should send the output
+// without a length rather than call Size.
+func (s *Stream) KnownSize() (int64, bool) {
+	if size, ok := streamSizes.Load(s.key); ok {
+		return size.(int64), true
+	}
+	if s.job != nil {
+		if size := int64(C.transcode_job_size(s.job)); size >= 0 {
+			streamSizes.Store(s.key, size)
+			return size, true
+		}
+	}
+	return 0, false
+}
+
+// Size returns the output's size. If it is not known (see KnownSize), it is measured by transcoding the input once,
+// without keeping the output.
+func (s *Stream) Size() (int64, error) {
+	if s.closed {
+		return 0, ErrStreamClosed
+	}
+	if size, ok := s.KnownSize(); ok {
+		return size, nil
+	}
+	job, err := openJob(s.path, s.format)
+	if err != nil {
+		return 0, err
+	}
+	defer C.transcode_job_close(&job)
+
+	var size int64
+	scratch := make([]byte, s.chunk)
+	for {
+		n, err := pull(job, scratch)
+		size += int64(n)
+		if err == io.EOF {
+			streamSizes.Store(s.key, size)
+			return size, nil
+		}
+		if err != nil {
+			return 0, err
+		}
+	}
+}
+
+// Close stops the transcode. Output which was not read is dropped.
+func (s *Stream) Close() error {
+	if s.closed {
+		return ErrStreamClosed
+	}
+	s.closed = true
+	C.transcode_job_close(&s.job)
+	s.buf = nil
+	return nil
+}
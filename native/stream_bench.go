@@ -0,0 +1,31 @@
+package native
+
+/*
+#include "golang_glue.h"
+*/
+import "C"
+import (
+	"io"
+	"time"
+)
+
+// StreamPullCost measures a single cgo crossing into transcode_job_pull, averaged over `pulls` calls. The calls go to
+// a job which is already at its end, so they return right away and only the crossing itself is measured. For
+// benchmarks.
+func StreamPullCost(path, format string, pulls int) (time.Duration, error) {
+	s, err := OpenStream(path, format, 0)
+	if err != nil {
+		return 0, err
+	}
+	defer s.Close()
+	if _, err := s.WriteTo(io.Discard); err != nil {
+		return 0, err
+	}
+
+	var b [1]byte
+	start := time.Now()
+	for i := 0; i < pulls; i++ {
+		C.transcode_job_pull(s.job, (*C.uint8_t)(&b[0]), 1)
+	}
+	return time.Since(start) / time.Duration(pulls), nil
+}
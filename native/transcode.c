@@ -28,38 +28,119 @@
  */
 
 #include "custom_avio.h"
+#include "dsd.h"
+#include "metrics.h"
+#include "pcm_kernels.h"
+#include "transcode.h"
 #include "util.h"
 #include <libavcodec/avcodec.h>
-#include <libavfilter/buffersink.h>
-#include <libavfilter/buffersrc.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/intreadwrite.h>
 #include <libavutil/mem.h>
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
 
-static AVFormatContext *ifmt_ctx;
-static AVFormatContext *ofmt_ctx;
+// defined in libav.c
+extern decoder_context *
+            fingerprint_conversion_alloc(AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *codec_ctx);
+extern decoder_context *transcode_conversion_alloc(
+    AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *dec_ctx, const AVCodecContext *enc_ctx);
+extern decoder_context *decoder_context_alloc(AVFormatContext *fmt_ctx, AVStream *stream, AVCodecContext *codec_ctx);
+extern int              change_target_format(
+                 struct decoder_context *ctx,
+                 enum AVSampleFormat     target_fmt,
+                 u_int8_t                target_depth,
+                 int32_t                 target_rate,
+                 const AVChannelLayout * target_layout);
+extern void decoder_context_free(decoder_context **ctx);
+
+// One of the pcm_kernels swap kernels
+typedef void (*swap_kernel)(uint8_t *dst, const uint8_t *src, size_t samples);
 typedef struct FilteringContext {
-    AVFilterContext *buffersink_ctx;
-    AVFilterContext *buffersrc_ctx;
-    AVFilterGraph *  filter_graph;
+    // Conversion plan from the decoder's into the encoder's format. Its swr context is cached between transcodes.
+    decoder_context *conversion;
+    int64_t          next_pts;
+
+    // Set if decoded frames only need repacking into the output's PCM layout (no rate, layout or depth change). Both
+    // the conversion and the encoder are bypassed then.
+    bool         pack_directly;
+    // Set if the demuxed packets already are the output's PCM, except for the byte order. The decoder is bypassed as
+    // well then. raw_swap is NULL if the byte order matches, too.
+    bool        raw_pcm;
+    swap_kernel raw_swap;
+    uint8_t *    scratch;
+    unsigned int scratch_size;
 
     AVPacket *enc_pkt;
     AVFrame * filtered_frame;
 } FilteringContext;
-static FilteringContext *filter_ctx;
+
+// Whether uncompressed sources may bypass the decoder. Benchmarks turn it off to check both paths give the same output.
+bool transcode_raw_pcm = true;
+
+int32_t transcode_threads = 0;
+
+// AVIO buffer of file outputs. The muxer writes in chunks of this size, so it has to be large enough for a file to go
+// to the disk in few large writes rather than one per packet.
+#define FILE_OUTPUT_BUFFER (256 << 10)
 
 typedef struct StreamContext {
     AVCodecContext *dec_ctx;
     AVCodecContext *enc_ctx;
 
     AVFrame *dec_frame;
+    // Replaces the decoder for DSD sources (dsd.h), NULL otherwise
+    dsd_converter *dsd;
 } StreamContext;
-static StreamContext *stream_ctx;
 
-static int open_input_file_with_format_context(AVFormatContext *ctx) {
+struct transcode_job {
+    AVFormatContext * ifmt_ctx;
+    AVFormatContext * ofmt_ctx;
+    FilteringContext *filter_ctx;
+    StreamContext *   stream_ctx;
+    bool              owns_input; // opened from a path, closed with the job
+    // Set by transcode_to_file: the output is tagged with `metadata` (may be empty) instead of nothing.
+    bool          write_tags;
+    AVDictionary *metadata;
+
+    AVPacket *packet;
+    int       selected_stream;
+    int64_t   fed_samples;
+    int64_t   sample_limit; // samples to feed to the output, 0 for the whole stream
+    bool      finished;     // everything flushed and the trailer written
+    int       error;        // first failure while pulling, returned by every later pull
+
+    // Set for transcode_job_open: the muxer writes into `pending` instead of an AudioFS AVIO handle, and pulls take
+    // their bytes from there, starting at pending_offset.
+    bool         streaming;
+    uint8_t *    pending;
+    unsigned int pending_size;
+    size_t       pending_len;
+    size_t       pending_offset;
+    // Set for pulled outputs whose header was sized up front (see size_pulled_header): exactly data_left more bytes of
+    // audio are queued, whatever the muxer writes.
+    bool    sized;
+    int64_t data_left;
+    bool    data_pad; // the data chunk has an odd size, so a pad byte follows it
+    int64_t size;     // size of the whole output as the header has it, -1 if it was not sized
+};
+
+static bool window_filled(const transcode_job *job) {
+    return job->sample_limit > 0 && job->fed_samples >= job->sample_limit;
+}
+
+/**
+ * dsd_thread_count: threads for a DSD converter. transcode_threads caps them, as the converter runs in the same budget
+ * as the codecs.
+ */
+static int32_t dsd_thread_count(void) {
+    if (transcode_threads <= 0) { return dsd_threads; }
+    return dsd_threads > 0 ? MIN(dsd_threads, transcode_threads) : transcode_threads;
+}
+
+static int open_input_file_with_format_context(transcode_job *job, AVFormatContext *ctx) {
     int          ret;
     unsigned int i;
 
@@ -67,13 +148,13 @@ static int open_input_file_with_format_context(AVFormatContext *ctx) {
         errorf("No FormatContext provided");
         return -1; // TODO Better code
     }
-    ifmt_ctx = ctx;
+    job->ifmt_ctx = ctx;
 
-    stream_ctx = av_malloc(sizeof(*stream_ctx));
-    if (!stream_ctx) { return AVERROR(ENOMEM); }
+    job->stream_ctx = av_mallocz(sizeof(*job->stream_ctx));
+    if (!job->stream_ctx) { return AVERROR(ENOMEM); }
 
-    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        AVStream *stream = ifmt_ctx->streams[i];
+    for (i = 0; i < job->ifmt_ctx->nb_streams; i++) {
+        AVStream *stream = job->ifmt_ctx->streams[i];
         if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) { continue; }
         const AVCodec * dec = avcodec_find_decoder(stream->codecpar->codec_id);
         AVCodecContext *codec_ctx;
@@ -97,22 +178,34 @@ static int open_input_file_with_format_context(AVFormatContext *ctx) {
         /* Reencode video & audio and remux subtitles etc. */
         if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO || codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
             if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-                codec_ctx->framerate = av_guess_frame_rate(ifmt_ctx, stream, NULL);
+                codec_ctx->framerate = av_guess_frame_rate(job->ifmt_ctx, stream, NULL);
             }
             /* Open decoder */
+            if (transcode_threads > 0) { codec_ctx->thread_count = transcode_threads; }
             ret = avcodec_open2(codec_ctx, dec, NULL);
             if (ret < 0) {
                 errorf("Failed to open decoder for stream #%u\n", i);
                 return ret;
             }
         }
-        stream_ctx->dec_ctx = codec_ctx;
+        if (dsd_output_rate > 0 && dsd_codec(codec_ctx->codec_id)) {
+            // Demuxers report DSD's rate in bytes per channel.
+            job->stream_ctx->dsd = dsd_converter_alloc(
+                codec_ctx->codec_id,
+                &codec_ctx->ch_layout,
+                codec_ctx->sample_rate * 8,
+                dsd_output_rate,
+                dsd_thread_count());
+            // The decoder context stays open, but now describes the converter's output (planar float, like libav's).
+            if (job->stream_ctx->dsd != NULL) { codec_ctx->sample_rate = dsd_converter_rate(job->stream_ctx->dsd); }
+        }
+        job->stream_ctx->dec_ctx = codec_ctx;
 
-        stream_ctx->dec_frame = av_frame_alloc();
-        if (!stream_ctx->dec_frame) { return AVERROR(ENOMEM); }
+        job->stream_ctx->dec_frame = av_frame_alloc();
+        if (!job->stream_ctx->dec_frame) { return AVERROR(ENOMEM); }
     }
 
-    av_dump_format(ifmt_ctx, 0, "input", 0);
+    av_dump_format(job->ifmt_ctx, 0, "input", 0);
     return 0;
 }
 
@@ -121,40 +214,329 @@ static int open_input_file_with_format_context(AVFormatContext *ctx) {
  * @param filename
  * @return
  */
-__attribute__((deprecated)) static int open_input_file(const char *filename) {
-    int ret;
-    ifmt_ctx = NULL;
-    if ((ret = avformat_open_input(&ifmt_ctx, filename, NULL, NULL)) < 0) {
+__attribute__((deprecated)) static int open_input_file(transcode_job *job, const char *filename) {
+    int          ret;
+    metrics_span span = metrics_start();
+    job->ifmt_ctx     = NULL;
+    if ((ret = avformat_open_input(&job->ifmt_ctx, filename, NULL, NULL)) < 0) {
         errorf("Cannot open input file\n");
         return ret;
     }
 
-    if ((ret = avformat_find_stream_info(ifmt_ctx, NULL)) < 0) {
+    ret = avformat_find_stream_info(job->ifmt_ctx, NULL);
+    metrics_stop(&span, METRICS_STAGE_PROBE, job->ifmt_ctx->pb ? avio_tell(job->ifmt_ctx->pb) : 0, 0);
+    if (ret < 0) {
         errorf("Cannot find stream information\n");
         return ret;
     }
-    ret = open_input_file_with_format_context(ifmt_ctx);
+    ret = open_input_file_with_format_context(job, job->ifmt_ctx);
+    return ret;
+}
+
+static bool is_fingerprint_output(const transcode_job *job) {
+    return 0 == strcmp(job->ofmt_ctx->oformat->name, "chromaprint");
+}
+
+/**
+ * passthrough_codec: pick the PCM encoder which stores samples of a (packed) sample format without conversion
+ *
+ * Big endian is preferred. Little endian is used if the muxer only takes that (e.g. wav).
+ *
+ * @param oformat   output format
+ * @param fmt       packed sample format of the source, as set up by change_target_format
+ * @param depth     bits used of fmt (24 for 24-in-32)
+ * @return the encoder's codec id
+ */
+static enum AVCodecID passthrough_codec(const AVOutputFormat *oformat, enum AVSampleFormat fmt, uint8_t depth) {
+    enum AVCodecID big, little;
+
+    switch (fmt) {
+        case AV_SAMPLE_FMT_S32:
+            big    = depth == 24 ? AV_CODEC_ID_PCM_S24BE : AV_CODEC_ID_PCM_S32BE;
+            little = depth == 24 ? AV_CODEC_ID_PCM_S24LE : AV_CODEC_ID_PCM_S32LE;
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            big    = AV_CODEC_ID_PCM_F32BE;
+            little = AV_CODEC_ID_PCM_F32LE;
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            big    = AV_CODEC_ID_PCM_F64BE;
+            little = AV_CODEC_ID_PCM_F64LE;
+            break;
+        case AV_SAMPLE_FMT_S64:
+            big    = AV_CODEC_ID_PCM_S64BE;
+            little = AV_CODEC_ID_PCM_S64LE;
+            break;
+        default:
+            // s16, and u8 which widens to s16 without loss
+            big    = AV_CODEC_ID_PCM_S16BE;
+            little = AV_CODEC_ID_PCM_S16LE;
+            break;
+    }
+
+    // 1: supported, 0: not supported, negative: the muxer does not say
+    if (avformat_query_codec(oformat, big, FF_COMPLIANCE_NORMAL) == 0
+        && avformat_query_codec(oformat, little, FF_COMPLIANCE_NORMAL) == 1) {
+        return little;
+    }
+    return big;
+}
+
+/**
+ * passthrough_output_format: set up an encoder context to store the source's samples as they are
+ *
+ * The rate, layout and depth are taken from the source via change_target_format, so nothing is resampled or
+ * truncated, and the conversion is skipped entirely if the decoder's output can be packed as-is.
+ *
+ * @param in_stream decoded stream
+ * @param dec_ctx   opened decoder
+ * @param encoder   set to the chosen encoder
+ * @param enc_ctx   set to the allocated encoder context (sample rate, layout, format and time base set up)
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static int passthrough_output_format(
+    transcode_job *  job,
+    AVStream *       in_stream,
+    AVCodecContext * dec_ctx,
+    const AVCodec ** encoder,
+    AVCodecContext **enc_ctx) {
+    decoder_context *source = decoder_context_alloc(job->ifmt_ctx, in_stream, dec_ctx);
+    int              ret    = 0;
+
+    if (source == NULL) { return AVERROR(ENOMEM); }
+    if (change_target_format(source, AV_SAMPLE_FMT_NONE, 0, 0, NULL) < 0) {
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    *encoder = avcodec_find_encoder(
+        passthrough_codec(job->ofmt_ctx->oformat, source->override_sample_fmt, source->override_depth));
+    if (!*encoder) {
+        fatalf("Necessary encoder not found\n");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    *enc_ctx = avcodec_alloc_context3(*encoder);
+    if (!*enc_ctx) {
+        fatalf("Failed to allocate the encoder context\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    (*enc_ctx)->sample_rate = source->override_sample_rate;
+    (*enc_ctx)->sample_fmt  = (*encoder)->sample_fmts[0];
+    (*enc_ctx)->time_base   = (AVRational){1, source->override_sample_rate};
+    ret                     = av_channel_layout_copy(&(*enc_ctx)->ch_layout, &source->override_channel_layout);
+    infof(
+        "Output: %s, %d Hz, %d channels\n",
+        (*encoder)->name,
+        (*enc_ctx)->sample_rate,
+        (*enc_ctx)->ch_layout.nb_channels);
+
+end:
+    decoder_context_free(&source);
     return ret;
 }
 
 /**
- * Allocate an AVFormatContext for an output format.
- * avformat_free_context() can be used to free the context and
- * everything allocated by the framework within it.
- *
- * @param ctx           pointee is set to the created format context,
- *                      or to NULL in case of failure
- * @param oformat       format to use for allocating the context, if NULL
- *                      format_name and filename are used instead
- * @param format_name   the name of output format to use for allocating the
- *                      context, if NULL filename is used instead
- * @param filename      the name of the filename to use for allocating the
- *                      context, may be NULL
- *
- * @return  >= 0 in case of success, a negative AVERROR code in case of
- *          failure
+ * job_output_write: AVIO write callback of pulled jobs, queueing the muxer's output for transcode_job_pull
+ *
+ * INTERNAL
+ *
+ * @param opaque    transcode job
+ * @return buf_size on success, a negative AVERROR on failure
  */
-static int open_output_file(const AVOutputFormat *oformat, const char *format_name, const char *filename) {
+static int job_output_write(void *opaque, uint8_t *buf, int buf_size) {
+    transcode_job *job   = opaque;
+    int            count = buf_size;
+
+    if (job->sized) {
+        // Audio beyond what the header promised is dropped, and so is the muxer's own pad byte.
+        count = (int)MIN((int64_t)buf_size, job->data_left);
+        job->data_left -= count;
+        if (count == 0) { return buf_size; }
+    }
+
+    if (job->pending_offset > 0) {
+        // Drop what was pulled already, so the queue does not grow beyond what was not pulled yet.
+        memmove(job->pending, job->pending + job->pending_offset, job->pending_len - job->pending_offset);
+        job->pending_len -= job->pending_offset;
+        job->pending_offset = 0;
+    }
+    if (job->pending_len + count > UINT_MAX) { return AVERROR(ENOMEM); }
+    uint8_t *pending = av_fast_realloc(job->pending, &job->pending_size, job->pending_len + count);
+    if (pending == NULL) { return AVERROR(ENOMEM); }
+    job->pending = pending;
+    memcpy(job->pending + job->pending_len, buf, count);
+    job->pending_len += count;
+    return buf_size;
+}
+
+/**
+ * pulled_output_frames: sample frames the output of a pulled job will have, from the input's duration and the window
+ *
+ * INTERNAL
+ *
+ * @return number of frames, or -1 if the input does not know its duration
+ */
+static int64_t pulled_output_frames(const transcode_job *job, const transcode_window *window, int sample_rate) {
+    const AVStream *in_stream = job->ifmt_ctx->streams[job->selected_stream];
+    int64_t         frames    = -1;
+
+    if (in_stream->duration != AV_NOPTS_VALUE && in_stream->duration > 0) {
+        frames = av_rescale_q(in_stream->duration, in_stream->time_base, (AVRational){1, sample_rate});
+    } else if (job->ifmt_ctx->duration != AV_NOPTS_VALUE && job->ifmt_ctx->duration > 0) {
+        frames = av_rescale(job->ifmt_ctx->duration, sample_rate, AV_TIME_BASE);
+    }
+    if (frames < 0 || window == NULL) { return frames; }
+    if (window->start > 0) { frames = MAX(0, frames - av_rescale(window->start, sample_rate, AV_TIME_BASE)); }
+    if (window->duration > 0) { frames = MIN(frames, av_rescale(window->duration, sample_rate, AV_TIME_BASE)); }
+    return frames;
+}
+
+static void write_header_size(uint8_t *at, bool big_endian, uint32_t size) {
+    if (big_endian) {
+        AV_WB32(at, size);
+    } else {
+        AV_WL32(at, size);
+    }
+}
+
+/**
+ * size_pulled_header: fill in the sizes of a pulled aiff or wav output's header
+ *
+ * Both muxers write sizes of 0 (or -1) up front and patch them in the trailer, which a pulled output cannot do. AIFF
+ * has no notion of an unknown length, so players would see an empty file. Instead, the sizes are computed from the
+ * input's duration while the header is still queued, and job_output_write and job_finish make the audio match them.
+ * For PCM and lossless inputs, the duration is exact. For lossy ones, it may be off by the encoder's delay and
+ * padding, which is trimmed or filled with silence.
+ *
+ * INTERNAL
+ *
+ * @return 0 on success (also if the output needs no sizes), a negative AVERROR if they cannot be known
+ */
+static int size_pulled_header(transcode_job *job, const transcode_window *window) {
+    const AVCodecParameters *par  = job->ofmt_ctx->streams[0]->codecpar;
+    const char *             name = job->ofmt_ctx->oformat->name;
+    bool                     aiff = 0 == strcmp(name, "aiff");
+    int                      ret;
+
+    if (!aiff && 0 != strcmp(name, "wav")) { return 0; }
+    // Everything written so far is the header, and nothing was pulled yet.
+    avio_flush(job->ofmt_ctx->pb);
+    if (job->ofmt_ctx->pb->error < 0) { return job->ofmt_ctx->pb->error; }
+
+    int frame_size = av_get_bits_per_sample(par->codec_id) / 8 * par->ch_layout.nb_channels;
+    if (frame_size <= 0) {
+        errorf("Cannot size the header of pulled %s output: %s is not PCM\n", name, avcodec_get_name(par->codec_id));
+        return AVERROR(EINVAL);
+    }
+    int64_t frames = pulled_output_frames(job, window, par->sample_rate);
+    if (frames < 0) {
+        errorf("Cannot size the header of pulled %s output: the input's duration is unknown\n", name);
+        return AVERROR(EINVAL);
+    }
+    int64_t  data_size = frames * frame_size;
+    uint8_t *header    = job->pending;
+    size_t   length    = job->pending_len;
+    // The data chunk's size field counts SSND's offset and block size fields as well.
+    int64_t data_chunk = aiff ? data_size + 8 : data_size;
+    int64_t total      = (int64_t)length + data_size + (data_size & 1);
+    if (total - 8 > UINT32_MAX) {
+        errorf("Pulled %s output of %" PRId64 " bytes is too large for its header\n", name, total);
+        return AVERROR(EFBIG);
+    }
+
+    ret = AVERROR_BUG;
+    if (length >= 12 && 0 == memcmp(header, aiff ? "FORM" : "RIFF", 4)) {
+        for (size_t pos = 12; pos + 8 <= length;) {
+            const uint8_t *id   = header + pos;
+            uint32_t       size = aiff ? AV_RB32(id + 4) : AV_RL32(id + 4);
+            if (aiff && 0 == memcmp(id, "COMM", 4) && pos + 14 <= length) {
+                AV_WB32(header + pos + 10, (uint32_t)frames);
+            } else if (0 == memcmp(id, aiff ? "SSND" : "data", 4)) {
+                // The audio follows right after the header.
+                if (pos + (aiff ? 16 : 8) == length) {
+                    write_header_size(header + pos + 4, aiff, (uint32_t)data_chunk);
+                    ret = 0;
+                }
+                break;
+            }
+            pos += 8 + (size_t)size + (size & 1);
+        }
+    }
+    if (ret < 0) {
+        errorf("Unexpected header of pulled %s output\n", name);
+        return ret;
+    }
+    write_header_size(header + 4, aiff, (uint32_t)(total - 8));
+
+    job->sized     = true;
+    job->size      = total;
+    job->data_left = data_size;
+    job->data_pad  = data_size & 1;
+    debugf("Sized pulled %s output: %" PRId64 " frames, %" PRId64 " bytes\n", name, frames, total);
+    return 0;
+}
+
+/**
+ * add_attached_pics: add an output stream for every attached picture (cover art) of the input, after the audio
+ * streams, so their stream indices stay the same
+ *
+ * INTERNAL
+ *
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static int add_attached_pics(transcode_job *job) {
+    for (unsigned int i = 0; i < job->ifmt_ctx->nb_streams; i++) {
+        AVStream *in_stream = job->ifmt_ctx->streams[i];
+        if (!(in_stream->disposition & AV_DISPOSITION_ATTACHED_PIC) || in_stream->attached_pic.size <= 0) { continue; }
+        if (avformat_query_codec(job->ofmt_ctx->oformat, in_stream->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+            warnf("Dropping attached picture #%u, the muxer does not take %s\n", i,
+                  avcodec_get_name(in_stream->codecpar->codec_id));
+            continue;
+        }
+
+        AVStream *out_stream = avformat_new_stream(job->ofmt_ctx, NULL);
+        if (out_stream == NULL) { return AVERROR(ENOMEM); }
+        int ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+        if (ret < 0) { return ret; }
+        out_stream->codecpar->codec_tag = 0;
+        out_stream->disposition         = AV_DISPOSITION_ATTACHED_PIC;
+        out_stream->time_base           = in_stream->time_base;
+        out_stream->id                  = (int)i; // input stream holding the picture, see write_attached_pics
+        if ((ret = av_dict_copy(&out_stream->metadata, in_stream->metadata, 0)) < 0) { return ret; }
+    }
+    return 0;
+}
+
+/**
+ * write_attached_pics: hand the pictures of the streams added by add_attached_pics to the muxer
+ *
+ * INTERNAL
+ *
+ * Muxers like aiff and mp3 keep them until they write their tags, so this only copies a reference.
+ *
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static int write_attached_pics(transcode_job *job) {
+    for (unsigned int i = 0; i < job->ofmt_ctx->nb_streams; i++) {
+        AVStream *out_stream = job->ofmt_ctx->streams[i];
+        if (!(out_stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) { continue; }
+
+        AVPacket *pic = av_packet_clone(&job->ifmt_ctx->streams[out_stream->id]->attached_pic);
+        if (pic == NULL) { return AVERROR(ENOMEM); }
+        pic->stream_index = (int)i;
+        pic->pts = pic->dts = 0;
+        int ret             = av_write_frame(job->ofmt_ctx, pic);
+        av_packet_free(&pic);
+        if (ret < 0) { return ret; }
+    }
+    return 0;
+}
+
+static int open_output_file(
+    transcode_job *job, const AVOutputFormat *oformat, const char *format_name, const char *filename) {
     AVStream *      out_stream = NULL;
     AVStream *      in_stream = NULL;
     AVCodecContext *dec_ctx = NULL, *enc_ctx = NULL;
@@ -162,17 +544,17 @@ static int open_output_file(const AVOutputFormat *oformat, const char *format_na
     int             ret = 0;
     unsigned int    i = 0;
 
-    ofmt_ctx = NULL;
-    avformat_alloc_output_context2(&ofmt_ctx, oformat, format_name, filename);
-    if (!ofmt_ctx) {
+    job->ofmt_ctx = NULL;
+    avformat_alloc_output_context2(&job->ofmt_ctx, oformat, format_name, filename);
+    if (!job->ofmt_ctx) {
         errorf("Could not create output context\n");
         return AVERROR_UNKNOWN;
     }
 
-    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        in_stream = ifmt_ctx->streams[i];
+    for (i = 0; i < job->ifmt_ctx->nb_streams; i++) {
+        in_stream = job->ifmt_ctx->streams[i];
         if (in_stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            out_stream = avformat_new_stream(ofmt_ctx, NULL);
+            out_stream = avformat_new_stream(job->ofmt_ctx, NULL);
             if (!out_stream) {
                 errorf("Failed allocating output stream\n");
                 return AVERROR_UNKNOWN;
@@ -181,48 +563,38 @@ static int open_output_file(const AVOutputFormat *oformat, const char *format_na
             continue;
         }
 
-        dec_ctx = stream_ctx->dec_ctx;
+        dec_ctx = job->stream_ctx->dec_ctx;
 
         if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-            encoder = avcodec_find_encoder_by_name("pcm_s16be");
-            if (!encoder) {
-                fatalf("Necessary encoder not found\n");
-                return AVERROR_INVALIDDATA;
-            }
-            enc_ctx = avcodec_alloc_context3(encoder);
-            if (!enc_ctx) {
-                fatalf("Failed to allocate the encoder context\n");
-                return AVERROR(ENOMEM);
+            if (is_fingerprint_output(job)) {
+                // The chromaprint muxer feeds packets to chromaprint as-is, so it needs native endian samples.
+                encoder = avcodec_find_encoder_by_name(AV_NE("pcm_s16be", "pcm_s16le"));
+                if (!encoder) {
+                    fatalf("Necessary encoder not found\n");
+                    return AVERROR_INVALIDDATA;
+                }
+                enc_ctx = avcodec_alloc_context3(encoder);
+                if (!enc_ctx) {
+                    fatalf("Failed to allocate the encoder context\n");
+                    return AVERROR(ENOMEM);
+                }
+                // Already in the format chromaprint uses internally. See fingerprint_conversion_alloc
+                enc_ctx->sample_rate = FINGERPRINT_SAMPLE_RATE;
+                enc_ctx->sample_fmt  = encoder->sample_fmts[0];
+                enc_ctx->time_base   = (AVRational){1, enc_ctx->sample_rate};
+                ret = av_channel_layout_copy(&enc_ctx->ch_layout, &(AVChannelLayout)AV_CHANNEL_LAYOUT_MONO);
+            } else {
+                ret = passthrough_output_format(job, in_stream, dec_ctx, &encoder, &enc_ctx);
             }
-
-            /* In this example, we transcode to same properties (picture size,
-             * sample rate etc.). These properties can be changed for output
-             * streams easily using filters */
-            if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-                //            if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-                //                enc_ctx->height = dec_ctx->height;
-                //                enc_ctx->width = dec_ctx->width;
-                //                enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-                //                /* take first format from list of supported formats */
-                //                if (encoder->pix_fmts)
-                //                    enc_ctx->pix_fmt = encoder->pix_fmts[0];
-                //                else
-                //                    enc_ctx->pix_fmt = dec_ctx->pix_fmt;
-                //                /* video time_base can be set to whatever is handy and supported by encoder */
-                //                enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
-                //            } else {
-                enc_ctx->sample_rate = 44100;
-
-                ret = av_channel_layout_copy(&enc_ctx->ch_layout, &dec_ctx->ch_layout);
-                if (ret < 0) { return ret; }
-                /* take first format from list of supported formats */
-                enc_ctx->sample_fmt = encoder->sample_fmts[0];
-                enc_ctx->time_base  = (AVRational){1, enc_ctx->sample_rate};
+            if (ret < 0) {
+                avcodec_free_context(&enc_ctx);
+                return ret;
             }
 
-            if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) { enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER; }
+            if (job->ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) { enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER; }
 
             /* Third parameter can be used to pass settings to encoder */
+            if (transcode_threads > 0) { enc_ctx->thread_count = transcode_threads; }
             ret = avcodec_open2(enc_ctx, encoder, NULL);
             if (ret < 0) {
                 errorf("Cannot open video encoder for stream #%u\n", i);
@@ -234,8 +606,8 @@ static int open_output_file(const AVOutputFormat *oformat, const char *format_na
                 return ret;
             }
 
-            out_stream->time_base = enc_ctx->time_base;
-            stream_ctx->enc_ctx   = enc_ctx;
+            out_stream->time_base    = enc_ctx->time_base;
+            job->stream_ctx->enc_ctx = enc_ctx;
         } else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN) {
             fatalf("Elementary stream #%d is of unknown type, cannot proceed\n", i);
             return AVERROR_INVALIDDATA;
@@ -249,18 +621,33 @@ static int open_output_file(const AVOutputFormat *oformat, const char *format_na
             //            out_stream->time_base = in_stream->time_base;
         }
     }
-    av_dump_format(ofmt_ctx, 0, filename, 1);
+    if (job->write_tags) {
+        if ((ret = av_dict_copy(&job->ofmt_ctx->metadata, job->metadata, 0)) < 0) { return ret; }
+        if ((ret = add_attached_pics(job)) < 0) { return ret; }
+    }
+    av_dump_format(job->ofmt_ctx, 0, job->streaming ? "pull" : filename, 1);
 
-    if (!(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+    if (job->streaming) {
+        // Not seekable, so muxers write out as they go. Flushing every packet hands it to the next pull right away.
+        unsigned char *buffer = av_malloc(4096);
+        if (buffer == NULL) { return AVERROR(ENOMEM); }
+        job->ofmt_ctx->pb = avio_alloc_context(buffer, 4096, 1, job, NULL, &job_output_write, NULL);
+        if (job->ofmt_ctx->pb == NULL) {
+            av_free(buffer);
+            return AVERROR(ENOMEM);
+        }
+        job->ofmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    } else if (!(job->ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
         void *handle = audiofs_avio_open(filename);
         if (handle == NULL) {
             errorf("Could not open output file");
             return -1;
         }
-        unsigned char *buffer = av_malloc(4096);
-        AVIOContext *  avio_ctx
-            = avio_alloc_context(buffer, 4096, 1, handle, &audiofs_avio_read, &audiofs_avio_write, &audiofs_avio_seek);
-        ofmt_ctx->pb = avio_ctx;
+        int            buffer_size = audiofs_avio_is_memory_backed(handle) ? 4096 : FILE_OUTPUT_BUFFER;
+        unsigned char *buffer      = av_malloc(buffer_size);
+        AVIOContext *  avio_ctx    = avio_alloc_context(
+            buffer, buffer_size, 1, handle, &audiofs_avio_read, &audiofs_avio_write, &audiofs_avio_seek);
+        job->ofmt_ctx->pb = avio_ctx;
         if (ret < 0) {
             errorf("Could not open output file '%s'", filename);
             return ret;
@@ -268,198 +655,179 @@ static int open_output_file(const AVOutputFormat *oformat, const char *format_na
     }
 
     /* init muxer, write output file header */
-    ret = avformat_write_header(ofmt_ctx, NULL);
+    // aiff only writes the most common tags as chunks of its own, all of them go into an ID3v2 chunk besides.
+    // Muxers without the option ignore it.
+    AVDictionary *options = NULL;
+    if (job->write_tags) { av_dict_set(&options, "write_id3v2", "1", 0); }
+    ret = avformat_write_header(job->ofmt_ctx, &options);
+    av_dict_free(&options);
     if (ret < 0) {
         errorf("Error occurred when opening output file\n");
         return ret;
     }
+    if (job->write_tags && (ret = write_attached_pics(job)) < 0) {
+        errorf("Could not write attached pictures\n");
+        return ret;
+    }
 
     return 0;
 }
 
-static int
-init_filter(FilteringContext *fctx, AVCodecContext *dec_ctx, AVCodecContext *enc_ctx, const char *filter_spec) {
-    char             args[512];
-    int              ret            = 0;
-    const AVFilter * buffersrc      = NULL;
-    const AVFilter * buffersink     = NULL;
-    AVFilterContext *buffersrc_ctx  = NULL;
-    AVFilterContext *buffersink_ctx = NULL;
-    AVFilterInOut *  outputs        = avfilter_inout_alloc();
-    AVFilterInOut *  inputs         = avfilter_inout_alloc();
-    AVFilterGraph *  filter_graph   = avfilter_graph_alloc();
-
-    if (!outputs || !inputs || !filter_graph) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+/**
+ * can_pack_directly: whether decoded frames can be turned into output packets by the PCM conversion kernels alone
+ *
+ * This is the case if the rate and layout are unchanged and the sample format only differs in planarity, endianness
+ * or 24-in-32 packing. The result is bit-identical to what swr and the PCM encoders produce.
+ *
+ * @param dec_ctx   opened decoder
+ * @param enc_ctx   opened encoder
+ * @return true if pack_write_frame can be used
+ */
+static bool can_pack_directly(const AVCodecContext *dec_ctx, const AVCodecContext *enc_ctx) {
+    if (dec_ctx->sample_rate != enc_ctx->sample_rate
+        || 0 != av_channel_layout_compare(&dec_ctx->ch_layout, &enc_ctx->ch_layout)) {
+        return false;
     }
 
-    //    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-    //        buffersrc = avfilter_get_by_name("buffer");
-    //        buffersink = avfilter_get_by_name("buffersink");
-    //        if (!buffersrc || !buffersink) {
-    //            errorf( "filtering source or sink element not found\n");
-    //            ret = AVERROR_UNKNOWN;
-    //            goto end;
-    //        }
-    //
-    //        snprintf(args, sizeof(args),
-    //                 "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-    //                 dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-    //                 dec_ctx->time_base.num, dec_ctx->time_base.den,
-    //                 dec_ctx->sample_aspect_ratio.num,
-    //                 dec_ctx->sample_aspect_ratio.den);
-    //
-    //        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-    //                                           args, NULL, filter_graph);
-    //        if (ret < 0) {
-    //            errorf( "Cannot create buffer source\n");
-    //            goto end;
-    //        }
-    //
-    //        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-    //                                           NULL, NULL, filter_graph);
-    //        if (ret < 0) {
-    //            errorf( "Cannot create buffer sink\n");
-    //            goto end;
-    //        }
-    //
-    //        ret = av_opt_set_bin(buffersink_ctx, "pix_fmts",
-    //                             (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt),
-    //                             AV_OPT_SEARCH_CHILDREN);
-    //        if (ret < 0) {
-    //            errorf( "Cannot set output pixel format\n");
-    //            goto end;
-    //        }
-    //    } else
-    if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-        char buf[64];
-        buffersrc  = avfilter_get_by_name("abuffer");
-        buffersink = avfilter_get_by_name("abuffersink");
-        if (!buffersrc || !buffersink) {
-            errorf("filtering source or sink element not found\n");
-            ret = AVERROR_UNKNOWN;
-            goto end;
-        }
-        av_channel_layout_describe(&enc_ctx->ch_layout, buf, sizeof(buf));
-        snprintf(
-            args,
-            sizeof(args),
-            "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
-            dec_ctx->time_base.num,
-            dec_ctx->time_base.den,
-            dec_ctx->sample_rate,
-            av_get_sample_fmt_name(dec_ctx->sample_fmt),
-            buf);
-        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in", args, NULL, filter_graph);
-        if (ret < 0) {
-            errorf("Cannot create audio buffer source\n");
-            goto end;
-        }
-
-        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph);
-        if (ret < 0) {
-            errorf("Cannot create audio buffer sink\n");
-            goto end;
-        }
-
-        ret = av_opt_set_bin(
-            buffersink_ctx,
-            "sample_fmts",
-            (uint8_t *)&enc_ctx->sample_fmt,
-            sizeof(enc_ctx->sample_fmt),
-            AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            errorf("Cannot set output sample format\n");
-            goto end;
-        }
-
-        av_channel_layout_describe(&enc_ctx->ch_layout, buf, sizeof(buf));
-        ret = av_opt_set(buffersink_ctx, "ch_layouts", buf, AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            errorf("Cannot set output channel layout\n");
-            goto end;
-        }
-
-        ret = av_opt_set_bin(
-            buffersink_ctx,
-            "sample_rates",
-            (uint8_t *)&enc_ctx->sample_rate,
-            sizeof(enc_ctx->sample_rate),
-            AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            errorf("Cannot set output sample rate\n");
-            goto end;
-        }
-    } else {
-        ret = AVERROR_UNKNOWN;
-        goto end;
+    enum AVSampleFormat packed = av_get_packed_sample_fmt(dec_ctx->sample_fmt);
+    switch (enc_ctx->codec_id) {
+        case AV_CODEC_ID_PCM_S16BE:
+            return packed == AV_SAMPLE_FMT_S16;
+        case AV_CODEC_ID_PCM_S24BE:
+        case AV_CODEC_ID_PCM_S24LE:
+        case AV_CODEC_ID_PCM_S32BE:
+            return packed == AV_SAMPLE_FMT_S32;
+        default:
+            // Native endian outputs are a plain (interleaving) copy
+            if (enc_ctx->codec_id == AV_NE(AV_CODEC_ID_PCM_S16BE, AV_CODEC_ID_PCM_S16LE)) {
+                return packed == AV_SAMPLE_FMT_S16;
+            }
+            if (enc_ctx->codec_id == AV_NE(AV_CODEC_ID_PCM_S32BE, AV_CODEC_ID_PCM_S32LE)) {
+                return packed == AV_SAMPLE_FMT_S32;
+            }
+            return false;
     }
+}
 
-    /* Endpoints for the filter graph. */
-    outputs->name       = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx;
-    outputs->pad_idx    = 0;
-    outputs->next       = NULL;
-
-    inputs->name       = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
-    inputs->pad_idx    = 0;
-    inputs->next       = NULL;
-
-    if (!outputs->name || !inputs->name) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+/**
+ * swapped_pcm_codec: the PCM codec storing the same samples in the other byte order
+ *
+ * @return the codec id, or AV_CODEC_ID_NONE if there is none (or it is not worth it)
+ */
+static enum AVCodecID swapped_pcm_codec(enum AVCodecID codec_id) {
+    switch (codec_id) {
+        case AV_CODEC_ID_PCM_S16LE:
+            return AV_CODEC_ID_PCM_S16BE;
+        case AV_CODEC_ID_PCM_S16BE:
+            return AV_CODEC_ID_PCM_S16LE;
+        case AV_CODEC_ID_PCM_S24LE:
+            return AV_CODEC_ID_PCM_S24BE;
+        case AV_CODEC_ID_PCM_S24BE:
+            return AV_CODEC_ID_PCM_S24LE;
+        case AV_CODEC_ID_PCM_S32LE:
+            return AV_CODEC_ID_PCM_S32BE;
+        case AV_CODEC_ID_PCM_S32BE:
+            return AV_CODEC_ID_PCM_S32LE;
+        case AV_CODEC_ID_PCM_F32LE:
+            return AV_CODEC_ID_PCM_F32BE;
+        case AV_CODEC_ID_PCM_F32BE:
+            return AV_CODEC_ID_PCM_F32LE;
+        default:
+            return AV_CODEC_ID_NONE;
     }
+}
 
-    if ((ret = avfilter_graph_parse_ptr(filter_graph, filter_spec, &inputs, &outputs, NULL)) < 0) { goto end; }
-
-    if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0) { goto end; }
-
-    /* Fill FilteringContext */
-    fctx->buffersrc_ctx  = buffersrc_ctx;
-    fctx->buffersink_ctx = buffersink_ctx;
-    fctx->filter_graph   = filter_graph;
-
-end:
-    avfilter_inout_free(&inputs);
-    avfilter_inout_free(&outputs);
+/**
+ * can_copy_raw: whether the demuxer's packets can be written out without decoding them
+ *
+ * This is the case for interleaved PCM in the plain containers (wav, aiff, caf, w64), if the output stores the same
+ * samples, possibly in the other byte order. The result is bit-identical to decoding and pack_write_frame/encoding.
+ *
+ * @param par       input stream parameters
+ * @param enc_ctx   opened encoder
+ * @param swap      set to the kernel swapping the byte order, or NULL if the packets can be copied as-is
+ * @return true if raw_write_packet can be used
+ */
+static bool can_copy_raw(
+    const transcode_job *job, const AVCodecParameters *par, const AVCodecContext *enc_ctx, swap_kernel *swap) {
+    static const char *const containers[] = {"wav", "aiff", "caf", "w64"};
+    const pcm_kernels *      kernels      = pcm_kernels_get();
+    bool                     container    = false;
+
+    if (!transcode_raw_pcm) { return false; }
+    for (size_t i = 0; i < sizeof(containers) / sizeof(containers[0]); i++) {
+        container = container || 0 == strcmp(job->ifmt_ctx->iformat->name, containers[i]);
+    }
+    if (!container || par->sample_rate != enc_ctx->sample_rate
+        || 0 != av_channel_layout_compare(&par->ch_layout, &enc_ctx->ch_layout)) {
+        return false;
+    }
 
-    return ret;
+    if (par->codec_id == enc_ctx->codec_id) {
+        *swap = NULL;
+        return true;
+    }
+    if (swapped_pcm_codec(par->codec_id) != enc_ctx->codec_id) { return false; }
+    switch (av_get_bits_per_sample(par->codec_id)) {
+        case 16:
+            *swap = kernels->swap16;
+            return true;
+        case 24:
+            *swap = kernels->swap24;
+            return true;
+        case 32:
+            *swap = kernels->swap32;
+            return true;
+        default:
+            return false;
+    }
 }
 
-static int init_filters(void) {
-    const char * filter_spec = NULL;
+static int init_filters(transcode_job *job) {
     unsigned int i = 0;
-    int          ret = 0;
-    filter_ctx = av_malloc(sizeof(*filter_ctx));
-    if (!filter_ctx) { return AVERROR(ENOMEM); }
-
-    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        if (ifmt_ctx->streams[i]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) { continue; }
-
-        filter_ctx->buffersrc_ctx  = NULL;
-        filter_ctx->buffersink_ctx = NULL;
-        filter_ctx->filter_graph   = NULL;
-
-        filter_spec = "anull"; /* passthrough (dummy) filter for audio */
-        ret         = init_filter(filter_ctx, stream_ctx->dec_ctx, stream_ctx->enc_ctx, filter_spec);
-        if (ret) { return ret; }
+    job->filter_ctx = av_mallocz(sizeof(*job->filter_ctx));
+    if (!job->filter_ctx) { return AVERROR(ENOMEM); }
+
+    for (i = 0; i < job->ifmt_ctx->nb_streams; i++) {
+        AVStream *in_stream = job->ifmt_ctx->streams[i];
+        if (in_stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) { continue; }
+
+        job->filter_ctx->conversion    = NULL;
+        job->filter_ctx->next_pts      = 0;
+        job->filter_ctx->pack_directly = false;
+        job->filter_ctx->raw_pcm       = false;
+        job->filter_ctx->raw_swap      = NULL;
+
+        if (is_fingerprint_output(job)) {
+            job->filter_ctx->conversion
+                = fingerprint_conversion_alloc(job->ifmt_ctx, in_stream, job->stream_ctx->dec_ctx);
+            if (!job->filter_ctx->conversion) { return AVERROR(EINVAL); }
+        } else if (can_copy_raw(job, in_stream->codecpar, job->stream_ctx->enc_ctx, &job->filter_ctx->raw_swap)) {
+            infof("Copying raw PCM %s\n", job->filter_ctx->raw_swap != NULL ? "with swapped byte order" : "as-is");
+            job->filter_ctx->raw_pcm = true;
+        } else if (can_pack_directly(job->stream_ctx->dec_ctx, job->stream_ctx->enc_ctx)) {
+            infof("Packing decoded frames directly (%s kernels)\n", pcm_kernels_get()->name);
+            job->filter_ctx->pack_directly = true;
+        } else {
+            job->filter_ctx->conversion = transcode_conversion_alloc(
+                job->ifmt_ctx, in_stream, job->stream_ctx->dec_ctx, job->stream_ctx->enc_ctx);
+            if (!job->filter_ctx->conversion) { return AVERROR(EINVAL); }
+        }
 
-        filter_ctx->enc_pkt = av_packet_alloc();
-        if (!filter_ctx->enc_pkt) { return AVERROR(ENOMEM); }
+        job->filter_ctx->enc_pkt = av_packet_alloc();
+        if (!job->filter_ctx->enc_pkt) { return AVERROR(ENOMEM); }
 
-        filter_ctx->filtered_frame = av_frame_alloc();
-        if (!filter_ctx->filtered_frame) { return AVERROR(ENOMEM); }
+        job->filter_ctx->filtered_frame = av_frame_alloc();
+        if (!job->filter_ctx->filtered_frame) { return AVERROR(ENOMEM); }
 
         return (int)i;
     }
     return -1; // No stream found
 }
 
-static int encode_write_frame(int stream_index, int flush) {
-    StreamContext *   stream     = stream_ctx;
-    FilteringContext *filter     = filter_ctx;
+static int encode_write_frame(transcode_job *job, int stream_index, int flush) {
+    StreamContext *   stream     = job->stream_ctx;
+    FilteringContext *filter     = job->filter_ctx;
     AVFrame *         filt_frame = flush ? NULL : filter->filtered_frame;
     AVPacket *        enc_pkt    = filter->enc_pkt;
     int               ret = 0;
@@ -468,183 +836,521 @@ static int encode_write_frame(int stream_index, int flush) {
     /* encode filtered frame */
     av_packet_unref(enc_pkt);
 
-    ret = avcodec_send_frame(stream->enc_ctx, filt_frame);
+    metrics_span span = metrics_start();
+    ret               = avcodec_send_frame(stream->enc_ctx, filt_frame);
+    metrics_stop(&span, METRICS_STAGE_ENCODE, 0, 0);
 
     if (ret < 0) { return ret; }
 
     while (ret >= 0) {
-        ret = avcodec_receive_packet(stream->enc_ctx, enc_pkt);
+        span = metrics_start();
+        ret  = avcodec_receive_packet(stream->enc_ctx, enc_pkt);
+        metrics_stop(&span, METRICS_STAGE_ENCODE, ret >= 0 ? enc_pkt->size : 0, 0);
 
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) { return 0; }
 
         /* prepare packet for muxing */
         enc_pkt->stream_index = stream_index;
-        av_packet_rescale_ts(enc_pkt, stream->enc_ctx->time_base, ofmt_ctx->streams[stream_index]->time_base);
+        av_packet_rescale_ts(enc_pkt, stream->enc_ctx->time_base, job->ofmt_ctx->streams[stream_index]->time_base);
 
         tracef("Muxing frame\n");
         /* mux encoded frame */
-        ret = av_interleaved_write_frame(ofmt_ctx, enc_pkt);
+        int size = enc_pkt->size;
+        span     = metrics_start();
+        ret      = av_interleaved_write_frame(job->ofmt_ctx, enc_pkt);
+        metrics_stop(&span, METRICS_STAGE_MUX, size, 0);
     }
 
     return ret;
 }
 
-static int filter_encode_write_frame(AVFrame *frame, int stream_index) {
-    FilteringContext *filter = filter_ctx;
-    int               ret = 0;
+/**
+ * convert_encode_write_frame: convert a decoded frame via the single step conversion plan, then encode and mux it
+ *
+ * @param frame         decoded frame, or NULL to flush the resampler
+ * @param stream_index  output stream index
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static int convert_encode_write_frame(transcode_job *job, AVFrame *frame, int stream_index) {
+    FilteringContext *filter     = job->filter_ctx;
+    decoder_context * conversion = filter->conversion;
+    AVFrame *         out        = filter->filtered_frame;
+    int               ret        = 0;
+
+    do {
+        metrics_span span = metrics_start();
+        if (conversion->swrContext == NULL) {
+            // The decoder already outputs what we need.
+            if (frame == NULL) { return 0; }
+            ret = av_frame_ref(out, frame);
+        } else {
+            out->format      = conversion->override_sample_fmt;
+            out->sample_rate = conversion->override_sample_rate;
+            ret              = av_channel_layout_copy(&out->ch_layout, &conversion->override_channel_layout);
+            if (ret >= 0) { ret = swr_convert_frame(conversion->swrContext, out, frame); }
+        }
+        metrics_stop(&span, METRICS_STAGE_FILTER, 0, ret >= 0 ? out->nb_samples : 0);
+        if (ret < 0) {
+            errorf("Error while converting frame: %s\n", av_err2str(ret));
+            av_frame_unref(out);
+            return ret;
+        }
+        if (out->nb_samples == 0) {
+            av_frame_unref(out);
+            return 0;
+        }
 
-    //    infof("Pushing decoded frame to filters\n");
-    /* push the decoded frame into the filtergraph */
-    ret = av_buffersrc_add_frame_flags(filter->buffersrc_ctx, frame, 0);
-    if (ret < 0) {
-        errorf("Error while feeding the filtergraph\n");
-        return ret;
+        out->pts = filter->next_pts;
+        filter->next_pts += out->nb_samples;
+        ret = encode_write_frame(job, stream_index, 0);
+        av_frame_unref(out);
+        // When flushing, keep draining until the resampler has no more buffered samples.
+    } while (ret >= 0 && frame == NULL);
+
+    return ret;
+}
+
+/**
+ * pack_write_frame: convert a decoded frame into an output packet via the PCM conversion kernels and mux it
+ *
+ * Only valid if can_pack_directly returned true.
+ *
+ * @param frame         decoded frame, or NULL to flush (nothing is buffered, so this does nothing)
+ * @param stream_index  output stream index
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static int pack_write_frame(transcode_job *job, AVFrame *frame, int stream_index) {
+    FilteringContext * filter  = job->filter_ctx;
+    AVCodecContext *   enc_ctx = job->stream_ctx->enc_ctx;
+    AVPacket *         pkt     = filter->enc_pkt;
+    const pcm_kernels *kernels = pcm_kernels_get();
+    int                ret     = 0;
+
+    if (frame == NULL) { return 0; }
+
+    metrics_span   span      = metrics_start();
+    int            channels  = frame->ch_layout.nb_channels;
+    size_t         samples   = (size_t)frame->nb_samples * channels;
+    int            in_bytes  = av_get_bytes_per_sample(frame->format);
+    int            out_bytes = av_get_bits_per_sample(enc_ctx->codec_id) / 8;
+    const uint8_t *src       = frame->extended_data[0];
+
+    if (frame->sample_rate != enc_ctx->sample_rate || channels != enc_ctx->ch_layout.nb_channels
+        || av_get_packed_sample_fmt(frame->format) != av_get_packed_sample_fmt(job->stream_ctx->dec_ctx->sample_fmt)) {
+        errorf("Decoder output changed mid-stream\n");
+        return AVERROR_INPUT_CHANGED;
     }
 
-    /* pull filtered frames from the filtergraph */
-    while (1) {
-        //        infof("Pulling filtered frame from filters\n");
-        ret = av_buffersink_get_frame(filter->buffersink_ctx, filter->filtered_frame);
-        if (ret < 0) {
-            /* if no more frames for output - returns AVERROR(EAGAIN)
-             * if flushed and no more frames for output - returns AVERROR_EOF
-             * rewrite retcode to 0 to show it as normal procedure completion
-             */
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) { ret = 0; }
-            break;
+    av_packet_unref(pkt);
+    if ((ret = av_new_packet(pkt, (int)(samples * out_bytes))) < 0) { return ret; }
+
+    if (av_sample_fmt_is_planar(frame->format) && channels > 1) {
+        av_fast_malloc(&filter->scratch, &filter->scratch_size, samples * in_bytes);
+        if (!filter->scratch) { return AVERROR(ENOMEM); }
+        if (in_bytes == 2) {
+            kernels->interleave_s16(
+                (int16_t *)filter->scratch, (const int16_t *const *)frame->extended_data, channels, frame->nb_samples);
+        } else {
+            kernels->interleave_s32(
+                (int32_t *)filter->scratch, (const int32_t *const *)frame->extended_data, channels, frame->nb_samples);
         }
+        src = filter->scratch;
+    }
 
-        filter->filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
-        ret                               = encode_write_frame(stream_index, 0);
-        av_frame_unref(filter->filtered_frame);
-        if (ret < 0) { break; }
+    switch (enc_ctx->codec_id) {
+        case AV_CODEC_ID_PCM_S16BE:
+            kernels->s16_to_be(pkt->data, (const int16_t *)src, samples);
+            break;
+        case AV_CODEC_ID_PCM_S32BE:
+            kernels->s32_to_be(pkt->data, (const int32_t *)src, samples);
+            break;
+        case AV_CODEC_ID_PCM_S24BE:
+            kernels->s32_to_s24be(pkt->data, (const int32_t *)src, samples);
+            break;
+        case AV_CODEC_ID_PCM_S24LE:
+            kernels->s32_to_s24le(pkt->data, (const int32_t *)src, samples);
+            break;
+        default:
+            // native endian
+            memcpy(pkt->data, src, samples * out_bytes);
+            break;
     }
 
+    pkt->pts          = filter->next_pts;
+    pkt->dts          = filter->next_pts;
+    pkt->duration     = frame->nb_samples;
+    pkt->stream_index = stream_index;
+    filter->next_pts += frame->nb_samples;
+    av_packet_rescale_ts(pkt, enc_ctx->time_base, job->ofmt_ctx->streams[stream_index]->time_base);
+    metrics_stop(&span, METRICS_STAGE_FILTER, 0, frame->nb_samples);
+
+    tracef("Muxing packed frame\n");
+    int size = pkt->size;
+    span     = metrics_start();
+    ret      = av_interleaved_write_frame(job->ofmt_ctx, pkt);
+    metrics_stop(&span, METRICS_STAGE_MUX, size, 0);
     return ret;
 }
 
-static int flush_encoder(int stream_index) {
-    if (!(stream_ctx->enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY)) { return 0; }
+/**
+ * raw_write_packet: write a demuxed packet of raw PCM as an output packet
+ *
+ * Only valid if can_copy_raw returned true. A trailing partial sample frame is dropped, like the PCM decoders do.
+ *
+ * @param packet        demuxed packet
+ * @param stream_index  output stream index
+ * @return number of samples (per channel) written, a negative AVERROR on failure
+ */
+static int raw_write_packet(transcode_job *job, AVPacket *packet, int stream_index) {
+    FilteringContext *filter     = job->filter_ctx;
+    AVCodecContext *  enc_ctx    = job->stream_ctx->enc_ctx;
+    AVPacket *        pkt        = filter->enc_pkt;
+    int               channels   = enc_ctx->ch_layout.nb_channels;
+    int               block      = channels * av_get_bits_per_sample(enc_ctx->codec_id) / 8;
+    int               nb_samples = block > 0 ? packet->size / block : 0;
+    int               ret        = 0;
+
+    if (nb_samples == 0) { return 0; }
+
+    metrics_span span = metrics_start();
+    av_packet_unref(pkt);
+    if (filter->raw_swap == NULL) {
+        if ((ret = av_packet_ref(pkt, packet)) < 0) { return ret; }
+        pkt->size = nb_samples * block;
+    } else {
+        if ((ret = av_new_packet(pkt, nb_samples * block)) < 0) { return ret; }
+        filter->raw_swap(pkt->data, packet->data, (size_t)nb_samples * channels);
+    }
+
+    pkt->pts          = filter->next_pts;
+    pkt->dts          = filter->next_pts;
+    pkt->duration     = nb_samples;
+    pkt->pos          = -1;
+    pkt->stream_index = stream_index;
+    filter->next_pts += nb_samples;
+    av_packet_rescale_ts(pkt, enc_ctx->time_base, job->ofmt_ctx->streams[stream_index]->time_base);
+    metrics_stop(&span, METRICS_STAGE_FILTER, 0, nb_samples);
+
+    tracef("Muxing raw packet\n");
+    int size = pkt->size;
+    span     = metrics_start();
+    ret      = av_interleaved_write_frame(job->ofmt_ctx, pkt);
+    metrics_stop(&span, METRICS_STAGE_MUX, size, 0);
+    return ret < 0 ? ret : nb_samples;
+}
+
+static int filter_encode_write_frame(transcode_job *job, AVFrame *frame, int stream_index) {
+    if (job->filter_ctx->pack_directly) { return pack_write_frame(job, frame, stream_index); }
+    return convert_encode_write_frame(job, frame, stream_index);
+}
 
-    infof("Flushing stream #%u encoder\n", stream_index);
-    return encode_write_frame(stream_index, 1);
+static int decoder_send_packet(StreamContext *stream, const AVPacket *packet) {
+    if (stream->dsd != NULL) { return dsd_converter_send(stream->dsd, packet); }
+    return avcodec_send_packet(stream->dec_ctx, packet);
 }
 
-audiofs_avio_handle *do_transcode(
-    const char *          from_path,
-    AVFormatContext *     from_context,
-    const char *          to,
-    const AVOutputFormat *oformat,
-    const char *          format_name) {
-    volatile int ret = 0;
-    AVPacket *   packet = NULL;
-    int          stream_index;
-    int          selected_stream = 0;
+static int decoder_receive_frame(StreamContext *stream) {
+    if (stream->dsd != NULL) { return dsd_converter_receive(stream->dsd, stream->dec_frame); }
+    return avcodec_receive_frame(stream->dec_ctx, stream->dec_frame);
+}
 
-    if (from_path != NULL) {
-        if ((ret = open_input_file(from_path)) < 0) { goto end; }
-    } else {
-        if ((ret = open_input_file_with_format_context(from_context)) < 0) { goto end; }
-    }
-    if ((ret = open_output_file(oformat, format_name, to)) < 0) { goto end; }
-    if ((ret = init_filters()) < 0) {
-        goto end;
-    } else {
-        selected_stream = ret;
-    }
-    if (!(packet = av_packet_alloc())) { goto end; }
+/**
+ * decoder_write_frames: feed all frames the decoder has ready to the output
+ *
+ * INTERNAL
+ *
+ * Stops early once the job's window is filled (job->sample_limit).
+ *
+ * @return 0 once the decoder needs more input, is drained or the limit is reached, a negative AVERROR on failure
+ */
+static int decoder_write_frames(transcode_job *job, int stream_index) {
+    StreamContext *stream = job->stream_ctx;
+    int            ret    = 0;
 
-    /* read all packets */
-    while (1) {
-        if ((ret = av_read_frame(ifmt_ctx, packet)) < 0) { break; }
+    while (ret >= 0) {
+        metrics_span span = metrics_start();
+        ret               = decoder_receive_frame(stream);
+        metrics_stop(&span, METRICS_STAGE_DECODE, 0, ret >= 0 ? stream->dec_frame->nb_samples : 0);
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+            return 0;
+        } else if (ret < 0) {
+            return ret;
+        }
 
-        if (packet->stream_index != selected_stream) { continue; }
-        stream_index = packet->stream_index;
-        tracef("Demuxer gave frame of stream_index %u\n", stream_index);
+        stream->dec_frame->pts = stream->dec_frame->best_effort_timestamp;
+        job->fed_samples += stream->dec_frame->nb_samples;
+        ret = filter_encode_write_frame(job, stream->dec_frame, stream_index);
+        // Window filled. Everything that is still buffered in the decoder is not needed anymore.
+        if (window_filled(job)) { break; }
+    }
+    return ret < 0 ? ret : 0;
+}
 
-        if (filter_ctx->filter_graph) {
-            StreamContext *stream = stream_ctx;
+static int flush_encoder(transcode_job *job, int stream_index) {
+    if (!(job->stream_ctx->enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY)) { return 0; }
 
-            tracef("Going to reencode&filter the frame\n");
+    infof("Flushing stream #%u encoder\n", stream_index);
+    return encode_write_frame(job, stream_index, 1);
+}
 
-            av_packet_rescale_ts(packet, ifmt_ctx->streams[stream_index]->time_base, stream->dec_ctx->time_base);
-            ret = avcodec_send_packet(stream->dec_ctx, packet);
+/**
+ * job_start: open input and output, set up the conversion and seek to the window's start
+ *
+ * INTERNAL
+ *
+ * @param to    output filename, 'memory' for a memory backed output, or NULL to queue the output for pulling
+ * @return 0 on success, a negative AVERROR on failure. The job has to be freed via job_free either way.
+ */
+static int job_start(
+    transcode_job *         job,
+    const char *            from_path,
+    AVFormatContext *       from_context,
+    const char *            to,
+    const AVOutputFormat *  oformat,
+    const char *            format_name,
+    const transcode_window *window) {
+    int ret = 0;
+
+    metrics_current_file.transcodes++;
+    job->streaming  = to == NULL;
+    job->owns_input = from_path != NULL;
+    if (from_path != NULL) {
+        if ((ret = open_input_file(job, from_path)) < 0) { return ret; }
+    } else {
+        if ((ret = open_input_file_with_format_context(job, from_context)) < 0) { return ret; }
+    }
+    if ((ret = open_output_file(job, oformat, format_name, to)) < 0) { return ret; }
+    if ((ret = init_filters(job)) < 0) { return ret; }
+    job->selected_stream = ret;
+    if (!(job->packet = av_packet_alloc())) { return AVERROR(ENOMEM); }
+
+    if (window != NULL) {
+        if (window->start > 0) {
+            // Seeking backwards lands on the closest sync point before the requested start, which is exact for PCM
+            // and close enough for fingerprinting on everything else. It is deterministic for a given file.
+            ret = av_seek_frame(job->ifmt_ctx, -1, window->start, AVSEEK_FLAG_BACKWARD);
             if (ret < 0) {
-                errorf("Decoding failed\n");
-                break;
+                errorf("Could not seek to %" PRId64 "\n", window->start);
+                return ret;
             }
+            avcodec_flush_buffers(job->stream_ctx->dec_ctx);
+            if (job->stream_ctx->dsd != NULL) { dsd_converter_reset(job->stream_ctx->dsd); }
+        }
+        if (window->duration > 0) {
+            job->sample_limit = av_rescale(window->duration, job->stream_ctx->dec_ctx->sample_rate, AV_TIME_BASE);
+        }
+        AUDIOFS_PRINTVAL(job->sample_limit, PRId64);
+    }
+    if (job->streaming && (ret = size_pulled_header(job, window)) < 0) { return ret; }
+    return 0;
+}
 
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(stream->dec_ctx, stream->dec_frame);
-                if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-                    break;
-                } else if (ret < 0) {
-                    goto end;
-                }
+/**
+ * job_step: demux one packet and feed it through to the muxer
+ *
+ * INTERNAL
+ *
+ * @return 0 on success, AVERROR_EOF once the input ended, or another negative AVERROR on failure
+ */
+static int job_step(transcode_job *job) {
+    AVPacket *packet = job->packet;
+    int       stream_index;
+    int       ret;
+
+    metrics_span span = metrics_start();
+    ret               = av_read_frame(job->ifmt_ctx, packet);
+    metrics_stop(&span, METRICS_STAGE_DEMUX, ret >= 0 ? packet->size : 0, 0);
+    // Read errors end the input, everything up to them is still transcoded.
+    if (ret < 0) { return AVERROR_EOF; }
+
+    if (packet->stream_index != job->selected_stream) {
+        av_packet_unref(packet);
+        return 0;
+    }
+    stream_index = packet->stream_index;
+    tracef("Demuxer gave frame of stream_index %u\n", stream_index);
+
+    if (job->filter_ctx->raw_pcm) {
+        ret = raw_write_packet(job, packet, stream_index);
+        if (ret >= 0) {
+            job->fed_samples += ret;
+            ret = 0;
+        }
+    } else if (job->filter_ctx->conversion || job->filter_ctx->pack_directly) {
+        StreamContext *stream = job->stream_ctx;
 
-                stream->dec_frame->pts = stream->dec_frame->best_effort_timestamp;
-                ret                    = filter_encode_write_frame(stream->dec_frame, stream_index);
-                if (ret < 0) { goto end; }
-            }
+        tracef("Going to reencode&filter the frame\n");
+
+        av_packet_rescale_ts(packet, job->ifmt_ctx->streams[stream_index]->time_base, stream->dec_ctx->time_base);
+        span = metrics_start();
+        ret  = decoder_send_packet(stream, packet);
+        metrics_stop(&span, METRICS_STAGE_DECODE, packet->size, 0);
+        if (ret < 0) {
+            errorf("Decoding failed\n");
+            ret = AVERROR_EOF;
         } else {
-            /* remux this frame without reencoding */
-            av_packet_rescale_ts(
-                packet,
-                ifmt_ctx->streams[stream_index]->time_base,
-                ofmt_ctx->streams[stream_index]->time_base);
-
-            ret = av_interleaved_write_frame(ofmt_ctx, packet);
-            if (ret < 0) { goto end; }
+            ret = decoder_write_frames(job, stream_index);
+        }
+    } else {
+        /* remux this frame without reencoding */
+        av_packet_rescale_ts(
+            packet,
+            job->ifmt_ctx->streams[stream_index]->time_base,
+            job->ofmt_ctx->streams[stream_index]->time_base);
+
+        int size = packet->size;
+        span     = metrics_start();
+        ret      = av_interleaved_write_frame(job->ofmt_ctx, packet);
+        metrics_stop(&span, METRICS_STAGE_MUX, size, 0);
+    }
+    av_packet_unref(packet);
+    return ret;
+}
+
+/**
+ * job_finish: flush everything buffered along the way and write the trailer
+ *
+ * INTERNAL
+ *
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static int job_finish(transcode_job *job) {
+    int ret = 0;
+
+    job->finished = true;
+    // The DSD converter holds input back to convert it in batches, the rest of it comes out now.
+    if (job->stream_ctx->dsd != NULL && !window_filled(job)) {
+        if ((ret = decoder_send_packet(job->stream_ctx, NULL)) < 0
+            || (ret = decoder_write_frames(job, job->selected_stream)) < 0) {
+            errorf("Flushing DSD conversion failed\n");
+            return ret;
         }
-        av_packet_unref(packet);
     }
 
     /* flush filter */
-    if (filter_ctx->filter_graph) {
-        ret = filter_encode_write_frame(NULL, selected_stream);
+    if (job->filter_ctx->conversion || job->filter_ctx->pack_directly) {
+        ret = filter_encode_write_frame(job, NULL, job->selected_stream);
         if (ret < 0) {
             errorf("Flushing filter failed\n");
-            goto end;
+            return ret;
         }
     }
 
     /* flush encoder */
-    ret = flush_encoder(selected_stream);
+    ret = flush_encoder(job, job->selected_stream);
     if (ret < 0) {
         errorf("Flushing encoder failed\n");
-        goto end;
+        return ret;
     }
 
-    av_write_trailer(ofmt_ctx);
-end:
-    av_packet_free(&packet);
-    avcodec_free_context(&stream_ctx->dec_ctx);
-    avcodec_free_context(&stream_ctx->enc_ctx);
-    if (filter_ctx && filter_ctx->filter_graph) {
-        avfilter_graph_free(&filter_ctx->filter_graph);
-        av_packet_free(&filter_ctx->enc_pkt);
-        av_frame_free(&filter_ctx->filtered_frame);
+    // Muxers like chromaprint do most of their work here.
+    metrics_span trailer = metrics_start();
+    ret                  = av_write_trailer(job->ofmt_ctx);
+    metrics_stop(&trailer, METRICS_STAGE_MUX, 0, 0);
+    if (ret < 0 || !job->sized) { return ret; }
+
+    // The input ended before its duration: fill the rest of what the header promised with silence.
+    static const uint8_t silence[4096] = {0};
+    avio_flush(job->ofmt_ctx->pb);
+    if (job->data_left > 0) { debugf("Padding pulled output with %" PRId64 " bytes of silence\n", job->data_left); }
+    while (ret >= 0 && job->data_left > 0) {
+        ret = job_output_write(job, (uint8_t *)silence, (int)MIN((int64_t)sizeof(silence), job->data_left));
     }
+    job->sized = false;
+    if (ret >= 0 && job->data_pad) { ret = job_output_write(job, (uint8_t *)silence, 1); }
+    return ret < 0 ? ret : 0;
+}
 
-    av_frame_free(&stream_ctx->dec_frame);
-    av_free(stream_ctx);
+/**
+ * job_free: free a job and everything it opened, except for the AudioFS AVIO handle of non-pulled outputs
+ *
+ * INTERNAL
+ */
+static void job_free(transcode_job **job_ref) {
+    transcode_job *job = *job_ref;
+    if (job == NULL) { return; }
+
+    av_packet_free(&job->packet);
+    if (job->stream_ctx) {
+        avcodec_free_context(&job->stream_ctx->dec_ctx);
+        avcodec_free_context(&job->stream_ctx->enc_ctx);
+        av_frame_free(&job->stream_ctx->dec_frame);
+        dsd_converter_free(&job->stream_ctx->dsd);
+    }
+    av_freep(&job->stream_ctx);
+    if (job->filter_ctx) {
+        decoder_context_free(&job->filter_ctx->conversion);
+        av_freep(&job->filter_ctx->scratch);
+        av_packet_free(&job->filter_ctx->enc_pkt);
+        av_frame_free(&job->filter_ctx->filtered_frame);
+    }
+    av_freep(&job->filter_ctx);
 
-    av_free(filter_ctx);
-    if (from_path != NULL) {
+    if (job->owns_input) {
         // Only free them if they were allocated here!
-
-        avformat_close_input(&ifmt_ctx);
+        avformat_close_input(&job->ifmt_ctx);
+    }
+    if (job->streaming && job->ofmt_ctx != NULL && job->ofmt_ctx->pb != NULL) {
+        av_freep(&job->ofmt_ctx->pb->buffer);
+        avio_context_free(&job->ofmt_ctx->pb);
     }
+    avformat_free_context(job->ofmt_ctx);
+    av_dict_free(&job->metadata);
+    av_freep(&job->pending);
+    av_freep(job_ref);
+}
+
+/**
+ * do_transcode: transcode the first audio stream of the input into the requested output
+ *
+ * For serving an output while it is produced, see transcode_job_open.
+ *
+ * @param from_path     path to open, or NULL to use from_context
+ * @param from_context  already opened input context (used if from_path is NULL)
+ * @param to            output filename, or 'memory' for a memory backed output
+ * @param oformat       output format, or NULL to guess by format_name/to
+ * @param format_name   name of the output format (e.g. 'chromaprint')
+ * @param window        part of the input to transcode, or NULL for the whole stream. Demuxing and decoding stop as
+ *                      soon as window->duration worth of audio was fed to the output.
+ *
+ * @return AudioFS AVIO handle holding the output, or NULL on error
+ */
+audiofs_avio_handle *do_transcode(
+    const char *            from_path,
+    AVFormatContext *       from_context,
+    const char *            to,
+    const AVOutputFormat *  oformat,
+    const char *            format_name,
+    const transcode_window *window) {
+    transcode_job *      job    = av_mallocz(sizeof(*job));
     audiofs_avio_handle *handle = NULL;
-    if (ofmt_ctx && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+    int                  ret    = 0;
+
+    if (job == NULL) { return NULL; }
+    if (to == NULL) {
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+    if ((ret = job_start(job, from_path, from_context, to, oformat, format_name, window)) < 0) { goto end; }
+
+    /* read all packets (or until the window is filled) */
+    while (!window_filled(job)) {
+        ret = job_step(job);
+        if (ret == AVERROR_EOF) { break; }
+        if (ret < 0) { goto end; }
+    }
+    ret = job_finish(job);
+
+end:
+    if (job->ofmt_ctx && !(job->ofmt_ctx->oformat->flags & AVFMT_NOFILE) && job->ofmt_ctx->pb) {
         // Extract out file handle, so the caller can read the transcoded data.
-        avio_flush(ofmt_ctx->pb);
-        handle = ofmt_ctx->pb->opaque;
+        avio_flush(job->ofmt_ctx->pb);
+        handle = job->ofmt_ctx->pb->opaque;
         infof("AudioFS AVIO handle: %p\n", handle);
         infof("extracted shared memory file handle: %p\n", handle);
         infof("memory backed?: %d\n", audiofs_avio_is_memory_backed(handle));
     }
-    avformat_free_context(ofmt_ctx);
+    job_free(&job);
 
     if (ret < 0) {
         errorf("Error occurred: %s\n", av_err2str(ret));
@@ -653,3 +1359,84 @@ end:
 
     return handle;
 }
+
+transcode_job *transcode_job_open(
+    const char *            from_path,
+    AVFormatContext *       from_context,
+    const AVOutputFormat *  oformat,
+    const char *            format_name,
+    const transcode_window *window) {
+    transcode_job *job = av_mallocz(sizeof(*job));
+    int            ret;
+
+    if (job == NULL) { return NULL; }
+    job->size = -1;
+    if ((ret = job_start(job, from_path, from_context, NULL, oformat, format_name, window)) < 0) {
+        errorf("Could not start transcode: %s\n", av_err2str(ret));
+        job_free(&job);
+        return NULL;
+    }
+    return job;
+}
+
+int64_t transcode_job_size(const transcode_job *job) { return job->size; }
+
+int transcode_job_pull(transcode_job *job, uint8_t *buf, int size) {
+    int ret = 0;
+
+    if (job->error < 0) { return job->error; }
+    if (size < 0) { return AVERROR(EINVAL); }
+
+    // Transcode only as far as this pull needs, so at most one packet's output is queued beyond it.
+    while (job->pending_len - job->pending_offset < (size_t)size && !job->finished) {
+        ret = window_filled(job) ? AVERROR_EOF : job_step(job);
+        if (ret == AVERROR_EOF) { ret = job_finish(job); }
+        if (ret < 0) {
+            errorf("Transcode failed: %s\n", av_err2str(ret));
+            job->error = ret;
+            return ret;
+        }
+    }
+
+    size_t count = MIN((size_t)size, job->pending_len - job->pending_offset);
+    memcpy(buf, job->pending + job->pending_offset, count);
+    job->pending_offset += count;
+    if (job->pending_offset == job->pending_len) {
+        job->pending_offset = 0;
+        job->pending_len    = 0;
+    }
+    return (int)count;
+}
+
+void transcode_job_close(transcode_job **job) { job_free(job); }
+
+int transcode_to_file(const char *from_path, const char *to, const char *format_name, const AVDictionary *metadata) {
+    transcode_job *      job    = av_mallocz(sizeof(*job));
+    audiofs_avio_handle *handle = NULL;
+    int                  ret    = 0;
+
+    if (job == NULL) { return AVERROR(ENOMEM); }
+    job->write_tags = true;
+    if ((ret = av_dict_copy(&job->metadata, metadata, 0)) < 0) { goto end; }
+    if ((ret = job_start(job, from_path, NULL, to, NULL, format_name, NULL)) < 0) { goto end; }
+    while ((ret = job_step(job)) == 0) {}
+    if (ret == AVERROR_EOF) { ret = job_finish(job); }
+
+end:
+    if (job->ofmt_ctx && !(job->ofmt_ctx->oformat->flags & AVFMT_NOFILE) && job->ofmt_ctx->pb) {
+        avio_flush(job->ofmt_ctx->pb);
+        handle = job->ofmt_ctx->pb->opaque;
+        av_freep(&job->ofmt_ctx->pb->buffer);
+        avio_context_free(&job->ofmt_ctx->pb);
+    }
+    job_free(&job);
+    if (handle != NULL) {
+        int closed = audiofs_avio_close(&handle);
+        if (ret >= 0) { ret = closed; }
+    }
+    if (ret < 0) {
+        errorf("Could not write '%s': %s\n", to, av_err2str(ret));
+        return ret;
+    }
+    return 0;
+}
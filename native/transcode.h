@@ -0,0 +1,83 @@
+//
+// Pull based transcoding, for serving an output while it is produced. See transcode.c.
+//
+
+#ifndef NATIVE_TRANSCODE_H
+#define NATIVE_TRANSCODE_H
+
+#include "types.h"
+#include <libavformat/avformat.h>
+
+typedef struct transcode_job transcode_job;
+
+// Threads a transcode may use, counted against the caller's budget: every codec opens with this many, and the DSD
+// converter uses at most this many. 0 leaves the codecs at libav's default and DSD conversion to dsd_threads.
+extern int32_t transcode_threads;
+
+/**
+ * transcode_job_open: set up a transcode of the first audio stream whose output is produced as it is pulled
+ *
+ * Unlike do_transcode, nothing is transcoded up front, and the output is never held in full: memory stays bounded to
+ * a few frames, no matter how long the input is.
+ *
+ * The output is not seekable. The sizes in aiff and wav headers, which their muxers patch in the trailer, are
+ * computed from the input's duration instead, and the audio is trimmed or padded with silence to match them (which
+ * only happens for lossy inputs, whose duration is an estimate). Inputs without a duration fail to open for these
+ * formats, and so do formats which cannot be written without seeking.
+ *
+ * @param from_path     path to open, or NULL to use from_context
+ * @param from_context  already opened input context (used if from_path is NULL). Must outlive the job.
+ * @param oformat       output format, or NULL to look it up by format_name
+ * @param format_name   name of the output format (e.g. 'aiff')
+ * @param window        part of the input to transcode, or NULL for the whole stream
+ * @return job (close via transcode_job_close), or NULL on error
+ */
+transcode_job *transcode_job_open(
+    const char *            from_path,
+    AVFormatContext *       from_context,
+    const AVOutputFormat *  oformat,
+    const char *            format_name,
+    const transcode_window *window);
+
+/**
+ * transcode_job_pull: fill a buffer with the next bytes of output, transcoding as much input as that takes
+ *
+ * @param buf   buffer to fill
+ * @param size  size of buf
+ * @return number of bytes written to buf (less than size only at the end of the output), 0 once the output is
+ *         complete, or a negative AVERROR on failure (repeated by every later call)
+ */
+int transcode_job_pull(transcode_job *job, uint8_t *buf, int size);
+
+/**
+ * transcode_job_size: size of the whole output, if it is known up front
+ *
+ * This is the case for the formats whose header has sizes (aiff and wav), see transcode_job_open.
+ *
+ * @return size in bytes, or -1 if it is only known once the output was pulled to the end
+ */
+int64_t transcode_job_size(const transcode_job *job);
+
+/**
+ * transcode_job_close: stop a job and free it. Output which was not pulled yet is dropped.
+ *
+ * @param job   reference to the job. Set to NULL afterwards.
+ */
+void transcode_job_close(transcode_job **job);
+
+/**
+ * transcode_to_file: transcode the first audio stream of a file into a tagged file, e.g. for exporting it
+ *
+ * The output is written as it is produced, through a large buffer, and synced before this returns. Unlike pulled
+ * outputs, it is seekable, so header sizes are patched once the trailer is written.
+ *
+ * @param from_path     path to open
+ * @param to            output filename. An existing file is truncated.
+ * @param format_name   name of the output format (e.g. 'aiff')
+ * @param metadata      tags to write, or NULL for none. Tags of the input are not carried over, its attached pictures
+ *                      (cover art) are, if the muxer takes them.
+ * @return 0 on success, a negative AVERROR on failure. The output may be left partially written then.
+ */
+int transcode_to_file(const char *from_path, const char *to, const char *format_name, const AVDictionary *metadata);
+
+#endif // NATIVE_TRANSCODE_H
@@ -21,6 +21,8 @@ typedef struct audiofs_buffer {
     pthread_mutex_t lock;
     void *          self;
     pthread_mutex_t used_outside_audiofs; // Lock this mutex when used outside of C code
+    uint64_t        reserved;             // bytes reserved against the memory budget (see membudget.h)
+    int             spill_fd;             // file `data` is mapped from once spilled, -1 while on the heap
 } audiofs_buffer;
 
 typedef struct decoder_context {
@@ -48,4 +50,18 @@ typedef struct decoder_context {
     int cookieB;
 } decoder_context;
 
+#define FINGERPRINT_DEFAULT_LENGTH 120
+#define FINGERPRINT_WINDOW_MIDDLE  (-1)
+#define FINGERPRINT_SAMPLE_RATE    11025 // chromaprint's internal sample rate
+
+typedef struct transcode_window {
+    int64_t start;    // AV_TIME_BASE units. 0 to start at the beginning of the stream
+    int64_t duration; // AV_TIME_BASE units. 0 to read until the end of the stream
+} transcode_window;
+
+typedef struct fingerprint_options {
+    int32_t length;               // seconds of audio to fingerprint. 0 for the full stream (careful mode)
+    int32_t second_window_offset; // seconds. 0 disables, FINGERPRINT_WINDOW_MIDDLE centers it in the stream
+} fingerprint_options;
+
 #endif // NATIVE_TYPES_H
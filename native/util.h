@@ -3,28 +3,89 @@
 #define NATIVE_UTIL_H
 
 #include "macros.h"
+#include "membudget.h"
 #include "types.h"
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+/**
+ * audiofs_buffer_map: (re)map a spilled buffer's file at `size`. Its content up to `size` is kept.
+ *
+ * INTERNAL
+ *
+ * @return whether the buffer is mapped at `size` now. Otherwise it is unchanged.
+ */
+__attribute__((__warn_unused_result__)) static inline bool audiofs_buffer_map(audiofs_buffer *buffer, uint64_t size) {
+    if (ftruncate(buffer->spill_fd, (off_t)size) != 0) { return false; }
+    void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->spill_fd, 0);
+    if (mapped == MAP_FAILED) { return false; }
+    if (buffer->data != NULL) { munmap(buffer->data, buffer->len); }
+    buffer->data = mapped;
+    return true;
+}
+
+/**
+ * audiofs_buffer_spill: move a buffer's heap memory into a spill file, sized `size`, and return its reservation
+ *
+ * INTERNAL
+ *
+ * @return whether the buffer is spilled now. Otherwise it is unchanged.
+ */
+__attribute__((__warn_unused_result__)) static inline bool audiofs_buffer_spill(audiofs_buffer *buffer, uint64_t size) {
+    int fd = membudget_spill_open();
+    if (fd < 0) { return false; }
+    void *heap = buffer->data;
+    buffer->spill_fd = fd;
+    buffer->data     = NULL;
+    if (!audiofs_buffer_map(buffer, size)) {
+        errorf("could not map a spill file of %" PRIu64 " bytes\n", size);
+        close(fd);
+        buffer->spill_fd = -1;
+        buffer->data     = heap;
+        return false;
+    }
+    if (heap != NULL) { memcpy(buffer->data, heap, MIN(buffer->len, size)); }
+    free(heap);
+    membudget_release(buffer->reserved);
+    buffer->reserved = 0;
+    membudget_spilled(size, true);
+    debugf("spilled a buffer of %" PRIu64 " bytes\n", size);
+    return true;
+}
+
+/**
+ * audiofs_buffer_alloc: allocate a buffer of `size` zeroed bytes against the memory budget
+ *
+ * If the budget has no room, the buffer is spilled right away (see membudget.h).
+ */
 __attribute__((__warn_unused_result__)) static inline audiofs_buffer *audiofs_buffer_alloc(uint64_t size) {
     audiofs_buffer *buffer = AUDIOFS_MALLOC(sizeof(audiofs_buffer));
     if (buffer == NULL) { return NULL; }
-    buffer->cookie = _AUDIOFS_CONTEXT_MAGIC_A;
-    buffer->self   = buffer;
-    buffer->len    = size;
+    buffer->cookie   = _AUDIOFS_CONTEXT_MAGIC_A;
+    buffer->self     = buffer;
+    buffer->len      = 0;
+    buffer->spill_fd = -1;
 
     // If the caller just wanted to allocate this structure, let them.
     if (size == 0) { return buffer; }
 
-    buffer->data = AUDIOFS_MALLOC(size);
+    if (membudget_reserve(size)) {
+        buffer->data     = AUDIOFS_MALLOC(size);
+        buffer->reserved = size;
+        if (buffer->data == NULL) { membudget_release(size); }
+    } else if (!audiofs_buffer_spill(buffer, size)) {
+        buffer->data = NULL;
+    }
     if (buffer->data == NULL) {
         // Alloc failed. Clear temporary memory and bail hard.
         AUDIOFS_FREE(buffer);
         return NULL;
     }
+    buffer->len = size;
     pthread_mutex_unlock(&buffer->used_outside_audiofs);
     pthread_mutex_unlock(&buffer->lock);
 
@@ -113,23 +174,49 @@ audiofs_buffer_realloc(audiofs_buffer *buffer, uint64_t size) {
     pthread_mutex_unlock(&buffer->used_outside_audiofs);
 
     if (size == 0) {
-        AUDIOFS_FREE_NO_TRACE(buffer->data);
+        if (buffer->spill_fd >= 0) {
+            munmap(buffer->data, buffer->len);
+            close(buffer->spill_fd);
+            buffer->data     = NULL;
+            buffer->spill_fd = -1;
+        } else {
+            AUDIOFS_FREE_NO_TRACE(buffer->data);
+            membudget_release(buffer->reserved);
+            buffer->reserved = 0;
+        }
         buffer->len = 0;
         goto ret;
     }
 
-    if (size != buffer->len) {
+    if (size != buffer->len && buffer->spill_fd >= 0) {
+        // Spilled buffers stay spilled. The file grows with zeroes.
+        if (!audiofs_buffer_map(buffer, size)) {
+            pthread_mutex_unlock(&buffer->lock);
+            return false;
+        }
+        if (size > buffer->len) { membudget_spilled(size - buffer->len, false); }
+        buffer->len = size;
+    } else if (size > buffer->len && !membudget_reserve(size - buffer->len)) {
+        if (!audiofs_buffer_spill(buffer, size)) {
+            pthread_mutex_unlock(&buffer->lock);
+            return false;
+        }
+        buffer->len = size;
+    } else if (size != buffer->len) {
         // reallocate with new size. New memory will be 0-initialized
         void *new_ptr = realloc(buffer->data, size);
         if (new_ptr == NULL) {
             // Could not reallocate memory (OOM, or other). Memory is unchanged
+            if (size > buffer->len) { membudget_release(size - buffer->len); }
             pthread_mutex_unlock(&buffer->lock);
             return false;
         }
         // blank out new regions if realloc is larger
-        if (buffer->len > size) { memset(new_ptr + buffer->len, 0, buffer->len - size); }
-        buffer->len  = size;
-        buffer->data = new_ptr;
+        if (size > buffer->len) { memset((uint8_t *)new_ptr + buffer->len, 0, size - buffer->len); }
+        if (size < buffer->len) { membudget_release(buffer->len - size); }
+        buffer->reserved = buffer->reserved + size - buffer->len;
+        buffer->len      = size;
+        buffer->data     = new_ptr;
        // c_frees += portable_ish_malloced_size(buffer->data);
        // c_allocs += size;
     }
@@ -145,6 +232,17 @@ ret:
     return true;
 }
 
+/**
+ * audiofs_buffer_free: free a buffer and its data, and return its reservation
+ *
+ * @param buffer    reference to the buffer. Set to NULL afterwards.
+ */
+static inline void audiofs_buffer_free(audiofs_buffer **buffer) {
+    if (!audiofs_buffer_ok(*buffer)) { return; }
+    if (!audiofs_buffer_realloc(*buffer, 0)) { errorf("could not free a buffer's data\n"); }
+    AUDIOFS_FREE(*buffer);
+}
+
 __attribute((pure)) __attribute__((__warn_unused_result__)) static inline bool context_ok(struct decoder_context *ctx) {
     if (!ctx || ctx->cookieA != _AUDIOFS_CONTEXT_MAGIC_A || ctx->cookieB != _AUDIOFS_CONTEXT_MAGIC_B) { return false; }
 
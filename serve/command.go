@@ -3,6 +3,7 @@ package serve
 import (
 	"errors"
 	"github.com/spf13/cobra"
+	"gitlab.com/t4cc0re/audiofs/metrics"
 )
 
 var cmdServe = &cobra.Command{
@@ -13,6 +14,10 @@ var cmdServe = &cobra.Command{
 	RunE: func(cmd *cobra.Command, args []string) error {
 		return errors.New("please select a subcommand")
 	},
+	// Every server exposes its transcode pipeline metrics in the Prometheus text format, unless disabled.
+	PersistentPreRun: func(cmd *cobra.Command, args []string) {
+		metrics.ServeConfigured()
+	},
 }
 
 func Inject(rootCommand *cobra.Command) {
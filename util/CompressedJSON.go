@@ -6,8 +6,157 @@ import (
 	"github.com/klauspost/compress/zstd"
 	"github.com/sirupsen/logrus"
 	"gitlab.com/t4cc0re/audiofs/config"
+	"sync"
 )
 
+var ErrUnsupportedAlgorithm = errors.New("unsupported algorithm")
+
+// zstdCodecs holds the encoders and the decoder shared by all calls. zstd.Encoder.EncodeAll and
+// zstd.Decoder.DecodeAll are safe for concurrent use and keep their own pool of block encoders/decoders, so creating
+// them once per level/dictionary instead of once per call saves their (large) allocations and the warm-up on every
+// record.
+type zstdCodecs struct {
+	mutex sync.RWMutex
+	// encoders is keyed by level and dictionary ID (0: none)
+	encoders map[zstdEncoderKey]*zstd.Encoder
+	// decoder knows every dictionary in `dictionaries`. zstd frames carry the ID of the dictionary they were written
+	// with, so the decoder picks the right one for every blob.
+	decoder      *zstd.Decoder
+	dictionaries map[uint32][]byte
+	// newest is the highest registered dictionary ID
+	newest uint32
+	loaded bool
+}
+
+type zstdEncoderKey struct {
+	level        int
+	dictionaryID uint32
+}
+
+var codecs = &zstdCodecs{encoders: map[zstdEncoderKey]*zstd.Encoder{}, dictionaries: map[uint32][]byte{}}
+
+// ensureLoaded loads the dictionaries from disk on first use. Must be called with the write lock held.
+func (c *zstdCodecs) ensureLoaded() {
+	if c.loaded {
+		return
+	}
+	c.loaded = true
+	dictionaries, err := LoadDictionaries(dictionaryDir())
+	if err != nil {
+		logrus.Warnf("could not load zstd dictionaries: %v", err)
+	}
+	for id, dict := range dictionaries {
+		c.add(id, dict)
+	}
+}
+
+// add registers a dictionary. Must be called with the write lock held.
+func (c *zstdCodecs) add(id uint32, dict []byte) {
+	c.dictionaries[id] = dict
+	if id > c.newest {
+		c.newest = id
+	}
+}
+
+// RegisterDictionary makes a dictionary (as returned by TrainDictionary) available for compression and
+// decompression. Dictionaries in `json_export.compression.dictionaries` are registered automatically.
+func RegisterDictionary(dict []byte) (uint32, error) {
+	id, err := DictionaryID(dict)
+	if err != nil {
+		return 0, err
+	}
+	codecs.mutex.Lock()
+	defer codecs.mutex.Unlock()
+	codecs.ensureLoaded()
+	codecs.add(id, dict)
+	// The decoder only learns dictionaries on creation. The old one may still be in use, so it is left to the GC instead
+	// of being closed. DecodeAll-only decoders do not run goroutines.
+	codecs.decoder = nil
+	return id, nil
+}
+
+// encoder returns the shared encoder for a level and dictionary (0: none).
+func (c *zstdCodecs) encoder(level int, dictionaryID uint32) (*zstd.Encoder, error) {
+	key := zstdEncoderKey{level: level, dictionaryID: dictionaryID}
+	c.mutex.RLock()
+	encoder := c.encoders[key]
+	c.mutex.RUnlock()
+	if encoder != nil {
+		return encoder, nil
+	}
+
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	if encoder = c.encoders[key]; encoder != nil {
+		return encoder, nil
+	}
+	c.ensureLoaded()
+	options := []zstd.EOption{zstd.WithEncoderLevel(zstd.EncoderLevelFromZstd(level))}
+	if dictionaryID != 0 {
+		dict, ok := c.dictionaries[dictionaryID]
+		if !ok {
+			return nil, ErrUnknownDictionary
+		}
+		options = append(options, zstd.WithEncoderDict(dict))
+	}
+	encoder, err := zstd.NewWriter(nil, options...)
+	if err != nil {
+		return nil, err
+	}
+	c.encoders[key] = encoder
+	return encoder, nil
+}
+
+// getDecoder returns the shared decoder, which knows all registered dictionaries.
+func (c *zstdCodecs) getDecoder() (*zstd.Decoder, error) {
+	c.mutex.RLock()
+	decoder := c.decoder
+	c.mutex.RUnlock()
+	if decoder != nil {
+		return decoder, nil
+	}
+
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	if c.decoder != nil {
+		return c.decoder, nil
+	}
+	c.ensureLoaded()
+	dicts := make([][]byte, 0, len(c.dictionaries))
+	for _, dict := range c.dictionaries {
+		dicts = append(dicts, dict)
+	}
+	decoder, err := zstd.NewReader(nil, zstd.WithDecoderDicts(dicts...))
+	if err != nil {
+		return nil, err
+	}
+	c.decoder = decoder
+	return decoder, nil
+}
+
+// activeDictionary is the dictionary new blobs are compressed with: `json_export.compression.dictionary` if set,
+// the newest registered dictionary if 0, none if negative.
+func (c *zstdCodecs) activeDictionary() uint32 {
+	configured := config.Config.GetInt64("json_export.compression.dictionary")
+	if configured < 0 {
+		return 0
+	}
+	if configured > 0 {
+		return uint32(configured)
+	}
+	c.mutex.RLock()
+	loaded, newest := c.loaded, c.newest
+	c.mutex.RUnlock()
+	if loaded {
+		return newest
+	}
+
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	c.ensureLoaded()
+	return c.newest
+}
+
 func MarshallCompressed(v any) ([]byte, error) {
 	return MarshallCompressedWithAlgo(
 		config.Config.GetString("json_export.compression.algo"),
@@ -24,20 +173,27 @@ func UnmarshallCompressed(data []byte, v any) error {
 	)
 }
 
+// UnmarshallCompressedWithAlgo decodes blobs written by MarshallCompressedWithAlgo and
+// MarshallCompressedWithDictionary. Blobs written with a dictionary need it to be registered.
 func UnmarshallCompressedWithAlgo(algo string, input []byte, v any) error {
 	var uncompressed []byte
 	var err error
 	switch algo {
 	case "zstd":
-		var decoder, _ = zstd.NewReader(nil)
-		defer decoder.Close()
-		uncompressed, err = decoder.DecodeAll(input, make([]byte, 0, len(input)))
-		logrus.Printf("compressed: %d, JSON: %d\n", len(input), len(uncompressed))
+		var decoder *zstd.Decoder
+		if decoder, err = codecs.getDecoder(); err != nil {
+			break
+		}
+		// Metadata compresses well, start with a buffer big enough for the common case.
+		uncompressed, err = decoder.DecodeAll(input, make([]byte, 0, 8*len(input)))
+		if logrus.IsLevelEnabled(logrus.TraceLevel) {
+			logrus.Tracef("compressed: %d, JSON: %d\n", len(input), len(uncompressed))
+		}
 	case "none", "":
 		// No compression? Nothing to do :D
 		uncompressed = input
 	default:
-		err = errors.New("unsupported algorithm")
+		err = ErrUnsupportedAlgorithm
 	}
 	if err != nil {
 		return err //TODO: wrap
@@ -46,7 +202,19 @@ func UnmarshallCompressedWithAlgo(algo string, input []byte, v any) error {
 	return json.Unmarshal(uncompressed, v)
 }
 
+// MarshallCompressedWithAlgo compresses with the active dictionary (see `json_export.compression.dictionary`).
 func MarshallCompressedWithAlgo(algo string, level int, v any) ([]byte, error) {
+	var dictionaryID uint32
+	if algo == "zstd" {
+		dictionaryID = codecs.activeDictionary()
+	}
+	return MarshallCompressedWithDictionary(algo, level, dictionaryID, v)
+}
+
+// MarshallCompressedWithDictionary compresses with a specific registered dictionary, 0 for none. The dictionary ID is
+// stored in the zstd frame header, so blobs stay readable after newer dictionaries were trained, as long as the
+// dictionary they were written with is kept around.
+func MarshallCompressedWithDictionary(algo string, level int, dictionaryID uint32, v any) ([]byte, error) {
 	buf, err := json.Marshal(v)
 	if err != nil {
 		return nil, err
@@ -54,14 +222,18 @@ func MarshallCompressedWithAlgo(algo string, level int, v any) ([]byte, error) {
 
 	switch algo {
 	case "zstd":
-		var encoder, _ = zstd.NewWriter(nil, zstd.WithEncoderLevel(zstd.EncoderLevelFromZstd(level)))
-		defer encoder.Close()
-		buf2 := encoder.EncodeAll(buf, make([]byte, 0, len(buf)))
-		logrus.Printf("JSON: %d, compressed: %d\n", len(buf), len(buf2))
+		encoder, err := codecs.encoder(level, dictionaryID)
+		if err != nil {
+			return nil, err
+		}
+		buf2 := encoder.EncodeAll(buf, make([]byte, 0, len(buf)/2))
+		if logrus.IsLevelEnabled(logrus.TraceLevel) {
+			logrus.Tracef("JSON: %d, compressed: %d, dictionary: %d\n", len(buf), len(buf2), dictionaryID)
+		}
 		return buf2, nil
 	case "none", "":
 		return buf, nil
 	default:
-		return nil, errors.New("unsupported algorithm")
+		return nil, ErrUnsupportedAlgorithm
 	}
 }
@@ -0,0 +1,307 @@
+package util
+
+import (
+	"encoding/binary"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"github.com/klauspost/compress/zstd"
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/walk"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sort"
+	"strings"
+	"sync"
+)
+
+const (
+	// dictionaryMagic starts every zstd dictionary, followed by its (little endian) ID.
+	dictionaryMagic = 0xEC30A437
+	// DictionaryIDBase is the first dictionary version. The zstd format reserves lower IDs for registered dictionaries,
+	// ours count upwards from here with every `train-dictionary` run.
+	DictionaryIDBase = 32768
+	// DefaultDictionarySize is zstd's default (112 KiB). Metadata documents are small, bigger dictionaries do not help.
+	DefaultDictionarySize = 110 << 10
+	dictionaryExtension   = ".zdict"
+	dictionaryMinSamples  = 8
+
+	// Segment selection: dictionaryDmer byte substrings are counted across all samples, the dictionary is assembled
+	// from the dictionarySegment byte windows containing the most frequent ones (a simplified zstd "fast cover").
+	dictionaryDmer      = 8
+	dictionarySegment   = 256
+	dictionaryHashBits  = 20
+	dictionaryHashPrime = 0xcf1bbcdcb7a56463
+)
+
+var (
+	ErrUnknownDictionary      = errors.New("unknown zstd dictionary")
+	ErrInvalidDictionary      = errors.New("invalid zstd dictionary")
+	ErrNotEnoughSamples       = fmt.Errorf("need at least %d samples to train a dictionary", dictionaryMinSamples)
+	ErrDictionaryDirNotConfig = errors.New("`json_export.compression.dictionaries` is not set")
+)
+
+func dictionaryDir() string {
+	return config.Config.GetString("json_export.compression.dictionaries")
+}
+
+// DictionaryID reads the ID from a zstd dictionary's header.
+func DictionaryID(dict []byte) (uint32, error) {
+	if len(dict) < 8 || binary.LittleEndian.Uint32(dict) != dictionaryMagic {
+		return 0, ErrInvalidDictionary
+	}
+	id := binary.LittleEndian.Uint32(dict[4:])
+	if id == 0 {
+		return 0, ErrInvalidDictionary
+	}
+	return id, nil
+}
+
+// LoadDictionaries reads all dictionaries in dir. A missing directory is not an error.
+func LoadDictionaries(dir string) (map[uint32][]byte, error) {
+	dictionaries := map[uint32][]byte{}
+	if dir == "" {
+		return dictionaries, nil
+	}
+	entries, err := os.ReadDir(dir)
+	if errors.Is(err, os.ErrNotExist) {
+		return dictionaries, nil
+	}
+	if err != nil {
+		return nil, err
+	}
+	for _, entry := range entries {
+		if entry.IsDir() || !strings.HasSuffix(entry.Name(), dictionaryExtension) {
+			continue
+		}
+		dict, err := os.ReadFile(filepath.Join(dir, entry.Name()))
+		if err != nil {
+			return nil, err
+		}
+		id, err := DictionaryID(dict)
+		if err != nil {
+			return nil, fmt.Errorf("%s: %w", entry.Name(), err)
+		}
+		dictionaries[id] = dict
+	}
+	return dictionaries, nil
+}
+
+// NextDictionaryID is the ID (version) for the next trained dictionary.
+func NextDictionaryID() uint32 {
+	codecs.mutex.Lock()
+	defer codecs.mutex.Unlock()
+	codecs.ensureLoaded()
+	if codecs.newest < DictionaryIDBase {
+		return DictionaryIDBase
+	}
+	return codecs.newest + 1
+}
+
+// SaveDictionary stores a dictionary in `json_export.compression.dictionaries` and registers it, which makes it the
+// active one unless `json_export.compression.dictionary` pins another. Dictionaries must never be deleted while blobs
+// written with them exist.
+func SaveDictionary(dict []byte) (string, error) {
+	dir := dictionaryDir()
+	if dir == "" {
+		return "", ErrDictionaryDirNotConfig
+	}
+	id, err := DictionaryID(dict)
+	if err != nil {
+		return "", err
+	}
+	if err = os.MkdirAll(dir, 0755); err != nil {
+		return "", err
+	}
+	path := filepath.Join(dir, fmt.Sprintf("metadata-%d%s", id, dictionaryExtension))
+	if _, err = os.Stat(path); err == nil {
+		return "", fmt.Errorf("%s already exists", path)
+	}
+	tmp := path + ".tmp"
+	if err = os.WriteFile(tmp, dict, 0644); err != nil {
+		return "", err
+	}
+	if err = os.Rename(tmp, path); err != nil {
+		_ = os.Remove(tmp)
+		return "", err
+	}
+	if _, err = RegisterDictionary(dict); err != nil {
+		return "", err
+	}
+	return path, nil
+}
+
+// TrainDictionary builds a zstd dictionary of up to `size` bytes for documents like the samples.
+func TrainDictionary(samples [][]byte, size int, id uint32, level int) ([]byte, error) {
+	if len(samples) < dictionaryMinSamples {
+		return nil, ErrNotEnoughSamples
+	}
+	history := selectDictionarySegments(samples, size)
+	if len(history) < 8 {
+		return nil, ErrNotEnoughSamples
+	}
+	return zstd.BuildDict(zstd.BuildDictOptions{
+		ID:       id,
+		Contents: samples,
+		History:  history,
+		// zstd's initial repeat offsets
+		Offsets: [3]int{1, 4, 8},
+		Level:   zstd.EncoderLevelFromZstd(level),
+	})
+}
+
+func dmerHash(b []byte) uint32 {
+	return uint32((binary.LittleEndian.Uint64(b) * dictionaryHashPrime) >> (64 - dictionaryHashBits))
+}
+
+type dictionarySegmentCandidate struct {
+	data  []byte
+	score uint64
+}
+
+// selectDictionarySegments picks the content of the dictionary: the samples are split into epochs, every round takes
+// the best scoring segment of each epoch and removes its d-mers from the frequencies, so the same keys do not end up
+// in the dictionary twice. The best segments go last, where they are cheapest to reference.
+func selectDictionarySegments(samples [][]byte, size int) []byte {
+	// Number of samples containing a d-mer. Counting per sample keeps one tag-heavy file from dominating.
+	frequencies := make([]uint32, 1<<dictionaryHashBits)
+	seen := make([]uint32, 1<<dictionaryHashBits)
+	for i, sample := range samples {
+		for pos := 0; pos+dictionaryDmer <= len(sample); pos++ {
+			hash := dmerHash(sample[pos:])
+			if seen[hash] != uint32(i)+1 {
+				seen[hash] = uint32(i) + 1
+				frequencies[hash]++
+			}
+		}
+	}
+
+	epochs := size / dictionarySegment
+	if epochs > len(samples) {
+		epochs = len(samples)
+	}
+	if epochs < 1 {
+		epochs = 1
+	}
+
+	var segments []dictionarySegmentCandidate
+	total := 0
+	for total < size {
+		progress := false
+		for epoch := 0; epoch < epochs && total < size; epoch++ {
+			best := bestDictionarySegment(samples[epoch*len(samples)/epochs:(epoch+1)*len(samples)/epochs], frequencies)
+			if best.score == 0 {
+				continue
+			}
+			for pos := 0; pos+dictionaryDmer <= len(best.data); pos++ {
+				frequencies[dmerHash(best.data[pos:])] = 0
+			}
+			segments = append(segments, best)
+			total += len(best.data)
+			progress = true
+		}
+		if !progress {
+			break
+		}
+	}
+
+	sort.SliceStable(segments, func(i, j int) bool { return segments[i].score < segments[j].score })
+	history := make([]byte, 0, total)
+	for _, segment := range segments {
+		history = append(history, segment.data...)
+	}
+	// Drop the least useful segments if the last round overshot.
+	if len(history) > size {
+		history = history[len(history)-size:]
+	}
+	return history
+}
+
+// bestDictionarySegment finds the window with the highest sum of d-mer frequencies in the samples.
+func bestDictionarySegment(samples [][]byte, frequencies []uint32) dictionarySegmentCandidate {
+	var best dictionarySegmentCandidate
+	for _, sample := range samples {
+		if len(sample) < dictionaryDmer {
+			continue
+		}
+		window := dictionarySegment
+		if window > len(sample) {
+			window = len(sample)
+		}
+		dmers := window - dictionaryDmer + 1
+
+		var score uint64
+		for pos := 0; pos < dmers; pos++ {
+			score += uint64(frequencies[dmerHash(sample[pos:])])
+		}
+		bestStart, bestScore := 0, score
+		for start := 1; start+window <= len(sample); start++ {
+			score -= uint64(frequencies[dmerHash(sample[start-1:])])
+			score += uint64(frequencies[dmerHash(sample[start+dmers-1:])])
+			if score > bestScore {
+				bestStart, bestScore = start, score
+			}
+		}
+		if bestScore > best.score {
+			best = dictionarySegmentCandidate{data: sample[bestStart : bestStart+window], score: bestScore}
+		}
+	}
+	return best
+}
+
+// SampleMetadataJSON probes a random sample of up to n files below the given paths and returns their metadata as
+// JSON, as stored by MarshallCompressed. Files which cannot be probed are skipped.
+func SampleMetadataJSON(paths []string, n int) ([][]byte, error) {
+	// Reservoir sampling, so huge libraries do not need to be held in memory.
+	var files []string
+	seen := 0
+	err := walk.Walk(paths, walk.Options{Workers: config.Config.GetInt("scan.workers"), Extensions: walk.ExtensionsFromConfig()},
+		func(path string) bool {
+			seen++
+			if len(files) < n {
+				files = append(files, path)
+			} else if i := rand.Intn(seen); i < n {
+				files[i] = path
+			}
+			return true
+		})
+	if err != nil {
+		return nil, err
+	}
+
+	samples := make([][]byte, len(files))
+	var wg sync.WaitGroup
+	next := make(chan int)
+	for worker := 0; worker < runtime.NumCPU(); worker++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for i := range next {
+				val, err := GetMetadataFromFile(files[i])
+				if err != nil {
+					logrus.Debugf("skipping '%s': %v", files[i], err)
+					continue
+				}
+				if samples[i], err = json.Marshal(val); err != nil {
+					logrus.Debugf("skipping '%s': %v", files[i], err)
+				}
+			}
+		}()
+	}
+	for i := range files {
+		next <- i
+	}
+	close(next)
+	wg.Wait()
+
+	result := samples[:0]
+	for _, sample := range samples {
+		if sample != nil {
+			result = append(result, sample)
+		}
+	}
+	return result, nil
+}
@@ -1,35 +1,59 @@
 package util
 
 import (
-	"encoding/json"
-	"errors"
 	"os"
-	"os/exec"
 	"path"
 	"path/filepath"
 
-	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/scheduler"
 	"gitlab.com/t4cc0re/audiofs/lib/types"
 )
 
-func GetMetadataFromFile(file string) (*types.FileMetadata, error) {
+// FingerprintOptions selects which part of the audio is fed to chromaprint (see `fpcalc -length`).
+type FingerprintOptions struct {
+	// Length is the amount of seconds to fingerprint. 0 fingerprints the full stream.
+	Length int
+	// SecondWindow optionally fingerprints a second window: "" (disabled), "middle" or an offset in seconds.
+	SecondWindow string
+}
 
-	ex, err := os.Executable()
-	if err != nil {
-		panic(err)
+// FingerprintOptionsFromConfig returns the configured fingerprint window. Careful mode always uses the full stream.
+func FingerprintOptionsFromConfig(careful bool) FingerprintOptions {
+	if careful {
+		return FingerprintOptions{}
 	}
-	exPath := filepath.Dir(ex)
-	JSON, err := exec.Command(path.Join(exPath, "native"), file).Output()
-	if err != nil {
-		logrus.Errorf("%+v", err)
-		return nil, err
+	return FingerprintOptions{
+		Length:       config.Config.GetInt("fingerprint.length"),
+		SecondWindow: config.Config.GetString("fingerprint.second_window"),
 	}
+}
+
+func GetMetadataFromFile(file string) (*types.FileMetadata, error) {
+	return GetMetadataFromFileWithOptions(file, FingerprintOptionsFromConfig(false))
+}
 
-	val := types.FileMetadata{}
-	err = json.Unmarshal([]byte(JSON), &val)
+// GetMetadataFromFileWithOptions probes a file as batch work, see GetMetadataFromFileAs.
+func GetMetadataFromFileWithOptions(file string, fingerprint FingerprintOptions) (*types.FileMetadata, error) {
+	return GetMetadataFromFileAs(scheduler.Batch, file, fingerprint)
+}
+
+// GetMetadataFromFileAs probes a file with the priority of `class`, e.g. scheduler.Interactive when a user waits for
+// the result.
+func GetMetadataFromFileAs(class scheduler.Class, file string, fingerprint FingerprintOptions) (*types.FileMetadata, error) {
+	return DefaultNativePool().GetMetadata(class, file, fingerprint)
+}
+
+// ExportFile transcodes a file into a tagged `format` file as batch work, see NativePool.Export.
+func ExportFile(file string, metadata *types.FileMetadata, output, format string) error {
+	return DefaultNativePool().Export(scheduler.Batch, file, metadata, output, format)
+}
+
+// nativeBinary is the `native` helper, which is shipped next to this executable.
+func nativeBinary() string {
+	ex, err := os.Executable()
 	if err != nil {
-		return nil, errors.Join(err, errors.New("unknown"))
+		panic(err)
 	}
-
-	return &val, nil
+	return path.Join(filepath.Dir(ex), "native")
 }
@@ -0,0 +1,294 @@
+package util
+
+import (
+	"bufio"
+	"context"
+	"encoding/json"
+	"errors"
+	"io"
+	"os"
+	"os/exec"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/sirupsen/logrus"
+	"gitlab.com/t4cc0re/audiofs/config"
+	"gitlab.com/t4cc0re/audiofs/lib/scheduler"
+	"gitlab.com/t4cc0re/audiofs/lib/types"
+	"gitlab.com/t4cc0re/audiofs/metrics"
+)
+
+var (
+	ErrNativeWorkerCrashed = errors.New("native worker crashed")
+	ErrNativeWorkerTimeout = errors.New("native worker timed out")
+)
+
+// nativeRequest is one line sent to `native -worker`.
+type nativeRequest struct {
+	ID int64 `json:"id"`
+	// Op is "export" to transcode Path into Output, or empty to probe Path.
+	Op           string `json:"op,omitempty"`
+	Path         string `json:"path"`
+	Length       int    `json:"length"`
+	SecondWindow string `json:"second_window,omitempty"`
+	// Threads caps the codec and DSD conversion threads of this request, as granted by the scheduler.
+	Threads int `json:"threads,omitempty"`
+
+	Output string            `json:"output,omitempty"`
+	Format string            `json:"format,omitempty"`
+	Tags   map[string]string `json:"tags,omitempty"`
+}
+
+// nativeResponse is one line received from `native -worker`.
+type nativeResponse struct {
+	ID       int64           `json:"id"`
+	Metadata json.RawMessage `json:"metadata"`
+	Error    string          `json:"error"`
+	Metrics  *metrics.File   `json:"metrics"`
+}
+
+// nativeWorker is a running `native -worker` process. It handles one request at a time.
+type nativeWorker struct {
+	cmd       *exec.Cmd
+	stdin     io.WriteCloser
+	responses chan []byte
+}
+
+// startNativeWorker starts a worker whose in-memory buffers may use `memoryBudget` bytes before they spill to
+// `native.spill_dir` (0 for no limit).
+func startNativeWorker(memoryBudget int64) (*nativeWorker, error) {
+	cmd := exec.Command(
+		nativeBinary(),
+		"-worker",
+		"-dsd-rate", strconv.Itoa(config.Config.GetInt("conversion.dsd_rate")),
+		"-dsd-threads", strconv.Itoa(config.Config.GetInt("conversion.dsd_threads")),
+		"-memory-budget", strconv.FormatInt(memoryBudget, 10),
+		"-memory-wait", strconv.FormatInt(config.Config.GetDuration("native.memory_wait").Milliseconds(), 10),
+	)
+	if dir := config.Config.GetString("native.spill_dir"); dir != "" {
+		cmd.Args = append(cmd.Args, "-spill-dir", dir)
+	}
+	// stdout is the protocol. Logs on stderr are only interesting when debugging.
+	if logrus.IsLevelEnabled(logrus.DebugLevel) {
+		cmd.Stderr = os.Stderr
+	}
+	stdin, err := cmd.StdinPipe()
+	if err != nil {
+		return nil, err
+	}
+	stdout, err := cmd.StdoutPipe()
+	if err != nil {
+		return nil, err
+	}
+	if err = cmd.Start(); err != nil {
+		return nil, err
+	}
+
+	w := &nativeWorker{cmd: cmd, stdin: stdin, responses: make(chan []byte, 1)}
+	go func() {
+		defer close(w.responses)
+		scanner := bufio.NewScanner(stdout)
+		// Tag-heavy files produce long lines.
+		scanner.Buffer(make([]byte, 0, 64*1024), 64*1024*1024)
+		for scanner.Scan() {
+			w.responses <- append([]byte(nil), scanner.Bytes()...)
+		}
+	}()
+	return w, nil
+}
+
+// request sends a single request and waits for its response. `fatal` is set when the worker has to be replaced.
+func (w *nativeWorker) request(req nativeRequest, timeout time.Duration) (resp *nativeResponse, err error, fatal bool) {
+	line, err := json.Marshal(req)
+	if err != nil {
+		return nil, err, false
+	}
+	if _, err = w.stdin.Write(append(line, '\n')); err != nil {
+		return nil, errors.Join(ErrNativeWorkerCrashed, err), true
+	}
+
+	timer := time.NewTimer(timeout)
+	defer timer.Stop()
+	for {
+		select {
+		case line, ok := <-w.responses:
+			if !ok {
+				return nil, ErrNativeWorkerCrashed, true
+			}
+			resp = &nativeResponse{}
+			if err = json.Unmarshal(line, resp); err != nil {
+				return nil, err, true
+			}
+			if resp.ID != req.ID {
+				logrus.Warnf("native worker answered request %d, expected %d", resp.ID, req.ID)
+				continue
+			}
+			if resp.Error != "" {
+				return resp, errors.New(resp.Error), false
+			}
+			return resp, nil, false
+		case <-timer.C:
+			return nil, ErrNativeWorkerTimeout, true
+		}
+	}
+}
+
+func (w *nativeWorker) stop() {
+	_ = w.stdin.Close()
+	_ = w.cmd.Process.Kill()
+	// Unblock the reader, in case it still holds a line.
+	go func() {
+		for range w.responses {
+		}
+	}()
+	_ = w.cmd.Wait()
+}
+
+// NativePool keeps a fixed number of `native -worker` processes around, so probing a file does not pay for process
+// creation and FFmpeg initialization. Workers are started on first use and replaced after crashing or timing out, so
+// a single malformed file only fails itself. `native.memory_budget` is split evenly between the workers.
+type NativePool struct {
+	// idle holds one entry per slot. nil means the slot has no running worker.
+	idle         chan *nativeWorker
+	size         int
+	timeout      time.Duration
+	workerMemory int64
+	nextID       atomic.Int64
+}
+
+func NewNativePool(size int, timeout time.Duration) *NativePool {
+	if size < 1 {
+		size = 1
+	}
+	p := &NativePool{idle: make(chan *nativeWorker, size), size: size, timeout: timeout,
+		workerMemory: config.Config.GetInt64("native.memory_budget") / int64(size)}
+	for i := 0; i < size; i++ {
+		p.idle <- nil
+	}
+	return p
+}
+
+var (
+	defaultNativePool     *NativePool
+	defaultNativePoolOnce sync.Once
+)
+
+// DefaultNativePool returns the process-wide pool, sized by `native.workers` and `native.timeout`. By default there
+// is one worker per thread of the scheduler's budget, so the scheduler decides how many requests run, not the pool.
+func DefaultNativePool() *NativePool {
+	defaultNativePoolOnce.Do(func() {
+		workers := config.Config.GetInt("native.workers")
+		if workers <= 0 {
+			workers = scheduler.Default().Budget()
+		}
+		defaultNativePool = NewNativePool(workers, config.Config.GetDuration("native.timeout"))
+	})
+	return defaultNativePool
+}
+
+// Size is the number of workers, i.e. how many files can be probed concurrently.
+func (p *NativePool) Size() int {
+	return p.size
+}
+
+// run sends a request to the next idle worker, once the scheduler admits a job of `class`. It sets the request's ID
+// and threads.
+func (p *NativePool) run(class scheduler.Class, req nativeRequest) (*nativeResponse, error) {
+	grant, err := scheduler.Default().Acquire(context.Background(), class, scheduler.Threads(class))
+	if err != nil {
+		return nil, err
+	}
+	defer grant.Release()
+
+	w := <-p.idle
+	defer func() { p.idle <- w }()
+
+	if w == nil {
+		if w, err = startNativeWorker(p.workerMemory); err != nil {
+			return nil, err
+		}
+	}
+
+	req.ID, req.Threads = p.nextID.Add(1), grant.Threads
+	resp, err, fatal := w.request(req, p.timeout)
+	if fatal {
+		logrus.Warnf("restarting native worker after '%s': %v", req.Path, err)
+		w.stop()
+		w = nil
+	}
+	return resp, err
+}
+
+// GetMetadata probes a file on the next idle worker, once the scheduler admits a job of `class`. Safe for concurrent
+// use.
+func (p *NativePool) GetMetadata(class scheduler.Class, file string, fingerprint FingerprintOptions) (*types.FileMetadata, error) {
+	resp, err := p.run(class, nativeRequest{Path: file, Length: fingerprint.Length, SecondWindow: fingerprint.SecondWindow})
+	if err != nil {
+		var fileMetrics *metrics.File
+		if resp != nil {
+			fileMetrics = resp.Metrics
+		}
+		metrics.Default.ObserveFile("", false, fileMetrics)
+		return nil, err
+	}
+
+	val := types.FileMetadata{}
+	if err = json.Unmarshal(resp.Metadata, &val); err != nil {
+		metrics.Default.ObserveFile("", false, resp.Metrics)
+		return nil, err
+	}
+	metrics.Default.ObserveFile(audioCodec(&val), true, resp.Metrics)
+	return &val, nil
+}
+
+// Export transcodes `file` into `output` (e.g. format "aiff"), tagged with the tags of its metadata, as probed by
+// GetMetadata. The output is written directly and synced before this returns. Safe for concurrent use.
+func (p *NativePool) Export(class scheduler.Class, file string, metadata *types.FileMetadata, output, format string) error {
+	resp, err := p.run(class, nativeRequest{Op: "export", Path: file, Output: output, Format: format, Tags: exportTags(metadata)})
+	var fileMetrics *metrics.File
+	if resp != nil {
+		fileMetrics = resp.Metrics
+	}
+	metrics.Default.ObserveFile(audioCodec(metadata), err == nil, fileMetrics)
+	return err
+}
+
+// exportTags are the file's tags, plus those of its first audio stream, which is where e.g. Ogg keeps them.
+func exportTags(val *types.FileMetadata) map[string]string {
+	tags := map[string]string{}
+	for key, value := range val.File.Metadata {
+		tags[key] = value
+	}
+	for _, stream := range val.Streams {
+		if stream.Codec.Type == "audio" {
+			for key, value := range stream.Metadata {
+				if _, ok := tags[key]; !ok {
+					tags[key] = value
+				}
+			}
+			break
+		}
+	}
+	return tags
+}
+
+// audioCodec is the codec of the first audio stream, which is what gets decoded.
+func audioCodec(val *types.FileMetadata) string {
+	for _, stream := range val.Streams {
+		if stream.Codec.Type == "audio" {
+			return stream.Codec.Name
+		}
+	}
+	return ""
+}
+
+// Close stops all workers. Waits for running requests to finish.
+func (p *NativePool) Close() {
+	for i := 0; i < p.size; i++ {
+		if w := <-p.idle; w != nil {
+			w.stop()
+		}
+	}
+}